@@ -9,11 +9,18 @@
  */
 
 #ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/slab.h>
 #include <linux/string.h>
+#define AESD_ALLOC_SLOTS(count) kcalloc(count, sizeof(struct aesd_buffer_entry), GFP_KERNEL)
+#define AESD_FREE_SLOTS(slots) kfree(slots)
 #else
+#include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#define AESD_ALLOC_SLOTS(count) calloc(count, sizeof(struct aesd_buffer_entry))
+#define AESD_FREE_SLOTS(slots) free(slots)
 #endif
 
 #include "aesd-circular-buffer.h"
@@ -31,60 +38,28 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
+    uint32_t index;
     // if circular buffer does not exist, exit. C-array cannot be empty
     if(!buffer)
     {
         return NULL;
     }
-    // Beware of pointer arithmetic and overflows, use int values.
-    int16_t accumulated_length = 0;
-    int8_t entry_id = buffer->out_offs;
-    int16_t offset = char_offset;
-
-    // Iterating through circular buffer elements
-    while(char_offset > accumulated_length)
+    // The entries know their start, so the one holding char_offset is found by binary search,
+    // in size_t arithmetic whatever the size of the history
+    index = aesd_circular_buffer_index_for_fpos(buffer, char_offset);
+    if(index == aesd_circular_buffer_count(buffer))
     {
-        // For each iteration, we accumulate the char number of each entry in accumulated_length, and we point to
-        // the next entry. We keep the remaining char_offset in offset
-        accumulated_length += buffer->entry[entry_id].size;
-        entry_id = (entry_id + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        offset = char_offset - accumulated_length;
-
-        // End condition. Occurs when existing entries were read and next entries are empty
-        PDEBUG("entry_id %d, buffer->entry[entry_id].size %ld, and offset is %d\n",entry_id, buffer->entry[entry_id].size, offset);
-        if((offset == 0)&&(buffer->entry[entry_id].size == 0))
-        {
-            return NULL;
-        }
-
-        // If offset is negative, it means we went too far, and the remaining offset is targeting a character within the
-        // current entry_id. So we add back the string size to the offset. Entering this if means we will exit the loop
-        // in the next iteration.
-        if(offset < 0)
-        {
-            entry_id = (entry_id - 1 +AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-            offset += buffer->entry[entry_id].size;
-            PDEBUG("entry_id %d, buffer->entry[entry_id].size %ld, and offset is %d\n",entry_id, buffer->entry[entry_id].size, offset);
-        }
-
-        // The char_offset is higher than the total number of written elements in the circular buffer.
-        // We detect this if we went back to the initial element (out_offs), and char offset is higher than the total
-        // number of chars we have accumulated. Both conditions together means char_offset is bigger than the total number
-        // of char in the buffer
-        int16_t max_position = accumulated_length-1;
-        if((entry_id == buffer->out_offs)&&(char_offset > max_position))
-        {
-            return NULL;
-        }
+        PDEBUG("Offset %zu is past the %zu bytes of the buffer\n", char_offset, aesd_circular_buffer_size(buffer));
+        return NULL;
     }
-    PDEBUG("offset is %d, accumulated_length is %d, and string is %s\n",offset, accumulated_length, buffer->entry[entry_id].buffptr);
-    *entry_offset_byte_rtn = offset;
-    return &(buffer->entry[entry_id]);
+    *entry_offset_byte_rtn = char_offset - aesd_circular_buffer_entry_start(buffer, index);
+    PDEBUG("Offset %zu is byte %zu of entry %u\n", char_offset, *entry_offset_byte_rtn, index);
+    return &(buffer->entry[AESD_CIRCULAR_BUFFER_SLOT(buffer, buffer->out_offs + index)]);
 }
 
 /**
 * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
-* If the buffer was already full, replace the oldest entry and advances buffer->out_offs to the
+* If the buffer was already full, remove the oldest entry and advances buffer->out_offs to the
 * new start location. Returns pointer to the oldest entry.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
@@ -92,27 +67,28 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
     const char* resultP = NULL;
-    // Printing %s leads to a strange behavior, because it only stops at the first \0 char, which we are not writing. So the print
-    // overflows and print until a \0 is found in memory. Adding this \0 during write is not that trivial, hence not done yet.
-    PDEBUG("Writing element %s at write pointer %d, read pointer is %d\n", add_entry->buffptr, buffer->in_offs, buffer->out_offs);
+    // Entries are not \0 terminated, and the lines of one write share their memory: print size bytes only
+    PDEBUG("Writing element %.*s at write pointer %d, read pointer is %d\n", (int)add_entry->size, add_entry->buffptr, buffer->in_offs, buffer->out_offs);
     // Check if the current circular buffer pointer is valid
-    if(buffer->in_offs >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+    if(buffer->in_offs >= buffer->capacity)
     {
         PDEBUG("Error, the input circular buffer is invalid");
         return resultP;
     }
 
-    // If buffer full, make room for a new element
+    // If buffer full, make room for a new element. The slot of the oldest one is emptied, it is
+    // only the slot written next when the depth is the capacity
     if(buffer->full)
     {
         PDEBUG("Buffer full, Replacing entries!");
-        resultP = buffer->entry[buffer->in_offs].buffptr;
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        resultP = buffer->entry[buffer->out_offs].buffptr;
+        buffer->entry[buffer->out_offs].buffptr = NULL;
+        buffer->entry[buffer->out_offs].size = 0;
+        buffer->entry[buffer->out_offs].batch = NULL;
+        buffer->out_offs = AESD_CIRCULAR_BUFFER_SLOT(buffer, buffer->out_offs + 1);
     }
-
-    // If write buffer pointer about to catch read buffer, it means the buffer will be full
-    // after adding the current element
-    if((buffer->in_offs +1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED == buffer->out_offs)
+    // If the buffer holds one entry less than its depth, it will be full after adding the current element
+    else if(aesd_circular_buffer_count(buffer) + 1 == buffer->depth)
     {
         buffer->full = true;
     }
@@ -120,15 +96,114 @@ const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
     // Replace entry in the circular buffer
     buffer->entry[buffer->in_offs].buffptr = add_entry->buffptr;
     buffer->entry[buffer->in_offs].size = add_entry->size;
-    PDEBUG("Writen %s at write pointer %d", buffer->entry[buffer->in_offs].buffptr, buffer->in_offs);
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->entry[buffer->in_offs].start = buffer->end;
+    buffer->entry[buffer->in_offs].batch = add_entry->batch;
+    buffer->end += add_entry->size;
+    PDEBUG("Writen %.*s at write pointer %d", (int)add_entry->size, add_entry->buffptr, buffer->in_offs);
+    buffer->in_offs = AESD_CIRCULAR_BUFFER_SLOT(buffer, buffer->in_offs + 1);
     return resultP;
 }
 
 /**
-* Initializes the circular buffer described by @param buffer to an empty struct
+* Initializes the circular buffer described by @param buffer to an empty struct, keeping
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries in its inline slots
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->inline_entry;
+    buffer->depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->capacity = AESDCHAR_INLINE_ENTRIES;
+    while(buffer->capacity / 2 >= buffer->depth)
+    {
+        buffer->capacity /= 2;
+    }
+}
+
+/**
+* Keep @param depth entries in @param buffer from now on, its newest ones are preserved. The older
+* entries beyond the new depth are removed, @param release (if not NULL) is called with each one.
+* The entries are moved to the start of the slots, so out_offs is 0 until the buffer is full again.
+* Any necessary locking must be handled by the caller
+* @return 0, -EINVAL if depth is 0 or above AESDCHAR_MAX_DEPTH, -ENOMEM if the slots could not be
+* allocated (the buffer is then unchanged)
+*/
+int aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer, uint32_t depth,
+            void (*release)(struct aesd_buffer_entry *entry))
+{
+    struct aesd_buffer_entry inline_copy[AESDCHAR_INLINE_ENTRIES];
+    struct aesd_buffer_entry *slots;
+    uint32_t capacity = 1;
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    uint32_t keep = count < depth ? count : depth;
+    uint32_t i;
+
+    if(depth == 0 || depth > AESDCHAR_MAX_DEPTH)
+    {
+        return -EINVAL;
+    }
+    while(capacity < depth)
+    {
+        capacity *= 2;
+    }
+    // Small buffers use the inline slots, which the entries may still be in: they go through a copy
+    if(capacity <= AESDCHAR_INLINE_ENTRIES)
+    {
+        memset(inline_copy, 0, sizeof(inline_copy));
+        slots = inline_copy;
+    }
+    else
+    {
+        slots = AESD_ALLOC_SLOTS(capacity);
+        if(!slots)
+        {
+            return -ENOMEM;
+        }
+    }
+    PDEBUG("Resizing from depth %u to %u, %u slots, keeping %u of %u entries\n", buffer->depth, depth, capacity, keep, count);
+
+    for(i = 0; i < count; i++)
+    {
+        struct aesd_buffer_entry *entry = &buffer->entry[AESD_CIRCULAR_BUFFER_SLOT(buffer, buffer->out_offs + i)];
+        if(i < count - keep)
+        {
+            if(release)
+            {
+                release(entry);
+            }
+        }
+        else
+        {
+            slots[i - (count - keep)] = *entry;
+        }
+    }
+    if(buffer->entry != buffer->inline_entry)
+    {
+        AESD_FREE_SLOTS(buffer->entry);
+    }
+    if(slots == inline_copy)
+    {
+        memcpy(buffer->inline_entry, inline_copy, sizeof(inline_copy));
+        slots = buffer->inline_entry;
+    }
+    buffer->entry = slots;
+    buffer->depth = depth;
+    buffer->capacity = capacity;
+    buffer->out_offs = 0;
+    buffer->in_offs = AESD_CIRCULAR_BUFFER_SLOT(buffer, keep);
+    buffer->full = keep == depth;
+    return 0;
+}
+
+/**
+* Free the slots allocated by aesd_circular_buffer_resize(), the entries are left to the caller.
+* The buffer is back to its initial state
+*/
+void aesd_circular_buffer_destroy(struct aesd_circular_buffer *buffer)
+{
+    if(buffer->entry && buffer->entry != buffer->inline_entry)
+    {
+        AESD_FREE_SLOTS(buffer->entry);
+    }
+    aesd_circular_buffer_init(buffer);
 }
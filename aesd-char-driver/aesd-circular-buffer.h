@@ -19,7 +19,24 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Default number of entries kept, the depth module parameter of the driver changes it
+ */
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
+/**
+ * Slots stored in the buffer itself, a depth up to this one needs no allocation
+ */
+#define AESDCHAR_INLINE_ENTRIES 16
+/**
+ * Largest depth accepted by aesd_circular_buffer_resize()
+ */
+#define AESDCHAR_MAX_DEPTH 65536
+
+#if AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED < 1 || AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED > AESDCHAR_INLINE_ENTRIES
+#error "The default depth must fit in the inline slots"
+#endif
 
 struct aesd_buffer_entry
 {
@@ -31,29 +48,113 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Position of the entry among all the bytes added to the buffer, set by
+     * aesd_circular_buffer_add_entry(). Differences stay right if it wraps
+     */
+    size_t start;
+    /**
+     * Allocation buffptr is part of, when entries share one. Opaque to the buffer, kept with the entry
+     */
+    void *batch;
 };
 
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations, capacity slots:
+     * inline_entry, or allocated by aesd_circular_buffer_resize(). The structure must not be copied
+     */
+    struct aesd_buffer_entry *entry;
+    struct aesd_buffer_entry inline_entry[AESDCHAR_INLINE_ENTRIES];
+    /**
+     * Number of entries kept, the oldest one is replaced beyond
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t depth;
+    /**
+     * Number of slots, depth rounded up to a power of two so that positions wrap with a mask.
+     * Slots not holding an entry are empty (NULL buffptr, size 0)
+     */
+    uint32_t capacity;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
-     * set to true when the buffer entry structure is full
+     * set to true when the buffer holds depth entries
      */
     bool full;
+    /**
+     * Position of the next entry, the bytes added so far
+     */
+    size_t end;
 };
 
+/**
+ * Slot of position pos, wrapped around the capacity
+ */
+#define AESD_CIRCULAR_BUFFER_SLOT(buffer,pos) ((pos) & ((buffer)->capacity - 1))
+
+/**
+ * @return the number of entries held by @param buffer
+ */
+static inline uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->full ? buffer->depth : AESD_CIRCULAR_BUFFER_SLOT(buffer, buffer->in_offs - buffer->out_offs);
+}
+
+/**
+ * @return the offset of entry @param index (0 being the oldest) in the concatenated entries, in O(1)
+ */
+static inline size_t aesd_circular_buffer_entry_start(const struct aesd_circular_buffer *buffer, uint32_t index)
+{
+    return buffer->entry[AESD_CIRCULAR_BUFFER_SLOT(buffer, buffer->out_offs + index)].start -
+           buffer->entry[buffer->out_offs].start;
+}
+
+/**
+ * @return the number of bytes held by @param buffer
+ */
+static inline size_t aesd_circular_buffer_size(const struct aesd_circular_buffer *buffer)
+{
+    return aesd_circular_buffer_count(buffer) ? buffer->end - buffer->entry[buffer->out_offs].start : 0;
+}
+
+/**
+ * @return the entry (0 being the oldest) holding byte @param char_offset of the concatenated entries,
+ * found by binary search on the entry starts, or the number of entries if there is no such byte
+ */
+static inline uint32_t aesd_circular_buffer_index_for_fpos(const struct aesd_circular_buffer *buffer, size_t char_offset)
+{
+    uint32_t count = aesd_circular_buffer_count(buffer);
+    uint32_t low = 0;
+    uint32_t high;
+    if(char_offset >= aesd_circular_buffer_size(buffer))
+    {
+        return count;
+    }
+    // Last entry starting at or before char_offset, empty entries before it are skipped
+    high = count - 1;
+    while(low < high)
+    {
+        uint32_t mid = low + (high - low + 1) / 2;
+        if(aesd_circular_buffer_entry_start(buffer, mid) <= char_offset)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
@@ -61,14 +162,19 @@ extern const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *b
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern int aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer, uint32_t depth,
+            void (*release)(struct aesd_buffer_entry *entry));
+
+extern void aesd_circular_buffer_destroy(struct aesd_circular_buffer *buffer);
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -77,7 +183,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<(buffer)->capacity; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
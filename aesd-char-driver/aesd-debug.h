@@ -9,6 +9,10 @@
 #define AESD_CHAR_DRIVER_AESD_DEBUG_H_
 
 #define AESD_DEBUG 1  //Remove comment on this line to enable debug
+// The server links the ring code in, without its traces
+#ifdef AESD_NO_DEBUG
+#  undef AESD_DEBUG
+#endif
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
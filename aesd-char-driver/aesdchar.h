@@ -25,9 +25,19 @@
 
 #include "aesd-circular-buffer.h"
 
+// First allocation of the entry buffer, doubled as partial writes accumulate
+#define AESD_ENTRY_MIN_CAPACITY 64
+
+// Allocation holding the entry buffer. Once its lines are committed, their ring entries all point into
+// data, it is freed with the last of them
+struct aesd_batch
+{
+     unsigned int refs;                    /* ring entries pointing into data */
+     char data[];
+};
+
 // Functions prototypes
 void clean_aesd(void);
-int checkEOLChar(const char* buff, const int size);
 int aesd_adjust_file_offset(struct file *filp, loff_t *f_pos, uint32_t write_cmd, uint32_t write_cmd_offset);
 int aesd_open(struct inode *inode, struct file *filp);
 int aesd_release(struct inode *inode, struct file *filp);
@@ -44,6 +54,8 @@ void aesd_cleanup_module(void);
 struct aesd_dev
 {
      struct aesd_buffer_entry entry;       /* buffer for partial data     */
+     struct aesd_batch *batch;             /* allocation of entry         */
+     size_t entry_capacity;                /* bytes allocated for entry   */
      struct aesd_circular_buffer bufferP;  /* data buffer                 */
      int readCounter;                      /* End condition for read loop */
      unsigned long size;                   /* amount of data stored here */
@@ -52,6 +64,6 @@ struct aesd_dev
 };
 
 // This prototype has to happen after its input definition
-void write_entry_into_buffer(struct aesd_dev *dev);
+int write_entry_into_buffer(struct aesd_dev *dev, size_t scanFrom);
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
@@ -14,6 +14,7 @@
 #include <linux/cdev.h>
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/printk.h>
 #include <linux/slab.h>         // kmalloc()
 #include <linux/string.h>
@@ -30,28 +31,79 @@ MODULE_LICENSE("Dual BSD/GPL");
 
 struct aesd_dev aesd_device;
 
-void clean_aesd(void)
+// Number of entries kept. Set at load time (insmod aesdchar.ko depth=N) or while loaded through
+// /sys/module/aesdchar/parameters/depth, which resizes the circular buffer keeping the newest entries
+static unsigned int depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+
+// A batch is freed with the last entry pointing into it
+static void put_batch(struct aesd_batch *batch)
 {
-    uint8_t index;
-    struct aesd_buffer_entry *entry;
-    PDEBUG("Erase device");
-    AESD_CIRCULAR_BUFFER_FOREACH(entry,&aesd_device.bufferP,index) {
-        kfree(entry->buffptr);
-    }
+    if (batch && --batch->refs == 0)
+        kfree(batch);
+}
+
+static void release_entry(struct aesd_buffer_entry *entry)
+{
+    put_batch(entry->batch);
 }
 
-// Return the position of the first EOL char in char array
-int checkEOLChar(const char* buff, const int size)
+static int aesd_set_depth(const char *val, const struct kernel_param *kp)
 {
-    int i;
-    for(i=0; i<size; i++)
+    unsigned int new_depth;
+    int retval = kstrtouint(val, 0, &new_depth);
+    if (retval)
+        return retval;
+    if (new_depth == 0 || new_depth > AESDCHAR_MAX_DEPTH)
+        return -EINVAL;
+
+    // Before the module is initialized, the buffer is sized by aesd_init_module(). The lock is only
+    // initialized with it
+    if (aesd_device.bufferP.entry == NULL)
     {
-        if(buff[i]=='\n')
-        {
-            return i;
-        }
+        depth = new_depth;
+        return 0;
     }
-    return -1;
+    if (mutex_lock_interruptible(&aesd_device.lock))
+        return -ERESTARTSYS;
+    // Checked again under the lock, clean_aesd() may have freed the buffer meanwhile
+    if (aesd_device.bufferP.entry == NULL)
+        depth = new_depth;
+    else if (!(retval = aesd_circular_buffer_resize(&aesd_device.bufferP, new_depth, release_entry)))
+    {
+        depth = new_depth;
+        // Evicted entries are not part of the content anymore
+        aesd_device.size = aesd_circular_buffer_size(&aesd_device.bufferP);
+        PDEBUG("Depth set to %u, %lu bytes kept", depth, aesd_device.size);
+    }
+    mutex_unlock(&aesd_device.lock);
+    return retval;
+}
+
+static const struct kernel_param_ops aesd_depth_ops = {
+    .set = aesd_set_depth,
+    .get = param_get_uint,
+};
+module_param_cb(depth, &aesd_depth_ops, &depth, 0644);
+MODULE_PARM_DESC(depth, "Number of writes kept, 1 to 65536 (default 10)");
+
+void clean_aesd(void)
+{
+    uint32_t index;
+    struct aesd_buffer_entry *entry;
+    PDEBUG("Erase device");
+    // The depth parameter can still be written, it must not resize the buffer being freed
+    mutex_lock(&aesd_device.lock);
+    // Empty slots have no batch
+    AESD_CIRCULAR_BUFFER_FOREACH(entry,&aesd_device.bufferP,index) {
+        put_batch(entry->batch);
+    }
+    aesd_circular_buffer_destroy(&aesd_device.bufferP);
+    // Left without buffer, aesd_set_depth() only records the depth from now on
+    aesd_device.bufferP.entry = NULL;
+    // Partial write never terminated
+    kfree(aesd_device.batch);
+    aesd_device.batch = NULL;
+    mutex_unlock(&aesd_device.lock);
 }
 
 // Ajust file offset (f_pos) parameter based on the location specified by
@@ -63,67 +115,125 @@ int aesd_adjust_file_offset(struct file *filp, loff_t *f_pos, uint32_t write_cmd
 {
     PDEBUG("Adjusting file offset with: %u and offset %u", write_cmd, write_cmd_offset);
     int retval = 0;
-    int i;
-    size_t size_offset = 0;
     struct aesd_dev *dev;
+    struct aesd_circular_buffer *buffer;
+
+    dev = filp->private_data;
+    buffer = &dev->bufferP;
+    // The depth can be changed through sysfs, which moves the entries
+    if (mutex_lock_interruptible(&dev->lock))
+        return -ERESTARTSYS;
 
-    if(write_cmd > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED){
+    // Entries are counted from the oldest one, whatever slot it is in
+    if(write_cmd >= aesd_circular_buffer_count(buffer)){
         PDEBUG("Write command is outside the range of the circular buffer");
-        return -EINVAL;
+        retval = -EINVAL;
+        goto out;
     }
 
-    dev = filp->private_data;
-    if(write_cmd_offset > dev->bufferP.entry[write_cmd].size){
+    if(write_cmd_offset > buffer->entry[AESD_CIRCULAR_BUFFER_SLOT(buffer, buffer->out_offs + write_cmd)].size){
         PDEBUG("Write command offset is outside of the circular buffer entry: %u ", write_cmd_offset);
-        return -EINVAL;
-    }
-
-    // In this section, we compute the number of bytes used by the write_cmd previous entries
-    for (i=0; i<write_cmd; i++)
-    {
-        size_offset += dev->bufferP.entry[i].size;
+        retval = -EINVAL;
+        goto out;
     }
 
-    // Set f_pos to the requested position
-    *f_pos = size_offset + write_cmd_offset;
+    // The entries know their start, no need to sum the sizes of the write_cmd previous ones
+    *f_pos = (loff_t)aesd_circular_buffer_entry_start(buffer, write_cmd) + write_cmd_offset;
     PDEBUG("File offset set to: %lld", *f_pos);
+  out:
+    mutex_unlock(&dev->lock);
     return retval;
 }
 
-// Check if single entry should be written into circular buffer
-void write_entry_into_buffer(struct aesd_dev *dev)
+// Move the complete lines of the entry buffer into the circular buffer, one entry per line, so each
+// record of a bulk write can be reached with AESDCHAR_IOCSEEKTO. Only the bytes from scanFrom on, the
+// ones just written, are looked at for EOL characters: the pending ones have none.
+// The lines are not copied, their entries point into the entry buffer allocation (its batch), which is
+// freed with the last of them. The bytes after the last EOL move to a new entry buffer.
+// @return 0, or -ENOMEM if that buffer could not be allocated, nothing is committed then
+int write_entry_into_buffer(struct aesd_dev *dev, size_t scanFrom)
 {
-    // Now check if current write has EOL character
-    int EOLPos = checkEOLChar(dev->entry.buffptr, dev->entry.size);
-    PDEBUG("Found EOL char at pos %d ", EOLPos);
-    if(EOLPos == dev->entry.size-1)
+    struct aesd_batch *batch = dev->batch;
+    struct aesd_batch *tail = NULL;
+    const char *data = dev->entry.buffptr;
+    size_t end = dev->entry.size;
+    size_t tailSize, tailCapacity = 0;
+    size_t lineStart = 0;
+
+    // Last EOL char of the new bytes, the lines end there
+    while (end > scanFrom && data[end - 1] != '\n')
+        end--;
+    if (end == scanFrom)
     {
-        // TODO: Need to remember the potentially removed item, remove when add_entry returns circular entry
-        size_t sizeToRemove = dev->bufferP.entry[dev->bufferP.in_offs].size;
-        const char* entryToRemove = aesd_circular_buffer_add_entry(&(dev->bufferP), &(dev->entry));
-        if(entryToRemove)
-        {
-            PDEBUG("Removing entry: %s", entryToRemove);
-            dev->size -= sizeToRemove;
-            kfree(entryToRemove);
-        }
-        // Update circular buffer size
-        dev->size += dev->entry.size;
+        // No EOL char in the new bytes, meaning we only store in entry buffer
+        PDEBUG("Written in entry buffer");
+        return 0;
+    }
 
-        // Remove the content from the entry buffer since moved to circular buffer
-        dev->entry.buffptr = NULL;
-        dev->entry.size = 0;
+    // Allocated before committing anything, a failure leaves the device as it was
+    tailSize = dev->entry.size - end;
+    if (tailSize)
+    {
+        tailCapacity = AESD_ENTRY_MIN_CAPACITY;
+        while (tailCapacity < tailSize)
+            tailCapacity *= 2;
+        tail = kmalloc(sizeof(*tail) + tailCapacity, GFP_KERNEL);
+        if (!tail)
+            return -ENOMEM;
+        tail->refs = 0;
+        memcpy(tail->data, data + end, tailSize);
     }
-    else if(EOLPos < 0)
+
+    // The lines keep the batch as long as the newest of them. A page or more of doubling slack is not
+    // kept with them: krealloc() never shrinks an allocation, the lines move to one of their size.
+    // Smaller slack stays, a copy per ordinary write would cost more. Kept in place if that fails
+    if (dev->entry_capacity - end >= PAGE_SIZE)
     {
-        // No EOL char, meaning we only store in entry buffer
-        PDEBUG("Written in entry buffer");
+        struct aesd_batch *shrunk = kmalloc(sizeof(*shrunk) + end, GFP_KERNEL);
+        if (shrunk)
+        {
+            shrunk->refs = batch->refs;
+            memcpy(shrunk->data, data, end);
+            kfree(batch);
+            batch = shrunk;
+            data = shrunk->data;
+        }
     }
-    else
+
+    while (lineStart < end)
     {
-        // EOL char found inside the char array
-        PDEBUG("Written in entry buffer");
+        struct aesd_buffer_entry line;
+        size_t scan = lineStart > scanFrom ? lineStart : scanFrom;
+        // Found at the latest at end - 1
+        size_t lineEnd = (const char *)memchr(data + scan, '\n', end - scan) - data + 1;
+        // Remember the item removed when full, the oldest one
+        struct aesd_buffer_entry removed = {0};
+        if (dev->bufferP.full)
+            removed = dev->bufferP.entry[dev->bufferP.out_offs];
+
+        line.buffptr = data + lineStart;
+        line.size = lineEnd - lineStart;
+        line.batch = batch;
+        // Taken first, the entry removed may be a previous line of this batch
+        batch->refs++;
+        if (aesd_circular_buffer_add_entry(&(dev->bufferP), &line))
+        {
+            PDEBUG("Removing entry of %zu bytes", removed.size);
+            dev->size -= removed.size;
+            put_batch(removed.batch);
+        }
+        // Update circular buffer size
+        dev->size += line.size;
+        lineStart = lineEnd;
     }
+    PDEBUG("Batch of %zu bytes committed, %u entries kept from it", end, batch->refs);
+
+    // The lines own the batch now, the entry buffer starts over with the bytes left
+    dev->batch = tail;
+    dev->entry.buffptr = tail ? tail->data : NULL;
+    dev->entry.size = tailSize;
+    dev->entry_capacity = tailCapacity;
+    return 0;
 }
 
 // System call implementation
@@ -140,7 +250,7 @@ int aesd_open(struct inode *inode, struct file *filp)
     // and once the complete circular buffer size has been written, then we overwrite the oldest content,
     // regardless of the mode used to open the device (> or >>).
     
-    // Return the content (or partial content) related to the most recent 10 write commands, in the order
+    // Return the content (or partial content) related to the most recent depth write commands, in the order
     // they were received, on any read attempt. So if the buffer is not full, indice 0 will allways be the
     // first to be received, so should be the first to be returned.
     if (!dev->bufferP.full)
@@ -160,7 +270,7 @@ int aesd_release(struct inode *inode, struct file *filp)
 }
 
 // System call implementation
-// Return the content (or partial content) related to the most recent 10 write commands, in the order
+// Return the content (or partial content) related to the most recent depth write commands, in the order
 // they were received, on any read attempt.
 // f_pos is used here to handle partial read
 ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
@@ -176,7 +286,7 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
         return -ERESTARTSYS;
     }
 
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&(dev->bufferP), *f_pos, &entryOffset);
+    entry = *f_pos >= 0 ? aesd_circular_buffer_find_entry_offset_for_fpos(&(dev->bufferP), (size_t)*f_pos, &entryOffset) : NULL;
     if(!entry)
     {
         PDEBUG("No entrie was written yet, so do nothing");
@@ -191,7 +301,8 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
         retval = -EFAULT;
         goto out;
     }
-    PDEBUG("Read %s, %zd bytes from entry %u of the circular buffer",
+    PDEBUG("Read %.*s, %zd bytes from entry %u of the circular buffer",
+                (int)retval,
                 entry->buffptr + entryOffset,
                 retval, 
                 dev->bufferP.out_offs
@@ -211,53 +322,48 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
 {
     ssize_t retval = -ENOMEM;
     struct aesd_dev *dev = filp->private_data;
-    int newSize;
+    size_t newSize, scanFrom;
     PDEBUG("Request write %zu bytes with offset %lld",count,*f_pos);
 
     if (mutex_lock_interruptible(&dev->lock))
         return -ERESTARTSYS;
 
-    // Allocate more than required so we can reuse the heap memory for partial write case later
-    newSize = count+dev->entry.size;
-    char* newString = kmalloc(newSize,GFP_KERNEL);
-
-    // We have 4 uses cases here.
-    // Cases with empty entry buffer:
-    // - New write terminated by an EOL charater: write in entry buffer, copy in circular buffer and free entry buffer
-    // - New write without EOL character: write in entry buffer
-    // Cases with filled entry buffer:
-    // - New write terminated by an EOL charater: kmalloc a new entry with the concatenated char arrays and free previous
-    //   instance, copy in circular buffer and free entry buffer
-    // - New write without EOL character: kmalloc a new entry with the concatenated char arrays and free previous instance
-
-    // Partial write ongoing
-    if(dev->entry.buffptr)
+    // The entry buffer accumulates the writes, then each line it holds becomes a ring entry, see
+    // write_entry_into_buffer(). Its capacity doubles when it is too small, so a line arriving in
+    // many small writes is copied O(log n) times instead of once per write. Nothing points into it
+    // before its lines are committed, it can move
+    newSize = dev->entry.size + count;
+    if (newSize > dev->entry_capacity)
     {
-        PDEBUG("Proceeding a partial write");
-        memcpy(newString, dev->entry.buffptr, dev->entry.size);
-        // Here we do pointer arithmetic to concatenate previous and new content
-        if (copy_from_user(newString + dev->entry.size, buf, count)) {
-            retval = -EFAULT;
+        size_t newCapacity = dev->entry_capacity ? dev->entry_capacity : AESD_ENTRY_MIN_CAPACITY;
+        struct aesd_batch *grown;
+        while (newCapacity < newSize)
+            newCapacity *= 2;
+        grown = krealloc(dev->batch, sizeof(*grown) + newCapacity, GFP_KERNEL);
+        if (!grown) {
+            PDEBUG("Could not grow the entry buffer to %zu bytes", newCapacity);
             goto out;
         }
-        // Replace the entry buffer with the new content
-        kfree(dev->entry.buffptr);
-        dev->entry.buffptr = newString;
-        dev->entry.size = newSize;
+        PDEBUG("Entry buffer grown to %zu bytes", newCapacity);
+        if (!dev->batch)
+            grown->refs = 0;
+        dev->batch = grown;
+        dev->entry.buffptr = grown->data;
+        dev->entry_capacity = newCapacity;
+    }
 
-        write_entry_into_buffer(dev);
+    // Here we do pointer arithmetic to append the new content after the pending one
+    if (copy_from_user((char *)dev->entry.buffptr + dev->entry.size, buf, count)) {
+        retval = -EFAULT;
+        goto out;
     }
-    else
-    {
-        PDEBUG("Starting a new write session");
-        // Since entry buffer was not used, we can directly allocate it
-        dev->entry.buffptr = kmalloc(count,GFP_KERNEL);
-        dev->entry.size = count;
-        if (copy_from_user(dev->entry.buffptr, buf, dev->entry.size)) {
-            retval = -EFAULT;
-            goto out;
-        }
-        write_entry_into_buffer(dev);
+    scanFrom = dev->entry.size;
+    dev->entry.size = newSize;
+    retval = write_entry_into_buffer(dev, scanFrom);
+    if (retval) {
+        // The bytes written are not kept, the caller can retry
+        dev->entry.size = scanFrom;
+        goto out;
     }
 
     *f_pos += count;
@@ -294,7 +400,7 @@ loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
 // Beware of not confusing the ioctl command, cmd, and the SEEKTO command, which is part of arg
 // aesd_ioctl can only be called from user space, because copy_from_user will fail if the arg pointer
 // is pointing to kernel memory
-// Currently, this method is not using any locking mechanism
+// The offset is computed under the device lock, see aesd_adjust_file_offset()
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     long retval = 0;
@@ -366,12 +472,22 @@ int aesd_init_module(void)
     }
     // Here, the device, the circular buffer and the circular buffer entry are initialized
     memset(&aesd_device,0,sizeof(struct aesd_dev));
+    // Before the buffer: aesd_set_depth() takes the lock as soon as the buffer is set
+    mutex_init(&aesd_device.lock);
+    mutex_lock(&aesd_device.lock);
     aesd_circular_buffer_init(&aesd_device.bufferP);
+    result = aesd_circular_buffer_resize(&aesd_device.bufferP, depth, NULL);
+    mutex_unlock(&aesd_device.lock);
+    if (result) {
+        unregister_chrdev_region(dev, 1);
+        return result;
+    }
     aesd_device.entry.buffptr = NULL;
+    aesd_device.batch = NULL;
     result = aesd_setup_cdev(&aesd_device);
-	mutex_init(&aesd_device.lock);
 
     if( result ) {
+        clean_aesd();
         unregister_chrdev_region(dev, 1);
     }
     return result;
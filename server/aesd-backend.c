@@ -0,0 +1,594 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-backend.c: Storage behind aesdsocket, the aesdchar device, a regular file or an in-memory ring
+ * ========================================== */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "aesd-backend.h"
+#include "aesd-probe.h"
+
+// Seek commands on a file read it by chunks of this size, looking for the entry boundaries
+#define SCAN_CHUNK 4096
+
+static ssize_t write_all(int fd, const char *buf, size_t len)
+{
+    size_t written = 0;
+    while (written < len)
+    {
+        ssize_t rc = write(fd, buf + written, len - written);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        written += rc;
+    }
+    return written;
+}
+
+/// Same as write_all() for count buffers, iov is modified
+static ssize_t writev_all(int fd, struct iovec *iov, int count)
+{
+    size_t written = 0;
+    while (count > 0)
+    {
+        ssize_t rc = writev(fd, iov, count);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        written += rc;
+        // Skip what was written
+        while (count > 0 && (size_t)rc >= iov->iov_len)
+        {
+            rc -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+    return written;
+}
+
+/// Read until len bytes or the end. The device returns at most one entry per read()
+static ssize_t read_all(int fd, char *buf, size_t len)
+{
+    size_t total = 0;
+    while (total < len)
+    {
+        ssize_t rc = read(fd, buf + total, len - total);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (rc == 0)
+            break;
+        total += rc;
+    }
+    return total;
+}
+
+// Device: opened for each operation like the server always did, the driver keeps no per open state
+// besides the file position
+
+static ssize_t device_append(struct aesd_backend *backend, const char *buf, size_t len)
+{
+    int fd = open(backend->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    // One write() per packet, the driver commits an entry per line it holds
+    ssize_t written = write_all(fd, buf, len);
+    close(fd);
+    return written;
+}
+
+static ssize_t device_appendv(struct aesd_backend *backend, const struct iovec *iov, int count)
+{
+    struct iovec left[count];
+    memcpy(left, iov, sizeof(left));
+    int fd = open(backend->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    // One open and one system call for the group. The driver has no write_iter, so the kernel calls its
+    // write once per buffer: the lines of every packet are still committed on their own
+    ssize_t written = writev_all(fd, left, count);
+    close(fd);
+    return written;
+}
+
+static ssize_t device_read_at(struct aesd_backend *backend, size_t offset, char *buf, size_t len)
+{
+    int fd = open(backend->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ssize_t read_bytes = -1;
+    if (offset == 0 || lseek(fd, offset, SEEK_SET) == (off_t)offset)
+        read_bytes = read_all(fd, buf, len);
+    close(fd);
+    return read_bytes;
+}
+
+static ssize_t device_seek_to(struct aesd_backend *backend, uint32_t write_cmd, uint32_t write_cmd_offset)
+{
+    int fd = open(backend->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    struct aesd_seekto seekto = {.write_cmd = write_cmd, .write_cmd_offset = write_cmd_offset};
+    // The driver moves the file position, read it back
+    off_t position = -1;
+    if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) == 0)
+        position = lseek(fd, 0, SEEK_CUR);
+    close(fd);
+    return position;
+}
+
+/// One open for all the entries: the seek ioctl gives the start of each one on the same descriptor
+static ssize_t device_entry_lens(struct aesd_backend *backend, uint32_t *lens, uint32_t max, size_t size)
+{
+    int fd = open(backend->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    uint32_t count = 0;
+    off_t previous = 0;
+    while (count < max)
+    {
+        struct aesd_seekto seekto = {.write_cmd = count, .write_cmd_offset = 0};
+        off_t start;
+        if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) != 0 || (start = lseek(fd, 0, SEEK_CUR)) < 0)
+            break;
+        if (count > 0)
+            lens[count - 1] = start - previous;
+        previous = start;
+        count++;
+    }
+    close(fd);
+    if (count > 0)
+        lens[count - 1] = size - previous;
+    return count;
+}
+
+static ssize_t device_size(struct aesd_backend *backend)
+{
+    int fd = open(backend->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    off_t size = lseek(fd, 0, SEEK_END);
+    close(fd);
+    return size;
+}
+
+static void device_close(struct aesd_backend *backend)
+{
+}
+
+static const struct aesd_backend_ops device_ops = {
+    device_append, device_appendv, device_read_at, device_seek_to, device_entry_lens, device_size, device_close,
+};
+
+// File: every entry is kept, an entry being a line
+
+static ssize_t file_append(struct aesd_backend *backend, const char *buf, size_t len)
+{
+    return write_all(backend->fd, buf, len);
+}
+
+static ssize_t file_appendv(struct aesd_backend *backend, const struct iovec *iov, int count)
+{
+    struct iovec left[count];
+    memcpy(left, iov, sizeof(left));
+    return writev_all(backend->fd, left, count);
+}
+
+static ssize_t file_read_at(struct aesd_backend *backend, size_t offset, char *buf, size_t len)
+{
+    size_t total = 0;
+    while (total < len)
+    {
+        ssize_t rc = pread(backend->fd, buf + total, len - total, offset + total);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (rc == 0)
+            break;
+        total += rc;
+    }
+    return total;
+}
+
+static ssize_t file_seek_to(struct aesd_backend *backend, uint32_t write_cmd, uint32_t write_cmd_offset)
+{
+    char chunk[SCAN_CHUNK];
+    size_t offset = 0;
+    size_t entry_start = 0;
+    uint32_t entry = 0;
+    for (;;)
+    {
+        ssize_t len = file_read_at(backend, offset, chunk, sizeof(chunk));
+        if (len < 0)
+            return -1;
+        if (len == 0)
+            break;
+        for (ssize_t i = 0; i < len; i++)
+        {
+            if (chunk[i] != '\n')
+                continue;
+            size_t entry_end = offset + i + 1;
+            if (entry == write_cmd)
+            {
+                // Found, the offset is inside the entry or its end (as the driver), or the seek fails
+                if (write_cmd_offset > entry_end - entry_start)
+                {
+                    errno = EINVAL;
+                    return -1;
+                }
+                return entry_start + write_cmd_offset;
+            }
+            entry++;
+            entry_start = entry_end;
+        }
+        offset += len;
+    }
+    // No such entry, or the trailing bytes are not committed yet
+    errno = EINVAL;
+    return -1;
+}
+
+static ssize_t file_entry_lens(struct aesd_backend *backend, uint32_t *lens, uint32_t max, size_t size)
+{
+    char chunk[SCAN_CHUNK];
+    size_t offset = 0;
+    size_t entry_start = 0;
+    uint32_t count = 0;
+    (void)size;
+    while (count < max)
+    {
+        ssize_t len = file_read_at(backend, offset, chunk, sizeof(chunk));
+        if (len < 0)
+            return -1;
+        if (len == 0)
+            break;
+        for (ssize_t i = 0; i < len && count < max; i++)
+        {
+            if (chunk[i] != '\n')
+                continue;
+            lens[count++] = offset + i + 1 - entry_start;
+            entry_start = offset + i + 1;
+        }
+        offset += len;
+    }
+    // Trailing bytes without their new line are not an entry yet
+    return count;
+}
+
+static ssize_t file_size(struct aesd_backend *backend)
+{
+    struct stat st;
+    return fstat(backend->fd, &st) == 0 ? st.st_size : -1;
+}
+
+static void file_close(struct aesd_backend *backend)
+{
+    close(backend->fd);
+    backend->fd = -1;
+}
+
+static const struct aesd_backend_ops file_ops = {
+    file_append, file_appendv, file_read_at, file_seek_to, file_entry_lens, file_size, file_close,
+};
+
+// Memory: the ring code of the driver (aesd-circular-buffer.c), in the process
+
+static size_t memory_count(const struct aesd_backend *backend)
+{
+    return aesd_circular_buffer_count(&backend->ring);
+}
+
+/// Entry i in reading order, 0 being the oldest
+static struct aesd_buffer_entry *memory_entry(struct aesd_backend *backend, size_t i)
+{
+    return &backend->ring.entry[AESD_CIRCULAR_BUFFER_SLOT(&backend->ring, backend->ring.out_offs + i)];
+}
+
+/// Lines of one append, their entries point into data. Freed with the last of them, as the driver
+/// does with struct aesd_batch
+struct memory_batch
+{
+    unsigned int refs;
+    char data[];
+};
+
+static void memory_release(struct aesd_buffer_entry *entry)
+{
+    struct memory_batch *batch = entry->batch;
+    if (batch != NULL && --batch->refs == 0)
+        free(batch);
+}
+
+// Each line is an entry, as the driver splits a write: the pending bytes and the complete lines go
+// to one batch allocation, the bytes after the last new line are kept in partial for the next append.
+// Both are allocated before committing anything, a failure leaves the ring as it was
+static ssize_t memory_append(struct aesd_backend *backend, const char *buf, size_t len)
+{
+    size_t lines_len = len;
+    while (lines_len > 0 && buf[lines_len - 1] != '\n')
+        lines_len--;
+    if (lines_len == 0)
+    {
+        // No new line, only pending bytes
+        char *partial = len > 0 ? realloc(backend->partial, backend->partial_len + len) : backend->partial;
+        if (len > 0 && partial == NULL)
+            return -1;
+        memcpy(partial + backend->partial_len, buf, len);
+        backend->partial = partial;
+        backend->partial_len += len;
+        return len;
+    }
+
+    size_t batch_len = backend->partial_len + lines_len;
+    size_t tail_len = len - lines_len;
+    struct memory_batch *batch = malloc(sizeof(*batch) + batch_len);
+    char *tail = tail_len > 0 ? malloc(tail_len) : NULL;
+    if (batch == NULL || (tail_len > 0 && tail == NULL))
+    {
+        free(batch);
+        free(tail);
+        errno = ENOMEM;
+        return -1;
+    }
+    batch->refs = 0;
+    if (backend->partial_len > 0)
+        memcpy(batch->data, backend->partial, backend->partial_len);
+    memcpy(batch->data + backend->partial_len, buf, lines_len);
+    if (tail_len > 0)
+        memcpy(tail, buf + lines_len, tail_len);
+
+    for (size_t start = 0; start < batch_len;)
+    {
+        // Found at the latest at batch_len - 1
+        size_t end = (const char *)memchr(batch->data + start, '\n', batch_len - start) - batch->data + 1;
+        struct aesd_buffer_entry line = {.buffptr = batch->data + start, .size = end - start, .batch = batch};
+        // Remember the entry removed when full, the oldest one
+        struct aesd_buffer_entry removed = {0};
+        if (backend->ring.full)
+            removed = backend->ring.entry[backend->ring.out_offs];
+        // Taken first, the entry removed may be a previous line of this batch
+        batch->refs++;
+        if (aesd_circular_buffer_add_entry(&backend->ring, &line) != NULL)
+            memory_release(&removed);
+        start = end;
+    }
+    free(backend->partial);
+    backend->partial = tail;
+    backend->partial_len = tail_len;
+    return len;
+}
+
+static ssize_t memory_appendv(struct aesd_backend *backend, const struct iovec *iov, int count)
+{
+    size_t written = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (memory_append(backend, iov[i].iov_base, iov[i].iov_len) < 0)
+            return -1;
+        written += iov[i].iov_len;
+    }
+    return written;
+}
+
+static ssize_t memory_read_at(struct aesd_backend *backend, size_t offset, char *buf, size_t len)
+{
+    size_t total = 0;
+    size_t count = memory_count(backend);
+    // First entry by binary search on the entry starts, then the following ones
+    size_t i = aesd_circular_buffer_index_for_fpos(&backend->ring, offset);
+    if (i < count)
+        offset -= aesd_circular_buffer_entry_start(&backend->ring, i);
+    for (; i < count && total < len; i++)
+    {
+        struct aesd_buffer_entry *entry = memory_entry(backend, i);
+        size_t chunk = entry->size - offset;
+        if (chunk > len - total)
+            chunk = len - total;
+        memcpy(buf + total, entry->buffptr + offset, chunk);
+        total += chunk;
+        offset = 0;
+    }
+    return total;
+}
+
+static ssize_t memory_seek_to(struct aesd_backend *backend, uint32_t write_cmd, uint32_t write_cmd_offset)
+{
+    // As the driver, the offset may be the end of the entry
+    if (write_cmd >= memory_count(backend) || write_cmd_offset > memory_entry(backend, write_cmd)->size)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return aesd_circular_buffer_entry_start(&backend->ring, write_cmd) + write_cmd_offset;
+}
+
+static ssize_t memory_entry_lens(struct aesd_backend *backend, uint32_t *lens, uint32_t max, size_t size)
+{
+    size_t count = memory_count(backend);
+    (void)size;
+    if (count > max)
+        count = max;
+    for (size_t i = 0; i < count; i++)
+        lens[i] = memory_entry(backend, i)->size;
+    return count;
+}
+
+static ssize_t memory_size(struct aesd_backend *backend)
+{
+    return aesd_circular_buffer_size(&backend->ring);
+}
+
+static void memory_close(struct aesd_backend *backend)
+{
+    uint32_t index;
+    struct aesd_buffer_entry *entry;
+    // Empty slots have no batch
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &backend->ring, index)
+    {
+        memory_release(entry);
+    }
+    aesd_circular_buffer_destroy(&backend->ring);
+    free(backend->partial);
+    backend->partial = NULL;
+    backend->partial_len = 0;
+}
+
+static const struct aesd_backend_ops memory_ops = {
+    memory_append, memory_appendv, memory_read_at, memory_seek_to, memory_entry_lens, memory_size, memory_close,
+};
+
+/// Entries kept by the loaded driver, its default if the module parameter cannot be read
+static uint32_t device_depth(void)
+{
+    unsigned long depth = 0;
+    FILE *param = fopen(AESD_BACKEND_DEVICE_DEPTH, "re");
+    if (param != NULL)
+    {
+        if (fscanf(param, "%lu", &depth) != 1)
+            depth = 0;
+        fclose(param);
+    }
+    return depth > 0 && depth <= AESDCHAR_MAX_DEPTH ? depth : AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+int aesd_backend_open(struct aesd_backend *backend, const char *spec)
+{
+    memset(backend, 0, sizeof(*backend));
+    backend->fd = -1;
+    const char *path = strchr(spec, ':');
+    size_t kind_len = path != NULL ? (size_t)(path - spec) : strlen(spec);
+    if (path != NULL)
+        path++;
+
+    if (kind_len == strlen("device") && strncmp(spec, "device", kind_len) == 0)
+    {
+        backend->ops = &device_ops;
+        backend->name = "device";
+        backend->bounded = true;
+        backend->depth = device_depth();
+        snprintf(backend->path, sizeof(backend->path), "%s", path != NULL ? path : AESD_BACKEND_DEVICE_PATH);
+        return 0;
+    }
+    if (kind_len == strlen("file") && strncmp(spec, "file", kind_len) == 0 && path != NULL && *path != '\0')
+    {
+        backend->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (backend->fd < 0)
+            return -1;
+        if (realpath(path, backend->path) == NULL)
+        {
+            close(backend->fd);
+            return -1;
+        }
+        backend->ops = &file_ops;
+        backend->name = "file";
+        backend->depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        return 0;
+    }
+    if (kind_len == strlen("memory") && strncmp(spec, "memory", kind_len) == 0)
+    {
+        char *end = NULL;
+        unsigned long depth = path != NULL ? strtoul(path, &end, 10) : AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        if (depth == 0 || depth > AESDCHAR_MAX_DEPTH || (end != NULL && *end != '\0'))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        // The ring code of the driver, linked in
+        aesd_circular_buffer_init(&backend->ring);
+        int rc = aesd_circular_buffer_resize(&backend->ring, depth, NULL);
+        if (rc != 0)
+        {
+            errno = -rc;
+            return -1;
+        }
+        backend->ops = &memory_ops;
+        backend->name = "memory";
+        backend->bounded = true;
+        backend->depth = depth;
+        return 0;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+ssize_t aesd_backend_append(struct aesd_backend *backend, const char *buf, size_t len)
+{
+    AESD_PROBE2(write__start, len, 1);
+    ssize_t rc = backend->ops->append(backend, buf, len);
+    AESD_PROBE1(write__done, rc);
+    return rc;
+}
+
+ssize_t aesd_backend_appendv(struct aesd_backend *backend, const struct iovec *iov, int count)
+{
+    size_t len = 0;
+    for (int i = 0; i < count; i++)
+        len += iov[i].iov_len;
+    AESD_PROBE2(write__start, len, count);
+    ssize_t rc = backend->ops->appendv(backend, iov, count);
+    AESD_PROBE1(write__done, rc);
+    return rc;
+}
+
+ssize_t aesd_backend_read_at(struct aesd_backend *backend, size_t offset, char *buf, size_t len)
+{
+    AESD_PROBE2(read__start, offset, len);
+    ssize_t rc = backend->ops->read_at(backend, offset, buf, len);
+    AESD_PROBE1(read__done, rc);
+    return rc;
+}
+
+ssize_t aesd_backend_seek_to(struct aesd_backend *backend, uint32_t write_cmd, uint32_t write_cmd_offset)
+{
+    AESD_PROBE2(seek__start, write_cmd, write_cmd_offset);
+    ssize_t rc = backend->ops->seek_to(backend, write_cmd, write_cmd_offset);
+    AESD_PROBE1(seek__done, rc);
+    return rc;
+}
+
+ssize_t aesd_backend_entry_lens(struct aesd_backend *backend, uint32_t *lens, uint32_t max, size_t size)
+{
+    return backend->ops->entry_lens(backend, lens, max, size);
+}
+
+ssize_t aesd_backend_size(struct aesd_backend *backend)
+{
+    return backend->ops->size(backend);
+}
+
+uint32_t aesd_backend_depth(struct aesd_backend *backend)
+{
+    if (backend->ops == &device_ops)
+        backend->depth = device_depth();
+    return backend->depth;
+}
+
+void aesd_backend_close(struct aesd_backend *backend)
+{
+    backend->ops->close(backend);
+}
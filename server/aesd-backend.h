@@ -0,0 +1,84 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-backend.h: Storage behind aesdsocket, the aesdchar device, a regular file or an in-memory ring
+ * ========================================== */
+
+// The server only appends packets, reads the history from an offset and resolves seek commands, so
+// any storage offering these operations can replace the device:
+// - device: the aesdchar driver (default /dev/aesdchar), seeks run the AESDCHAR_IOCSEEKTO ioctl
+// - file:   a regular file keeping every entry, entries being its lines
+// - memory: the device semantics without the device: the last depth entries (default
+//           AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED), each line written is committed as one entry,
+//           evicting the oldest one when the ring is full, bytes after the last new line wait for the
+//           next writes
+// Calls are not synchronized, the caller serializes them (file_mutex in aesdsocket).
+
+#ifndef AESD_BACKEND_H
+#define AESD_BACKEND_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+#define AESD_BACKEND_DEVICE_PATH "/dev/aesdchar"
+// Depth of the loaded driver, read again by aesd_backend_depth() as it can be written at any time
+#define AESD_BACKEND_DEVICE_DEPTH "/sys/module/aesdchar/parameters/depth"
+
+struct aesd_backend;
+
+struct aesd_backend_ops
+{
+    /// Write a packet, returns the bytes written or -1 with errno set
+    ssize_t (*append)(struct aesd_backend *backend, const char *buf, size_t len);
+    /// Write count packets in one call, each one as if appended alone. Returns the bytes written or -1
+    /// with errno set
+    ssize_t (*appendv)(struct aesd_backend *backend, const struct iovec *iov, int count);
+    /// Read the history from offset, returns the bytes read (0 past the end) or -1 with errno set
+    ssize_t (*read_at)(struct aesd_backend *backend, size_t offset, char *buf, size_t len);
+    /// Offset of byte write_cmd_offset of entry write_cmd (0 being the oldest), -1 with errno set to
+    /// EINVAL if there is no such byte
+    ssize_t (*seek_to)(struct aesd_backend *backend, uint32_t write_cmd, uint32_t write_cmd_offset);
+    /// Length of each entry into lens, oldest first, at most max of them. size is the history size read
+    /// last, its final entry ends there. Returns the number of entries, -1 with errno set
+    ssize_t (*entry_lens)(struct aesd_backend *backend, uint32_t *lens, uint32_t max, size_t size);
+    /// Size of the history, -1 with errno set on error
+    ssize_t (*size)(struct aesd_backend *backend);
+    void (*close)(struct aesd_backend *backend);
+};
+
+struct aesd_backend
+{
+    const struct aesd_backend_ops *ops;
+    const char *name;
+    bool bounded;                   // only the last entries are kept, older ones are evicted
+    uint32_t depth;                 // entries kept, for a file the driver default (log replay, shared memory),
+                                    // for the device as last read, see aesd_backend_depth()
+    char path[PATH_MAX];            // device and file
+    int fd;                         // file, kept open
+    // memory
+    struct aesd_circular_buffer ring;
+    char *partial;                  // bytes written after the last new line
+    size_t partial_len;
+};
+
+/// Open the storage described by spec: "device", "device:path", "file:path", "memory" or "memory:depth".
+/// A file path is made absolute, so it still works once the daemon changed its directory.
+/// Returns 0, -1 with errno set
+int aesd_backend_open(struct aesd_backend *backend, const char *spec);
+
+ssize_t aesd_backend_append(struct aesd_backend *backend, const char *buf, size_t len);
+ssize_t aesd_backend_appendv(struct aesd_backend *backend, const struct iovec *iov, int count);
+ssize_t aesd_backend_read_at(struct aesd_backend *backend, size_t offset, char *buf, size_t len);
+ssize_t aesd_backend_seek_to(struct aesd_backend *backend, uint32_t write_cmd, uint32_t write_cmd_offset);
+ssize_t aesd_backend_entry_lens(struct aesd_backend *backend, uint32_t *lens, uint32_t max, size_t size);
+ssize_t aesd_backend_size(struct aesd_backend *backend);
+/// Entries kept now. The depth of the device is read again, it changes when the driver is resized
+/// through sysfs; depth is updated
+uint32_t aesd_backend_depth(struct aesd_backend *backend);
+void aesd_backend_close(struct aesd_backend *backend);
+
+#endif /* AESD_BACKEND_H */
@@ -0,0 +1,150 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-budget.c: Memory budget, a byte cap shared by the connections and a pool of borrowed buffers
+ * ========================================== */
+
+#include <stdlib.h>
+#include <syslog.h>
+
+#include "aesd-budget.h"
+
+// Caller holds the lock
+static void charge(struct aesd_budget *budget, size_t size)
+{
+    budget->used += size;
+    if (budget->used > budget->peak)
+        budget->peak = budget->used;
+}
+
+int aesd_budget_init(struct aesd_budget *budget, size_t cap, size_t buffer_size)
+{
+    // The pool holds at least a buffer and its link
+    if (buffer_size < sizeof(struct aesd_budget_buffer) || cap < AESD_BUDGET_POOL_RESERVE * buffer_size)
+        return -1;
+    budget->cap = cap;
+    budget->used = 0;
+    budget->peak = 0;
+    budget->buffer_size = buffer_size;
+    pthread_mutex_init(&budget->lock, NULL);
+    pthread_cond_init(&budget->freed, NULL);
+    budget->pool = NULL;
+    budget->buffers = 0;
+    budget->borrows = 0;
+    budget->waits = 0;
+    budget->refused = 0;
+    return 0;
+}
+
+void aesd_budget_destroy(struct aesd_budget *budget)
+{
+    pthread_mutex_lock(&budget->lock);
+    syslog(LOG_INFO, "Memory budget: peak %zu of %zu bytes, %llu borrows, %llu waits, %llu refused\n",
+           budget->peak, budget->cap, (unsigned long long)budget->borrows, (unsigned long long)budget->waits,
+           (unsigned long long)budget->refused);
+    while (budget->pool != NULL)
+    {
+        struct aesd_budget_buffer *next = budget->pool->next;
+        free(budget->pool);
+        budget->used -= budget->buffer_size;
+        budget->buffers--;
+        budget->pool = next;
+    }
+    pthread_mutex_unlock(&budget->lock);
+}
+
+bool aesd_budget_admit(struct aesd_budget *budget, size_t size)
+{
+    size_t limit = budget->cap - AESD_BUDGET_POOL_RESERVE * budget->buffer_size;
+    pthread_mutex_lock(&budget->lock);
+    bool admitted = budget->used + size <= limit;
+    if (admitted)
+        charge(budget, size);
+    else
+        budget->refused++;
+    pthread_mutex_unlock(&budget->lock);
+    return admitted;
+}
+
+// Bytes the pool still needs to reach its reserve. Caller holds the lock
+static size_t missing_reserve(struct aesd_budget *budget)
+{
+    return budget->buffers < AESD_BUDGET_POOL_RESERVE
+               ? (AESD_BUDGET_POOL_RESERVE - budget->buffers) * budget->buffer_size : 0;
+}
+
+bool aesd_budget_try_charge(struct aesd_budget *budget, size_t size)
+{
+    pthread_mutex_lock(&budget->lock);
+    // Free pooled buffers beyond the reserve make room first
+    while (budget->used + size + missing_reserve(budget) > budget->cap && budget->pool != NULL &&
+           budget->buffers > AESD_BUDGET_POOL_RESERVE)
+    {
+        struct aesd_budget_buffer *buf = budget->pool;
+        budget->pool = buf->next;
+        free(buf);
+        budget->used -= budget->buffer_size;
+        budget->buffers--;
+    }
+    // The pool reserve stays available, borrowers holding a buffer may need a second one
+    bool charged = budget->used + size + missing_reserve(budget) <= budget->cap;
+    if (charged)
+        charge(budget, size);
+    else
+        budget->refused++;
+    pthread_mutex_unlock(&budget->lock);
+    return charged;
+}
+
+void aesd_budget_release(struct aesd_budget *budget, size_t size)
+{
+    pthread_mutex_lock(&budget->lock);
+    budget->used -= size;
+    pthread_cond_broadcast(&budget->freed);
+    pthread_mutex_unlock(&budget->lock);
+}
+
+void *aesd_budget_borrow(struct aesd_budget *budget)
+{
+    pthread_mutex_lock(&budget->lock);
+    budget->borrows++;
+    bool waited = false;
+    for (;;)
+    {
+        if (budget->pool != NULL)
+        {
+            struct aesd_budget_buffer *buf = budget->pool;
+            budget->pool = buf->next;
+            pthread_mutex_unlock(&budget->lock);
+            return buf;
+        }
+        if (budget->used + budget->buffer_size <= budget->cap)
+            break;
+        if (!waited)
+            budget->waits++;
+        waited = true;
+        pthread_cond_wait(&budget->freed, &budget->lock);
+    }
+    // Charged before allocating, so concurrent borrowers cannot overshoot the cap
+    charge(budget, budget->buffer_size);
+    budget->buffers++;
+    pthread_mutex_unlock(&budget->lock);
+
+    void *buf = malloc(budget->buffer_size);
+    if (buf == NULL)
+    {
+        pthread_mutex_lock(&budget->lock);
+        budget->buffers--;
+        pthread_mutex_unlock(&budget->lock);
+        aesd_budget_release(budget, budget->buffer_size);
+    }
+    return buf;
+}
+
+void aesd_budget_return(struct aesd_budget *budget, void *buf)
+{
+    struct aesd_budget_buffer *node = buf;
+    pthread_mutex_lock(&budget->lock);
+    node->next = budget->pool;
+    budget->pool = node;
+    pthread_cond_broadcast(&budget->freed);
+    pthread_mutex_unlock(&budget->lock);
+}
@@ -0,0 +1,60 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-budget.h: Memory budget, a byte cap shared by the connections and a pool of borrowed buffers
+ * ========================================== */
+
+// Everything a connection allocates is charged on one budget. A connection holds its control block
+// and thread stack for its whole life (admission), and borrows receive buffers from a shared pool
+// only while it has data to process. Returned buffers stay in the pool, still charged, for the next
+// borrower. Admissions and other charges may not use the pool reserve, so admitted connections can
+// always progress.
+
+#ifndef AESD_BUDGET_H
+#define AESD_BUDGET_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Buffers kept for the pool, never taken by admissions
+#define AESD_BUDGET_POOL_RESERVE 16
+
+struct aesd_budget_buffer
+{
+    struct aesd_budget_buffer *next;
+};
+
+struct aesd_budget
+{
+    size_t cap;             // bytes
+    size_t used;            // bytes charged, pool included
+    size_t peak;
+    size_t buffer_size;     // size of a pooled buffer
+    pthread_mutex_t lock;
+    pthread_cond_t freed;
+    struct aesd_budget_buffer *pool;    // free buffers
+    size_t buffers;         // pooled buffers allocated, borrowed or free
+    uint64_t borrows;
+    uint64_t waits;         // borrows which had to wait for memory
+    uint64_t refused;       // admissions and allocations refused
+};
+
+/// Returns 0, -1 if the cap cannot hold the pool reserve
+int aesd_budget_init(struct aesd_budget *budget, size_t cap, size_t buffer_size);
+/// Frees the pool, logs the statistics. Buffers still borrowed are not freed
+void aesd_budget_destroy(struct aesd_budget *budget);
+
+/// Charge a new connection, refused if it would use the pool reserve. Returns true if charged
+bool aesd_budget_admit(struct aesd_budget *budget, size_t size);
+/// Charge an allocation, freeing pooled buffers beyond the reserve to make room, refused if it would
+/// leave no room for the pool reserve. It never waits: the memory could only come back from the
+/// caller. Returns true if charged
+bool aesd_budget_try_charge(struct aesd_budget *budget, size_t size);
+void aesd_budget_release(struct aesd_budget *budget, size_t size);
+
+/// Get a buffer of buffer_size bytes from the pool, waiting for one if the budget is exhausted.
+/// Returns NULL only if out of system memory
+void *aesd_budget_borrow(struct aesd_budget *budget);
+void aesd_budget_return(struct aesd_budget *budget, void *buf);
+
+#endif /* AESD_BUDGET_H */
@@ -0,0 +1,144 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-capture.c: Binary capture of the inbound traffic, for offline replay
+ * ========================================== */
+
+#include <errno.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "aesd-capture.h"
+
+// Records are buffered, the capture must not slow down the connections
+#define AESD_CAPTURE_BUFFER (256 * 1024)
+
+static uint64_t now_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Caller holds the lock
+static void write_record(struct aesd_capture *capture, uint32_t conn_id, uint16_t type, const char *buf, size_t len)
+{
+    if (capture->failed)
+        return;
+    struct aesd_capture_record record = {
+        .time_ns = now_ns(CLOCK_MONOTONIC) - capture->start_ns,
+        .conn_id = conn_id,
+        .type = type,
+        .len = len,
+    };
+    if (fwrite(&record, sizeof(record), 1, capture->file) != 1 || (len > 0 && fwrite(buf, len, 1, capture->file) != 1))
+    {
+        syslog(LOG_ERR, "Could not write the capture: %d, capture stopped\n", errno);
+        capture->failed = 1;
+        return;
+    }
+    capture->records++;
+    capture->bytes += len;
+}
+
+int aesd_capture_open(struct aesd_capture *capture, const char *path)
+{
+    memset(capture, 0, sizeof(*capture));
+    capture->file = fopen(path, "w");
+    if (capture->file == NULL)
+        return -1;
+    setvbuf(capture->file, NULL, _IOFBF, AESD_CAPTURE_BUFFER);
+
+    struct aesd_capture_header header = {
+        .magic = AESD_CAPTURE_MAGIC,
+        .version = AESD_CAPTURE_VERSION,
+        .start_realtime_ns = now_ns(CLOCK_REALTIME),
+    };
+    // Flush the header now, nothing must stay buffered if the process forks (daemon mode)
+    if (fwrite(&header, sizeof(header), 1, capture->file) != 1 || fflush(capture->file) != 0)
+    {
+        fclose(capture->file);
+        capture->file = NULL;
+        return -1;
+    }
+    capture->start_ns = now_ns(CLOCK_MONOTONIC);
+    pthread_mutex_init(&capture->lock, NULL);
+    return 0;
+}
+
+uint32_t aesd_capture_connection(struct aesd_capture *capture)
+{
+    pthread_mutex_lock(&capture->lock);
+    uint32_t conn_id = ++capture->next_conn_id;
+    write_record(capture, conn_id, AESD_CAPTURE_OPEN, NULL, 0);
+    pthread_mutex_unlock(&capture->lock);
+    return conn_id;
+}
+
+void aesd_capture_data(struct aesd_capture *capture, uint32_t conn_id, const char *buf, size_t len)
+{
+    pthread_mutex_lock(&capture->lock);
+    while (len > 0)
+    {
+        size_t chunk = len < AESD_CAPTURE_MAX_DATA ? len : AESD_CAPTURE_MAX_DATA;
+        write_record(capture, conn_id, AESD_CAPTURE_DATA, buf, chunk);
+        buf += chunk;
+        len -= chunk;
+    }
+    pthread_mutex_unlock(&capture->lock);
+}
+
+void aesd_capture_closed(struct aesd_capture *capture, uint32_t conn_id)
+{
+    pthread_mutex_lock(&capture->lock);
+    write_record(capture, conn_id, AESD_CAPTURE_CLOSE, NULL, 0);
+    pthread_mutex_unlock(&capture->lock);
+}
+
+void aesd_capture_close(struct aesd_capture *capture)
+{
+    if (capture->file == NULL)
+        return;
+    pthread_mutex_lock(&capture->lock);
+    if (fclose(capture->file) != 0)
+        syslog(LOG_ERR, "Could not flush the capture: %d\n", errno);
+    capture->file = NULL;
+    syslog(LOG_INFO, "Capture: %u connections, %llu records, %llu bytes\n", capture->next_conn_id,
+           (unsigned long long)capture->records, (unsigned long long)capture->bytes);
+    pthread_mutex_unlock(&capture->lock);
+}
+
+int aesd_capture_reader_open(struct aesd_capture_reader *reader, const char *path)
+{
+    reader->file = fopen(path, "r");
+    if (reader->file == NULL)
+        return -1;
+    if (fread(&reader->header, sizeof(reader->header), 1, reader->file) != 1 ||
+        reader->header.magic != AESD_CAPTURE_MAGIC || reader->header.version != AESD_CAPTURE_VERSION)
+    {
+        fclose(reader->file);
+        reader->file = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int aesd_capture_next(struct aesd_capture_reader *reader, struct aesd_capture_record *record, char *buf)
+{
+    size_t got = fread(record, 1, sizeof(*record), reader->file);
+    if (got == 0)
+        return 0;
+    // A capture cut by a crash ends with a partial record, report it rather than replaying garbage
+    if (got != sizeof(*record) || record->type > AESD_CAPTURE_CLOSE)
+        return -1;
+    if (record->len > 0 && fread(buf, record->len, 1, reader->file) != 1)
+        return -1;
+    return 1;
+}
+
+void aesd_capture_reader_close(struct aesd_capture_reader *reader)
+{
+    if (reader->file != NULL)
+        fclose(reader->file);
+    reader->file = NULL;
+}
@@ -0,0 +1,87 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-capture.h: Binary capture of the inbound traffic, for offline replay
+ * ========================================== */
+
+// File layout: struct aesd_capture_header, then a sequence of records:
+//   struct aesd_capture_record | len bytes, as received by one recv() call
+// Connections get an id when they are accepted (AESD_CAPTURE_OPEN record) and end with an
+// AESD_CAPTURE_CLOSE record, so a replay can reproduce the concurrency and the packetization.
+// Fields are stored in host byte order.
+
+#ifndef AESD_CAPTURE_H
+#define AESD_CAPTURE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define AESD_CAPTURE_MAGIC 0x50414341u // "ACAP"
+#define AESD_CAPTURE_VERSION 1
+
+#define AESD_CAPTURE_OPEN 0
+#define AESD_CAPTURE_DATA 1
+#define AESD_CAPTURE_CLOSE 2
+
+// Bigger received packets are split in several data records
+#define AESD_CAPTURE_MAX_DATA UINT16_MAX
+
+struct aesd_capture_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t start_realtime_ns; // wall clock time of the first record, for reference only
+};
+
+struct aesd_capture_record
+{
+    uint64_t time_ns;   // monotonic time since the capture started
+    uint32_t conn_id;
+    uint16_t type;      // AESD_CAPTURE_OPEN, AESD_CAPTURE_DATA or AESD_CAPTURE_CLOSE
+    uint16_t len;       // number of bytes following the record, 0 unless AESD_CAPTURE_DATA
+};
+
+/// Writer side, shared by all the connection threads
+struct aesd_capture
+{
+    FILE *file;
+    pthread_mutex_t lock;
+    uint64_t start_ns;
+    uint32_t next_conn_id;
+    uint64_t records;
+    uint64_t bytes;
+    int failed;         // a write failed, the capture stopped
+};
+
+/// Reader side
+struct aesd_capture_reader
+{
+    FILE *file;
+    struct aesd_capture_header header;
+};
+
+/// Create (or truncate) the capture file. Returns 0 on success, -1 on error
+int aesd_capture_open(struct aesd_capture *capture, const char *path);
+
+/// Record a new connection. Returns its id
+uint32_t aesd_capture_connection(struct aesd_capture *capture);
+
+/// Record the bytes received on a connection
+void aesd_capture_data(struct aesd_capture *capture, uint32_t conn_id, const char *buf, size_t len);
+
+/// Record the end of a connection
+void aesd_capture_closed(struct aesd_capture *capture, uint32_t conn_id);
+
+/// Flush the records, log the counters and close the file
+void aesd_capture_close(struct aesd_capture *capture);
+
+/// Open a capture for reading. Returns 0 on success, -1 on error (errno EINVAL if it is not a capture)
+int aesd_capture_reader_open(struct aesd_capture_reader *reader, const char *path);
+
+/// Read the next record and its bytes (buf must hold AESD_CAPTURE_MAX_DATA bytes).
+/// Returns 1 if a record was read, 0 at the end of the capture, -1 on a truncated or invalid record
+int aesd_capture_next(struct aesd_capture_reader *reader, struct aesd_capture_record *record, char *buf);
+
+void aesd_capture_reader_close(struct aesd_capture_reader *reader);
+
+#endif /* AESD_CAPTURE_H */
@@ -0,0 +1,274 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-client-bench.c: Append throughput of libaesdclient against one connection per message
+ * Usage: aesd-client-bench [host] [port] [messages] [pool size]
+ * ========================================== */
+
+#define _GNU_SOURCE // memmem
+
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-client.h"
+
+#define BATCH 64
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int make_line(char *line, size_t cap, const char *mode, unsigned i)
+{
+    return snprintf(line, cap, "%s message %u sensor reading within range\n", mode, i);
+}
+
+/// Open a connection to host:port, -1 on error
+static int connect_to(const char *host, const char *port)
+{
+    struct addrinfo hints = {0};
+    struct addrinfo *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return -1;
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/// Receive until the stream holds marker, the replies before it are skipped. Returns 0 once found
+static int wait_for(int fd, const char *marker)
+{
+    static char stream[65536];
+    size_t len = 0;
+    size_t marker_len = strlen(marker);
+    for (;;)
+    {
+        ssize_t received = recv(fd, stream + len, sizeof(stream) - len, 0);
+        if (received <= 0)
+            return -1;
+        len += received;
+        if (memmem(stream, len, marker, marker_len) != NULL)
+            return 0;
+        // Keep the tail, the marker may straddle two receives
+        if (len >= marker_len)
+        {
+            memmove(stream, stream + len - marker_len + 1, marker_len - 1);
+            len = marker_len - 1;
+        }
+    }
+}
+
+/// Fire and forget: silent ingest mode, nothing is answered. Lines are sent pipelined so each one is
+/// an entry, switching back to counted acknowledgements at the end tells when all were written
+static unsigned silent(const char *host, const char *port, unsigned messages)
+{
+    int fd = connect_to(host, port);
+    if (fd < 0)
+        return 0;
+    const char *pipeline = "AESDSOCKET_PIPELINE:1\n";
+    const char *ingest = "AESDSOCKET_INGEST:2\n";
+    const char *done = "AESDSOCKET_INGEST:1\n";
+    unsigned sent = 0;
+    if (send(fd, pipeline, strlen(pipeline), MSG_NOSIGNAL) < 0 || wait_for(fd, pipeline) != 0 ||
+        send(fd, ingest, strlen(ingest), MSG_NOSIGNAL) < 0)
+        goto out;
+    char batch[BATCH * 128];
+    while (sent < messages)
+    {
+        size_t len = 0;
+        unsigned count = messages - sent < BATCH ? messages - sent : BATCH;
+        for (unsigned j = 0; j < count; j++)
+            len += make_line(batch + len, sizeof(batch) - len, "silent", sent + j);
+        if (send(fd, batch, len, MSG_NOSIGNAL) < 0)
+            goto out;
+        sent += count;
+    }
+    if (send(fd, done, strlen(done), MSG_NOSIGNAL) < 0 || wait_for(fd, done) != 0)
+        sent = 0;
+out:
+    close(fd);
+    return sent;
+}
+
+/// What a client without the library does: connect, send, half close, read the history until the server closes
+static unsigned one_shot(const char *host, const char *port, unsigned messages)
+{
+    struct addrinfo hints = {0};
+    struct addrinfo *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return 0;
+
+    unsigned acked = 0;
+    char line[128];
+    static char reply[65536];
+    for (unsigned i = 0; i < messages; i++)
+    {
+        int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) != 0)
+        {
+            if (fd >= 0)
+                close(fd);
+            break;
+        }
+        int len = make_line(line, sizeof(line), "one-shot", i);
+        send(fd, line, len, MSG_NOSIGNAL);
+        shutdown(fd, SHUT_WR);
+        ssize_t received;
+        size_t total = 0;
+        while ((received = recv(fd, reply, sizeof(reply), 0)) > 0)
+            total += received;
+        close(fd);
+        acked += total > 0;
+    }
+    freeaddrinfo(res);
+    return acked;
+}
+
+static unsigned blocking(struct aesd_client *client, unsigned messages)
+{
+    unsigned acked = 0;
+    char line[128];
+    for (unsigned i = 0; i < messages; i++)
+    {
+        int len = make_line(line, sizeof(line), "blocking", i);
+        acked += aesd_client_append(client, line, len, NULL, 0) >= 0;
+    }
+    return acked;
+}
+
+static unsigned batched(struct aesd_client *client, unsigned messages)
+{
+    static char storage[BATCH][128];
+    const char *lines[BATCH];
+    size_t lens[BATCH];
+    unsigned acked = 0;
+    for (unsigned i = 0; i < messages; i += BATCH)
+    {
+        unsigned count = messages - i < BATCH ? messages - i : BATCH;
+        for (unsigned j = 0; j < count; j++)
+        {
+            lens[j] = make_line(storage[j], sizeof(storage[j]), "batched", i + j);
+            lines[j] = storage[j];
+        }
+        ssize_t n = aesd_client_append_many(client, lines, lens, count);
+        if (n > 0)
+            acked += n;
+    }
+    return acked;
+}
+
+static void count_cb(int status, const char *reply, size_t len, void *ctx)
+{
+    if (status == 0)
+        (*(unsigned *)ctx)++;
+}
+
+/// Keep up to BATCH requests in flight, spread over the pool
+static unsigned async(struct aesd_client *client, unsigned messages)
+{
+    unsigned acked = 0;
+    unsigned submitted = 0;
+    char line[128];
+    while (submitted < messages || aesd_client_pending(client) > 0)
+    {
+        while (submitted < messages && aesd_client_pending(client) < BATCH)
+        {
+            int len = make_line(line, sizeof(line), "async", submitted);
+            if (aesd_client_submit(client, line, len, count_cb, &acked) != 0)
+                return acked;
+            submitted++;
+        }
+        if (aesd_client_poll(client, -1) < 0)
+            break;
+    }
+    return acked;
+}
+
+static void report(const char *name, unsigned acked, double elapsed)
+{
+    printf("%-24s %10u %12.0f %12.1f\n", name, acked, acked / elapsed, elapsed * 1e6 / (acked ? acked : 1));
+}
+
+int main(int argc, char **argv)
+{
+    const char *host = argc > 1 ? argv[1] : "localhost";
+    const char *port = argc > 2 ? argv[2] : "9000";
+    unsigned messages = argc > 3 ? strtoul(argv[3], NULL, 10) : 2000;
+    unsigned pool_size = argc > 4 ? strtoul(argv[4], NULL, 10) : 4;
+
+    printf("%-24s %10s %12s %12s\n", "mode", "acked", "msgs/s", "us/msg");
+
+    double start = now_s();
+    unsigned acked = one_shot(host, port, messages);
+    report("connection per message", acked, now_s() - start);
+
+    struct aesd_client *client = aesd_client_create(host, port, 1, 0);
+    if (client == NULL)
+    {
+        perror("aesd_client_create");
+        return EXIT_FAILURE;
+    }
+    start = now_s();
+    acked = blocking(client, messages);
+    report("pooled, blocking", acked, now_s() - start);
+
+    start = now_s();
+    acked = batched(client, messages);
+    report("pooled, pipelined", acked, now_s() - start);
+    aesd_client_destroy(client);
+
+    // Only the history added since the previous reply
+    client = aesd_client_create(host, port, 1, AESD_CLIENT_DELTA);
+    if (client == NULL)
+    {
+        perror("aesd_client_create");
+        return EXIT_FAILURE;
+    }
+    start = now_s();
+    acked = batched(client, messages);
+    report("pipelined, delta", acked, now_s() - start);
+    aesd_client_destroy(client);
+
+    // Appends only, acknowledged with an entry count instead of the history
+    client = aesd_client_create(host, port, 1, AESD_CLIENT_INGEST);
+    if (client == NULL)
+    {
+        perror("aesd_client_create");
+        return EXIT_FAILURE;
+    }
+    start = now_s();
+    acked = batched(client, messages);
+    report("pipelined, ingest count", acked, now_s() - start);
+    aesd_client_destroy(client);
+
+    start = now_s();
+    acked = silent(host, port, messages);
+    report("pipelined, ingest silent", acked, now_s() - start);
+
+    client = aesd_client_create(host, port, pool_size, AESD_CLIENT_COMPRESS);
+    if (client == NULL)
+    {
+        perror("aesd_client_create");
+        return EXIT_FAILURE;
+    }
+    start = now_s();
+    acked = async(client, messages);
+    report("async, pool, compressed", acked, now_s() - start);
+    aesd_client_destroy(client);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,668 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-client.c: Client library for aesdsocket (libaesdclient)
+ * ========================================== */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "aesd-client.h"
+#include "aesd-lz.h"
+
+// Same as MAX_BUFFER_SIZE in aesdsocket.c, the biggest reply the server sends
+#define AESD_CLIENT_MAX_REPLY 50000
+#define AESD_CLIENT_PIPELINE_ON "AESDSOCKET_PIPELINE:1\n"
+#define AESD_CLIENT_COMPRESS_ON "AESDSOCKET_COMPRESS:1\n"
+#define AESD_CLIENT_INGEST_ON "AESDSOCKET_INGEST:1\n"
+#define AESD_CLIENT_DELTA_ON "AESDSOCKET_DELTA:1\n"
+#define AESD_CLIENT_RECV_SIZE 16384
+
+/// Callback of a request waiting for its reply
+struct aesd_client_req
+{
+    aesd_client_cb cb;
+    void *ctx;
+};
+
+/// One persistent pipelined connection of the pool
+struct aesd_client_conn
+{
+    int fd;                         // -1 while not connected
+    char *out;                      // requests not sent yet
+    size_t out_len, out_sent, out_cap;
+    char *in;                       // received bytes not decoded yet
+    size_t in_len, in_cap;
+    char *reply;                    // decoded reply given to the callback
+    size_t reply_cap;
+    struct aesd_client_req *fifo;   // requests waiting for their reply, in sending order
+    size_t fifo_head, fifo_count, fifo_cap;
+    struct aesd_lz_stream lz;       // reply stream, only set up with AESD_CLIENT_COMPRESS
+    bool lz_init;
+};
+
+struct aesd_client
+{
+    char *host;
+    char *port;
+    unsigned flags;
+    unsigned pool_size;
+    struct aesd_client_conn *pool;
+    struct pollfd *pfd;
+};
+
+/// Result of a blocking call
+struct aesd_client_wait
+{
+    bool done;
+    int status;
+    char *reply;
+    size_t reply_cap;
+    size_t reply_len;
+};
+
+/// Result of aesd_client_append_many
+struct aesd_client_batch
+{
+    size_t remaining;
+    size_t acked;
+    int status;
+};
+
+static int grow(char **buf, size_t *cap, size_t needed)
+{
+    if (needed <= *cap)
+        return 0;
+    size_t new_cap = *cap ? *cap : 256;
+    while (new_cap < needed)
+        new_cap *= 2;
+    char *new_buf = realloc(*buf, new_cap);
+    if (new_buf == NULL)
+        return -1;
+    *buf = new_buf;
+    *cap = new_cap;
+    return 0;
+}
+
+static int fifo_push(struct aesd_client_conn *conn, aesd_client_cb cb, void *ctx)
+{
+    if (conn->fifo_count == conn->fifo_cap)
+    {
+        size_t new_cap = conn->fifo_cap ? conn->fifo_cap * 2 : 16;
+        struct aesd_client_req *fifo = malloc(new_cap * sizeof(*fifo));
+        if (fifo == NULL)
+            return -1;
+        // Unwrap the ring while moving it
+        for (size_t i = 0; i < conn->fifo_count; i++)
+            fifo[i] = conn->fifo[(conn->fifo_head + i) % conn->fifo_cap];
+        free(conn->fifo);
+        conn->fifo = fifo;
+        conn->fifo_head = 0;
+        conn->fifo_cap = new_cap;
+    }
+    conn->fifo[(conn->fifo_head + conn->fifo_count) % conn->fifo_cap] = (struct aesd_client_req){cb, ctx};
+    conn->fifo_count++;
+    return 0;
+}
+
+static struct aesd_client_req fifo_pop(struct aesd_client_conn *conn)
+{
+    struct aesd_client_req req = conn->fifo[conn->fifo_head];
+    conn->fifo_head = (conn->fifo_head + 1) % conn->fifo_cap;
+    conn->fifo_count--;
+    return req;
+}
+
+/// Close the connection and fail every request still waiting on it.
+/// Returns the number of callbacks called
+static int conn_fail(struct aesd_client_conn *conn, int error)
+{
+    int called = 0;
+    if (conn->fd >= 0)
+        close(conn->fd);
+    conn->fd = -1;
+    conn->out_len = conn->out_sent = 0;
+    conn->in_len = 0;
+    if (conn->lz_init)
+        aesd_lz_stream_free(&conn->lz);
+    conn->lz_init = false;
+    while (conn->fifo_count > 0)
+    {
+        struct aesd_client_req req = fifo_pop(conn);
+        if (req.cb != NULL)
+            req.cb(-error, NULL, 0, req.ctx);
+        called++;
+    }
+    return called;
+}
+
+static int queue_line(struct aesd_client_conn *conn, const char *line, size_t len, aesd_client_cb cb, void *ctx)
+{
+    bool add_newline = len == 0 || line[len - 1] != '\n';
+    if (memchr(line, '\n', add_newline ? len : len - 1) != NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    // Drop what was already sent before making room
+    if (conn->out_sent > 0)
+    {
+        memmove(conn->out, conn->out + conn->out_sent, conn->out_len - conn->out_sent);
+        conn->out_len -= conn->out_sent;
+        conn->out_sent = 0;
+    }
+    if (grow(&conn->out, &conn->out_cap, conn->out_len + len + 1) != 0 || fifo_push(conn, cb, ctx) != 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(conn->out + conn->out_len, line, len);
+    conn->out_len += len;
+    if (add_newline)
+        conn->out[conn->out_len++] = '\n';
+    return 0;
+}
+
+/// Send what the socket accepts without blocking. Returns 0, or -1 with errno set if the connection broke
+static int conn_flush(struct aesd_client_conn *conn)
+{
+    while (conn->out_sent < conn->out_len)
+    {
+        ssize_t sent = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        conn->out_sent += sent;
+    }
+    conn->out_len = conn->out_sent = 0;
+    return 0;
+}
+
+/// Decode the complete frames received so far. Returns the number of callbacks called, -1 on protocol error
+static int conn_dispatch(struct aesd_client_conn *conn)
+{
+    int called = 0;
+    size_t pos = 0;
+    while (conn->in_len - pos >= AESD_LZ_FRAME_HEADER)
+    {
+        size_t raw_len, payload_len;
+        const char *frame = conn->in + pos;
+        if (aesd_lz_frame_lengths(frame, &raw_len, &payload_len) != 0 || conn->fifo_count == 0)
+            return -1;
+        if (conn->in_len - pos - AESD_LZ_FRAME_HEADER < payload_len)
+            break;
+        if (grow(&conn->reply, &conn->reply_cap, raw_len + 1) != 0)
+            return -1;
+        ssize_t reply_len = aesd_lz_decode_frame(conn->lz_init ? &conn->lz : NULL, frame,
+                                                 AESD_LZ_FRAME_HEADER + payload_len, conn->reply, conn->reply_cap);
+        if (reply_len < 0)
+            return -1;
+        pos += AESD_LZ_FRAME_HEADER + payload_len;
+
+        // Pop before calling, the callback may submit new requests
+        struct aesd_client_req req = fifo_pop(conn);
+        if (req.cb != NULL)
+            req.cb(0, conn->reply, reply_len, req.ctx);
+        called++;
+        // The callback closed the connection, there is nothing left to decode
+        if (conn->fd < 0)
+            return called;
+    }
+    memmove(conn->in, conn->in + pos, conn->in_len - pos);
+    conn->in_len -= pos;
+    return called;
+}
+
+/// Read what is available and run the callbacks of the complete replies.
+/// Returns the number of callbacks called, -1 with errno set if the connection broke
+static int conn_receive(struct aesd_client_conn *conn)
+{
+    int called = 0;
+    for (;;)
+    {
+        if (grow(&conn->in, &conn->in_cap, conn->in_len + AESD_CLIENT_RECV_SIZE) != 0)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        ssize_t received = recv(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len, 0);
+        if (received < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return called;
+            return -1;
+        }
+        if (received == 0)
+        {
+            errno = ECONNRESET;
+            return -1;
+        }
+        conn->in_len += received;
+        int dispatched = conn_dispatch(conn);
+        if (dispatched < 0)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+        called += dispatched;
+        // A callback may have used or closed the connection, stop once it is idle
+        if (conn->fd < 0 || conn->fifo_count == 0)
+            return called;
+    }
+}
+
+static void compress_ack(int status, const char *reply, size_t len, void *ctx)
+{
+    struct aesd_client_conn *conn = ctx;
+    // The server acknowledges with its actual state, a refused request leaves the replies raw
+    if (status == 0 && (len != strlen(AESD_CLIENT_COMPRESS_ON) || memcmp(reply, AESD_CLIENT_COMPRESS_ON, len) != 0))
+    {
+        aesd_lz_stream_free(&conn->lz);
+        conn->lz_init = false;
+    }
+}
+
+/// Blocking read of the plain acknowledgement sent before the connection is pipelined
+static int read_plain_line(int fd, char *buf, size_t cap)
+{
+    size_t len = 0;
+    while (len + 1 < cap)
+    {
+        ssize_t received = recv(fd, buf + len, 1, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return -1;
+        if (buf[len++] == '\n')
+        {
+            buf[len] = '\0';
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int conn_open(struct aesd_client *client, struct aesd_client_conn *conn)
+{
+    struct addrinfo hints = {0};
+    struct addrinfo *res = NULL;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(client->host, client->port, &hints, &res);
+    if (rc != 0)
+    {
+        errno = rc == EAI_SYSTEM ? errno : EHOSTUNREACH;
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+        return -1;
+
+    // Replies come one frame per request from now on
+    char ack[64];
+    if (send(fd, AESD_CLIENT_PIPELINE_ON, strlen(AESD_CLIENT_PIPELINE_ON), MSG_NOSIGNAL) < 0 ||
+        read_plain_line(fd, ack, sizeof(ack)) != 0 || strcmp(ack, AESD_CLIENT_PIPELINE_ON) != 0)
+    {
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    conn->fd = fd;
+
+    // Their acknowledgement is a raw frame, nothing to check: a server without these modes keeps
+    // answering with the full history, still one frame per request
+    if (((client->flags & AESD_CLIENT_INGEST) &&
+         queue_line(conn, AESD_CLIENT_INGEST_ON, strlen(AESD_CLIENT_INGEST_ON), NULL, NULL) != 0) ||
+        ((client->flags & AESD_CLIENT_DELTA) &&
+         queue_line(conn, AESD_CLIENT_DELTA_ON, strlen(AESD_CLIENT_DELTA_ON), NULL, NULL) != 0))
+    {
+        int error = errno;
+        conn_fail(conn, error);
+        errno = error;
+        return -1;
+    }
+
+    if (client->flags & AESD_CLIENT_COMPRESS)
+    {
+        // Set up now, the acknowledgement is a raw frame and the following replies are part of the stream
+        if (aesd_lz_stream_init(&conn->lz, AESD_CLIENT_MAX_REPLY) != 0)
+        {
+            conn_fail(conn, ENOMEM);
+            errno = ENOMEM;
+            return -1;
+        }
+        conn->lz_init = true;
+        if (queue_line(conn, AESD_CLIENT_COMPRESS_ON, strlen(AESD_CLIENT_COMPRESS_ON), compress_ack, conn) != 0)
+        {
+            int error = errno;
+            conn_fail(conn, error);
+            errno = error;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/// Pick the least loaded connection, opening a new one rather than queueing behind busy ones
+static struct aesd_client_conn *pick_conn(struct aesd_client *client)
+{
+    struct aesd_client_conn *best = NULL;
+    struct aesd_client_conn *idle_slot = NULL;
+    for (unsigned i = 0; i < client->pool_size; i++)
+    {
+        struct aesd_client_conn *conn = &client->pool[i];
+        if (conn->fd < 0)
+        {
+            if (idle_slot == NULL)
+                idle_slot = conn;
+            continue;
+        }
+        if (best == NULL || conn->fifo_count < best->fifo_count)
+            best = conn;
+    }
+    if (best != NULL && (best->fifo_count == 0 || idle_slot == NULL))
+        return best;
+    if (conn_open(client, idle_slot) == 0)
+        return idle_slot;
+    // Fall back to the connections already open
+    return best;
+}
+
+static int submit_to(struct aesd_client_conn *conn, const char *line, size_t len, aesd_client_cb cb, void *ctx)
+{
+    if (queue_line(conn, line, len, cb, ctx) != 0)
+        return -1;
+    // Start sending at once, the reply can come while the caller prepares the next request
+    if (conn_flush(conn) != 0)
+    {
+        int error = errno;
+        // The request is queued, its callback reports the failure
+        conn_fail(conn, error);
+    }
+    return 0;
+}
+
+struct aesd_client *aesd_client_create(const char *host, const char *port, unsigned pool_size, unsigned flags)
+{
+    struct aesd_client *client = calloc(1, sizeof(*client));
+    if (client == NULL)
+        return NULL;
+    client->pool_size = pool_size ? pool_size : 1;
+    client->flags = flags;
+    client->host = strdup(host);
+    client->port = strdup(port);
+    client->pool = calloc(client->pool_size, sizeof(*client->pool));
+    client->pfd = calloc(client->pool_size, sizeof(*client->pfd));
+    if (client->host == NULL || client->port == NULL || client->pool == NULL || client->pfd == NULL)
+    {
+        aesd_client_destroy(client);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (unsigned i = 0; i < client->pool_size; i++)
+        client->pool[i].fd = -1;
+    return client;
+}
+
+void aesd_client_destroy(struct aesd_client *client)
+{
+    if (client == NULL)
+        return;
+    for (unsigned i = 0; client->pool != NULL && i < client->pool_size; i++)
+    {
+        struct aesd_client_conn *conn = &client->pool[i];
+        conn_fail(conn, ECANCELED);
+        free(conn->out);
+        free(conn->in);
+        free(conn->reply);
+        free(conn->fifo);
+    }
+    free(client->pool);
+    free(client->pfd);
+    free(client->host);
+    free(client->port);
+    free(client);
+}
+
+int aesd_client_submit(struct aesd_client *client, const char *line, size_t len, aesd_client_cb cb, void *ctx)
+{
+    struct aesd_client_conn *conn = pick_conn(client);
+    if (conn == NULL)
+        return -1;
+    return submit_to(conn, line, len, cb, ctx);
+}
+
+int aesd_client_submit_seek(struct aesd_client *client, uint32_t write_cmd, uint32_t write_cmd_offset,
+                            aesd_client_cb cb, void *ctx)
+{
+    char line[64];
+    int len = aesd_seekto_format(line, sizeof(line), write_cmd, write_cmd_offset);
+    if (len < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return aesd_client_submit(client, line, len, cb, ctx);
+}
+
+int aesd_client_poll(struct aesd_client *client, int timeout_ms)
+{
+    nfds_t nfds = 0;
+    int called = 0;
+    for (unsigned i = 0; i < client->pool_size; i++)
+    {
+        struct aesd_client_conn *conn = &client->pool[i];
+        client->pfd[i].fd = -1;
+        client->pfd[i].revents = 0;
+        if (conn->fd < 0 || conn->fifo_count == 0)
+            continue;
+        client->pfd[i].fd = conn->fd;
+        client->pfd[i].events = POLLIN | (conn->out_sent < conn->out_len ? POLLOUT : 0);
+        nfds = i + 1;
+    }
+    if (nfds == 0)
+        return 0;
+
+    int ready = poll(client->pfd, nfds, timeout_ms);
+    if (ready < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (unsigned i = 0; i < nfds; i++)
+    {
+        struct aesd_client_conn *conn = &client->pool[i];
+        short revents = client->pfd[i].revents;
+        if (revents == 0 || conn->fd != client->pfd[i].fd)
+            continue;
+        if ((revents & POLLOUT) && conn_flush(conn) != 0)
+        {
+            called += conn_fail(conn, errno);
+            continue;
+        }
+        if (revents & (POLLIN | POLLERR | POLLHUP))
+        {
+            int received = conn_receive(conn);
+            if (received < 0)
+                called += conn_fail(conn, errno);
+            else
+                called += received;
+        }
+    }
+    return called;
+}
+
+size_t aesd_client_pending(const struct aesd_client *client)
+{
+    size_t pending = 0;
+    for (unsigned i = 0; i < client->pool_size; i++)
+        pending += client->pool[i].fifo_count;
+    return pending;
+}
+
+static void wait_cb(int status, const char *reply, size_t len, void *ctx)
+{
+    struct aesd_client_wait *wait = ctx;
+    wait->done = true;
+    wait->status = status;
+    wait->reply_len = len;
+    if (status == 0 && wait->reply != NULL)
+        memcpy(wait->reply, reply, len < wait->reply_cap ? len : wait->reply_cap);
+}
+
+static ssize_t wait_reply(struct aesd_client *client, struct aesd_client_wait *wait)
+{
+    while (!wait->done)
+    {
+        if (aesd_client_poll(client, -1) < 0)
+            return -1;
+    }
+    if (wait->status != 0)
+    {
+        errno = -wait->status;
+        return -1;
+    }
+    return wait->reply_len;
+}
+
+ssize_t aesd_client_append(struct aesd_client *client, const char *line, size_t len, char *reply, size_t reply_cap)
+{
+    struct aesd_client_wait wait = {.reply = reply, .reply_cap = reply_cap};
+    if (aesd_client_submit(client, line, len, wait_cb, &wait) != 0)
+        return -1;
+    return wait_reply(client, &wait);
+}
+
+ssize_t aesd_client_seek(struct aesd_client *client, uint32_t write_cmd, uint32_t write_cmd_offset,
+                         char *reply, size_t reply_cap)
+{
+    struct aesd_client_wait wait = {.reply = reply, .reply_cap = reply_cap};
+    if (aesd_client_submit_seek(client, write_cmd, write_cmd_offset, wait_cb, &wait) != 0)
+        return -1;
+    return wait_reply(client, &wait);
+}
+
+static void batch_cb(int status, const char *reply, size_t len, void *ctx)
+{
+    struct aesd_client_batch *batch = ctx;
+    batch->remaining--;
+    if (status == 0)
+        batch->acked++;
+    else
+        batch->status = status;
+}
+
+ssize_t aesd_client_append_many(struct aesd_client *client, const char *const *lines, const size_t *lens, size_t count)
+{
+    // Validate everything first, so a batch is either fully queued or not at all
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t len = lens[i];
+        if (len > 0 && lines[i][len - 1] == '\n')
+            len--;
+        if (memchr(lines[i], '\n', len) != NULL)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    // A single connection keeps the lines in order
+    struct aesd_client_conn *conn = pick_conn(client);
+    if (conn == NULL)
+        return -1;
+    struct aesd_client_batch batch = {0};
+    for (size_t i = 0; i < count && conn->fd >= 0; i++)
+    {
+        if (queue_line(conn, lines[i], lens[i], batch_cb, &batch) != 0)
+            break;
+        batch.remaining++;
+    }
+    if (conn->fd >= 0 && conn_flush(conn) != 0)
+        conn_fail(conn, errno);
+
+    while (batch.remaining > 0)
+    {
+        if (aesd_client_poll(client, -1) < 0)
+            return -1;
+    }
+    if (batch.acked == 0 && count > 0)
+    {
+        errno = batch.status ? -batch.status : EIO;
+        return -1;
+    }
+    return batch.acked;
+}
+
+int aesd_seekto_format(char *buf, size_t cap, uint32_t write_cmd, uint32_t write_cmd_offset)
+{
+    int len = snprintf(buf, cap, "%s%" PRIu32 ",%" PRIu32 "\n", AESD_IOCL_COM, write_cmd, write_cmd_offset);
+    if (len < 0 || (size_t)len >= cap)
+        return -1;
+    return len;
+}
+
+static const char *parse_u32(const char *p, const char *end, uint32_t *value)
+{
+    uint64_t v = 0;
+    const char *start = p;
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        v = v * 10 + (*p - '0');
+        if (v > UINT32_MAX)
+            return NULL;
+        p++;
+    }
+    if (p == start)
+        return NULL;
+    *value = v;
+    return p;
+}
+
+int aesd_seekto_parse(const char *line, size_t len, struct aesd_seekto *seekto)
+{
+    size_t prefix_len = strlen(AESD_IOCL_COM);
+    const char *end = line + len;
+    if (len > 0 && end[-1] == '\n')
+        end--;
+    if (len < prefix_len || memcmp(line, AESD_IOCL_COM, prefix_len) != 0)
+        return -1;
+
+    const char *p = parse_u32(line + prefix_len, end, &seekto->write_cmd);
+    if (p == NULL || p >= end || *p != ',')
+        return -1;
+    p = parse_u32(p + 1, end, &seekto->write_cmd_offset);
+    if (p == NULL || p != end)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,79 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-client.h: Client library for aesdsocket (libaesdclient)
+ * ========================================== */
+
+// A client keeps a pool of persistent connections to one aesdsocket server. Each connection is
+// switched to pipelined mode (AESDSOCKET_PIPELINE:1), so many appends can be sent before their
+// replies are read, every reply being one frame in the order of the requests.
+//
+// Two APIs share the same connections:
+// - non-blocking: aesd_client_submit() queues a request and returns at once, the callback runs from
+//   aesd_client_poll() once the reply is there.
+// - blocking: aesd_client_append() and aesd_client_seek() wait for their reply,
+//   aesd_client_append_many() pipelines a whole batch and waits for all the replies.
+// A client is not thread safe, use one client per thread. Requests sent on one connection are
+// handled in order, requests spread over the pool are not ordered with each other.
+
+#ifndef AESD_CLIENT_H
+#define AESD_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+// Ask for compressed replies on every connection of the pool
+#define AESD_CLIENT_COMPRESS 0x1
+// Ingest mode (AESDSOCKET_INGEST:1): appends are answered with the number of entries the connection
+// wrote, in decimal followed by a new line, instead of the history. Seeks still get the history
+#define AESD_CLIENT_INGEST 0x2
+// Delta replies (AESDSOCKET_DELTA:1): an append reply only holds the history the connection did not
+// receive yet, see AESD_DELTA_COM in aesdsocket.h. Each connection of the pool has its own position
+#define AESD_CLIENT_DELTA 0x4
+
+/// Called once per request. status is 0 on success, a negative errno otherwise (reply is then NULL).
+/// reply is only valid during the call.
+typedef void (*aesd_client_cb)(int status, const char *reply, size_t len, void *ctx);
+
+struct aesd_client;
+
+/// Create a client for host:port, with up to pool_size connections opened on demand
+struct aesd_client *aesd_client_create(const char *host, const char *port, unsigned pool_size, unsigned flags);
+void aesd_client_destroy(struct aesd_client *client);
+
+/// Non-blocking API: queue one line (a trailing new line is added if missing, it cannot hold another one).
+/// Returns 0 if queued, -1 with errno set otherwise
+int aesd_client_submit(struct aesd_client *client, const char *line, size_t len, aesd_client_cb cb, void *ctx);
+
+/// Non-blocking API: queue a seek command, the reply holds the history from that position
+int aesd_client_submit_seek(struct aesd_client *client, uint32_t write_cmd, uint32_t write_cmd_offset,
+                            aesd_client_cb cb, void *ctx);
+
+/// Send and receive what is possible, waiting up to timeout_ms (-1: forever) for some progress.
+/// Returns the number of callbacks called, -1 on error
+int aesd_client_poll(struct aesd_client *client, int timeout_ms);
+
+/// Number of requests waiting for their reply
+size_t aesd_client_pending(const struct aesd_client *client);
+
+/// Blocking API: append one line and wait for the history. Up to reply_cap bytes are copied in reply.
+/// Returns the full reply size (can be more than reply_cap), -1 with errno set on error
+ssize_t aesd_client_append(struct aesd_client *client, const char *line, size_t len, char *reply, size_t reply_cap);
+
+/// Blocking API: pipeline count lines on one connection, keeping their order, and wait for all the replies.
+/// Returns the number of acknowledged lines, -1 with errno set if none could be sent
+ssize_t aesd_client_append_many(struct aesd_client *client, const char *const *lines, const size_t *lens, size_t count);
+
+/// Blocking API: seek to write_cmd/write_cmd_offset and get the history from there
+ssize_t aesd_client_seek(struct aesd_client *client, uint32_t write_cmd, uint32_t write_cmd_offset,
+                         char *reply, size_t reply_cap);
+
+/// Format the seek command "AESDCHAR_IOCSEEKTO:X,Y\n". Returns its length, -1 if buf is too small
+int aesd_seekto_format(char *buf, size_t cap, uint32_t write_cmd, uint32_t write_cmd_offset);
+
+/// Parse a seek command, strictly: prefix, two unsigned 32 bits numbers separated by a comma,
+/// optional new line. Returns 0 on success, -1 if the line is not a valid seek command
+int aesd_seekto_parse(const char *line, size_t len, struct aesd_seekto *seekto);
+
+#endif /* AESD_CLIENT_H */
@@ -0,0 +1,31 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-crc32.c: CRC-32 (IEEE 802.3), table driven
+ * ========================================== */
+
+#include <pthread.h>
+
+#include "aesd-crc32.h"
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void crc_table_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+uint32_t aesd_crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    pthread_once(&crc_table_once, crc_table_init);
+    crc = ~crc;
+    while (len--)
+        crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
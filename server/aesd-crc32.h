@@ -0,0 +1,14 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-crc32.h: CRC-32 (IEEE 802.3) used to validate on disk records
+ * ========================================== */
+
+#ifndef AESD_CRC32_H
+#define AESD_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Continue a CRC over len more bytes. Start with crc = 0
+uint32_t aesd_crc32_update(uint32_t crc, const void *buf, size_t len);
+
+#endif /* AESD_CRC32_H */
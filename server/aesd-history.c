@@ -0,0 +1,130 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-history.c: Single-flight cache of the full history read from the device
+ * ========================================== */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <syslog.h>
+
+#include "aesd-history.h"
+
+void aesd_history_init(struct aesd_history_cache *cache, size_t max_size, aesd_history_loader loader, void *ctx)
+{
+    atomic_init(&cache->generation, 0);
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->loaded, NULL);
+    cache->current = NULL;
+    cache->loading = false;
+    cache->max_size = max_size;
+    cache->loader = loader;
+    cache->loader_ctx = ctx;
+    cache->budget = NULL;
+    cache->reads = 0;
+    cache->replies = 0;
+}
+
+void aesd_history_destroy(struct aesd_history_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    syslog(LOG_INFO, "History cache: %llu replies served from %llu device reads\n",
+           (unsigned long long)cache->replies, (unsigned long long)cache->reads);
+    if (cache->current != NULL)
+        aesd_history_put(cache->current);
+    cache->current = NULL;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+uint64_t aesd_history_written(struct aesd_history_cache *cache)
+{
+    return atomic_fetch_add(&cache->generation, 1) + 1;
+}
+
+uint64_t aesd_history_generation(struct aesd_history_cache *cache)
+{
+    return atomic_load(&cache->generation);
+}
+
+// Caller holds the lock
+static struct aesd_history *take(struct aesd_history_cache *cache, struct aesd_history *history)
+{
+    atomic_fetch_add(&history->refcount, 1);
+    cache->replies++;
+    return history;
+}
+
+struct aesd_history *aesd_history_get(struct aesd_history_cache *cache, uint64_t min_generation)
+{
+    pthread_mutex_lock(&cache->lock);
+    for (;;)
+    {
+        if (cache->current != NULL && cache->current->generation >= min_generation)
+        {
+            struct aesd_history *history = take(cache, cache->current);
+            pthread_mutex_unlock(&cache->lock);
+            return history;
+        }
+        if (!cache->loading)
+            break;
+        // A read is in flight. Even if it started before our write, wait for it rather than
+        // reading concurrently, one of the waiters then leads the next read
+        pthread_cond_wait(&cache->loaded, &cache->lock);
+    }
+
+    // Leader: the loader takes the generation once writes are blocked, so the read also covers the
+    // connections which wrote while it was waiting for the device
+    cache->loading = true;
+    cache->reads++;
+    pthread_mutex_unlock(&cache->lock);
+
+    // Charged until the last reference is put, refused rather than waited for
+    size_t size = sizeof(struct aesd_history) + cache->max_size;
+    bool charged = cache->budget == NULL || aesd_budget_try_charge(cache->budget, size);
+    struct aesd_history *history = charged ? malloc(size) : NULL;
+    uint64_t generation = 0;
+    ssize_t len = -1;
+    if (history != NULL)
+        len = cache->loader(cache, history->data, cache->max_size, &generation);
+    if (len < 0)
+    {
+        free(history);
+        history = NULL;
+        if (!charged)
+            errno = ENOMEM;
+        else if (cache->budget != NULL)
+            aesd_budget_release(cache->budget, size);
+    }
+    else
+    {
+        // One reference held by the cache
+        atomic_init(&history->refcount, 1);
+        history->generation = generation;
+        history->budget = cache->budget;
+        history->size = size;
+        history->len = len;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache->loading = false;
+    if (history != NULL)
+    {
+        if (cache->current != NULL)
+            aesd_history_put(cache->current);
+        cache->current = history;
+        take(cache, history);
+    }
+    pthread_cond_broadcast(&cache->loaded);
+    pthread_mutex_unlock(&cache->lock);
+    return history;
+}
+
+void aesd_history_put(struct aesd_history *history)
+{
+    if (atomic_fetch_sub(&history->refcount, 1) == 1)
+    {
+        struct aesd_budget *budget = history->budget;
+        size_t size = history->size;
+        free(history);
+        if (budget != NULL)
+            aesd_budget_release(budget, size);
+    }
+}
@@ -0,0 +1,71 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-history.h: Single-flight cache of the full history read from the device
+ * ========================================== */
+
+// Every write bumps the history generation. A connection which needs a reply asks for a history
+// at least as recent as its own write: if the cached history is recent enough it is shared, if a
+// read is already in flight the connection waits for it, otherwise the connection reads the device
+// itself (leader) and every connection waiting meanwhile gets the same buffer. Under a burst of
+// writers, the device is read once per burst instead of once per client.
+
+#ifndef AESD_HISTORY_H
+#define AESD_HISTORY_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "aesd-budget.h"
+
+/// Immutable, reference counted history snapshot
+struct aesd_history
+{
+    atomic_uint refcount;
+    uint64_t generation;    // every write up to this generation is included
+    struct aesd_budget *budget; // charged for size bytes, NULL if none
+    size_t size;            // bytes allocated, the structure included
+    size_t len;
+    char data[];
+};
+
+struct aesd_history_cache;
+
+/// Reads the history into buf, returns its size or -1 on error. While writes are blocked, the loader
+/// sets *generation to aesd_history_generation(), so the snapshot includes every write it reports
+typedef ssize_t (*aesd_history_loader)(struct aesd_history_cache *cache, char *buf, size_t cap, uint64_t *generation);
+
+struct aesd_history_cache
+{
+    _Atomic uint64_t generation;    // number of writes so far
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+    struct aesd_history *current;   // last history read, NULL if none
+    bool loading;                   // a leader is reading the device
+    size_t max_size;
+    aesd_history_loader loader;
+    void *loader_ctx;
+    struct aesd_budget *budget;     // charged for every snapshot, NULL if none (set after init)
+    uint64_t reads;                 // device reads
+    uint64_t replies;               // histories handed out
+};
+
+void aesd_history_init(struct aesd_history_cache *cache, size_t max_size, aesd_history_loader loader, void *ctx);
+void aesd_history_destroy(struct aesd_history_cache *cache);
+
+/// Record a write into the device, call it while the write is serialized with the loader (file_mutex).
+/// Returns the generation a reply to this write must include
+uint64_t aesd_history_written(struct aesd_history_cache *cache);
+
+/// Number of writes recorded so far
+uint64_t aesd_history_generation(struct aesd_history_cache *cache);
+
+/// Get a history including at least min_generation. Returns NULL if the device could not be read, or
+/// with errno set to ENOMEM if the budget cannot hold a new snapshot. Release it with aesd_history_put()
+struct aesd_history *aesd_history_get(struct aesd_history_cache *cache, uint64_t min_generation);
+
+void aesd_history_put(struct aesd_history *history);
+
+#endif /* AESD_HISTORY_H */
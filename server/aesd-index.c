@@ -0,0 +1,354 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-index.c: Trigram index of the entries of a history, for the search command
+ * ========================================== */
+#define _GNU_SOURCE // memmem
+#include <errno.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "aesd-index.h"
+
+#define TABLE_INITIAL_SIZE 1024
+#define POSTING_INITIAL_CAP 4
+
+static int key_cmp(const void *a, const void *b)
+{
+    uint32_t ka = *(const uint32_t *)a, kb = *(const uint32_t *)b;
+    return ka < kb ? -1 : ka > kb;
+}
+
+/// Distinct trigrams of buf into keys (room for len - 2), as keys (trigram + 1), sorted. Returns their number
+static size_t trigram_keys(const char *buf, size_t len, uint32_t *keys)
+{
+    if (len < 3)
+        return 0;
+    const unsigned char *p = (const unsigned char *)buf;
+    for (size_t i = 0; i + 2 < len; i++)
+        keys[i] = ((uint32_t)p[i] << 16 | (uint32_t)p[i + 1] << 8 | p[i + 2]) + 1;
+    qsort(keys, len - 2, sizeof(uint32_t), key_cmp);
+    size_t count = 1;
+    for (size_t i = 1; i < len - 2; i++)
+    {
+        if (keys[i] != keys[count - 1])
+            keys[count++] = keys[i];
+    }
+    return count;
+}
+
+/// Distinct trigrams of an entry into index->scratch. Returns their number, -1 if out of memory
+static ssize_t entry_keys(struct aesd_index *index, const char *buf, size_t len)
+{
+    if (len > 2 && len - 2 > index->scratch_cap)
+    {
+        uint32_t *scratch = realloc(index->scratch, (len - 2) * sizeof(uint32_t));
+        if (scratch == NULL)
+            return -1;
+        index->scratch = scratch;
+        index->scratch_cap = len - 2;
+    }
+    return trigram_keys(buf, len, index->scratch);
+}
+
+static size_t slot_of(const struct aesd_index *index, uint32_t key)
+{
+    return (key * 0x9E3779B1u) & (index->table_size - 1);
+}
+
+/// Posting list of key, NULL if the trigram was never seen
+static struct aesd_index_posting *posting_find(const struct aesd_index *index, uint32_t key)
+{
+    for (size_t slot = slot_of(index, key);; slot = (slot + 1) & (index->table_size - 1))
+    {
+        if (index->table[slot].key == key)
+            return &index->table[slot];
+        if (index->table[slot].key == 0)
+            return NULL;
+    }
+}
+
+static int table_grow(struct aesd_index *index)
+{
+    size_t old_size = index->table_size;
+    struct aesd_index_posting *old = index->table;
+    struct aesd_index_posting *table = calloc(old_size * 2, sizeof(*table));
+    if (table == NULL)
+        return -1;
+    index->table = table;
+    index->table_size = old_size * 2;
+    for (size_t i = 0; i < old_size; i++)
+    {
+        if (old[i].key == 0)
+            continue;
+        size_t slot = slot_of(index, old[i].key);
+        while (table[slot].key != 0)
+            slot = (slot + 1) & (index->table_size - 1);
+        table[slot] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/// Posting list of key, created empty if needed. Lists are never removed, a trigram seen once is
+/// likely to come back. Returns NULL if out of memory
+static struct aesd_index_posting *posting_get(struct aesd_index *index, uint32_t key)
+{
+    struct aesd_index_posting *posting = posting_find(index, key);
+    if (posting != NULL)
+        return posting;
+    // At most 3/4 full, probes stay short
+    if ((index->table_used + 1) * 4 > index->table_size * 3 && table_grow(index) != 0)
+        return NULL;
+    size_t slot = slot_of(index, key);
+    while (index->table[slot].key != 0)
+        slot = (slot + 1) & (index->table_size - 1);
+    index->table[slot].key = key;
+    index->table_used++;
+    return &index->table[slot];
+}
+
+static int posting_append(struct aesd_index_posting *posting, uint64_t seq)
+{
+    if (posting->head + posting->count == posting->cap)
+    {
+        if (posting->head > 0)
+        {
+            // Reuse the room left by the entries removed from the front
+            memmove(posting->seqs, posting->seqs + posting->head, posting->count * sizeof(uint64_t));
+            posting->head = 0;
+        }
+        else
+        {
+            uint32_t cap = posting->cap ? posting->cap * 2 : POSTING_INITIAL_CAP;
+            uint64_t *seqs = realloc(posting->seqs, cap * sizeof(uint64_t));
+            if (seqs == NULL)
+                return -1;
+            posting->seqs = seqs;
+            posting->cap = cap;
+        }
+    }
+    posting->seqs[posting->head + posting->count++] = seq;
+    return 0;
+}
+
+/// Whether the posting list holds seq, by binary search
+static bool posting_has(const struct aesd_index_posting *posting, uint64_t seq)
+{
+    const uint64_t *seqs = posting->seqs + posting->head;
+    size_t lo = 0, hi = posting->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (seqs[mid] < seq)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < posting->count && seqs[lo] == seq;
+}
+
+static void evict_oldest(struct aesd_index *index)
+{
+    uint64_t seq = index->first_seq++;
+    struct aesd_index_entry *entry = &index->entries[seq % index->capacity];
+    ssize_t count = entry_keys(index, entry->data, entry->len);
+    for (ssize_t i = 0; i < count; i++)
+    {
+        // The oldest entry is at the front of the lists it is in
+        struct aesd_index_posting *posting = posting_find(index, index->scratch[i]);
+        if (posting != NULL && posting->count > 0 && posting->seqs[posting->head] == seq)
+        {
+            posting->head++;
+            if (--posting->count == 0)
+                posting->head = 0;
+        }
+    }
+    free(entry->data);
+    entry->data = NULL;
+}
+
+static void add_entry(struct aesd_index *index, const char *buf, size_t len, uint64_t offset)
+{
+    if (index->next_seq - index->first_seq == index->capacity)
+        evict_oldest(index);
+    uint64_t seq = index->next_seq++;
+    struct aesd_index_entry *entry = &index->entries[seq % index->capacity];
+    entry->offset = offset;
+    entry->len = len;
+    entry->data = malloc(len);
+    ssize_t count = entry->data != NULL ? entry_keys(index, buf, len) : -1;
+    if (count < 0)
+    {
+        // Kept empty, the numbering of the next entries stays right
+        syslog(LOG_ERR, "No memory left to index an entry of %zu bytes\n", len);
+        entry->len = 0;
+        return;
+    }
+    memcpy(entry->data, buf, len);
+    for (ssize_t i = 0; i < count; i++)
+    {
+        struct aesd_index_posting *posting = posting_get(index, index->scratch[i]);
+        if (posting == NULL || posting_append(posting, seq) != 0)
+            syslog(LOG_ERR, "No memory left to index an entry of %zu bytes\n", len);
+    }
+}
+
+int aesd_index_init(struct aesd_index *index, bool bounded, size_t depth)
+{
+    memset(index, 0, sizeof(*index));
+    index->bounded = bounded;
+    index->capacity = bounded ? depth : AESD_INDEX_FILE_ENTRIES;
+    index->entries = calloc(index->capacity, sizeof(*index->entries));
+    index->table = calloc(TABLE_INITIAL_SIZE, sizeof(*index->table));
+    if (index->entries == NULL || index->table == NULL)
+    {
+        free(index->entries);
+        free(index->table);
+        errno = ENOMEM;
+        return -1;
+    }
+    index->table_size = TABLE_INITIAL_SIZE;
+    pthread_rwlock_init(&index->lock, NULL);
+    return 0;
+}
+
+void aesd_index_destroy(struct aesd_index *index)
+{
+    syslog(LOG_INFO, "Index: %llu entries kept, %zu trigrams, %llu searches, %llu candidates checked\n",
+           (unsigned long long)(index->next_seq - index->first_seq), index->table_used,
+           (unsigned long long)atomic_load(&index->searches), (unsigned long long)atomic_load(&index->candidates));
+    for (uint64_t seq = index->first_seq; seq < index->next_seq; seq++)
+        free(index->entries[seq % index->capacity].data);
+    for (size_t i = 0; i < index->table_size; i++)
+        free(index->table[i].seqs);
+    free(index->entries);
+    free(index->table);
+    free(index->scratch);
+    pthread_rwlock_destroy(&index->lock);
+}
+
+void aesd_index_replace(struct aesd_index *index, struct aesd_index *from)
+{
+    struct aesd_index previous = *from;
+    pthread_rwlock_wrlock(&index->lock);
+    from->bounded = index->bounded;
+    from->capacity = index->capacity;
+    from->entries = index->entries;
+    from->first_seq = index->first_seq;
+    from->next_seq = index->next_seq;
+    from->table = index->table;
+    from->table_size = index->table_size;
+    from->table_used = index->table_used;
+    from->scratch = index->scratch;
+    from->scratch_cap = index->scratch_cap;
+    index->bounded = previous.bounded;
+    index->capacity = previous.capacity;
+    index->entries = previous.entries;
+    index->first_seq = previous.first_seq;
+    index->next_seq = previous.next_seq;
+    index->table = previous.table;
+    index->table_size = previous.table_size;
+    index->table_used = previous.table_used;
+    index->scratch = previous.scratch;
+    index->scratch_cap = previous.scratch_cap;
+    pthread_rwlock_unlock(&index->lock);
+    aesd_index_destroy(from);
+}
+
+void aesd_index_add(struct aesd_index *index, const char *buf, size_t len, uint64_t offset)
+{
+    pthread_rwlock_wrlock(&index->lock);
+    if (index->bounded)
+    {
+        add_entry(index, buf, len, offset);
+    }
+    else
+    {
+        // A file entry is a line
+        const char *end = buf + len;
+        for (const char *line = buf; line < end;)
+        {
+            const char *eol = memchr(line, '\n', end - line);
+            size_t line_len = eol != NULL ? (size_t)(eol - line) + 1 : (size_t)(end - line);
+            add_entry(index, line, line_len, offset + (line - buf));
+            line += line_len;
+        }
+    }
+    pthread_rwlock_unlock(&index->lock);
+}
+
+/// Report a match, numbered and placed like the storage does
+static bool report(struct aesd_index *index, uint64_t seq, aesd_index_match match, void *ctx)
+{
+    const struct aesd_index_entry *entry = &index->entries[seq % index->capacity];
+    if (!index->bounded)
+        return match(seq, entry->offset, entry->data, entry->len, ctx);
+    // The oldest entry kept is the first of the storage
+    uint64_t base = index->entries[index->first_seq % index->capacity].offset;
+    return match(seq - index->first_seq, entry->offset - base, entry->data, entry->len, ctx);
+}
+
+size_t aesd_index_search(struct aesd_index *index, const char *term, size_t len, aesd_index_match match, void *ctx)
+{
+    size_t matches = 0;
+    // Searches run together, the index only changes with the storage
+    pthread_rwlock_rdlock(&index->lock);
+    atomic_fetch_add(&index->searches, 1);
+    if (len < 3)
+    {
+        // No trigram to look up
+        for (uint64_t seq = index->first_seq; seq < index->next_seq; seq++)
+        {
+            const struct aesd_index_entry *entry = &index->entries[seq % index->capacity];
+            atomic_fetch_add(&index->candidates, 1);
+            if (len > 0 && memmem(entry->data, entry->len, term, len) == NULL)
+                continue;
+            matches++;
+            if (!report(index, seq, match, ctx))
+                break;
+        }
+        pthread_rwlock_unlock(&index->lock);
+        return matches;
+    }
+
+    // The term trigrams, the shortest list first
+    uint32_t keys[len - 2];
+    size_t count = trigram_keys(term, len, keys);
+    struct aesd_index_posting *postings[count];
+    for (size_t i = 0; i < count; i++)
+    {
+        postings[i] = posting_find(index, keys[i]);
+        if (postings[i] == NULL || postings[i]->count == 0)
+        {
+            // A trigram no entry holds
+            pthread_rwlock_unlock(&index->lock);
+            return 0;
+        }
+        if (postings[i]->count < postings[0]->count)
+        {
+            struct aesd_index_posting *shortest = postings[i];
+            postings[i] = postings[0];
+            postings[0] = shortest;
+        }
+    }
+    for (uint32_t i = 0; i < postings[0]->count; i++)
+    {
+        uint64_t seq = postings[0]->seqs[postings[0]->head + i];
+        bool candidate = true;
+        for (size_t j = 1; j < count && candidate; j++)
+            candidate = posting_has(postings[j], seq);
+        if (!candidate)
+            continue;
+        // Every trigram is there, maybe not in the term order
+        const struct aesd_index_entry *entry = &index->entries[seq % index->capacity];
+        atomic_fetch_add(&index->candidates, 1);
+        if (memmem(entry->data, entry->len, term, len) == NULL)
+            continue;
+        matches++;
+        if (!report(index, seq, match, ctx))
+            break;
+    }
+    pthread_rwlock_unlock(&index->lock);
+    return matches;
+}
@@ -0,0 +1,79 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-index.h: Trigram index of the entries of a history, for the search command
+ * ========================================== */
+
+// The index keeps a copy of the last entries of a history, the same ones as its storage: the ring
+// depth for a bounded storage, where the entry evicted by a write is removed from the index by the same
+// write, and the last AESD_INDEX_FILE_ENTRIES lines of a file. Each byte trigram of an entry lists it,
+// in posting lists sorted by entry number: an entry is added at the end of the lists of its trigrams
+// and, the oldest, removed from their front.
+// A search intersects the lists of the trigrams of the term, starting from the shortest, and checks the
+// candidates with memmem(): its cost depends on how often the trigrams occur, not on the history size.
+// Terms shorter than a trigram scan the entries kept.
+
+#ifndef AESD_INDEX_H
+#define AESD_INDEX_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lines of a file storage kept in the index, older lines are not searched
+#define AESD_INDEX_FILE_ENTRIES 65536
+
+struct aesd_index_entry
+{
+    uint64_t offset;        // position of the entry since the storage was created
+    size_t len;
+    char *data;
+};
+
+struct aesd_index_posting
+{
+    uint32_t key;           // trigram + 1, 0 for a free slot
+    uint32_t head;          // first entry number in use in seqs
+    uint32_t count;
+    uint32_t cap;
+    uint64_t *seqs;         // entry numbers, ascending
+};
+
+struct aesd_index
+{
+    pthread_rwlock_t lock;
+    bool bounded;           // entries as written, numbered from the oldest kept; otherwise lines of a file
+    size_t capacity;        // entries kept
+    struct aesd_index_entry *entries; // entry seq at seq % capacity
+    uint64_t first_seq;     // oldest entry kept
+    uint64_t next_seq;
+    struct aesd_index_posting *table; // open addressing, by trigram
+    size_t table_size;      // a power of two
+    size_t table_used;
+    uint32_t *scratch;      // trigrams of the entry being added or removed
+    size_t scratch_cap;
+    atomic_ullong searches;
+    atomic_ullong candidates; // entries checked with memmem()
+};
+
+/// Called for each matching entry, oldest first: its number (X of AESDCHAR_IOCSEEKTO:X,Y) and its offset
+/// in the history read. Returns false to stop the search
+typedef bool (*aesd_index_match)(uint64_t entry, uint64_t offset, const char *buf, size_t len, void *ctx);
+
+/// Index the entries of a bounded storage, depth of them, or the lines of a file (bounded false).
+/// Returns 0, -1 with errno set
+int aesd_index_init(struct aesd_index *index, bool bounded, size_t depth);
+void aesd_index_destroy(struct aesd_index *index);
+
+/// Take the entries of from, built meanwhile, once the searches running are done. from is left with the
+/// previous entries and destroyed
+void aesd_index_replace(struct aesd_index *index, struct aesd_index *from);
+
+/// Add a committed entry starting at offset, since the storage was created. The lines of an entry are
+/// added one by one for a file. The oldest entries are removed beyond the capacity
+void aesd_index_add(struct aesd_index *index, const char *buf, size_t len, uint64_t offset);
+
+/// Call match for each entry kept holding term. Returns the number of matches
+size_t aesd_index_search(struct aesd_index *index, const char *term, size_t len, aesd_index_match match, void *ctx);
+
+#endif /* AESD_INDEX_H */
@@ -0,0 +1,80 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-latency-bench.c: Round trip latency distribution of one append at a time
+ * Usage: aesd-latency-bench [host] [port] [requests]
+ * ========================================== */
+
+// Run it once against aesdsocket and once against aesdsocket -L cpu_list to compare the modes.
+// One persistent connection, one request in flight: the time measured is the server turnaround
+// plus the loopback, not the throughput.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "aesd-client.h"
+
+#define WARMUP 100
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, unsigned count, double p)
+{
+    unsigned i = (unsigned)(p / 100 * (count - 1));
+    return sorted[i] / 1e3;
+}
+
+int main(int argc, char **argv)
+{
+    const char *host = argc > 1 ? argv[1] : "localhost";
+    const char *port = argc > 2 ? argv[2] : "9000";
+    unsigned requests = argc > 3 ? strtoul(argv[3], NULL, 10) : 10000;
+    if (requests == 0)
+        return EXIT_FAILURE;
+
+    struct aesd_client *client = aesd_client_create(host, port, 1, 0);
+    uint64_t *samples = malloc(requests * sizeof(*samples));
+    if (client == NULL || samples == NULL)
+    {
+        perror("aesd_client_create");
+        return EXIT_FAILURE;
+    }
+
+    char line[64];
+    unsigned failed = 0;
+    for (unsigned i = 0; i < WARMUP + requests; i++)
+    {
+        int len = snprintf(line, sizeof(line), "latency probe %u\n", i);
+        uint64_t start = now_ns();
+        if (aesd_client_append(client, line, len, NULL, 0) < 0)
+            failed++;
+        if (i >= WARMUP)
+            samples[i - WARMUP] = now_ns() - start;
+    }
+    aesd_client_destroy(client);
+
+    qsort(samples, requests, sizeof(*samples), compare);
+    uint64_t total = 0;
+    for (unsigned i = 0; i < requests; i++)
+        total += samples[i];
+    printf("%u requests, %u failed, latency in us\n", requests, failed);
+    printf("%8s %8s %8s %8s %8s %8s %8s\n", "min", "avg", "p50", "p90", "p99", "p99.9", "max");
+    printf("%8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n", samples[0] / 1e3, total / 1e3 / requests,
+           percentile_us(samples, requests, 50), percentile_us(samples, requests, 90),
+           percentile_us(samples, requests, 99), percentile_us(samples, requests, 99.9),
+           samples[requests - 1] / 1e3);
+    free(samples);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
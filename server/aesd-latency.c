@@ -0,0 +1,111 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-latency.c: Low-latency mode, busy polling connection threads pinned to dedicated cores
+ * ========================================== */
+#define _GNU_SOURCE // CPU_SET, pthread_attr_setaffinity_np
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "aesd-latency.h"
+
+// Linux 5.11, missing from older libc headers
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+int aesd_latency_parse(struct aesd_latency *latency, const char *cpu_list)
+{
+    latency->cpu_count = 0;
+    atomic_init(&latency->next, 0);
+    const char *p = cpu_list;
+    while (*p != '\0')
+    {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE)
+            return -1;
+        long last = first;
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE)
+                return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            if (latency->cpu_count == AESD_LATENCY_MAX_CPUS)
+                return -1;
+            latency->cpus[latency->cpu_count++] = cpu;
+        }
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return -1;
+        p = end;
+    }
+    return latency->cpu_count > 0 ? 0 : -1;
+}
+
+int aesd_latency_lock_memory(void)
+{
+    // Freed memory stays in the heap instead of going back to the kernel, where the next
+    // allocation would fault it in again
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    return mlockall(MCL_CURRENT | MCL_FUTURE);
+}
+
+int aesd_latency_thread_attr(struct aesd_latency *latency, pthread_attr_t *attr)
+{
+    int cpu = latency->cpus[atomic_fetch_add(&latency->next, 1) % latency->cpu_count];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_attr_init(attr) != 0)
+        return -1;
+    if (pthread_attr_setstacksize(attr, AESD_LATENCY_STACK_SIZE) != 0 ||
+        pthread_attr_setaffinity_np(attr, sizeof(set), &set) != 0)
+    {
+        pthread_attr_destroy(attr);
+        return -1;
+    }
+    return cpu;
+}
+
+int aesd_latency_socket(int fd)
+{
+    int busy_poll_us = AESD_LATENCY_BUSY_POLL_US;
+    int prefer = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us)) != 0)
+        return -1;
+    // Older kernels do not know it, busy polling still works without
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+    return 0;
+}
+
+void aesd_latency_prefault(void *buf, size_t len)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    volatile char *p = buf;
+    for (size_t i = 0; i < len; i += page)
+        p[i] = 0;
+    if (len > 0)
+        p[len - 1] = 0;
+}
+
+ssize_t aesd_latency_recv(int fd, void *buf, size_t len, volatile int *running)
+{
+    while (*running)
+    {
+        ssize_t received = recv(fd, buf, len, MSG_DONTWAIT);
+        if (received >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            return received;
+    }
+    return 0;
+}
@@ -0,0 +1,52 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-latency.h: Low-latency mode, busy polling connection threads pinned to dedicated cores
+ * ========================================== */
+
+// Trades CPU for tail latency: every connection thread spins on a non-blocking receive instead of
+// sleeping in recv(), on a core of the configured list (round robin), with its memory locked and
+// already faulted in. A spinning thread keeps its core busy for the whole connection, so the listed
+// cores should be isolated from the rest of the system (isolcpus, cpusets).
+
+#ifndef AESD_LATENCY_H
+#define AESD_LATENCY_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define AESD_LATENCY_MAX_CPUS 64
+// Time the kernel busy polls the device queue on a receive (SO_BUSY_POLL)
+#define AESD_LATENCY_BUSY_POLL_US 50
+// Stack of a connection thread, locked as a whole: keep it small rather than the default 8 MB
+#define AESD_LATENCY_STACK_SIZE (256 * 1024)
+
+struct aesd_latency
+{
+    int cpus[AESD_LATENCY_MAX_CPUS];
+    size_t cpu_count;
+    atomic_size_t next;     // round robin over cpus
+};
+
+/// Parse a cpu list such as "2,3" or "2-5,7". Returns 0, -1 if the list is invalid or too long
+int aesd_latency_parse(struct aesd_latency *latency, const char *cpu_list);
+
+/// Lock the current and future memory of the process and keep freed heap mapped, so the hot path
+/// never page faults. Call it after the fork, locks are not inherited. Returns 0, -1 with errno set
+int aesd_latency_lock_memory(void);
+
+/// Thread attributes of the next connection: small stack, pinned to the next cpu of the list.
+/// Returns the cpu, -1 on error. Release attr with pthread_attr_destroy()
+int aesd_latency_thread_attr(struct aesd_latency *latency, pthread_attr_t *attr);
+
+/// Ask the kernel to busy poll the receive queue of an accepted socket. Returns 0, -1 with errno set
+/// (raising SO_BUSY_POLL above net.core.busy_read needs CAP_NET_ADMIN)
+int aesd_latency_socket(int fd);
+
+/// Touch every page of a buffer, in case the memory could not be locked
+void aesd_latency_prefault(void *buf, size_t len);
+
+/// recv() spinning until data, end of file or error. Returns 0 as well once *running is cleared
+ssize_t aesd_latency_recv(int fd, void *buf, size_t len, volatile int *running);
+
+#endif /* AESD_LATENCY_H */
@@ -0,0 +1,108 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-lz-bench.c: Measure bytes on the wire against CPU cost of reply compression
+ * Usage: aesd-lz-bench [appends] [ring depth]
+ * ========================================== */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aesd-lz.h"
+
+#define MAX_BUFFER_SIZE 50000
+#define LINE_SIZE 200
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Generate a log line looking like what our producers send
+static size_t make_line(char *line, unsigned i)
+{
+    static const char *levels[] = {"INFO", "WARN", "DEBUG", "ERROR"};
+    static const char *msgs[] = {
+        "sensor reading within range",
+        "connection established with gateway",
+        "retrying upload after timeout",
+        "battery level reported",
+        "configuration reloaded from flash",
+    };
+    return snprintf(line, LINE_SIZE, "20241008 18:%02u:%02u node-%03u %s %s value=%u\n",
+                    (i / 60) % 60, i % 60, (i * 7) % 128, levels[(i * 13) % 4], msgs[(i * 31) % 5], (i * 2654435761u) % 100000);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned appends = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000;
+    unsigned depth = argc > 2 ? strtoul(argv[2], NULL, 10) : 10;
+    if (depth == 0)
+        depth = 1;
+
+    // Ring of the most recent lines, as kept by the aesdchar driver
+    char (*ring)[LINE_SIZE] = calloc(depth, LINE_SIZE);
+    size_t *sizes = calloc(depth, sizeof(size_t));
+    char *reply = malloc(MAX_BUFFER_SIZE);
+    char *frame = malloc(aesd_lz_bound(MAX_BUFFER_SIZE));
+    char *decoded = malloc(MAX_BUFFER_SIZE);
+    struct aesd_lz_stream enc, dec;
+    if (!ring || !sizes || !reply || !frame || !decoded ||
+        aesd_lz_stream_init(&enc, MAX_BUFFER_SIZE) || aesd_lz_stream_init(&dec, MAX_BUFFER_SIZE))
+    {
+        fprintf(stderr, "allocation failed\n");
+        return EXIT_FAILURE;
+    }
+
+    unsigned long long raw_bytes = 0, wire_bytes = 0;
+    double enc_ns = 0, dec_ns = 0;
+    for (unsigned i = 0; i < appends; i++)
+    {
+        sizes[i % depth] = make_line(ring[i % depth], i);
+
+        // Full history reply, oldest entry first
+        size_t len = 0;
+        unsigned count = i + 1 < depth ? i + 1 : depth;
+        for (unsigned j = 0; j < count; j++)
+        {
+            unsigned idx = (i + 1 - count + j) % depth;
+            if (len + sizes[idx] > MAX_BUFFER_SIZE)
+                break;
+            memcpy(reply + len, ring[idx], sizes[idx]);
+            len += sizes[idx];
+        }
+
+        double t0 = now_ns();
+        ssize_t frame_len = aesd_lz_encode_frame(&enc, reply, len, frame, aesd_lz_bound(MAX_BUFFER_SIZE));
+        double t1 = now_ns();
+        ssize_t out_len = aesd_lz_decode_frame(&dec, frame, frame_len, decoded, MAX_BUFFER_SIZE);
+        double t2 = now_ns();
+        if (frame_len < 0 || out_len != (ssize_t)len || memcmp(decoded, reply, len) != 0)
+        {
+            fprintf(stderr, "round trip failed at reply %u\n", i);
+            return EXIT_FAILURE;
+        }
+        raw_bytes += len;
+        wire_bytes += frame_len;
+        enc_ns += t1 - t0;
+        dec_ns += t2 - t1;
+    }
+
+    printf("replies          : %u (ring depth %u)\n", appends, depth);
+    printf("raw bytes        : %llu\n", raw_bytes);
+    printf("wire bytes       : %llu (%.2f%% of raw, ratio %.1fx)\n", wire_bytes,
+           100.0 * wire_bytes / raw_bytes, (double)raw_bytes / wire_bytes);
+    printf("compress cost    : %.2f us/reply, %.1f MB/s\n", enc_ns / appends / 1e3, raw_bytes / (enc_ns / 1e9) / 1e6);
+    printf("decompress cost  : %.2f us/reply, %.1f MB/s\n", dec_ns / appends / 1e3, raw_bytes / (dec_ns / 1e9) / 1e6);
+
+    aesd_lz_stream_free(&enc);
+    aesd_lz_stream_free(&dec);
+    free(ring);
+    free(sizes);
+    free(reply);
+    free(frame);
+    free(decoded);
+    return EXIT_SUCCESS;
+}
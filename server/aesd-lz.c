@@ -0,0 +1,340 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-lz.c: Small LZ77 codec used to compress replies
+ * ========================================== */
+
+// Block format, a sequence of:
+//   token (1 byte): literal length on the 4 high bits, match length - 4 on the 4 low bits
+//   [literal length - 15 as a run of 255 bytes plus remainder, if the 4 bits are saturated]
+//   literals
+//   offset, LEB128 encoded, counted backwards from the current position (can reach into the dictionary)
+//   [match length - 19 as a run of 255 bytes plus remainder, if the 4 bits are saturated]
+// The last sequence of a block only holds literals and ends the block.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "aesd-lz.h"
+
+#define AESD_LZ_MIN_MATCH 4
+#define AESD_LZ_HASH_BITS 14
+#define AESD_LZ_HASH_SIZE (1 << AESD_LZ_HASH_BITS)
+#define AESD_LZ_MAGIC0 'A'
+#define AESD_LZ_MAGIC1 'Z'
+
+static inline uint32_t hash4(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - AESD_LZ_HASH_BITS);
+}
+
+static void put_be32(char *p, uint32_t v)
+{
+    p[0] = (char)(v >> 24);
+    p[1] = (char)(v >> 16);
+    p[2] = (char)(v >> 8);
+    p[3] = (char)v;
+}
+
+static uint32_t get_be32(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | u[3];
+}
+
+static void put_header(char *dst, char method, size_t raw_len, size_t payload_len)
+{
+    dst[0] = AESD_LZ_MAGIC0;
+    dst[1] = AESD_LZ_MAGIC1;
+    dst[2] = method;
+    put_be32(dst + 3, raw_len);
+    put_be32(dst + 7, payload_len);
+}
+
+// Write a length overflow as a run of 255 followed by the remainder
+static char *put_length(char *op, const char *oend, size_t len)
+{
+    while (len >= 255)
+    {
+        if (op >= oend)
+            return NULL;
+        *op++ = (char)255;
+        len -= 255;
+    }
+    if (op >= oend)
+        return NULL;
+    *op++ = (char)len;
+    return op;
+}
+
+static const char *get_length(const char *ip, const char *iend, size_t *len)
+{
+    unsigned char b;
+    do
+    {
+        if (ip >= iend)
+            return NULL;
+        b = (unsigned char)*ip++;
+        *len += b;
+    } while (b == 255);
+    return ip;
+}
+
+// Emit one sequence. mlen == 0 means literals only (end of block)
+static char *put_sequence(char *op, const char *oend, const char *lit, size_t llen, size_t offset, size_t mlen)
+{
+    if (op >= oend)
+        return NULL;
+    char *token = op++;
+    size_t mcode = mlen ? mlen - AESD_LZ_MIN_MATCH : 0;
+    *token = (char)(((llen >= 15 ? 15 : llen) << 4) | (mcode >= 15 ? 15 : mcode));
+
+    if (llen >= 15 && (op = put_length(op, oend, llen - 15)) == NULL)
+        return NULL;
+    if ((size_t)(oend - op) < llen)
+        return NULL;
+    memcpy(op, lit, llen);
+    op += llen;
+
+    if (mlen == 0)
+        return op;
+
+    // LEB128 offset
+    do
+    {
+        if (op >= oend)
+            return NULL;
+        *op++ = (char)((offset & 0x7F) | (offset > 0x7F ? 0x80 : 0));
+        offset >>= 7;
+    } while (offset);
+
+    if (mcode >= 15 && (op = put_length(op, oend, mcode - 15)) == NULL)
+        return NULL;
+    return op;
+}
+
+// The block just processed sits right after the dictionary, make it the next dictionary
+static void slide_window(struct aesd_lz_stream *s, size_t len)
+{
+    memmove(s->window, s->window + s->dict_len, len);
+    s->dict_len = len;
+}
+
+size_t aesd_lz_bound(size_t len)
+{
+    return AESD_LZ_FRAME_HEADER + len + len / 255 + 16;
+}
+
+size_t aesd_lz_stream_size(size_t max_block)
+{
+    return sizeof(struct aesd_lz_stream) + 2 * max_block + AESD_LZ_HASH_SIZE * sizeof(uint32_t);
+}
+
+int aesd_lz_stream_init(struct aesd_lz_stream *s, size_t max_block)
+{
+    s->window = malloc(2 * max_block);
+    s->hash = malloc(AESD_LZ_HASH_SIZE * sizeof(uint32_t));
+    s->dict_len = 0;
+    s->max_block = max_block;
+    if (s->window == NULL || s->hash == NULL)
+    {
+        aesd_lz_stream_free(s);
+        return -1;
+    }
+    return 0;
+}
+
+void aesd_lz_stream_free(struct aesd_lz_stream *s)
+{
+    free(s->window);
+    free(s->hash);
+    s->window = NULL;
+    s->hash = NULL;
+    s->dict_len = 0;
+}
+
+ssize_t aesd_lz_compress(struct aesd_lz_stream *s, const char *src, size_t len, char *dst, size_t dst_cap)
+{
+    if (len > s->max_block)
+        return -1;
+
+    char *base = s->window;
+    memcpy(base + s->dict_len, src, len);
+    const char *ip = base + s->dict_len;
+    const char *anchor = ip;
+    const char *end = ip + len;
+    char *op = dst;
+    const char *oend = dst + dst_cap;
+
+    // Index the dictionary, consecutive replies mostly repeat it
+    memset(s->hash, 0, AESD_LZ_HASH_SIZE * sizeof(uint32_t));
+    for (size_t pos = 0; pos + AESD_LZ_MIN_MATCH <= s->dict_len; pos++)
+    {
+        s->hash[hash4(base + pos)] = pos + 1;
+    }
+
+    while (ip + AESD_LZ_MIN_MATCH <= end)
+    {
+        uint32_t h = hash4(ip);
+        uint32_t candidate = s->hash[h];
+        s->hash[h] = (ip - base) + 1;
+        if (candidate != 0)
+        {
+            const char *ref = base + candidate - 1;
+            if (memcmp(ref, ip, AESD_LZ_MIN_MATCH) == 0)
+            {
+                size_t mlen = AESD_LZ_MIN_MATCH;
+                while (ip + mlen < end && ref[mlen] == ip[mlen])
+                    mlen++;
+                op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, mlen);
+                if (op == NULL)
+                    return -1;
+                ip += mlen;
+                anchor = ip;
+                continue;
+            }
+        }
+        ip++;
+    }
+
+    if (end > anchor)
+    {
+        op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+        if (op == NULL)
+            return -1;
+    }
+
+    slide_window(s, len);
+    return op - dst;
+}
+
+ssize_t aesd_lz_decompress(struct aesd_lz_stream *s, const char *src, size_t len, char *dst, size_t dst_cap)
+{
+    char *base = s->window;
+    char *op = base + s->dict_len;
+    const char *oend = op + (s->max_block < dst_cap ? s->max_block : dst_cap);
+    const char *ip = src;
+    const char *iend = src + len;
+
+    while (ip < iend)
+    {
+        unsigned char token = (unsigned char)*ip++;
+        size_t llen = token >> 4;
+        if (llen == 15 && (ip = get_length(ip, iend, &llen)) == NULL)
+            return -1;
+        if ((size_t)(iend - ip) < llen || (size_t)(oend - op) < llen)
+            return -1;
+        memcpy(op, ip, llen);
+        ip += llen;
+        op += llen;
+        if (ip >= iend)
+            break;
+
+        size_t offset = 0;
+        unsigned shift = 0;
+        unsigned char b;
+        do
+        {
+            if (ip >= iend || shift > 28)
+                return -1;
+            b = (unsigned char)*ip++;
+            offset |= (size_t)(b & 0x7F) << shift;
+            shift += 7;
+        } while (b & 0x80);
+
+        size_t mlen = token & 0x0F;
+        if (mlen == 15 && (ip = get_length(ip, iend, &mlen)) == NULL)
+            return -1;
+        mlen += AESD_LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - base) || (size_t)(oend - op) < mlen)
+            return -1;
+        // Byte per byte copy, source and destination can overlap
+        const char *ref = op - offset;
+        for (size_t i = 0; i < mlen; i++)
+            op[i] = ref[i];
+        op += mlen;
+    }
+
+    size_t out_len = op - (base + s->dict_len);
+    memcpy(dst, base + s->dict_len, out_len);
+    slide_window(s, out_len);
+    return out_len;
+}
+
+ssize_t aesd_lz_encode_frame(struct aesd_lz_stream *s, const char *src, size_t len, char *dst, size_t dst_cap)
+{
+    if (dst_cap < aesd_lz_bound(len))
+        return -1;
+
+    ssize_t payload = aesd_lz_compress(s, src, len, dst + AESD_LZ_FRAME_HEADER, dst_cap - AESD_LZ_FRAME_HEADER);
+    if (payload < 0)
+        return -1;
+
+    char method = AESD_LZ_METHOD_LZ;
+    if ((size_t)payload >= len)
+    {
+        // Incompressible block, send it as is. The dictionary was already updated by the compressor
+        method = AESD_LZ_METHOD_STORED;
+        memcpy(dst + AESD_LZ_FRAME_HEADER, src, len);
+        payload = len;
+    }
+    put_header(dst, method, len, payload);
+    return AESD_LZ_FRAME_HEADER + payload;
+}
+
+ssize_t aesd_lz_raw_frame(const char *src, size_t len, char *dst, size_t dst_cap)
+{
+    if (dst_cap < AESD_LZ_FRAME_HEADER + len)
+        return -1;
+    put_header(dst, AESD_LZ_METHOD_RAW, len, len);
+    memcpy(dst + AESD_LZ_FRAME_HEADER, src, len);
+    return AESD_LZ_FRAME_HEADER + len;
+}
+
+int aesd_lz_frame_lengths(const char *header, size_t *raw_len, size_t *payload_len)
+{
+    if (header[0] != AESD_LZ_MAGIC0 || header[1] != AESD_LZ_MAGIC1 ||
+        (header[2] != AESD_LZ_METHOD_STORED && header[2] != AESD_LZ_METHOD_LZ && header[2] != AESD_LZ_METHOD_RAW))
+    {
+        return -1;
+    }
+    *raw_len = get_be32(header + 3);
+    *payload_len = get_be32(header + 7);
+    return 0;
+}
+
+ssize_t aesd_lz_decode_frame(struct aesd_lz_stream *s, const char *frame, size_t len, char *dst, size_t dst_cap)
+{
+    size_t raw_len, payload_len;
+    if (len < AESD_LZ_FRAME_HEADER || aesd_lz_frame_lengths(frame, &raw_len, &payload_len) != 0)
+        return -1;
+    if (len - AESD_LZ_FRAME_HEADER < payload_len || raw_len > dst_cap)
+        return -1;
+
+    const char *payload = frame + AESD_LZ_FRAME_HEADER;
+    if (frame[2] == AESD_LZ_METHOD_RAW)
+    {
+        if (payload_len != raw_len)
+            return -1;
+        memcpy(dst, payload, raw_len);
+        return raw_len;
+    }
+
+    // Stored and compressed frames are part of the stream
+    if (s == NULL || raw_len > s->max_block)
+        return -1;
+    if (frame[2] == AESD_LZ_METHOD_STORED)
+    {
+        if (payload_len != raw_len)
+            return -1;
+        memcpy(s->window + s->dict_len, payload, raw_len);
+        memcpy(dst, payload, raw_len);
+        slide_window(s, raw_len);
+        return raw_len;
+    }
+
+    ssize_t out_len = aesd_lz_decompress(s, payload, payload_len, dst, raw_len);
+    if (out_len != (ssize_t)raw_len)
+        return -1;
+    return out_len;
+}
@@ -0,0 +1,62 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-lz.h: Small LZ77 codec used to compress replies, keeping the
+ * previous reply as dictionary for the next one
+ * ========================================== */
+
+#ifndef AESD_LZ_H
+#define AESD_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Frame header put in front of every compressed or pipelined reply:
+// 'A' 'Z' | method (1 byte) | raw length (4 bytes BE) | payload length (4 bytes BE)
+#define AESD_LZ_FRAME_HEADER 11
+#define AESD_LZ_METHOD_STORED 0
+#define AESD_LZ_METHOD_LZ 1
+// Uncompressed frame outside of the compressed stream (pipelined replies, command acknowledgements),
+// it does not update the dictionary
+#define AESD_LZ_METHOD_RAW 2
+
+/// Codec state, one per direction and per connection.
+/// Both ends must feed the same sequence of blocks so their dictionaries stay identical.
+struct aesd_lz_stream
+{
+    char *window;       // dictionary (previous block) followed by the current block
+    size_t dict_len;    // number of valid dictionary bytes at the beginning of window
+    size_t max_block;   // biggest block accepted, window holds twice this size
+    uint32_t *hash;     // position+1 of the last occurence of each 4 bytes sequence, 0 if none
+};
+
+/// Upper bound of the compressed size of a block of len bytes, frame header included
+size_t aesd_lz_bound(size_t len);
+
+/// Memory used by a stream accepting blocks of max_block bytes, the structure included
+size_t aesd_lz_stream_size(size_t max_block);
+
+int aesd_lz_stream_init(struct aesd_lz_stream *s, size_t max_block);
+void aesd_lz_stream_free(struct aesd_lz_stream *s);
+
+/// Compress one block, using the previous block as dictionary. Returns the compressed size, -1 on error
+ssize_t aesd_lz_compress(struct aesd_lz_stream *s, const char *src, size_t len, char *dst, size_t dst_cap);
+
+/// Decompress one block produced by aesd_lz_compress. Returns the raw size, -1 on corrupted input
+ssize_t aesd_lz_decompress(struct aesd_lz_stream *s, const char *src, size_t len, char *dst, size_t dst_cap);
+
+/// Compress src into a complete frame (header + payload). Falls back to a stored frame if compression
+/// does not pay off. Returns the frame size, -1 on error
+ssize_t aesd_lz_encode_frame(struct aesd_lz_stream *s, const char *src, size_t len, char *dst, size_t dst_cap);
+
+/// Put src in a raw frame, which does not need nor update a stream. Returns the frame size, -1 on error
+ssize_t aesd_lz_raw_frame(const char *src, size_t len, char *dst, size_t dst_cap);
+
+/// Parse a frame header (AESD_LZ_FRAME_HEADER bytes), so a reader knows how many payload bytes to wait for.
+/// Returns 0 on success, -1 if the header is not valid
+int aesd_lz_frame_lengths(const char *header, size_t *raw_len, size_t *payload_len);
+
+/// Decode a complete frame. s can be NULL if the connection only receives raw frames.
+/// Returns the raw size, -1 on error
+ssize_t aesd_lz_decode_frame(struct aesd_lz_stream *s, const char *frame, size_t len, char *dst, size_t dst_cap);
+
+#endif /* AESD_LZ_H */
@@ -0,0 +1,148 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-mem-bench.c: Resident memory of aesdsocket against its number of idle connections
+ * Usage: aesd-mem-bench server_pid [host] [port] [connections] [step]
+ * ========================================== */
+
+// Opens idle connections step by step and reads the server resident and virtual memory and thread
+// count from /proc after each step. Run it against aesdsocket and aesdsocket -M budget_mb to compare the modes.
+// Both processes need a file descriptor limit above the connection count (ulimit -n).
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// The server listens with a backlog of 10: open a few connections, then wait for their threads, a
+// full backlog would drop the next SYN and stall the client for a retransmission (1 s)
+#define BATCH 8
+// Connections without their thread after this delay: the server stopped accepting (backpressure)
+#define ACCEPT_TIMEOUT_MS 2000
+
+/// Read a "Name: value" line of /proc/pid/status, -1 if not found
+static long proc_status(long pid, const char *name)
+{
+    char path[64];
+    char line[256];
+    snprintf(path, sizeof(path), "/proc/%ld/status", pid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+    long value = -1;
+    size_t name_len = strlen(name);
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (strncmp(line, name, name_len) == 0 && line[name_len] == ':')
+        {
+            value = strtol(line + name_len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(file);
+    return value;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s server_pid [host] [port] [connections] [step]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    long pid = strtol(argv[1], NULL, 10);
+    const char *host = argc > 2 ? argv[2] : "localhost";
+    const char *port = argc > 3 ? argv[3] : "9000";
+    unsigned connections = argc > 4 ? strtoul(argv[4], NULL, 10) : 10000;
+    unsigned step = argc > 5 ? strtoul(argv[5], NULL, 10) : 1000;
+    if (step == 0)
+        step = 1;
+
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    struct addrinfo hints = {0};
+    struct addrinfo *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(host, port, &hints, &res);
+    if (rc != 0)
+    {
+        fprintf(stderr, "%s:%s: %s\n", host, port, gai_strerror(rc));
+        return EXIT_FAILURE;
+    }
+
+    long base_kb = proc_status(pid, "VmRSS");
+    if (base_kb < 0)
+    {
+        fprintf(stderr, "No process %ld\n", pid);
+        return EXIT_FAILURE;
+    }
+    printf("%12s %10s %10s %14s %10s\n", "connections", "threads", "RSS MB", "KB/connection", "VSZ MB");
+    printf("%12u %10ld %10.1f %14s %10.1f\n", 0, proc_status(pid, "Threads"), base_kb / 1024.0, "-",
+           proc_status(pid, "VmSize") / 1024.0);
+
+    unsigned opened = 0;
+    bool refused = false;
+    while (opened < connections && !refused)
+    {
+        unsigned target = opened + step < connections ? opened + step : connections;
+        for (; opened < target; opened++)
+        {
+            int fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK, res->ai_protocol);
+            if (fd < 0)
+            {
+                perror("socket");
+                goto done;
+            }
+            if (connect(fd, res->ai_addr, res->ai_addrlen) != 0 && errno != EINPROGRESS)
+            {
+                perror("connect");
+                close(fd);
+                goto done;
+            }
+            if ((opened + 1) % BATCH != 0 && opened + 1 != target)
+                continue;
+            // The main thread is not a connection
+            long threads;
+            unsigned waited_ms = 0;
+            while ((threads = proc_status(pid, "Threads")) >= 0 && threads - 1 < opened + 1 &&
+                   waited_ms < ACCEPT_TIMEOUT_MS)
+            {
+                usleep(1000);
+                waited_ms++;
+            }
+            if (waited_ms == ACCEPT_TIMEOUT_MS)
+            {
+                printf("%ld connections served, no new one accepted for %d ms: backpressure\n", threads - 1,
+                       ACCEPT_TIMEOUT_MS);
+                opened++;
+                refused = true;
+                break;
+            }
+        }
+        long threads = proc_status(pid, "Threads");
+        long rss_kb = proc_status(pid, "VmRSS");
+        long vsz_kb = proc_status(pid, "VmSize");
+        if (rss_kb < 0)
+        {
+            fprintf(stderr, "Server %ld exited\n", pid);
+            break;
+        }
+        // The main thread is not a connection
+        long served = threads > 1 ? threads - 1 : 0;
+        printf("%12u %10ld %10.1f %14.1f %10.1f\n", opened, threads, rss_kb / 1024.0,
+               served ? (double)(rss_kb - base_kb) / served : 0, vsz_kb / 1024.0);
+        fflush(stdout);
+    }
+done:
+    // The connections are closed on exit
+    freeaddrinfo(res);
+    return EXIT_SUCCESS;
+}
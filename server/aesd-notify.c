@@ -0,0 +1,63 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-notify.c: Socket activation and readiness notification, following the service manager
+ * conventions (LISTEN_FDS, NOTIFY_SOCKET), without depending on libsystemd
+ * ========================================== */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "aesd-notify.h"
+
+int aesd_listen_fd(void)
+{
+    const char *pid = getenv("LISTEN_PID");
+    const char *fds = getenv("LISTEN_FDS");
+    if (pid == NULL || fds == NULL || strtol(pid, NULL, 10) != getpid())
+        return -1;
+    long count = strtol(fds, NULL, 10);
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    if (count < 1)
+        return -1;
+
+    // Only one port is served, further sockets are not ours
+    int fd = AESD_LISTEN_FDS_START;
+    for (long i = 1; i < count; i++)
+        close(AESD_LISTEN_FDS_START + i);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+int aesd_notify(const char *state)
+{
+    const char *path = getenv("NOTIFY_SOCKET");
+    if (path == NULL || path[0] == '\0')
+        return 0;
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    size_t path_len = strlen(path);
+    if (path_len >= sizeof(addr.sun_path) || (path[0] != '/' && path[0] != '@'))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(addr.sun_path, path, path_len);
+    // '@' stands for the abstract namespace
+    if (addr.sun_path[0] == '@')
+        addr.sun_path[0] = '\0';
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    ssize_t sent = sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&addr,
+                          offsetof(struct sockaddr_un, sun_path) + path_len);
+    close(fd);
+    return sent < 0 ? -1 : 1;
+}
@@ -0,0 +1,20 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-notify.h: Socket activation and readiness notification, following the service manager
+ * conventions (LISTEN_FDS, NOTIFY_SOCKET), without depending on libsystemd
+ * ========================================== */
+
+#ifndef AESD_NOTIFY_H
+#define AESD_NOTIFY_H
+
+// First file descriptor passed by the service manager
+#define AESD_LISTEN_FDS_START 3
+
+/// Listening socket passed by the service manager (LISTEN_PID and LISTEN_FDS set for this process).
+/// The variables are removed so children do not inherit them. Returns the fd, -1 if none was passed
+int aesd_listen_fd(void);
+
+/// Send a state, e.g. "READY=1" or "STATUS=...", to the service manager through $NOTIFY_SOCKET.
+/// Returns 1 if sent, 0 if there is no service manager to notify, -1 on error
+int aesd_notify(const char *state);
+
+#endif /* AESD_NOTIFY_H */
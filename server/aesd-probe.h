@@ -0,0 +1,90 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-probe.h: USDT static probes, for bpftrace and perf on a running server
+ * ========================================== */
+
+// A probe is a nop in the code and an ELF note (.note.stapsdt) telling the tracers where it is and
+// where its arguments live, the format of systemtap's sys/sdt.h. Not attached, it costs the nop and
+// maybe a register move per argument: nothing is called, nothing is linked.
+// sys/sdt.h is used when installed, otherwise the macros below emit the same notes (x86-64 and
+// aarch64, gcc and clang). Arguments are passed as 64-bit signed integers, pointers included.
+// Build with -DAESD_NO_PROBES to remove them. Listing and use:
+//   bpftrace -l 'usdt:./aesdsocket:*'
+//   readelf -n aesdsocket
+// Provider aesdsocket:
+//   conn__accept(handle, fd)             conn__close(handle, bytes received)
+//   request__start(handle, len, reply)   request__done(handle, rc)
+//   lock__wait(mutex)  lock__acquired(mutex)  lock__release(mutex)
+//   write__start(len, entries)  write__done(rc)    storage writes, entries > 1 for a grouped write
+//   read__start(offset, len)    read__done(rc)
+//   seek__start(write_cmd, write_cmd_offset)  seek__done(rc)
+
+#ifndef AESD_PROBE_H
+#define AESD_PROBE_H
+
+#include <stdint.h>
+
+#if defined(AESD_NO_PROBES)
+
+#define AESD_PROBE0(name) do {} while (0)
+#define AESD_PROBE1(name, a1) do { (void)(a1); } while (0)
+#define AESD_PROBE2(name, a1, a2) do { (void)(a1); (void)(a2); } while (0)
+#define AESD_PROBE3(name, a1, a2, a3) do { (void)(a1); (void)(a2); (void)(a3); } while (0)
+
+#elif defined(__has_include) && __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+#define AESD_PROBE0(name) DTRACE_PROBE(aesdsocket, name)
+#define AESD_PROBE1(name, a1) DTRACE_PROBE1(aesdsocket, name, (int64_t)(intptr_t)(a1))
+#define AESD_PROBE2(name, a1, a2) DTRACE_PROBE2(aesdsocket, name, (int64_t)(intptr_t)(a1), (int64_t)(intptr_t)(a2))
+#define AESD_PROBE3(name, a1, a2, a3) \
+    DTRACE_PROBE3(aesdsocket, name, (int64_t)(intptr_t)(a1), (int64_t)(intptr_t)(a2), (int64_t)(intptr_t)(a3))
+
+#elif defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+
+// Note: nop address, base address (for prelinked binaries), semaphore (none), provider, name, and
+// the arguments, "-8@<operand>" for a signed 8 byte value
+#define AESD_PROBE_ASM(name, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte 0\n" \
+    ".asciz \"aesdsocket\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+// Immediate, memory or register, wherever the value already is
+#define AESD_PROBE_ARG(a) "nor"((int64_t)(intptr_t)(a))
+
+#define AESD_PROBE0(name) __asm__ __volatile__(AESD_PROBE_ASM(name, "") ::)
+#define AESD_PROBE1(name, a1) __asm__ __volatile__(AESD_PROBE_ASM(name, "-8@%0") :: AESD_PROBE_ARG(a1))
+#define AESD_PROBE2(name, a1, a2) \
+    __asm__ __volatile__(AESD_PROBE_ASM(name, "-8@%0 -8@%1") :: AESD_PROBE_ARG(a1), AESD_PROBE_ARG(a2))
+#define AESD_PROBE3(name, a1, a2, a3) \
+    __asm__ __volatile__(AESD_PROBE_ASM(name, "-8@%0 -8@%1 -8@%2") \
+                         :: AESD_PROBE_ARG(a1), AESD_PROBE_ARG(a2), AESD_PROBE_ARG(a3))
+
+#else
+
+// No tracer support for this target
+#define AESD_PROBE0(name) do {} while (0)
+#define AESD_PROBE1(name, a1) do { (void)(a1); } while (0)
+#define AESD_PROBE2(name, a1, a2) do { (void)(a1); (void)(a2); } while (0)
+#define AESD_PROBE3(name, a1, a2, a3) do { (void)(a1); (void)(a2); (void)(a3); } while (0)
+
+#endif
+
+#endif /* AESD_PROBE_H */
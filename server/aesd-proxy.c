@@ -0,0 +1,205 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-proxy.c: Proxy mode, channels spread over several aesdsocket backends
+ * ========================================== */
+#define _GNU_SOURCE // memrchr
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "aesd-proxy.h"
+
+/// FNV-1a, 64 bits
+static uint64_t hash_bytes(uint64_t hash, const char *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)buf[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static uint64_t hash_name(const char *name, size_t len)
+{
+    uint64_t hash = hash_bytes(0xcbf29ce484222325ull, name, len);
+    // FNV alone spreads short similar names poorly, mix the bits (murmur3 finalizer)
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static int point_cmp(const void *a, const void *b)
+{
+    const struct aesd_proxy_point *pa = a, *pb = b;
+    return pa->hash < pb->hash ? -1 : pa->hash > pb->hash;
+}
+
+int aesd_proxy_init(struct aesd_proxy *proxy, const char *list)
+{
+    memset(proxy, 0, sizeof(*proxy));
+    const char *p = list;
+    while (*p != '\0')
+    {
+        const char *end = strchr(p, ',');
+        size_t len = end != NULL ? (size_t)(end - p) : strlen(p);
+        const char *colon = memrchr(p, ':', len);
+        if (proxy->count == AESD_PROXY_MAX_BACKENDS || colon == NULL || colon == p ||
+            (size_t)(colon - p) >= sizeof(proxy->backends[0].host) || colon + 1 == p + len ||
+            (size_t)(p + len - colon - 1) >= sizeof(proxy->backends[0].port))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        struct aesd_proxy_backend *backend = &proxy->backends[proxy->count];
+        snprintf(backend->host, sizeof(backend->host), "%.*s", (int)(colon - p), p);
+        snprintf(backend->port, sizeof(backend->port), "%.*s", (int)(p + len - colon - 1), colon + 1);
+        pthread_mutex_init(&backend->lock, NULL);
+        atomic_init(&backend->requests, 0);
+        atomic_init(&backend->failures, 0);
+
+        // The points only depend on the backend address, not on its rank in the list
+        for (unsigned v = 0; v < AESD_PROXY_VNODES; v++)
+        {
+            char vnode[300];
+            int vnode_len = snprintf(vnode, sizeof(vnode), "%s:%s#%u", backend->host, backend->port, v);
+            proxy->ring[proxy->points++] = (struct aesd_proxy_point){hash_name(vnode, vnode_len), proxy->count};
+        }
+        proxy->count++;
+        p += len;
+        if (*p == ',')
+            p++;
+    }
+    if (proxy->count == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    qsort(proxy->ring, proxy->points, sizeof(proxy->ring[0]), point_cmp);
+    return 0;
+}
+
+void aesd_proxy_destroy(struct aesd_proxy *proxy)
+{
+    for (unsigned i = 0; i < proxy->count; i++)
+    {
+        struct aesd_proxy_backend *backend = &proxy->backends[i];
+        syslog(LOG_INFO, "Backend %s:%s: %u links, %llu requests, %llu failed\n", backend->host, backend->port,
+               backend->links, (unsigned long long)atomic_load(&backend->requests),
+               (unsigned long long)atomic_load(&backend->failures));
+        // Borrowed links belong to connection threads still running at exit
+        for (int mode = 0; mode < 2; mode++)
+        {
+            while (backend->idle[mode] != NULL)
+            {
+                struct aesd_proxy_link *link = backend->idle[mode];
+                backend->idle[mode] = link->next;
+                aesd_client_destroy(link->client);
+                free(link);
+            }
+        }
+    }
+}
+
+unsigned aesd_proxy_route(const struct aesd_proxy *proxy, const char *name, size_t len)
+{
+    uint64_t hash = hash_name(name, len);
+    // First point at or after the hash, wrapping around
+    size_t lo = 0, hi = proxy->points;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (proxy->ring[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return proxy->ring[lo == proxy->points ? 0 : lo].backend;
+}
+
+struct aesd_proxy_link *aesd_proxy_acquire(struct aesd_proxy *proxy, unsigned backend_index, bool ingest)
+{
+    struct aesd_proxy_backend *backend = &proxy->backends[backend_index];
+    pthread_mutex_lock(&backend->lock);
+    struct aesd_proxy_link *link = backend->idle[ingest];
+    if (link != NULL)
+    {
+        backend->idle[ingest] = link->next;
+    }
+    pthread_mutex_unlock(&backend->lock);
+    if (link != NULL)
+        return link;
+
+    link = calloc(1, sizeof(*link));
+    if (link == NULL)
+        return NULL;
+    // The connection itself is opened by the first request
+    link->client = aesd_client_create(backend->host, backend->port, 1, ingest ? AESD_CLIENT_INGEST : 0);
+    if (link->client == NULL)
+    {
+        free(link);
+        return NULL;
+    }
+    link->backend = backend_index;
+    link->ingest = ingest;
+    pthread_mutex_lock(&backend->lock);
+    backend->links++;
+    pthread_mutex_unlock(&backend->lock);
+    return link;
+}
+
+static void select_ack(int status, const char *reply, size_t len, void *ctx)
+{
+    struct aesd_proxy_link *link = ctx;
+    char expected[sizeof(AESD_PROXY_CHANNEL_COM) + AESD_PROXY_CHANNEL_MAX + 1];
+    int expected_len = snprintf(expected, sizeof(expected), "%s%s\n", AESD_PROXY_CHANNEL_COM, link->channel);
+    // Refused or lost: the next batch selects it again
+    if (status != 0 || len != (size_t)expected_len || memcmp(reply, expected, len) != 0)
+    {
+        syslog(LOG_ERR, "Backend did not select the channel %s\n", link->channel);
+        link->channel[0] = '\0';
+    }
+}
+
+int aesd_proxy_select(struct aesd_proxy_link *link, const char *channel)
+{
+    if (strcmp(link->channel, channel) == 0)
+        return 0;
+    char line[sizeof(AESD_PROXY_CHANNEL_COM) + AESD_PROXY_CHANNEL_MAX];
+    int len = snprintf(line, sizeof(line), "%s%s", AESD_PROXY_CHANNEL_COM, channel);
+    snprintf(link->channel, sizeof(link->channel), "%s", channel);
+    if (aesd_client_submit(link->client, line, len, select_ack, link) != 0)
+    {
+        link->channel[0] = '\0';
+        return -1;
+    }
+    return 0;
+}
+
+void aesd_proxy_release(struct aesd_proxy *proxy, struct aesd_proxy_link *link, bool broken)
+{
+    struct aesd_proxy_backend *backend = &proxy->backends[link->backend];
+    if (broken)
+    {
+        atomic_fetch_add(&backend->failures, 1);
+        // Fails the requests still queued, while their borrower can take the callbacks
+        aesd_client_destroy(link->client);
+        link->client = aesd_client_create(backend->host, backend->port, 1, link->ingest ? AESD_CLIENT_INGEST : 0);
+        // Its new connection starts on the default channel
+        link->channel[0] = '\0';
+        if (link->client == NULL)
+        {
+            free(link);
+            pthread_mutex_lock(&backend->lock);
+            backend->links--;
+            pthread_mutex_unlock(&backend->lock);
+            return;
+        }
+    }
+    pthread_mutex_lock(&backend->lock);
+    link->next = backend->idle[link->ingest];
+    backend->idle[link->ingest] = link;
+    pthread_mutex_unlock(&backend->lock);
+}
@@ -0,0 +1,80 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-proxy.h: Proxy mode, channels spread over several aesdsocket backends
+ * ========================================== */
+
+// Each channel lives on one backend, chosen by consistent hashing of its name: a backend owns
+// AESD_PROXY_VNODES points of a hash ring, a channel goes to the first point after its own hash. Adding
+// or removing a backend only moves the channels of the ring arcs it gains or loses.
+// Requests reach the backends over persistent pipelined connections (libaesdclient, see
+// aesd-client.h), the links. A link is borrowed by one client connection for a batch of lines, then
+// goes back to its backend pool still connected, remembering the channel it selected upstream.
+
+#ifndef AESD_PROXY_H
+#define AESD_PROXY_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aesd-client.h"
+
+#define AESD_PROXY_MAX_BACKENDS 16
+// Ring points per backend, enough for an even spread with a few backends
+#define AESD_PROXY_VNODES 64
+// Same as AESD_CHANNEL_COM and AESD_CHANNEL_NAME_MAX in aesdsocket.h
+#define AESD_PROXY_CHANNEL_COM "AESDSOCKET_CHANNEL:"
+#define AESD_PROXY_CHANNEL_MAX 32
+
+struct aesd_proxy_link
+{
+    struct aesd_client *client;     // one pipelined connection, reopened by the library if it breaks
+    unsigned backend;
+    bool ingest;                    // AESD_CLIENT_INGEST: appends are answered with a count
+    char channel[AESD_PROXY_CHANNEL_MAX + 1]; // selected upstream, empty if unknown
+    struct aesd_proxy_link *next;   // idle list
+};
+
+struct aesd_proxy_backend
+{
+    char host[256];
+    char port[16];
+    pthread_mutex_t lock;           // idle lists
+    struct aesd_proxy_link *idle[2]; // echo and ingest links, not borrowed
+    unsigned links;                 // links created
+    atomic_ullong requests;         // lines forwarded
+    atomic_ullong failures;         // batches cut short by a broken connection
+};
+
+struct aesd_proxy_point
+{
+    uint64_t hash;
+    unsigned backend;
+};
+
+struct aesd_proxy
+{
+    struct aesd_proxy_backend backends[AESD_PROXY_MAX_BACKENDS];
+    unsigned count;
+    struct aesd_proxy_point ring[AESD_PROXY_MAX_BACKENDS * AESD_PROXY_VNODES]; // sorted by hash
+    size_t points;
+};
+
+/// Set the proxy up for the backends of list, "host:port[,host:port]...". No connection is opened yet.
+/// Returns 0, -1 with errno set to EINVAL if the list is invalid
+int aesd_proxy_init(struct aesd_proxy *proxy, const char *list);
+void aesd_proxy_destroy(struct aesd_proxy *proxy);
+
+/// Backend of the channel called name (len bytes)
+unsigned aesd_proxy_route(const struct aesd_proxy *proxy, const char *name, size_t len);
+
+/// Borrow a link to backend, in ingest mode or not, created if none is idle. Returns NULL if out of memory
+struct aesd_proxy_link *aesd_proxy_acquire(struct aesd_proxy *proxy, unsigned backend, bool ingest);
+/// Queue the selection of channel on the link if it is not the one selected upstream.
+/// Returns 0, -1 with errno set
+int aesd_proxy_select(struct aesd_proxy_link *link, const char *channel);
+/// Give a link back. A broken link gets a new connection, its queued requests fail right away
+void aesd_proxy_release(struct aesd_proxy *proxy, struct aesd_proxy_link *link, bool broken);
+
+#endif /* AESD_PROXY_H */
@@ -0,0 +1,588 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-repl.c: Leader/follower replication of the committed entries between aesdsocket instances
+ * ========================================== */
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-crc32.h"
+#include "aesd-repl.h"
+
+#define REPL_MAGIC 0x4C505241u // "ARPL"
+#define REPL_HELLO 1           // seq: first entry sent, ns: leader epoch. Also sent again on a gap
+#define REPL_ENTRY 2           // seq: entry number, ns: commit time
+#define REPL_HEARTBEAT 3       // seq: last entry committed by the leader, ns: leader time
+// Bigger entries are a corrupted stream
+#define REPL_MAX_ENTRY (64 * 1024 * 1024)
+// A follower not sending its request in time is dropped
+#define REPL_HANDSHAKE_MS 2000
+
+struct aesd_repl_record
+{
+    uint32_t magic;
+    uint32_t type;
+    uint64_t seq;
+    uint64_t ns;
+    uint32_t len;
+    uint32_t crc;
+};
+
+/// Sender thread argument
+struct repl_sender
+{
+    struct aesd_repl_leader *leader;
+    int fd;
+    unsigned slot;
+};
+
+static uint64_t realtime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t record_crc(struct aesd_repl_record hdr, const char *payload)
+{
+    hdr.crc = 0;
+    uint32_t crc = aesd_crc32_update(0, &hdr, sizeof(hdr));
+    return aesd_crc32_update(crc, payload, hdr.len);
+}
+
+static int send_record(int fd, uint32_t type, uint64_t seq, uint64_t ns, const char *payload, size_t len)
+{
+    struct aesd_repl_record hdr = {.magic = REPL_MAGIC, .type = type, .seq = seq, .ns = ns, .len = len};
+    hdr.crc = record_crc(hdr, payload);
+    struct iovec iov[2] = {{&hdr, sizeof(hdr)}, {(void *)payload, len}};
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+    size_t left = sizeof(hdr) + len;
+    while (left > 0)
+    {
+        ssize_t rc = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        left -= rc;
+        // Skip what was sent
+        while (rc > 0 && msg.msg_iovlen > 0)
+        {
+            size_t step = (size_t)rc < msg.msg_iov->iov_len ? (size_t)rc : msg.msg_iov->iov_len;
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + step;
+            msg.msg_iov->iov_len -= step;
+            rc -= step;
+            if (msg.msg_iov->iov_len == 0)
+            {
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            }
+        }
+    }
+    return 0;
+}
+
+static int recv_all(int fd, void *buf, size_t len)
+{
+    size_t received = 0;
+    while (received < len)
+    {
+        ssize_t rc = recv(fd, (char *)buf + received, len - received, 0);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+        received += rc;
+    }
+    return 0;
+}
+
+/// Read the follower request line. Returns 0 and its epoch and next sequence number, -1 if invalid
+static int read_request(int fd, uint64_t *epoch, uint64_t *next)
+{
+    char line[128];
+    size_t len = 0;
+    while (len + 1 < sizeof(line))
+    {
+        if (recv_all(fd, line + len, 1) != 0)
+            return -1;
+        if (line[len++] == '\n')
+            break;
+    }
+    line[len] = '\0';
+    unsigned long long e, n;
+    if (strncmp(line, AESD_REPL_FOLLOW_COM, strlen(AESD_REPL_FOLLOW_COM)) != 0 ||
+        sscanf(line + strlen(AESD_REPL_FOLLOW_COM), "%llu,%llu", &e, &n) != 2)
+        return -1;
+    *epoch = e;
+    *next = n;
+    return 0;
+}
+
+static void *sender_func(void *arg)
+{
+    struct repl_sender *sender = arg;
+    struct aesd_repl_leader *leader = sender->leader;
+    int fd = sender->fd;
+    char *buf = NULL;
+    size_t buf_cap = 0;
+
+    struct timeval timeout = {REPL_HANDSHAKE_MS / 1000, (REPL_HANDSHAKE_MS % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    uint64_t epoch, pos;
+    if (read_request(fd, &epoch, &pos) != 0)
+    {
+        syslog(LOG_ERR, "Invalid replication request, follower dropped\n");
+        goto out;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    pthread_mutex_lock(&leader->lock);
+    // Resume only within the same leader life, and if nothing was evicted meanwhile
+    bool resumed = epoch == leader->epoch && pos >= leader->first_seq && pos <= leader->next_seq;
+    if (!resumed)
+    {
+        pos = leader->first_seq;
+        // Epoch 0 is a follower connecting for the first time
+        if (epoch != 0)
+            leader->full_syncs++;
+    }
+    pthread_mutex_unlock(&leader->lock);
+    syslog(LOG_INFO, "Follower %s at entry %llu\n", resumed ? "resumes" : "receives the backlog", (unsigned long long)pos);
+    if (send_record(fd, REPL_HELLO, pos, leader->epoch, NULL, 0) != 0)
+        goto out;
+
+    pthread_mutex_lock(&leader->lock);
+    while (leader->running)
+    {
+        if (pos == leader->next_seq)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += AESD_REPL_HEARTBEAT_MS / 1000;
+            deadline.tv_nsec += (AESD_REPL_HEARTBEAT_MS % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            int rc = pthread_cond_timedwait(&leader->cond, &leader->lock, &deadline);
+            if (rc == ETIMEDOUT && pos == leader->next_seq && leader->running)
+            {
+                uint64_t last = leader->next_seq - 1;
+                pthread_mutex_unlock(&leader->lock);
+                rc = send_record(fd, REPL_HEARTBEAT, last, realtime_ns(), NULL, 0);
+                pthread_mutex_lock(&leader->lock);
+                if (rc != 0)
+                    break;
+            }
+            continue;
+        }
+        // Too slow, the backlog moved on: say so with a new hello from the oldest entry kept, so the
+        // follower does not apply the entries across the gap as if nothing was missing
+        if (pos < leader->first_seq)
+        {
+            uint64_t missed = leader->first_seq - pos;
+            pos = leader->first_seq;
+            leader->gaps++;
+            pthread_mutex_unlock(&leader->lock);
+            syslog(LOG_ERR, "Follower fell behind, %llu entries missed, resynchronized from entry %llu\n",
+                   (unsigned long long)missed, (unsigned long long)pos);
+            int rc = send_record(fd, REPL_HELLO, pos, leader->epoch, NULL, 0);
+            pthread_mutex_lock(&leader->lock);
+            if (rc != 0)
+                break;
+            continue;
+        }
+        // Copied, so publishing does not wait for the network
+        struct aesd_repl_entry *entry = &leader->backlog[pos % AESD_REPL_BACKLOG];
+        if (entry->len > buf_cap)
+        {
+            char *tmp = realloc(buf, entry->len);
+            if (tmp == NULL)
+                break;
+            buf = tmp;
+            buf_cap = entry->len;
+        }
+        memcpy(buf, entry->data, entry->len);
+        size_t len = entry->len;
+        uint64_t commit_ns = entry->commit_ns;
+        pthread_mutex_unlock(&leader->lock);
+        int rc = send_record(fd, REPL_ENTRY, pos, commit_ns, buf, len);
+        pthread_mutex_lock(&leader->lock);
+        if (rc != 0)
+            break;
+        pos++;
+    }
+    pthread_mutex_unlock(&leader->lock);
+
+out:
+    syslog(LOG_INFO, "Follower disconnected\n");
+    free(buf);
+    pthread_mutex_lock(&leader->lock);
+    leader->follower_fds[sender->slot] = -1;
+    leader->followers--;
+    pthread_cond_broadcast(&leader->cond);
+    pthread_mutex_unlock(&leader->lock);
+    close(fd);
+    free(sender);
+    return NULL;
+}
+
+static void *acceptor_func(void *arg)
+{
+    struct aesd_repl_leader *leader = arg;
+    for (;;)
+    {
+        int fd = accept(leader->listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            // Listening socket shut down
+            break;
+        }
+        pthread_mutex_lock(&leader->lock);
+        unsigned slot = 0;
+        while (slot < AESD_REPL_MAX_FOLLOWERS && leader->follower_fds[slot] >= 0)
+            slot++;
+        struct repl_sender *sender = NULL;
+        if (leader->running && slot < AESD_REPL_MAX_FOLLOWERS && (sender = malloc(sizeof(*sender))) != NULL)
+        {
+            *sender = (struct repl_sender){leader, fd, slot};
+            pthread_t thread;
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            if (pthread_create(&thread, &attr, sender_func, sender) == 0)
+            {
+                leader->follower_fds[slot] = fd;
+                leader->followers++;
+                fd = -1;
+            }
+            else
+            {
+                free(sender);
+            }
+            pthread_attr_destroy(&attr);
+        }
+        pthread_mutex_unlock(&leader->lock);
+        if (fd >= 0)
+        {
+            syslog(LOG_ERR, "Follower refused, %d followers at most\n", AESD_REPL_MAX_FOLLOWERS);
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+int aesd_repl_leader_start(struct aesd_repl_leader *leader, const char *port)
+{
+    memset(leader, 0, sizeof(*leader));
+    struct addrinfo hints = {0};
+    struct addrinfo *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(NULL, port, &hints, &res) != 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    leader->listen_fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+    int reuse = 1;
+    if (leader->listen_fd < 0 ||
+        setsockopt(leader->listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+        bind(leader->listen_fd, res->ai_addr, res->ai_addrlen) != 0 || listen(leader->listen_fd, AESD_REPL_MAX_FOLLOWERS) != 0)
+    {
+        int error = errno;
+        if (leader->listen_fd >= 0)
+            close(leader->listen_fd);
+        freeaddrinfo(res);
+        errno = error;
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    leader->epoch = realtime_ns();
+    leader->first_seq = 1;
+    leader->next_seq = 1;
+    for (unsigned i = 0; i < AESD_REPL_MAX_FOLLOWERS; i++)
+        leader->follower_fds[i] = -1;
+    leader->running = true;
+    pthread_mutex_init(&leader->lock, NULL);
+    pthread_cond_init(&leader->cond, NULL);
+    int rc = pthread_create(&leader->acceptor, NULL, acceptor_func, leader);
+    if (rc != 0)
+    {
+        close(leader->listen_fd);
+        errno = rc;
+        return -1;
+    }
+    syslog(LOG_INFO, "Replication leader listening for followers on port %s\n", port);
+    return 0;
+}
+
+void aesd_repl_publish(struct aesd_repl_leader *leader, const char *buf, size_t len)
+{
+    char *data = malloc(len);
+    pthread_mutex_lock(&leader->lock);
+    struct aesd_repl_entry *entry = &leader->backlog[leader->next_seq % AESD_REPL_BACKLOG];
+    if (leader->next_seq - leader->first_seq == AESD_REPL_BACKLOG)
+    {
+        // The slot holds the oldest entry
+        free(entry->data);
+        leader->first_seq++;
+    }
+    if (data == NULL)
+    {
+        // Keep the numbering, the followers skip an empty entry
+        syslog(LOG_ERR, "No memory to replicate entry %llu\n", (unsigned long long)leader->next_seq);
+        len = 0;
+    }
+    else
+    {
+        memcpy(data, buf, len);
+    }
+    *entry = (struct aesd_repl_entry){leader->next_seq++, realtime_ns(), len, data};
+    pthread_cond_broadcast(&leader->cond);
+    pthread_mutex_unlock(&leader->lock);
+}
+
+int aesd_repl_leader_status(struct aesd_repl_leader *leader, char *buf, size_t cap)
+{
+    pthread_mutex_lock(&leader->lock);
+    int len = snprintf(buf, cap, "role=leader seq=%llu backlog=%llu followers=%u full_syncs=%llu gaps=%llu",
+                       (unsigned long long)(leader->next_seq - 1),
+                       (unsigned long long)(leader->next_seq - leader->first_seq), leader->followers,
+                       (unsigned long long)leader->full_syncs, (unsigned long long)leader->gaps);
+    pthread_mutex_unlock(&leader->lock);
+    return len;
+}
+
+void aesd_repl_leader_stop(struct aesd_repl_leader *leader)
+{
+    pthread_mutex_lock(&leader->lock);
+    leader->running = false;
+    // Wakes the acceptor and the senders blocked in send()
+    shutdown(leader->listen_fd, SHUT_RDWR);
+    for (unsigned i = 0; i < AESD_REPL_MAX_FOLLOWERS; i++)
+    {
+        if (leader->follower_fds[i] >= 0)
+            shutdown(leader->follower_fds[i], SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&leader->cond);
+    while (leader->followers > 0)
+        pthread_cond_wait(&leader->cond, &leader->lock);
+    pthread_mutex_unlock(&leader->lock);
+    pthread_join(leader->acceptor, NULL);
+    close(leader->listen_fd);
+
+    syslog(LOG_INFO, "Replication leader: %llu entries published, %llu full syncs, %llu gaps\n",
+           (unsigned long long)(leader->next_seq - 1), (unsigned long long)leader->full_syncs,
+           (unsigned long long)leader->gaps);
+    for (uint64_t seq = leader->first_seq; seq < leader->next_seq; seq++)
+        free(leader->backlog[seq % AESD_REPL_BACKLOG].data);
+    leader->first_seq = leader->next_seq;
+}
+
+static int follower_connect(struct aesd_repl_follower *follower)
+{
+    struct addrinfo hints = {0};
+    struct addrinfo *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(follower->host, follower->port, &hints, &res) != 0)
+        return -1;
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL && fd < 0; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/// Receive records until the connection fails
+static void follower_session(struct aesd_repl_follower *follower, int fd)
+{
+    char request[128];
+    int request_len = snprintf(request, sizeof(request), "%s%llu,%llu\n", AESD_REPL_FOLLOW_COM,
+                               (unsigned long long)follower->epoch,
+                               (unsigned long long)atomic_load(&follower->applied) + 1);
+    if (send(fd, request, request_len, MSG_NOSIGNAL) != request_len)
+        return;
+
+    char *buf = NULL;
+    size_t buf_cap = 0;
+    struct aesd_repl_record hdr;
+    while (follower->running && recv_all(fd, &hdr, sizeof(hdr)) == 0)
+    {
+        if (hdr.magic != REPL_MAGIC || hdr.len > REPL_MAX_ENTRY)
+        {
+            syslog(LOG_ERR, "Invalid replication record, reconnecting\n");
+            break;
+        }
+        if (hdr.len > buf_cap)
+        {
+            char *tmp = realloc(buf, hdr.len);
+            if (tmp == NULL)
+                break;
+            buf = tmp;
+            buf_cap = hdr.len;
+        }
+        if (recv_all(fd, buf, hdr.len) != 0)
+            break;
+        if (record_crc(hdr, buf) != hdr.crc)
+        {
+            syslog(LOG_ERR, "Replication record %llu corrupted, reconnecting\n", (unsigned long long)hdr.seq);
+            break;
+        }
+
+        uint64_t applied = atomic_load(&follower->applied);
+        if (hdr.type == REPL_HELLO)
+        {
+            if (hdr.ns != follower->epoch || hdr.seq != applied + 1)
+            {
+                // New leader life, or entries evicted from the backlog: the history restarts from
+                // what the leader still has, appended after ours
+                if (follower->epoch != 0)
+                {
+                    syslog(LOG_ERR, "Replication resynchronized from entry %llu\n", (unsigned long long)hdr.seq);
+                    atomic_fetch_add(&follower->full_syncs, 1);
+                }
+                if (hdr.ns == follower->epoch && hdr.seq > applied + 1)
+                {
+                    atomic_fetch_add(&follower->missed, hdr.seq - applied - 1);
+                }
+                follower->epoch = hdr.ns;
+                atomic_store(&follower->applied, hdr.seq - 1);
+            }
+            atomic_store(&follower->connected, true);
+            syslog(LOG_INFO, "Following %s:%s from entry %llu\n", follower->host, follower->port, (unsigned long long)hdr.seq);
+        }
+        else if (hdr.type == REPL_ENTRY)
+        {
+            if (hdr.seq <= applied)
+                continue;
+            if (hdr.seq > applied + 1)
+            {
+                // Not announced by a hello, still counted
+                syslog(LOG_ERR, "Replication gap before entry %llu\n", (unsigned long long)hdr.seq);
+                atomic_fetch_add(&follower->missed, hdr.seq - applied - 1);
+            }
+            if (hdr.len > 0)
+                follower->apply(buf, hdr.len, follower->ctx);
+            atomic_store(&follower->applied, hdr.seq);
+            if (hdr.seq > atomic_load(&follower->leader_seq))
+                atomic_store(&follower->leader_seq, hdr.seq);
+            uint64_t now = realtime_ns();
+            atomic_store(&follower->delay_ns, now > hdr.ns ? now - hdr.ns : 0);
+        }
+        else if (hdr.type == REPL_HEARTBEAT)
+        {
+            atomic_store(&follower->leader_seq, hdr.seq);
+        }
+    }
+    free(buf);
+}
+
+static void *follower_func(void *arg)
+{
+    struct aesd_repl_follower *follower = arg;
+    while (follower->running)
+    {
+        int fd = follower_connect(follower);
+        if (fd >= 0)
+        {
+            pthread_mutex_lock(&follower->lock);
+            follower->fd = fd;
+            pthread_mutex_unlock(&follower->lock);
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            follower_session(follower, fd);
+            pthread_mutex_lock(&follower->lock);
+            follower->fd = -1;
+            pthread_mutex_unlock(&follower->lock);
+            close(fd);
+            if (atomic_exchange(&follower->connected, false))
+                syslog(LOG_INFO, "Lost the leader %s:%s\n", follower->host, follower->port);
+        }
+        if (!follower->running)
+            break;
+        atomic_fetch_add(&follower->reconnects, 1);
+        usleep(AESD_REPL_RETRY_MS * 1000);
+    }
+    return NULL;
+}
+
+int aesd_repl_follower_start(struct aesd_repl_follower *follower, const char *address, aesd_repl_apply apply, void *ctx)
+{
+    memset(follower, 0, sizeof(*follower));
+    const char *colon = strrchr(address, ':');
+    if (colon == NULL || colon == address || (size_t)(colon - address) >= sizeof(follower->host) ||
+        strlen(colon + 1) == 0 || strlen(colon + 1) >= sizeof(follower->port))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    snprintf(follower->host, sizeof(follower->host), "%.*s", (int)(colon - address), address);
+    snprintf(follower->port, sizeof(follower->port), "%s", colon + 1);
+    follower->apply = apply;
+    follower->ctx = ctx;
+    follower->fd = -1;
+    follower->running = true;
+    pthread_mutex_init(&follower->lock, NULL);
+    int rc = pthread_create(&follower->thread, NULL, follower_func, follower);
+    if (rc != 0)
+    {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+}
+
+int aesd_repl_follower_status(struct aesd_repl_follower *follower, char *buf, size_t cap)
+{
+    uint64_t applied = atomic_load(&follower->applied);
+    uint64_t leader_seq = atomic_load(&follower->leader_seq);
+    return snprintf(buf, cap,
+                    "role=follower leader=%s:%s connected=%d applied=%llu leader_seq=%llu lag_entries=%llu "
+                    "delay_us=%llu reconnects=%llu full_syncs=%llu missed=%llu",
+                    follower->host, follower->port, atomic_load(&follower->connected), (unsigned long long)applied,
+                    (unsigned long long)leader_seq, (unsigned long long)(leader_seq > applied ? leader_seq - applied : 0),
+                    (unsigned long long)(atomic_load(&follower->delay_ns) / 1000),
+                    (unsigned long long)atomic_load(&follower->reconnects),
+                    (unsigned long long)atomic_load(&follower->full_syncs),
+                    (unsigned long long)atomic_load(&follower->missed));
+}
+
+void aesd_repl_follower_stop(struct aesd_repl_follower *follower)
+{
+    follower->running = false;
+    pthread_mutex_lock(&follower->lock);
+    if (follower->fd >= 0)
+        shutdown(follower->fd, SHUT_RDWR);
+    pthread_mutex_unlock(&follower->lock);
+    pthread_join(follower->thread, NULL);
+    char status[512];
+    aesd_repl_follower_status(follower, status, sizeof(status));
+    syslog(LOG_INFO, "Replication %s\n", status);
+}
@@ -0,0 +1,98 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-repl.h: Leader/follower replication of the committed entries between aesdsocket instances
+ * ========================================== */
+
+// A leader numbers its committed entries from 1, keeps the last AESD_REPL_BACKLOG of them and
+// streams them to its followers over TCP. A follower connects and sends
+//   AESDSOCKET_FOLLOW:<epoch>,<next sequence number>\n
+// the leader answers with a hello record (its epoch and the first sequence number it sends), then
+// one entry record per committed entry, and a heartbeat record with its last sequence number when
+// there is nothing to send. A follower reconnecting to the same leader life (epoch) resumes where it
+// stopped while its next entry is still in the backlog, otherwise it receives the whole backlog again.
+// A connected follower falling behind the backlog gets a new hello record from the oldest entry kept:
+// both sides count the gap (gaps on the leader, missed entries on the follower) in their status.
+// Records are a header (struct aesd_repl_record in aesd-repl.c) and the entry, in host byte order,
+// the CRC covering both like the log records do.
+
+#ifndef AESD_REPL_H
+#define AESD_REPL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Entries kept by the leader for the followers which reconnect or fall behind
+#define AESD_REPL_BACKLOG 1024
+#define AESD_REPL_MAX_FOLLOWERS 16
+// Heartbeat period of an idle leader, and reconnection period of a follower
+#define AESD_REPL_HEARTBEAT_MS 1000
+#define AESD_REPL_RETRY_MS 500
+#define AESD_REPL_FOLLOW_COM "AESDSOCKET_FOLLOW:"
+
+struct aesd_repl_entry
+{
+    uint64_t seq;
+    uint64_t commit_ns;     // CLOCK_REALTIME, followers compute their delay from it
+    size_t len;
+    char *data;
+};
+
+struct aesd_repl_leader
+{
+    int listen_fd;
+    uint64_t epoch;         // start time, tells the followers the numbering started over
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    // new entry, follower finished, or stopping
+    struct aesd_repl_entry backlog[AESD_REPL_BACKLOG];
+    uint64_t first_seq;     // oldest entry in the backlog
+    uint64_t next_seq;      // sequence number of the next entry
+    int follower_fds[AESD_REPL_MAX_FOLLOWERS]; // -1 if free
+    unsigned followers;     // sender threads running
+    uint64_t full_syncs;    // followers which could not resume and received the whole backlog
+    uint64_t gaps;          // followers which fell behind the backlog while connected, resynchronized
+    bool running;
+    pthread_t acceptor;
+};
+
+/// Apply a replicated entry to the local history
+typedef void (*aesd_repl_apply)(const char *buf, size_t len, void *ctx);
+
+struct aesd_repl_follower
+{
+    char host[256];
+    char port[16];
+    aesd_repl_apply apply;
+    void *ctx;
+    pthread_mutex_t lock;   // fd, so stopping can interrupt a blocked receive
+    int fd;                 // -1 while disconnected
+    volatile bool running;
+    pthread_t thread;
+    uint64_t epoch;         // leader life the applied entries come from, 0 before the first hello
+    atomic_bool connected;
+    _Atomic uint64_t applied;       // last entry applied
+    _Atomic uint64_t leader_seq;    // last entry committed by the leader, as far as we know
+    _Atomic uint64_t delay_ns;      // commit on the leader to apply here, for the last entry
+    _Atomic uint64_t reconnects;
+    _Atomic uint64_t full_syncs;
+    _Atomic uint64_t missed;        // entries the leader evicted before sending them here
+};
+
+/// Listen for followers on port and start accepting them. Returns 0, -1 with errno set
+int aesd_repl_leader_start(struct aesd_repl_leader *leader, const char *port);
+/// Number and keep a committed entry, wake the followers up. Calls are serialized by the caller
+void aesd_repl_publish(struct aesd_repl_leader *leader, const char *buf, size_t len);
+/// One line describing the leader state, without new line. Returns its length
+int aesd_repl_leader_status(struct aesd_repl_leader *leader, char *buf, size_t cap);
+/// Disconnect the followers, stop accepting and free the backlog
+void aesd_repl_leader_stop(struct aesd_repl_leader *leader);
+
+/// Follow the leader at address "host:port", apply() being called for every entry, from the follower
+/// thread. Returns 0, -1 with errno set if the address is invalid or the thread could not start
+int aesd_repl_follower_start(struct aesd_repl_follower *follower, const char *address, aesd_repl_apply apply, void *ctx);
+/// One line describing the follower state and its lag, without new line. Returns its length
+int aesd_repl_follower_status(struct aesd_repl_follower *follower, char *buf, size_t cap);
+void aesd_repl_follower_stop(struct aesd_repl_follower *follower);
+
+#endif /* AESD_REPL_H */
@@ -0,0 +1,295 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-replay.c: Drive a server with the traffic recorded by aesdsocket -c
+ * Usage: aesd-replay [-s speed] capture_file [host] [port]
+ * ========================================== */
+
+// Every captured connection is replayed on its own connection, each captured packet is sent
+// with one send() at its captured time divided by the speed factor (-s 0: as fast as possible).
+// Replies are read and discarded as they come, so the server never blocks on a full socket.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-capture.h"
+
+// Stop waiting for the last replies after this much silence
+#define DRAIN_TIMEOUT_MS 2000
+
+struct replay_conn
+{
+    int fd;         // -1 if not open
+    bool closing;   // capture closed it, waiting for the server to close too
+};
+
+struct replay
+{
+    struct addrinfo *addr;
+    struct replay_conn *conns;  // indexed by captured connection id
+    size_t conn_cap;
+    struct pollfd *pfd;
+    size_t open_count;
+    uint64_t connections;
+    uint64_t records;
+    uint64_t packets;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t lag_ns_total;
+    uint64_t lag_ns_max;
+    uint64_t errors;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct replay_conn *get_conn(struct replay *r, uint32_t conn_id)
+{
+    if (conn_id >= r->conn_cap)
+    {
+        size_t new_cap = r->conn_cap ? r->conn_cap : 64;
+        while (new_cap <= conn_id)
+            new_cap *= 2;
+        struct replay_conn *conns = realloc(r->conns, new_cap * sizeof(*conns));
+        struct pollfd *pfd = realloc(r->pfd, new_cap * sizeof(*pfd));
+        if (conns == NULL || pfd == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = r->conn_cap; i < new_cap; i++)
+            conns[i] = (struct replay_conn){.fd = -1};
+        r->conns = conns;
+        r->pfd = pfd;
+        r->conn_cap = new_cap;
+    }
+    return &r->conns[conn_id];
+}
+
+static void close_conn(struct replay *r, struct replay_conn *conn)
+{
+    close(conn->fd);
+    conn->fd = -1;
+    conn->closing = false;
+    r->open_count--;
+}
+
+/// Read whatever the open connections received, waiting up to timeout_ms.
+/// Returns the number of bytes read
+static size_t drain(struct replay *r, int timeout_ms)
+{
+    static char buf[65536];
+    nfds_t nfds = 0;
+    for (size_t i = 0; i < r->conn_cap; i++)
+    {
+        r->pfd[i].fd = r->conns[i].fd;
+        r->pfd[i].events = POLLIN;
+        r->pfd[i].revents = 0;
+        if (r->conns[i].fd >= 0)
+            nfds = i + 1;
+    }
+    if (nfds == 0)
+    {
+        if (timeout_ms > 0)
+            usleep(timeout_ms * 1000);
+        return 0;
+    }
+    if (poll(r->pfd, nfds, timeout_ms) <= 0)
+        return 0;
+
+    size_t total = 0;
+    for (size_t i = 0; i < nfds; i++)
+    {
+        if (r->pfd[i].revents == 0)
+            continue;
+        ssize_t received;
+        while ((received = recv(r->conns[i].fd, buf, sizeof(buf), 0)) > 0)
+            total += received;
+        if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            close_conn(r, &r->conns[i]);
+    }
+    r->bytes_received += total;
+    return total;
+}
+
+static void open_conn(struct replay *r, uint32_t conn_id)
+{
+    struct replay_conn *conn = get_conn(r, conn_id);
+    if (conn->fd >= 0)
+        close_conn(r, conn);
+    int fd = socket(r->addr->ai_family, r->addr->ai_socktype, r->addr->ai_protocol);
+    if (fd < 0 || connect(fd, r->addr->ai_addr, r->addr->ai_addrlen) != 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        r->errors++;
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    conn->fd = fd;
+    r->open_count++;
+    r->connections++;
+}
+
+static void send_packet(struct replay *r, uint32_t conn_id, const char *buf, size_t len)
+{
+    struct replay_conn *conn = get_conn(r, conn_id);
+    while (len > 0 && conn->fd >= 0)
+    {
+        ssize_t sent = send(conn->fd, buf, len, MSG_NOSIGNAL);
+        if (sent > 0)
+        {
+            buf += sent;
+            len -= sent;
+            r->bytes_sent += sent;
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            // The server is not reading, read its replies so it can make progress
+            drain(r, 1);
+            continue;
+        }
+        close_conn(r, conn);
+        r->errors++;
+        return;
+    }
+    r->packets++;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-s speed] capture_file [host] [port]\n", name);
+    fprintf(stderr, "  -s  replay speed factor, 1 by default, 0 sends as fast as possible\n");
+}
+
+int main(int argc, char **argv)
+{
+    double speed = 1.0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1)
+    {
+        if (opt != 's')
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        speed = strtod(optarg, NULL);
+    }
+    if (optind >= argc || speed < 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *path = argv[optind];
+    const char *host = optind + 1 < argc ? argv[optind + 1] : "localhost";
+    const char *port = optind + 2 < argc ? argv[optind + 2] : "9000";
+
+    struct aesd_capture_reader reader;
+    if (aesd_capture_reader_open(&reader, path) != 0)
+    {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    struct replay r = {0};
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(host, port, &hints, &r.addr);
+    if (rc != 0)
+    {
+        fprintf(stderr, "%s:%s: %s\n", host, port, gai_strerror(rc));
+        return EXIT_FAILURE;
+    }
+
+    static char buf[AESD_CAPTURE_MAX_DATA];
+    struct aesd_capture_record record;
+    uint64_t start = now_ns();
+    uint64_t captured_ns = 0;
+    while ((rc = aesd_capture_next(&reader, &record, buf)) == 1)
+    {
+        captured_ns = record.time_ns;
+        r.records++;
+        if (speed > 0)
+        {
+            // Keep reading replies while waiting for the time of the next packet
+            uint64_t due = start + (uint64_t)(record.time_ns / speed);
+            uint64_t now;
+            while ((now = now_ns()) < due)
+                drain(&r, (due - now) / 1000000);  // busy polls the last millisecond
+            uint64_t lag = now - due;
+            r.lag_ns_total += lag;
+            if (lag > r.lag_ns_max)
+                r.lag_ns_max = lag;
+        }
+        else
+        {
+            drain(&r, 0);
+        }
+
+        switch (record.type)
+        {
+        case AESD_CAPTURE_OPEN:
+            open_conn(&r, record.conn_id);
+            break;
+        case AESD_CAPTURE_DATA:
+            send_packet(&r, record.conn_id, buf, record.len);
+            break;
+        case AESD_CAPTURE_CLOSE:
+        {
+            // Half close like the original client, the server answers what is pending and closes
+            struct replay_conn *conn = get_conn(&r, record.conn_id);
+            if (conn->fd >= 0 && !conn->closing)
+            {
+                shutdown(conn->fd, SHUT_WR);
+                conn->closing = true;
+            }
+            break;
+        }
+        }
+    }
+    if (rc < 0)
+        fprintf(stderr, "%s: truncated capture, replayed up to the last complete record\n", path);
+    uint64_t sent_ns = now_ns() - start;
+
+    // Wait for the last replies, then close what is left
+    uint64_t last_reply = now_ns();
+    while (r.open_count > 0 && now_ns() - last_reply < DRAIN_TIMEOUT_MS * 1000000ull)
+    {
+        if (drain(&r, 100) > 0)
+            last_reply = now_ns();
+    }
+    for (size_t i = 0; i < r.conn_cap; i++)
+    {
+        if (r.conns[i].fd >= 0)
+            close_conn(&r, &r.conns[i]);
+    }
+
+    double elapsed_s = sent_ns / 1e9;
+    printf("connections %llu, packets %llu, sent %llu bytes, received %llu bytes, errors %llu\n",
+           (unsigned long long)r.connections, (unsigned long long)r.packets, (unsigned long long)r.bytes_sent,
+           (unsigned long long)r.bytes_received, (unsigned long long)r.errors);
+    printf("captured over %.3f s, replayed in %.3f s (%.1fx), %.0f packets/s\n", captured_ns / 1e9, elapsed_s,
+           elapsed_s > 0 ? captured_ns / 1e9 / elapsed_s : 0, elapsed_s > 0 ? r.packets / elapsed_s : 0);
+    if (speed > 0)
+        printf("send lag avg %.1f us, max %.1f us\n", r.records ? r.lag_ns_total / 1e3 / r.records : 0,
+               r.lag_ns_max / 1e3);
+
+    freeaddrinfo(r.addr);
+    free(r.conns);
+    free(r.pfd);
+    aesd_capture_reader_close(&reader);
+    return rc < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
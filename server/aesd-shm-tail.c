@@ -0,0 +1,70 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-shm-tail.c: Print the history published by aesdsocket -m, without any connection
+ * Usage: aesd-shm-tail [-f] [shm_name]
+ * ========================================== */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aesd-shm.h"
+
+#define ENTRY_SIZE (1024 * 1024)
+#define POLL_DELAY 1000 // 1ms
+
+static volatile int keepRunning = 1;
+static void intHandler(int dummy)
+{
+    keepRunning = 0;
+}
+
+int main(int argc, char **argv)
+{
+    int follow = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "f")) != -1)
+    {
+        if (opt != 'f')
+        {
+            fprintf(stderr, "Usage: %s [-f] [shm_name]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        follow = 1;
+    }
+    const char *name = optind < argc ? argv[optind] : AESD_SHM_NAME;
+
+    struct aesd_shm shm;
+    if (aesd_shm_open(&shm, name) != 0)
+    {
+        fprintf(stderr, "Could not open shared memory %s: %s\n", name, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    signal(SIGINT, intHandler);
+
+    char *entry = malloc(ENTRY_SIZE);
+    struct aesd_shm_cursor cursor;
+    aesd_shm_cursor_oldest(&shm, &cursor);
+    while (keepRunning && entry != NULL)
+    {
+        ssize_t size = aesd_shm_next(&shm, &cursor, entry, ENTRY_SIZE);
+        if (size >= 0)
+        {
+            fwrite(entry, 1, size, stdout);
+            continue;
+        }
+        if (errno != EAGAIN || !follow)
+            break;
+        fflush(stdout);
+        usleep(POLL_DELAY);
+    }
+    fflush(stdout);
+    if (cursor.lost)
+        fprintf(stderr, "%llu entries overwritten before they could be read\n", (unsigned long long)cursor.lost);
+
+    free(entry);
+    aesd_shm_close(&shm);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,218 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-shm.c: Shared memory ring publishing the committed entries to local readers
+ * ========================================== */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aesd-shm.h"
+
+#define AESD_SHM_INVALID UINT64_MAX
+
+static size_t header_size(unsigned entry_count)
+{
+    size_t size = sizeof(struct aesd_shm_header) + entry_count * sizeof(struct aesd_shm_entry);
+    // Keep the data ring on its own cache lines
+    return (size + 63) & ~(size_t)63;
+}
+
+int aesd_shm_create(struct aesd_shm *shm, const char *name, unsigned entry_count, size_t data_size)
+{
+    memset(shm, 0, sizeof(*shm));
+    if (entry_count == 0 || data_size == 0)
+        return -1;
+    snprintf(shm->name, sizeof(shm->name), "%s", name);
+
+    // Start from a fresh object, sequence numbers restart with the writer
+    shm_unlink(shm->name);
+    int fd = shm_open(shm->name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+        return -1;
+
+    size_t hsize = header_size(entry_count);
+    shm->map_size = hsize + data_size;
+    if (ftruncate(fd, shm->map_size) != 0)
+    {
+        close(fd);
+        shm_unlink(shm->name);
+        return -1;
+    }
+    void *map = mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        shm_unlink(shm->name);
+        return -1;
+    }
+
+    shm->hdr = map;
+    shm->data = (char *)map + hsize;
+    shm->writer = 1;
+    shm->hdr->entry_count = entry_count;
+    shm->hdr->data_offset = hsize;
+    shm->hdr->data_size = data_size;
+    atomic_init(&shm->hdr->head, 0);
+    atomic_init(&shm->hdr->write_pos, 0);
+    for (unsigned i = 0; i < entry_count; i++)
+        atomic_init(&shm->hdr->entry[i].seq, AESD_SHM_INVALID);
+    shm->hdr->version = AESD_SHM_VERSION;
+    // Readers check the magic last, once everything else is in place
+    atomic_thread_fence(memory_order_release);
+    shm->hdr->magic = AESD_SHM_MAGIC;
+    return 0;
+}
+
+int64_t aesd_shm_publish(struct aesd_shm *shm, const char *buf, size_t len)
+{
+    struct aesd_shm_header *hdr = shm->hdr;
+    if (len > hdr->data_size)
+        return -1;
+
+    uint64_t seq = atomic_load_explicit(&hdr->head, memory_order_relaxed);
+    struct aesd_shm_entry *slot = &hdr->entry[seq % hdr->entry_count];
+
+    // Invalidate the slot, then announce the data range we are about to overwrite,
+    // both before touching the data, so a reader copying older bytes notices it
+    atomic_store_explicit(&slot->seq, AESD_SHM_INVALID, memory_order_relaxed);
+    uint64_t pos = atomic_load_explicit(&hdr->write_pos, memory_order_relaxed);
+    atomic_store_explicit(&hdr->write_pos, pos + len, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    size_t start = pos % hdr->data_size;
+    size_t first = len < hdr->data_size - start ? len : hdr->data_size - start;
+    memcpy(shm->data + start, buf, first);
+    memcpy(shm->data, buf + first, len - first);
+
+    slot->offset = pos;
+    slot->size = len;
+    atomic_store_explicit(&slot->seq, seq, memory_order_release);
+    atomic_store_explicit(&hdr->head, seq + 1, memory_order_release);
+    return seq;
+}
+
+int aesd_shm_open(struct aesd_shm *shm, const char *name)
+{
+    memset(shm, 0, sizeof(*shm));
+    snprintf(shm->name, sizeof(shm->name), "%s", name);
+    int fd = shm_open(shm->name, O_RDONLY, 0);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct aesd_shm_header))
+    {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    struct aesd_shm_header *hdr = map;
+    if (hdr->magic != AESD_SHM_MAGIC || hdr->version != AESD_SHM_VERSION ||
+        hdr->data_offset + hdr->data_size > (uint64_t)st.st_size)
+    {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    shm->hdr = hdr;
+    shm->data = (char *)map + hdr->data_offset;
+    shm->map_size = st.st_size;
+    return 0;
+}
+
+ssize_t aesd_shm_read(const struct aesd_shm *shm, uint64_t seq, char *buf, size_t cap)
+{
+    struct aesd_shm_header *hdr = shm->hdr;
+    uint64_t head = atomic_load_explicit(&hdr->head, memory_order_acquire);
+    if (seq >= head)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    struct aesd_shm_entry *slot = &hdr->entry[seq % hdr->entry_count];
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != seq)
+    {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    uint64_t offset = slot->offset;
+    uint64_t size = slot->size;
+    if (size > cap)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    size_t start = offset % hdr->data_size;
+    size_t first = size < hdr->data_size - start ? size : hdr->data_size - start;
+    memcpy(buf, shm->data + start, first);
+    memcpy(buf + first, shm->data, size - first);
+
+    // The copy is only valid if the writer did not start to reuse the slot or the bytes meanwhile
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq ||
+        atomic_load_explicit(&hdr->write_pos, memory_order_relaxed) - offset > hdr->data_size)
+    {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    return size;
+}
+
+void aesd_shm_cursor_oldest(const struct aesd_shm *shm, struct aesd_shm_cursor *cursor)
+{
+    uint64_t head = atomic_load_explicit(&shm->hdr->head, memory_order_acquire);
+    cursor->next = head > shm->hdr->entry_count ? head - shm->hdr->entry_count : 0;
+    cursor->lost = 0;
+}
+
+void aesd_shm_cursor_latest(const struct aesd_shm *shm, struct aesd_shm_cursor *cursor)
+{
+    cursor->next = atomic_load_explicit(&shm->hdr->head, memory_order_acquire);
+    cursor->lost = 0;
+}
+
+ssize_t aesd_shm_next(const struct aesd_shm *shm, struct aesd_shm_cursor *cursor, char *buf, size_t cap)
+{
+    for (;;)
+    {
+        ssize_t size = aesd_shm_read(shm, cursor->next, buf, cap);
+        if (size >= 0)
+        {
+            cursor->next++;
+            return size;
+        }
+        if (errno != EOVERFLOW)
+            return -1;
+
+        // The writer lapped us, skip to the oldest entry still held by the ring
+        struct aesd_shm_cursor oldest;
+        aesd_shm_cursor_oldest(shm, &oldest);
+        if (oldest.next <= cursor->next)
+            oldest.next = cursor->next + 1;
+        cursor->lost += oldest.next - cursor->next;
+        cursor->next = oldest.next;
+    }
+}
+
+void aesd_shm_close(struct aesd_shm *shm)
+{
+    if (shm->hdr == NULL)
+        return;
+    munmap(shm->hdr, shm->map_size);
+    if (shm->writer)
+        shm_unlink(shm->name);
+    shm->hdr = NULL;
+    shm->data = NULL;
+}
@@ -0,0 +1,91 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-shm.h: Shared memory ring publishing the committed entries to local readers
+ * ========================================== */
+
+// The ring mirrors struct aesd_circular_buffer: a fixed number of entry slots (same depth as the
+// driver), each describing one entry by its position and size, like buffptr/size. Instead of
+// in_offs/out_offs, the header holds the sequence number of the next entry, head:
+//   in_offs  = head % entry_count
+//   out_offs = head < entry_count ? 0 : head % entry_count
+//   full     = head >= entry_count
+// Entry bytes are stored in a separate data ring, addressed by absolute stream offsets.
+// There is a single writer (aesdsocket) and any number of readers, which never take a lock and
+// never make a syscall to read. A reader detects that an entry was overwritten while it was
+// copying it (overrun) by checking the slot sequence number and the writer position afterwards.
+
+#ifndef AESD_SHM_H
+#define AESD_SHM_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define AESD_SHM_NAME "/aesdsocket"
+#define AESD_SHM_DATA_SIZE (1024 * 1024)
+#define AESD_SHM_MAGIC 0x4D485341u // "ASHM"
+#define AESD_SHM_VERSION 1
+
+struct aesd_shm_entry
+{
+    _Atomic uint64_t seq;   // sequence number of the entry held by this slot, UINT64_MAX while rewritten
+    uint64_t offset;        // absolute position of the entry in the data stream
+    uint64_t size;          // number of bytes of the entry
+};
+
+struct aesd_shm_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_count;       // number of entry slots
+    uint32_t data_offset;       // start of the data ring, from the beginning of the mapping
+    uint64_t data_size;         // size of the data ring
+    _Atomic uint64_t head;      // sequence number of the next entry, also the number of published entries
+    _Atomic uint64_t write_pos; // absolute data position reserved by the writer
+    struct aesd_shm_entry entry[];
+};
+
+/// A mapping of the ring, either the writer or a reader side
+struct aesd_shm
+{
+    struct aesd_shm_header *hdr;
+    char *data;
+    size_t map_size;
+    char name[64];
+    int writer;
+};
+
+/// Position of a reader tailing the ring
+struct aesd_shm_cursor
+{
+    uint64_t next;  // sequence number of the next entry to read
+    uint64_t lost;  // entries overwritten before the reader could get them
+};
+
+/// Writer side: create (or reset) the ring. Returns 0 on success, -1 on error
+int aesd_shm_create(struct aesd_shm *shm, const char *name, unsigned entry_count, size_t data_size);
+
+/// Writer side: publish one entry. Returns its sequence number, -1 if it does not fit in the data ring
+int64_t aesd_shm_publish(struct aesd_shm *shm, const char *buf, size_t len);
+
+/// Reader side: map an existing ring read only. Returns 0 on success, -1 on error
+int aesd_shm_open(struct aesd_shm *shm, const char *name);
+
+/// Copy the entry seq into buf. Returns its size, or -1 with errno set to:
+/// EAGAIN if not published yet, EOVERFLOW if already overwritten, EMSGSIZE if buf is too small
+ssize_t aesd_shm_read(const struct aesd_shm *shm, uint64_t seq, char *buf, size_t cap);
+
+/// Start a cursor on the oldest entry still available
+void aesd_shm_cursor_oldest(const struct aesd_shm *shm, struct aesd_shm_cursor *cursor);
+
+/// Start a cursor after the newest entry, to only get the entries published from now on
+void aesd_shm_cursor_latest(const struct aesd_shm *shm, struct aesd_shm_cursor *cursor);
+
+/// Copy the next entry for this cursor. Overwritten entries are skipped and counted in cursor->lost.
+/// Returns the entry size, or -1 with errno EAGAIN if there is nothing new, EMSGSIZE if buf is too small
+ssize_t aesd_shm_next(const struct aesd_shm *shm, struct aesd_shm_cursor *cursor, char *buf, size_t cap);
+
+/// Unmap the ring, the writer also removes its name
+void aesd_shm_close(struct aesd_shm *shm);
+
+#endif /* AESD_SHM_H */
@@ -0,0 +1,154 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-snapshot.c: Snapshot of the history entries, for warm restarts
+ * ========================================== */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-crc32.h"
+#include "aesd-snapshot.h"
+
+static uint32_t snapshot_crc(struct aesd_snapshot_header hdr, const uint32_t *lens, const char *data)
+{
+    hdr.crc = 0;
+    uint32_t crc = aesd_crc32_update(0, &hdr, sizeof(hdr));
+    crc = aesd_crc32_update(crc, lens, hdr.count * sizeof(uint32_t));
+    return aesd_crc32_update(crc, data, hdr.bytes);
+}
+
+int aesd_snapshot_save(const char *path, const char *data, const uint32_t *lens, uint32_t count)
+{
+    struct aesd_snapshot_header hdr = {.magic = AESD_SNAPSHOT_MAGIC, .version = AESD_SNAPSHOT_VERSION,
+                                       .count = count, .created = time(NULL)};
+    for (uint32_t i = 0; i < count; i++)
+        hdr.bytes += lens[i];
+    hdr.crc = snapshot_crc(hdr, lens, data);
+
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+
+    struct iovec iov[3] = {{&hdr, sizeof(hdr)}, {(void *)lens, count * sizeof(uint32_t)}, {(void *)data, hdr.bytes}};
+    size_t total = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+    size_t written = 0;
+    int iov_index = 0;
+    while (written < total)
+    {
+        ssize_t rc = writev(fd, iov + iov_index, 3 - iov_index);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            goto fail;
+        }
+        written += rc;
+        // Skip what was written
+        while (rc > 0)
+        {
+            size_t step = (size_t)rc < iov[iov_index].iov_len ? (size_t)rc : iov[iov_index].iov_len;
+            iov[iov_index].iov_base = (char *)iov[iov_index].iov_base + step;
+            iov[iov_index].iov_len -= step;
+            rc -= step;
+            if (iov[iov_index].iov_len == 0 && iov_index < 2)
+                iov_index++;
+        }
+    }
+    // On disk before it replaces the previous snapshot
+    if (fdatasync(fd) != 0)
+        goto fail;
+    close(fd);
+    if (rename(tmp_path, path) != 0)
+    {
+        int error = errno;
+        unlink(tmp_path);
+        errno = error;
+        return -1;
+    }
+    return 0;
+
+fail:;
+    int error = errno;
+    close(fd);
+    unlink(tmp_path);
+    errno = error;
+    return -1;
+}
+
+int aesd_snapshot_load(const char *path, void (*fn)(const char *buf, size_t len, void *ctx), void *ctx)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    // Read whole, it is checked before any entry is handed out
+    char *file = malloc(st.st_size > 0 ? st.st_size : 1);
+    if (file == NULL)
+    {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t total = 0;
+    while (total < (size_t)st.st_size)
+    {
+        ssize_t rc = read(fd, file + total, st.st_size - total);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            break;
+        total += rc;
+    }
+    close(fd);
+
+    struct aesd_snapshot_header hdr;
+    if (total < sizeof(hdr))
+        goto corrupted;
+    memcpy(&hdr, file, sizeof(hdr));
+    const uint32_t *lens = (const uint32_t *)(file + sizeof(hdr));
+    const char *data = (const char *)(lens + hdr.count);
+    if (hdr.magic != AESD_SNAPSHOT_MAGIC || hdr.version != AESD_SNAPSHOT_VERSION ||
+        (total - sizeof(hdr)) / sizeof(uint32_t) < hdr.count ||
+        total - sizeof(hdr) - hdr.count * sizeof(uint32_t) != hdr.bytes ||
+        snapshot_crc(hdr, lens, data) != hdr.crc)
+        goto corrupted;
+
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < hdr.count; i++)
+        sum += lens[i];
+    if (sum != hdr.bytes)
+        goto corrupted;
+
+    for (uint32_t i = 0; i < hdr.count; i++)
+    {
+        fn(data, lens[i], ctx);
+        data += lens[i];
+    }
+    free(file);
+    return hdr.count;
+
+corrupted:
+    free(file);
+    errno = EBADMSG;
+    return -1;
+}
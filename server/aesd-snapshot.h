@@ -0,0 +1,38 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-snapshot.h: Snapshot of the history entries, for warm restarts
+ * ========================================== */
+
+// A snapshot is one file holding the entries of a history, oldest first, with their sizes:
+//   header (struct aesd_snapshot_header) | entry sizes (count x uint32_t) | entries, back to back
+// in host byte order. The CRC covers the header (crc field set to 0), the sizes and the entries.
+// It is written to a temporary file renamed over the previous snapshot, so a crash while saving
+// leaves the previous one intact. A snapshot is only loaded if it is complete and its CRC matches.
+
+#ifndef AESD_SNAPSHOT_H
+#define AESD_SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define AESD_SNAPSHOT_MAGIC 0x50534E41u // "ANSP"
+#define AESD_SNAPSHOT_VERSION 1
+
+struct aesd_snapshot_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;         // entries
+    uint32_t crc;
+    uint64_t bytes;         // entry bytes
+    uint64_t created;       // CLOCK_REALTIME, seconds
+};
+
+/// Save count entries, lens[i] bytes each, stored back to back in data. Returns 0, -1 with errno set
+int aesd_snapshot_save(const char *path, const char *data, const uint32_t *lens, uint32_t count);
+
+/// Check the snapshot at path, then call fn for each of its entries, oldest first.
+/// Returns the number of entries, -1 with errno set (ENOENT: no snapshot, EBADMSG: corrupted, fn
+/// not called)
+int aesd_snapshot_load(const char *path, void (*fn)(const char *buf, size_t len, void *ctx), void *ctx);
+
+#endif /* AESD_SNAPSHOT_H */
@@ -0,0 +1,593 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-stage.c: Staged mode, every connection served by the same pipeline of pinned threads
+ * ========================================== */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-stage.h"
+
+// A client not reading its replies for that long is disconnected, its replies are parked meanwhile
+#define SEND_TIMEOUT_MS 1000
+
+static const char *stage_names[AESD_STAGE_COUNT] = {"network", "commit", "send"};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void wake(int event_fd)
+{
+    uint64_t one = 1;
+    ssize_t rc = write(event_fd, &one, sizeof(one));
+    (void)rc;
+}
+
+// Rings: head and tail only grow, their difference is the depth. The producer publishes a slot with
+// a release store of tail, the consumer gives it back with a release store of head
+
+static size_t ring_depth(struct aesd_stage_ring *ring)
+{
+    return atomic_load_explicit(&ring->tail, memory_order_acquire) - atomic_load_explicit(&ring->head, memory_order_relaxed);
+}
+
+/// Wake the consumer up if it sleeps. Called by the producer once its batch is pushed
+static void ring_signal(struct aesd_stage_ring *ring)
+{
+    // Pairs with the consumer storing sleeping then reading tail: one of both sees the other
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->sleeping, memory_order_relaxed))
+        wake(ring->event_fd);
+}
+
+static void ring_push(struct aesd_stage_ring *ring, struct aesd_stage_request *request, uint64_t now)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    // Full: the next stage is behind, make sure it runs and wait for it
+    while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == AESD_STAGE_RING)
+    {
+        ring_signal(ring);
+        sched_yield();
+    }
+    request->pushed_ns = now;
+    ring->slots[tail & (AESD_STAGE_RING - 1)] = request;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/// Take up to AESD_STAGE_BATCH descriptors, accounting the depth and the waiting time in stats
+static unsigned ring_take(struct aesd_stage_ring *ring, struct aesd_stage_request **batch, struct aesd_stage_stats *stats, uint64_t now)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t depth = atomic_load_explicit(&ring->tail, memory_order_acquire) - head;
+    unsigned count = depth < AESD_STAGE_BATCH ? depth : AESD_STAGE_BATCH;
+    uint64_t wait_ns = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        batch[i] = ring->slots[(head + i) & (AESD_STAGE_RING - 1)];
+        wait_ns += now - batch[i]->pushed_ns;
+    }
+    atomic_store_explicit(&ring->head, head + count, memory_order_release);
+
+    atomic_fetch_add(&stats->depth_sum, depth);
+    atomic_fetch_add(&stats->wait_ns, wait_ns);
+    // Only this stage updates it
+    if (depth > atomic_load(&stats->depth_max))
+        atomic_store(&stats->depth_max, depth);
+    return count;
+}
+
+/// Wait until the ring holds descriptors. Returns false once the stage feeding it finished and the
+/// ring is drained
+static bool ring_wait(struct aesd_stages *stages, struct aesd_stage_ring *ring, unsigned stage)
+{
+    for (unsigned spin = 0;; spin++)
+    {
+        if (ring_depth(ring) > 0)
+            return true;
+        if (atomic_load(&stages->finished) >= stage)
+            return ring_depth(ring) > 0;
+        if (spin < AESD_STAGE_SPIN)
+            continue;
+        atomic_store(&ring->sleeping, true);
+        if (ring_depth(ring) == 0 && atomic_load(&stages->finished) < stage)
+        {
+            uint64_t count;
+            ssize_t rc = read(ring->event_fd, &count, sizeof(count));
+            (void)rc;
+        }
+        atomic_store(&ring->sleeping, false);
+        spin = 0;
+    }
+}
+
+static void account(struct aesd_stage_stats *stats, unsigned count, uint64_t start_ns)
+{
+    atomic_fetch_add(&stats->requests, count);
+    atomic_fetch_add(&stats->batches, 1);
+    atomic_fetch_add(&stats->busy_ns, now_ns() - start_ns);
+}
+
+static struct aesd_stage_request *new_request(struct aesd_stage_conn *conn, size_t size)
+{
+    struct aesd_stage_request *request = malloc(sizeof(*request) + size + 1);
+    if (request == NULL)
+        return NULL;
+    memset(request, 0, sizeof(*request));
+    request->conn = conn;
+    return request;
+}
+
+// Network stage
+
+/// Put the connections accepted since the last call in the epoll set
+static void register_added(struct aesd_stages *stages)
+{
+    pthread_mutex_lock(&stages->lock);
+    struct aesd_stage_conn *added = stages->added;
+    stages->added = NULL;
+    pthread_mutex_unlock(&stages->lock);
+    while (added != NULL)
+    {
+        struct aesd_stage_conn *conn = added;
+        added = conn->next;
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+        if (epoll_ctl(stages->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) != 0)
+        {
+            syslog(LOG_ERR, "Value of errno attempting to poll connection %d: %d\n", conn->fd, errno);
+            close(conn->fd);
+            free(conn);
+            atomic_fetch_sub(&stages->connections, 1);
+            continue;
+        }
+        conn->prev = NULL;
+        conn->next = stages->open;
+        if (stages->open != NULL)
+            stages->open->prev = conn;
+        stages->open = conn;
+    }
+}
+
+/// The network stage is done with conn: its close follows its last request
+static void close_conn(struct aesd_stages *stages, struct aesd_stage_conn *conn, uint64_t now)
+{
+    epoll_ctl(stages->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        stages->open = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+
+    struct aesd_stage_request *request;
+    // The connection cannot be given up without its descriptor
+    while ((request = new_request(conn, 0)) == NULL)
+        usleep(1000);
+    request->close = true;
+    ring_push(&stages->rings[0], request, now);
+}
+
+static void *network_func(void *arg)
+{
+    struct aesd_stages *stages = arg;
+    struct aesd_stage_ring *out = &stages->rings[0];
+    struct epoll_event events[AESD_STAGE_BATCH];
+    while (stages->running)
+    {
+        int ready = epoll_wait(stages->epoll_fd, events, AESD_STAGE_BATCH, -1);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Value of errno waiting for the connections: %d\n", errno);
+            break;
+        }
+        uint64_t start = now_ns();
+        unsigned pushed = 0;
+        for (int i = 0; i < ready; i++)
+        {
+            struct aesd_stage_conn *conn = events[i].data.ptr;
+            if (conn == NULL)
+            {
+                uint64_t count;
+                ssize_t rc = read(stages->wake_fd, &count, sizeof(count));
+                (void)rc;
+                register_added(stages);
+                continue;
+            }
+            struct aesd_stage_request *request = new_request(conn, AESD_STAGE_PACKET_SIZE);
+            if (request == NULL)
+            {
+                // Still readable, retried on the next wait
+                syslog(LOG_ERR, "No memory left to receive from connection %d\n", conn->fd);
+                continue;
+            }
+            ssize_t len = recv(conn->fd, request->buf, AESD_STAGE_PACKET_SIZE, 0);
+            if (len < 0 && (errno == EAGAIN || errno == EINTR))
+            {
+                free(request);
+                continue;
+            }
+            if (len <= 0)
+            {
+                // Closed by the client, or by the send stage after a failure
+                free(request);
+                close_conn(stages, conn, start);
+                pushed++;
+                continue;
+            }
+            request->buf[len] = '\0';
+            request->len = len;
+            request->reply = memchr(request->buf, '\n', len) != NULL;
+            ring_push(out, request, start);
+            pushed++;
+        }
+        if (pushed > 0)
+        {
+            ring_signal(out);
+            account(&stages->stats[AESD_STAGE_NETWORK], pushed, start);
+        }
+    }
+
+    // Stopping: the connections still open are closed after their last request
+    register_added(stages);
+    while (stages->open != NULL)
+        close_conn(stages, stages->open, now_ns());
+    ring_signal(out);
+    return NULL;
+}
+
+// Commit stage
+
+static void *commit_func(void *arg)
+{
+    struct aesd_stages *stages = arg;
+    struct aesd_stage_ring *in = &stages->rings[0];
+    struct aesd_stage_ring *out = &stages->rings[1];
+    struct aesd_stage_request *batch[AESD_STAGE_BATCH];
+    while (ring_wait(stages, in, AESD_STAGE_COMMIT))
+    {
+        uint64_t start = now_ns();
+        unsigned count = ring_take(in, batch, &stages->stats[AESD_STAGE_COMMIT], start);
+        stages->commit(batch, count, stages->ctx);
+        uint64_t end = now_ns();
+        for (unsigned i = 0; i < count; i++)
+            ring_push(out, batch[i], end);
+        ring_signal(out);
+        account(&stages->stats[AESD_STAGE_COMMIT], count, start);
+    }
+    return NULL;
+}
+
+// Send stage
+
+/// One send() on the non-blocking socket. Returns the bytes sent, 0 if it has no room, -1 on error
+static ssize_t send_some(int fd, const char *buf, size_t len)
+{
+    for (;;)
+    {
+        ssize_t rc = send(fd, buf, len, MSG_NOSIGNAL);
+        if (rc >= 0)
+            return rc;
+        if (errno == EINTR)
+            continue;
+        return errno == EAGAIN ? 0 : -1;
+    }
+}
+
+static void release_request(struct aesd_stage_request *request)
+{
+    if (request->out_free != NULL)
+        request->out_free(request->out_ref);
+    free(request);
+}
+
+static void close_sent(struct aesd_stages *stages, struct aesd_stage_conn *conn)
+{
+    close(conn->fd);
+    free(conn);
+    atomic_fetch_sub(&stages->connections, 1);
+}
+
+/// Stop sending to conn, the network stage sees the end of the connection and closes it
+static void break_conn(struct aesd_stage_conn *conn)
+{
+    syslog(LOG_ERR, "Value of errno attempting to send to connection %d: %d\n", conn->fd, errno);
+    conn->broken = true;
+    shutdown(conn->fd, SHUT_RDWR);
+}
+
+/// Queue request after the ones already parked on its connection, the first one blocks it
+static void park(struct aesd_stages *stages, struct aesd_stage_request *request, uint64_t now)
+{
+    struct aesd_stage_conn *conn = request->conn;
+    request->parked_next = NULL;
+    if (conn->parked != NULL)
+    {
+        conn->parked_tail->parked_next = request;
+        conn->parked_tail = request;
+        return;
+    }
+    conn->parked = conn->parked_tail = request;
+    conn->stalled_ns = now;
+    struct epoll_event event = {.events = EPOLLOUT, .data.ptr = conn};
+    if (epoll_ctl(stages->send_epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) != 0)
+    {
+        // Retried on the next flush anyway, only the wake-up is lost
+        syslog(LOG_ERR, "Value of errno attempting to poll connection %d for sending: %d\n", conn->fd, errno);
+    }
+    conn->blocked_next = stages->blocked;
+    stages->blocked = conn;
+}
+
+/// Send what the socket takes of the requests parked on conn. Returns true once none is left: the
+/// connection is unblocked, or closed and freed if its close descriptor was parked
+static bool flush_parked(struct aesd_stages *stages, struct aesd_stage_conn *conn, uint64_t now)
+{
+    while (conn->parked != NULL)
+    {
+        struct aesd_stage_request *request = conn->parked;
+        if (!request->close && !conn->broken && conn->parked_sent < request->out_len)
+        {
+            ssize_t sent = send_some(conn->fd, request->out + conn->parked_sent, request->out_len - conn->parked_sent);
+            if (sent < 0)
+            {
+                break_conn(conn);
+                continue;
+            }
+            if (sent > 0)
+                conn->stalled_ns = now;
+            conn->parked_sent += sent;
+            if (conn->parked_sent < request->out_len)
+            {
+                if (now - conn->stalled_ns < SEND_TIMEOUT_MS * 1000000ull)
+                    return false;
+                // Not reading its replies, its next ones are dropped
+                errno = ETIMEDOUT;
+                break_conn(conn);
+                continue;
+            }
+        }
+        conn->parked = request->parked_next;
+        conn->parked_sent = 0;
+        if (request->close)
+        {
+            epoll_ctl(stages->send_epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+            close_sent(stages, conn);
+            release_request(request);
+            return true;
+        }
+        release_request(request);
+    }
+    epoll_ctl(stages->send_epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    return true;
+}
+
+/// Retry the blocked connections, they leave the list once their parked requests are gone
+static void flush_blocked(struct aesd_stages *stages, uint64_t now)
+{
+    struct aesd_stage_conn **link = &stages->blocked;
+    while (*link != NULL)
+    {
+        struct aesd_stage_conn *conn = *link;
+        struct aesd_stage_conn *next = conn->blocked_next;
+        if (flush_parked(stages, conn, now))
+            *link = next;
+        else
+            link = &conn->blocked_next;
+    }
+}
+
+/// Send a reply, or close the connection after its last one. Parked instead while the connection is
+/// blocked, or if the socket has no room for all of it
+static void send_request(struct aesd_stages *stages, struct aesd_stage_request *request, uint64_t now)
+{
+    struct aesd_stage_conn *conn = request->conn;
+    if (conn->parked != NULL)
+    {
+        park(stages, request, now);
+        return;
+    }
+    if (request->close)
+    {
+        close_sent(stages, conn);
+    }
+    else if (request->out_len > 0 && !conn->broken)
+    {
+        ssize_t sent = send_some(conn->fd, request->out, request->out_len);
+        if (sent < 0)
+        {
+            break_conn(conn);
+        }
+        else if ((size_t)sent < request->out_len)
+        {
+            park(stages, request, now);
+            conn->parked_sent = sent;
+            return;
+        }
+    }
+    release_request(request);
+}
+
+/// Wait for room in a blocked connection, a descriptor in the ring or the first send deadline
+static void wait_send(struct aesd_stages *stages, struct aesd_stage_ring *ring)
+{
+    uint64_t now = now_ns();
+    uint64_t deadline = UINT64_MAX;
+    for (struct aesd_stage_conn *conn = stages->blocked; conn != NULL; conn = conn->blocked_next)
+    {
+        if (conn->stalled_ns + SEND_TIMEOUT_MS * 1000000ull < deadline)
+            deadline = conn->stalled_ns + SEND_TIMEOUT_MS * 1000000ull;
+    }
+    int timeout_ms = deadline > now ? (int)((deadline - now) / 1000000) + 1 : 0;
+    struct epoll_event events[AESD_STAGE_BATCH];
+    atomic_store(&ring->sleeping, true);
+    if (ring_depth(ring) == 0 && atomic_load(&stages->finished) < AESD_STAGE_SEND)
+    {
+        int ready = epoll_wait(stages->send_epoll_fd, events, AESD_STAGE_BATCH, timeout_ms);
+        for (int i = 0; i < ready; i++)
+        {
+            if (events[i].data.ptr != NULL)
+                continue;
+            uint64_t count;
+            ssize_t rc = read(ring->event_fd, &count, sizeof(count));
+            (void)rc;
+        }
+    }
+    else if (ring_depth(ring) == 0)
+    {
+        // Stopping, only the parked requests are left
+        epoll_wait(stages->send_epoll_fd, events, AESD_STAGE_BATCH, timeout_ms);
+    }
+    atomic_store(&ring->sleeping, false);
+}
+
+static void *send_func(void *arg)
+{
+    struct aesd_stages *stages = arg;
+    struct aesd_stage_ring *in = &stages->rings[1];
+    struct aesd_stage_request *batch[AESD_STAGE_BATCH];
+    for (;;)
+    {
+        // Nothing parked: wait for the ring only, as the other stages
+        if (stages->blocked == NULL && !ring_wait(stages, in, AESD_STAGE_SEND))
+            break;
+        if (stages->blocked != NULL && ring_depth(in) == 0)
+            wait_send(stages, in);
+        uint64_t start = now_ns();
+        if (stages->blocked != NULL)
+            flush_blocked(stages, start);
+        if (ring_depth(in) == 0)
+            continue;
+        unsigned count = ring_take(in, batch, &stages->stats[AESD_STAGE_SEND], start);
+        for (unsigned i = 0; i < count; i++)
+            send_request(stages, batch[i], start);
+        account(&stages->stats[AESD_STAGE_SEND], count, start);
+    }
+    return NULL;
+}
+
+static void *(*const stage_funcs[AESD_STAGE_COUNT])(void *) = {network_func, commit_func, send_func};
+
+int aesd_stage_start(struct aesd_stages *stages, struct aesd_latency *latency, aesd_stage_commit commit, void *ctx)
+{
+    memset(stages, 0, sizeof(*stages));
+    stages->commit = commit;
+    stages->ctx = ctx;
+    pthread_mutex_init(&stages->lock, NULL);
+    stages->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    stages->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (stages->epoll_fd < 0 || stages->wake_fd < 0 || epoll_ctl(stages->epoll_fd, EPOLL_CTL_ADD, stages->wake_fd, &event) != 0)
+        return -1;
+    for (int i = 0; i < AESD_STAGE_COUNT - 1; i++)
+    {
+        stages->rings[i].event_fd = eventfd(0, EFD_CLOEXEC);
+        if (stages->rings[i].event_fd < 0)
+            return -1;
+    }
+    // The send stage also waits for room in the sockets it could not write to
+    stages->send_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ring_event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (stages->send_epoll_fd < 0 ||
+        epoll_ctl(stages->send_epoll_fd, EPOLL_CTL_ADD, stages->rings[AESD_STAGE_SEND - 1].event_fd, &ring_event) != 0)
+        return -1;
+
+    stages->running = true;
+    for (int i = 0; i < AESD_STAGE_COUNT; i++)
+    {
+        pthread_attr_t attr;
+        stages->cpus[i] = aesd_latency_thread_attr(latency, &attr);
+        if (stages->cpus[i] < 0)
+            return -1;
+        int rc = pthread_create(&stages->threads[i], &attr, stage_funcs[i], stages);
+        pthread_attr_destroy(&attr);
+        if (rc != 0)
+        {
+            errno = rc;
+            return -1;
+        }
+        syslog(LOG_INFO, "Stage %s running on cpu %d\n", stage_names[i], stages->cpus[i]);
+    }
+    return 0;
+}
+
+int aesd_stage_add(struct aesd_stages *stages, int fd)
+{
+    struct aesd_stage_conn *conn = calloc(1, sizeof(*conn));
+    if (conn == NULL)
+        return -1;
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+    {
+        free(conn);
+        return -1;
+    }
+    conn->fd = fd;
+    atomic_fetch_add(&stages->connections, 1);
+    pthread_mutex_lock(&stages->lock);
+    conn->next = stages->added;
+    stages->added = conn;
+    pthread_mutex_unlock(&stages->lock);
+    wake(stages->wake_fd);
+    return 0;
+}
+
+int aesd_stage_status(struct aesd_stages *stages, char *buf, size_t cap)
+{
+    int len = 0;
+    for (int i = 0; i < AESD_STAGE_COUNT && (size_t)len < cap; i++)
+    {
+        struct aesd_stage_stats *stats = &stages->stats[i];
+        unsigned long long requests = atomic_load(&stats->requests);
+        unsigned long long batches = atomic_load(&stats->batches);
+        // The network stage has no input ring, its depth and wait stay 0
+        len += snprintf(buf + len, cap - len,
+                        "stage=%s cpu=%d connections=%u requests=%llu batches=%llu per_batch=%.1f depth_avg=%.1f "
+                        "depth_max=%llu wait_us=%.1f service_ns=%.0f\n",
+                        stage_names[i], stages->cpus[i], atomic_load(&stages->connections), requests, batches,
+                        batches > 0 ? (double)requests / batches : 0.0,
+                        batches > 0 ? (double)atomic_load(&stats->depth_sum) / batches : 0.0,
+                        (unsigned long long)atomic_load(&stats->depth_max),
+                        requests > 0 ? atomic_load(&stats->wait_ns) / 1e3 / requests : 0.0,
+                        requests > 0 ? (double)atomic_load(&stats->busy_ns) / requests : 0.0);
+    }
+    return (size_t)len < cap ? len : (int)cap - 1;
+}
+
+void aesd_stage_stop(struct aesd_stages *stages)
+{
+    stages->running = false;
+    wake(stages->wake_fd);
+    // Each stage finishes what the previous one handed over, then stops in turn
+    for (unsigned i = 0; i < AESD_STAGE_COUNT; i++)
+    {
+        pthread_join(stages->threads[i], NULL);
+        atomic_store(&stages->finished, i + 1);
+        if (i < AESD_STAGE_COUNT - 1)
+            wake(stages->rings[i].event_fd);
+    }
+
+    char status[1024];
+    aesd_stage_status(stages, status, sizeof(status));
+    for (char *line = strtok(status, "\n"); line != NULL; line = strtok(NULL, "\n"))
+        syslog(LOG_INFO, "Staged mode %s\n", line);
+    for (int i = 0; i < AESD_STAGE_COUNT - 1; i++)
+        close(stages->rings[i].event_fd);
+    close(stages->wake_fd);
+    close(stages->epoll_fd);
+    close(stages->send_epoll_fd);
+}
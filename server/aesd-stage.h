@@ -0,0 +1,126 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-stage.h: Staged mode, every connection served by the same pipeline of pinned threads
+ * ========================================== */
+
+// Instead of one thread per connection doing everything, three threads each run one step for all
+// the connections, on the cpus of a list:
+//   network: waits on every connection with epoll, receives a packet per ready connection, one request
+//            per packet as a connection thread would handle it
+//   commit:  hands the requests to the server in batches (written under one storage lock), which
+//            sets the reply of each request
+//   send:    sends the replies in order and closes the connections. A reply the socket has no room
+//            for is parked on its connection with the ones after it, and sent as the socket drains
+//            while the stage goes on with the other connections
+// Consecutive stages are connected by a lock-free single producer, single consumer ring of request
+// descriptors. A stage takes up to AESD_STAGE_BATCH descriptors at once, so the lock, the clock reads
+// and the wake-ups are paid per batch. A stage with nothing to do spins AESD_STAGE_SPIN polls of its
+// ring, then sleeps on an eventfd the producer only signals while it sleeps.
+// The requests of a connection go through the stages in order, its close last.
+
+#ifndef AESD_STAGE_H
+#define AESD_STAGE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aesd-latency.h"
+
+// Descriptors between two stages, a power of two
+#define AESD_STAGE_RING 1024
+#define AESD_STAGE_BATCH 64
+#define AESD_STAGE_SPIN 200
+// Largest packet received at once, same as a connection thread
+#define AESD_STAGE_PACKET_SIZE 2000
+
+#define AESD_STAGE_NETWORK 0
+#define AESD_STAGE_COMMIT 1
+#define AESD_STAGE_SEND 2
+#define AESD_STAGE_COUNT 3
+
+struct aesd_stage_request;
+
+struct aesd_stage_conn
+{
+    int fd;
+    bool broken;                    // a reply could not be sent, the next ones are dropped
+    struct aesd_stage_conn *prev, *next; // open connections, network stage only
+    // Send stage only
+    struct aesd_stage_request *parked, *parked_tail; // waiting for room in the socket, in order
+    size_t parked_sent;             // bytes of the first one already sent
+    uint64_t stalled_ns;            // last time a byte could be sent, while requests are parked
+    struct aesd_stage_conn *blocked_next; // connections with parked requests
+};
+
+struct aesd_stage_request
+{
+    struct aesd_stage_conn *conn;
+    bool close;                     // last descriptor of the connection, no packet
+    bool reply;                     // the packet holds a new line and is answered
+    struct aesd_stage_request *parked_next; // next request parked on the connection
+    uint64_t pushed_ns;             // entered its current ring
+    // Reply, set by the commit callback. out_free(out_ref) is called once it is sent
+    const char *out;
+    size_t out_len;
+    void (*out_free)(void *ref);
+    void *out_ref;
+    size_t len;
+    char buf[];                     // packet, null terminated
+};
+
+/// Commit stage: store count requests, in order, and set the reply of those answered.
+/// Close descriptors are part of the batch and must be left alone
+typedef void (*aesd_stage_commit)(struct aesd_stage_request **requests, unsigned count, void *ctx);
+
+struct aesd_stage_ring
+{
+    _Alignas(64) atomic_size_t head;    // next descriptor to take, moved by the consumer
+    _Alignas(64) atomic_size_t tail;    // next free slot, moved by the producer
+    _Alignas(64) atomic_bool sleeping;  // consumer waiting on event_fd
+    int event_fd;
+    struct aesd_stage_request *slots[AESD_STAGE_RING];
+};
+
+struct aesd_stage_stats
+{
+    atomic_ullong requests;
+    atomic_ullong batches;
+    atomic_ullong busy_ns;          // handling the batches
+    atomic_ullong wait_ns;          // requests waiting in the input ring, summed
+    atomic_ullong depth_sum;        // input ring depth when a batch is taken, summed
+    atomic_ullong depth_max;
+};
+
+struct aesd_stages
+{
+    int epoll_fd;
+    int wake_fd;                    // in the epoll set: new connections, or stopping
+    pthread_mutex_t lock;           // added
+    struct aesd_stage_conn *added;  // accepted, not in the epoll set yet
+    struct aesd_stage_conn *open;   // in the epoll set, network stage only
+    volatile bool running;
+    aesd_stage_commit commit;
+    void *ctx;
+    struct aesd_stage_ring rings[AESD_STAGE_COUNT - 1]; // network to commit, commit to send
+    int send_epoll_fd;              // send stage: room in the blocked connections, or descriptors in its ring
+    struct aesd_stage_conn *blocked; // send stage: connections with parked requests
+    struct aesd_stage_stats stats[AESD_STAGE_COUNT];
+    pthread_t threads[AESD_STAGE_COUNT];
+    int cpus[AESD_STAGE_COUNT];
+    atomic_uint connections;        // open
+    atomic_uint finished;           // stages stopped, in pipeline order
+};
+
+/// Start the stages, pinned round robin on the cpus of latency. Returns 0, -1 with errno set
+int aesd_stage_start(struct aesd_stages *stages, struct aesd_latency *latency, aesd_stage_commit commit, void *ctx);
+/// Serve an accepted connection, from now on owned by the stages. Returns 0, -1 with errno set
+int aesd_stage_add(struct aesd_stages *stages, int fd);
+/// One line per stage, each ending with a new line. Returns the length
+int aesd_stage_status(struct aesd_stages *stages, char *buf, size_t cap);
+/// Stop receiving, let the commit and send stages finish the requests received, then stop them.
+/// Connections still open are closed
+void aesd_stage_stop(struct aesd_stages *stages);
+
+#endif /* AESD_STAGE_H */
@@ -0,0 +1,171 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-udp.c: Datagram ingest, one entry per UDP datagram
+ * ========================================== */
+#define _GNU_SOURCE // recvmmsg
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "aesd-udp.h"
+
+// Room for the new line added to a datagram not ending with one
+#define SLOT_SIZE (AESD_UDP_DATAGRAM_MAX + 1)
+
+static void *receive_func(void *arg)
+{
+    struct aesd_udp *udp = arg;
+    struct mmsghdr msgs[AESD_UDP_BATCH];
+    struct iovec slots[AESD_UDP_BATCH];
+    struct iovec entries[AESD_UDP_BATCH];
+    // One SO_RXQ_OVFL counter per datagram
+    char controls[AESD_UDP_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+
+    while (udp->running)
+    {
+        memset(msgs, 0, sizeof(msgs));
+        for (unsigned i = 0; i < AESD_UDP_BATCH; i++)
+        {
+            // The last byte of the slot is kept for the new line
+            slots[i] = (struct iovec){udp->buffers + i * SLOT_SIZE, SLOT_SIZE - 1};
+            msgs[i].msg_hdr.msg_iov = &slots[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = controls[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+        }
+        // Waits for the first datagram only, then takes what is already queued
+        int received = recvmmsg(udp->fd, msgs, AESD_UDP_BATCH, MSG_WAITFORONE, NULL);
+        if (received < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (udp->running)
+                syslog(LOG_ERR, "Value of errno receiving datagrams on port %s: %d\n", udp->port, errno);
+            break;
+        }
+
+        unsigned count = 0;
+        size_t bytes = 0;
+        for (int i = 0; i < received; i++)
+        {
+            struct msghdr *hdr = &msgs[i].msg_hdr;
+            for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg))
+            {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+                {
+                    uint32_t drops;
+                    memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+                    // Total since the socket was created, wrapping around
+                    atomic_fetch_add(&udp->dropped, (uint32_t)(drops - udp->kernel_drops));
+                    udp->kernel_drops = drops;
+                }
+            }
+            size_t len = msgs[i].msg_len;
+            if (hdr->msg_flags & MSG_TRUNC)
+            {
+                atomic_fetch_add(&udp->truncated, 1);
+                continue;
+            }
+            // An empty datagram is no entry (shutdown() also wakes us up with one)
+            if (len == 0)
+                continue;
+            char *entry = slots[i].iov_base;
+            if (entry[len - 1] != '\n')
+                entry[len++] = '\n';
+            entries[count++] = (struct iovec){entry, len};
+            bytes += len;
+        }
+        if (count == 0)
+            continue;
+        udp->store(entries, count, udp->ctx);
+        atomic_fetch_add(&udp->datagrams, count);
+        atomic_fetch_add(&udp->bytes, bytes);
+        atomic_fetch_add(&udp->batches, 1);
+    }
+    return NULL;
+}
+
+int aesd_udp_start(struct aesd_udp *udp, const char *port, aesd_udp_store store, void *ctx)
+{
+    memset(udp, 0, sizeof(*udp));
+    snprintf(udp->port, sizeof(udp->port), "%s", port);
+    udp->store = store;
+    udp->ctx = ctx;
+    udp->buffers = malloc(AESD_UDP_BATCH * SLOT_SIZE);
+    if (udp->buffers == NULL)
+        return -1;
+
+    struct addrinfo hints = {0};
+    struct addrinfo *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(NULL, port, &hints, &res) != 0)
+    {
+        free(udp->buffers);
+        errno = EINVAL;
+        return -1;
+    }
+    udp->fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+    int on = 1;
+    int rcvbuf = AESD_UDP_RCVBUF;
+    if (udp->fd < 0 || setsockopt(udp->fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) != 0 ||
+        bind(udp->fd, res->ai_addr, res->ai_addrlen) != 0)
+    {
+        int error = errno;
+        if (udp->fd >= 0)
+            close(udp->fd);
+        freeaddrinfo(res);
+        free(udp->buffers);
+        errno = error;
+        return -1;
+    }
+    freeaddrinfo(res);
+    if (setsockopt(udp->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) != 0)
+        syslog(LOG_ERR, "Could not set the receive buffer of port %s: %d\n", port, errno);
+
+    atomic_init(&udp->datagrams, 0);
+    atomic_init(&udp->bytes, 0);
+    atomic_init(&udp->batches, 0);
+    atomic_init(&udp->dropped, 0);
+    atomic_init(&udp->truncated, 0);
+    udp->running = true;
+    int rc = pthread_create(&udp->thread, NULL, receive_func, udp);
+    if (rc != 0)
+    {
+        close(udp->fd);
+        free(udp->buffers);
+        errno = rc;
+        return -1;
+    }
+    syslog(LOG_INFO, "Receiving datagrams on port %s\n", port);
+    return 0;
+}
+
+int aesd_udp_status(struct aesd_udp *udp, char *buf, size_t cap)
+{
+    unsigned long long datagrams = atomic_load(&udp->datagrams);
+    unsigned long long batches = atomic_load(&udp->batches);
+    return snprintf(buf, cap, "port=%s datagrams=%llu bytes=%llu batches=%llu per_batch=%.1f dropped=%llu truncated=%llu",
+                    udp->port, datagrams, (unsigned long long)atomic_load(&udp->bytes), batches,
+                    batches > 0 ? (double)datagrams / batches : 0.0, (unsigned long long)atomic_load(&udp->dropped),
+                    (unsigned long long)atomic_load(&udp->truncated));
+}
+
+void aesd_udp_stop(struct aesd_udp *udp)
+{
+    udp->running = false;
+    // Fails with ENOTCONN on a socket which is not connected, but still wakes the receive up
+    shutdown(udp->fd, SHUT_RDWR);
+    pthread_join(udp->thread, NULL);
+    close(udp->fd);
+    free(udp->buffers);
+
+    char status[256];
+    aesd_udp_status(udp, status, sizeof(status));
+    syslog(LOG_INFO, "Datagram ingest %s\n", status);
+}
@@ -0,0 +1,55 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-udp.h: Datagram ingest, one entry per UDP datagram
+ * ========================================== */
+
+// Producers which do not need the history back send their entries as UDP datagrams: no connection,
+// no thread and no reply per entry. The receive thread reads up to AESD_UDP_BATCH datagrams per
+// recvmmsg() and hands them over in one call, so the server writes them as one group.
+// A datagram is one entry (one per line if it holds several), a new line is added if it does not end
+// with one. Nothing is acknowledged: datagrams dropped by the kernel (receive queue full) and datagrams
+// larger than AESD_UDP_DATAGRAM_MAX (not stored) are only counted.
+
+#ifndef AESD_UDP_H
+#define AESD_UDP_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define AESD_UDP_BATCH 64
+// Largest entry, without its new line
+#define AESD_UDP_DATAGRAM_MAX 2048
+// Socket receive buffer asked for, absorbs bursts while a batch is written (capped by net.core.rmem_max)
+#define AESD_UDP_RCVBUF (1 << 20)
+
+/// Store count entries at once, iov[i] being one entry ending with a new line
+typedef void (*aesd_udp_store)(const struct iovec *iov, unsigned count, void *ctx);
+
+struct aesd_udp
+{
+    int fd;
+    char port[16];
+    aesd_udp_store store;
+    void *ctx;
+    volatile bool running;
+    pthread_t thread;
+    char *buffers;                  // AESD_UDP_BATCH x (AESD_UDP_DATAGRAM_MAX + 1)
+    uint32_t kernel_drops;          // last SO_RXQ_OVFL count, cumulated by the kernel
+    atomic_ullong datagrams;        // stored
+    atomic_ullong bytes;            // stored, new lines added included
+    atomic_ullong batches;          // recvmmsg() calls which returned datagrams
+    atomic_ullong dropped;          // by the kernel, receive queue full
+    atomic_ullong truncated;        // larger than AESD_UDP_DATAGRAM_MAX, not stored
+};
+
+/// Bind port and start receiving, store() being called from the receive thread for every batch.
+/// Returns 0, -1 with errno set
+int aesd_udp_start(struct aesd_udp *udp, const char *port, aesd_udp_store store, void *ctx);
+/// One line of counters, without new line. Returns its length
+int aesd_udp_status(struct aesd_udp *udp, char *buf, size_t cap);
+void aesd_udp_stop(struct aesd_udp *udp);
+
+#endif /* AESD_UDP_H */
@@ -0,0 +1,89 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-wal-bench.c: Write throughput and durability latency of the write-ahead log
+ * Usage: aesd-wal-bench <dir> [entries] [threads] [fsync interval ms...]
+ * ========================================== */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-wal.h"
+
+struct bench_thread
+{
+    struct aesd_wal *wal;
+    unsigned entries;
+    unsigned id;
+};
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *producer(void *arg)
+{
+    struct bench_thread *t = arg;
+    char line[128];
+    for (unsigned i = 0; i < t->entries; i++)
+    {
+        int len = snprintf(line, sizeof(line), "producer %u entry %u sensor reading within range\n", t->id, i);
+        aesd_wal_append(t->wal, line, len);
+    }
+    return arg;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <dir> [entries] [threads] [fsync interval ms...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    unsigned entries = argc > 2 ? strtoul(argv[2], NULL, 10) : 20000;
+    unsigned threads = argc > 3 ? strtoul(argv[3], NULL, 10) : 4;
+    static const unsigned default_intervals[] = {0, 1, 5, 20};
+    unsigned n_intervals = argc > 4 ? argc - 4 : 4;
+    if (threads == 0)
+        threads = 1;
+
+    printf("%-12s %12s %12s %12s %14s %14s\n", "interval ms", "entries/s", "syncs", "per sync", "durable avg us", "durable max us");
+    for (unsigned k = 0; k < n_intervals; k++)
+    {
+        unsigned interval = argc > 4 ? strtoul(argv[4 + k], NULL, 10) : default_intervals[k];
+        char dir[4096];
+        snprintf(dir, sizeof(dir), "%s/bench-%u", argv[1], interval);
+
+        struct aesd_wal wal;
+        if (aesd_wal_open(&wal, dir, 0, interval) != 0)
+        {
+            fprintf(stderr, "could not open log in %s\n", dir);
+            return EXIT_FAILURE;
+        }
+        pthread_t tid[threads];
+        struct bench_thread ctx[threads];
+        double start = now_s();
+        for (unsigned i = 0; i < threads; i++)
+        {
+            ctx[i] = (struct bench_thread){&wal, entries / threads, i};
+            pthread_create(&tid[i], NULL, producer, &ctx[i]);
+        }
+        for (unsigned i = 0; i < threads; i++)
+            pthread_join(tid[i], NULL);
+        double elapsed = now_s() - start;
+
+        // Read the counters before close, which adds its final sync
+        struct aesd_wal_stats st = wal.stats;
+        aesd_wal_close(&wal);
+        uint64_t syncs = st.syncs ? st.syncs : 1;
+        printf("%-12u %12.0f %12llu %12.1f %14.1f %14.1f\n", interval, st.appends / elapsed,
+               (unsigned long long)st.syncs, (double)st.appends / syncs,
+               st.durable_ns_total / 1e3 / syncs, st.durable_ns_max / 1e3);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,434 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-wal.c: Segment based write-ahead log persisting the committed entries
+ * ========================================== */
+
+// On disk layout: dir/<segment id>.wal, each segment being a list of records
+//   header (struct wal_record) | payload
+// The CRC covers the header (crc field set to 0) and the payload, so a torn write at the
+// end of a segment is detected and discarded on the next start.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-crc32.h"
+#include "aesd-wal.h"
+
+#define WAL_MAGIC 0x4C415741u // "AWAL"
+#define WAL_SUFFIX ".wal"
+
+struct wal_record
+{
+    uint32_t magic;
+    uint32_t len;
+    uint64_t seq;
+    uint32_t crc;
+    uint32_t reserved;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t record_crc(struct wal_record hdr, const char *payload)
+{
+    hdr.crc = 0;
+    uint32_t crc = aesd_crc32_update(0, &hdr, sizeof(hdr));
+    return aesd_crc32_update(crc, payload, hdr.len);
+}
+
+static void segment_path(const struct aesd_wal *wal, uint32_t id, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%08u" WAL_SUFFIX, wal->dir, id);
+}
+
+static int id_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Return the sorted list of segment ids found in the log directory, NULL if empty
+static uint32_t *list_segments(const struct aesd_wal *wal, size_t *count)
+{
+    uint32_t *ids = NULL;
+    size_t cap = 0;
+    *count = 0;
+    DIR *d = opendir(wal->dir);
+    if (d == NULL)
+        return NULL;
+
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+    {
+        char *end;
+        unsigned long id = strtoul(de->d_name, &end, 10);
+        if (end == de->d_name || strcmp(end, WAL_SUFFIX) != 0)
+            continue;
+        if (*count == cap)
+        {
+            cap = cap ? 2 * cap : 8;
+            uint32_t *tmp = realloc(ids, cap * sizeof(uint32_t));
+            if (tmp == NULL)
+                break;
+            ids = tmp;
+        }
+        ids[(*count)++] = id;
+    }
+    closedir(d);
+    if (ids)
+        qsort(ids, *count, sizeof(uint32_t), id_compare);
+    return ids;
+}
+
+// Read a whole segment in memory. Segments are small, bounded by segment_limit plus one record
+static char *read_segment(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    char *data = NULL;
+    if (fstat(fd, &st) == 0 && (data = malloc(st.st_size + 1)) != NULL)
+    {
+        size_t done = 0;
+        while (done < (size_t)st.st_size)
+        {
+            ssize_t rc = read(fd, data + done, st.st_size - done);
+            if (rc <= 0)
+                break;
+            done += rc;
+        }
+        *size = done;
+    }
+    close(fd);
+    return data;
+}
+
+// Walk the valid records of a segment. Returns the offset after the last valid record
+static size_t walk_segment(const char *data, size_t size,
+                           void (*fn)(const struct wal_record *hdr, const char *payload, void *ctx), void *ctx)
+{
+    size_t pos = 0;
+    while (pos + sizeof(struct wal_record) <= size)
+    {
+        struct wal_record hdr;
+        memcpy(&hdr, data + pos, sizeof(hdr));
+        const char *payload = data + pos + sizeof(hdr);
+        if (hdr.magic != WAL_MAGIC || hdr.len > size - pos - sizeof(hdr) || record_crc(hdr, payload) != hdr.crc)
+            break;
+        if (fn)
+            fn(&hdr, payload, ctx);
+        pos += sizeof(hdr) + hdr.len;
+    }
+    return pos;
+}
+
+static void track_seq(const struct wal_record *hdr, const char *payload, void *ctx)
+{
+    uint64_t *next_seq = ctx;
+    if (hdr->seq >= *next_seq)
+        *next_seq = hdr->seq + 1;
+}
+
+static int open_segment(struct aesd_wal *wal, uint32_t id)
+{
+    char path[PATH_MAX + 32];
+    segment_path(wal, id, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        syslog(LOG_ERR, "Could not open log segment %s: %d", path, errno);
+        return -1;
+    }
+    wal->fd = fd;
+    wal->segment_id = id;
+    return 0;
+}
+
+// Called with the lock held. Without interval, the caller is waiting for durability so the
+// fdatasync is done in place. The flusher instead releases the lock during the sync, so
+// appends carry on while the batch is written to disk.
+static void sync_locked(struct aesd_wal *wal, bool release_lock)
+{
+    if (wal->dirty_records == 0)
+        return;
+
+    uint64_t oldest = wal->oldest_dirty_ns;
+    int fd = release_lock ? dup(wal->fd) : wal->fd;
+    wal->dirty_records = 0;
+    if (fd < 0)
+        return;
+
+    if (release_lock)
+        pthread_mutex_unlock(&wal->lock);
+    uint64_t start = now_ns();
+    if (fdatasync(fd) != 0)
+    {
+        syslog(LOG_ERR, "fdatasync of the log failed: %d", errno);
+    }
+    uint64_t end = now_ns();
+    if (release_lock)
+    {
+        close(fd);
+        pthread_mutex_lock(&wal->lock);
+    }
+
+    wal->stats.syncs++;
+    wal->stats.sync_ns_total += end - start;
+    if (end - start > wal->stats.sync_ns_max)
+        wal->stats.sync_ns_max = end - start;
+    wal->stats.durable_ns_total += end - oldest;
+    if (end - oldest > wal->stats.durable_ns_max)
+        wal->stats.durable_ns_max = end - oldest;
+}
+
+/// Thread grouping the fdatasync of all the records appended during one interval
+static void *flusher_func(void *arg)
+{
+    struct aesd_wal *wal = arg;
+    pthread_mutex_lock(&wal->lock);
+    while (wal->running)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wal->sync_interval_ms / 1000;
+        deadline.tv_nsec += (wal->sync_interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&wal->cond, &wal->lock, &deadline);
+        sync_locked(wal, true);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return arg;
+}
+
+int aesd_wal_open(struct aesd_wal *wal, const char *dir, size_t segment_limit, unsigned sync_interval_ms)
+{
+    memset(wal, 0, sizeof(*wal));
+    wal->fd = -1;
+    wal->segment_limit = segment_limit ? segment_limit : AESD_WAL_SEGMENT_SIZE;
+    wal->sync_interval_ms = sync_interval_ms;
+    wal->open_ns = now_ns();
+    snprintf(wal->dir, sizeof(wal->dir), "%s", dir);
+    if (mkdir(wal->dir, 0755) != 0 && errno != EEXIST)
+    {
+        syslog(LOG_ERR, "Could not create log directory %s: %d", wal->dir, errno);
+        return -1;
+    }
+
+    // Find the next sequence number and cut off a torn record at the end of the last segment
+    size_t count;
+    uint32_t *ids = list_segments(wal, &count);
+    uint32_t last_id = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        char path[PATH_MAX + 32];
+        size_t size = 0;
+        segment_path(wal, ids[i], path, sizeof(path));
+        char *data = read_segment(path, &size);
+        if (data == NULL)
+            continue;
+        size_t valid = walk_segment(data, size, track_seq, &wal->next_seq);
+        free(data);
+        if (i == count - 1)
+        {
+            if (valid < size && truncate(path, valid) == 0)
+            {
+                syslog(LOG_WARNING, "Discarded %zu bytes of torn record at the end of %s", size - valid, path);
+            }
+            last_id = ids[i];
+            wal->segment_bytes = valid;
+        }
+    }
+    free(ids);
+
+    if (open_segment(wal, last_id) != 0)
+        return -1;
+
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->cond, NULL);
+    if (wal->sync_interval_ms > 0)
+    {
+        wal->running = true;
+        if (pthread_create(&wal->flusher, NULL, flusher_func, wal) != 0)
+        {
+            syslog(LOG_ERR, "Could not start the log flusher, syncing every append");
+            wal->running = false;
+            wal->sync_interval_ms = 0;
+        }
+    }
+    syslog(LOG_INFO, "Write-ahead log opened in %s, segment %u, next sequence %llu, sync interval %u ms",
+           wal->dir, wal->segment_id, (unsigned long long)wal->next_seq, wal->sync_interval_ms);
+    return 0;
+}
+
+// Called with the lock held, start a new segment once the current one is full
+static int rotate_locked(struct aesd_wal *wal)
+{
+    sync_locked(wal, false);
+    close(wal->fd);
+    if (open_segment(wal, wal->segment_id + 1) != 0)
+        return -1;
+    wal->segment_bytes = 0;
+
+    if (wal->segment_id >= AESD_WAL_KEEP_SEGMENTS)
+    {
+        char path[PATH_MAX + 32];
+        segment_path(wal, wal->segment_id - AESD_WAL_KEEP_SEGMENTS, path, sizeof(path));
+        unlink(path);
+    }
+    return 0;
+}
+
+int64_t aesd_wal_append(struct aesd_wal *wal, const char *buf, size_t len)
+{
+    struct wal_record hdr = {.magic = WAL_MAGIC, .len = len};
+    int64_t seq = -1;
+
+    pthread_mutex_lock(&wal->lock);
+    if (wal->segment_bytes >= wal->segment_limit && rotate_locked(wal) != 0)
+        goto out;
+
+    hdr.seq = wal->next_seq;
+    hdr.crc = record_crc(hdr, buf);
+
+    // Header and payload in a single write, so a record is never interleaved with another one
+    struct iovec iov[2] = {{&hdr, sizeof(hdr)}, {(void *)buf, len}};
+    ssize_t rc = writev(wal->fd, iov, 2);
+    if (rc != (ssize_t)(sizeof(hdr) + len))
+    {
+        syslog(LOG_ERR, "Could not append record %llu to the log: %d", (unsigned long long)hdr.seq, errno);
+        goto out;
+    }
+    seq = wal->next_seq++;
+    wal->segment_bytes += rc;
+    wal->stats.appends++;
+    wal->stats.bytes += len;
+    if (wal->dirty_records++ == 0)
+        wal->oldest_dirty_ns = now_ns();
+
+    if (wal->sync_interval_ms == 0)
+        sync_locked(wal, false);
+
+  out:
+    pthread_mutex_unlock(&wal->lock);
+    return seq;
+}
+
+struct replay_ring
+{
+    char **buf;
+    size_t *len;
+    unsigned max;
+    uint64_t count;
+};
+
+static void keep_record(const struct wal_record *hdr, const char *payload, void *ctx)
+{
+    struct replay_ring *ring = ctx;
+    unsigned slot = ring->count % ring->max;
+    char *copy = malloc(hdr->len);
+    if (copy == NULL)
+        return;
+    memcpy(copy, payload, hdr->len);
+    free(ring->buf[slot]);
+    ring->buf[slot] = copy;
+    ring->len[slot] = hdr->len;
+    ring->count++;
+}
+
+int aesd_wal_replay(struct aesd_wal *wal, unsigned max_entries, void (*fn)(const char *buf, size_t len, void *ctx), void *ctx)
+{
+    if (max_entries == 0)
+        return 0;
+
+    struct replay_ring ring = {
+        .buf = calloc(max_entries, sizeof(char *)),
+        .len = calloc(max_entries, sizeof(size_t)),
+        .max = max_entries,
+    };
+    if (ring.buf == NULL || ring.len == NULL)
+    {
+        free(ring.buf);
+        free(ring.len);
+        return -1;
+    }
+
+    // Keep only the tail, in a ring of max_entries records
+    size_t count;
+    uint32_t *ids = list_segments(wal, &count);
+    for (size_t i = 0; i < count; i++)
+    {
+        char path[PATH_MAX + 32];
+        size_t size = 0;
+        segment_path(wal, ids[i], path, sizeof(path));
+        char *data = read_segment(path, &size);
+        if (data == NULL)
+            continue;
+        walk_segment(data, size, keep_record, &ring);
+        free(data);
+    }
+    free(ids);
+
+    unsigned replayed = ring.count < max_entries ? ring.count : max_entries;
+    for (unsigned i = 0; i < replayed; i++)
+    {
+        unsigned slot = (ring.count - replayed + i) % max_entries;
+        fn(ring.buf[slot], ring.len[slot], ctx);
+    }
+    for (unsigned i = 0; i < max_entries; i++)
+        free(ring.buf[i]);
+    free(ring.buf);
+    free(ring.len);
+    return replayed;
+}
+
+void aesd_wal_close(struct aesd_wal *wal)
+{
+    if (wal->fd < 0)
+        return;
+
+    pthread_mutex_lock(&wal->lock);
+    bool had_flusher = wal->running;
+    wal->running = false;
+    pthread_cond_signal(&wal->cond);
+    pthread_mutex_unlock(&wal->lock);
+    if (had_flusher)
+        pthread_join(wal->flusher, NULL);
+
+    pthread_mutex_lock(&wal->lock);
+    sync_locked(wal, false);
+    pthread_mutex_unlock(&wal->lock);
+
+    struct aesd_wal_stats *st = &wal->stats;
+    double elapsed_s = (now_ns() - wal->open_ns) / 1e9;
+    uint64_t syncs = st->syncs ? st->syncs : 1;
+    syslog(LOG_INFO, "Write-ahead log: %llu records, %llu bytes, %.1f records/s, %.1f KB/s",
+           (unsigned long long)st->appends, (unsigned long long)st->bytes,
+           st->appends / elapsed_s, st->bytes / elapsed_s / 1024);
+    syslog(LOG_INFO, "Write-ahead log: %llu fdatasync, %.1f records per sync, sync avg %.1f us max %.1f us, "
+           "durability avg %.1f us max %.1f us",
+           (unsigned long long)st->syncs, (double)st->appends / syncs,
+           st->sync_ns_total / 1e3 / syncs, st->sync_ns_max / 1e3,
+           st->durable_ns_total / 1e3 / syncs, st->durable_ns_max / 1e3);
+
+    close(wal->fd);
+    wal->fd = -1;
+    pthread_cond_destroy(&wal->cond);
+    pthread_mutex_destroy(&wal->lock);
+}
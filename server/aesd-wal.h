@@ -0,0 +1,65 @@
+/* Copyright (c) 2024 Sebastien Lemetter
+ * aesd-wal.h: Segment based write-ahead log persisting the committed entries
+ * ========================================== */
+
+#ifndef AESD_WAL_H
+#define AESD_WAL_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Default size after which a new segment file is started
+#define AESD_WAL_SEGMENT_SIZE (1024 * 1024)
+// Number of segment files kept on disk, older ones are removed on rotation
+#define AESD_WAL_KEEP_SEGMENTS 4
+
+/// Counters reported when the log is closed
+struct aesd_wal_stats
+{
+    uint64_t appends;           // records written
+    uint64_t bytes;             // payload bytes written
+    uint64_t syncs;             // fdatasync calls
+    uint64_t sync_ns_total;     // time spent in fdatasync
+    uint64_t sync_ns_max;
+    uint64_t durable_ns_total;  // append to durable latency, summed over syncs for the oldest record of the batch
+    uint64_t durable_ns_max;
+};
+
+struct aesd_wal
+{
+    char dir[PATH_MAX];
+    int fd;                     // current segment, opened in append mode
+    uint32_t segment_id;
+    size_t segment_bytes;       // size of the current segment
+    size_t segment_limit;
+    uint64_t next_seq;          // sequence number of the next record
+    unsigned sync_interval_ms;  // 0: fdatasync before returning from each append
+    uint64_t dirty_records;     // records written since the last fdatasync
+    uint64_t oldest_dirty_ns;   // time of the oldest of these records
+    uint64_t open_ns;           // time the log was opened, for throughput reporting
+    bool running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t flusher;
+    struct aesd_wal_stats stats;
+};
+
+/// Open (or create) the log stored in dir. A torn record at the end of the last segment is cut off.
+/// With sync_interval_ms > 0, a flusher thread groups the fdatasync of all records appended in the interval.
+/// Returns 0 on success, -1 on error
+int aesd_wal_open(struct aesd_wal *wal, const char *dir, size_t segment_limit, unsigned sync_interval_ms);
+
+/// Append one committed entry. Returns its sequence number, or -1 on error
+int64_t aesd_wal_append(struct aesd_wal *wal, const char *buf, size_t len);
+
+/// Call fn on the last max_entries valid records of the log, oldest first.
+/// Returns the number of replayed records, -1 on error
+int aesd_wal_replay(struct aesd_wal *wal, unsigned max_entries, void (*fn)(const char *buf, size_t len, void *ctx), void *ctx);
+
+/// Sync pending records, stop the flusher, log the statistics and close the segment
+void aesd_wal_close(struct aesd_wal *wal);
+
+#endif /* AESD_WAL_H */
@@ -1,8 +1,14 @@
 /* Copyright (c) 2024 Sebastien Lemetter
  * aesdsocket.c: Create a socket connection
  * ========================================== */
+#define _GNU_SOURCE // memmem
+#include <ctype.h>
 #include <errno.h>
+#include <getopt.h>
+#include <limits.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
@@ -10,19 +16,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <syslog.h>
 #include <time.h>
 
 #include "../aesd-char-driver/aesd_ioctl.h"
+#include "../aesd-char-driver/aesd-circular-buffer.h"
 #include "aesdsocket.h"
-#include "queue_bsd.h"
 
 #define BACKLOG 10
-#define FILEPATH "/dev/aesdchar"
 #define BUFFER_SIZE 2000
 #define MAX_BUFFER_SIZE 50000
 #define TIMEGAP_USECOND 10000000 //10s
-#define WAIT_DELAY 10000 //10ms
+#define SHUTDOWN_TIMEOUT_MS 5000 // Connection threads still running at exit are waited for this long
+#define BUDGET_STACK_SIZE (32 * 1024) // Connection thread stack in memory budget mode
+#define BUDGET_RETRY_MS 100 // Admission retry period once the memory budget is reached
 
 /// Thread function writing regular timestamps
 void* timestamp_func(void* thread_ts_param)
@@ -49,210 +57,2229 @@ void* timestamp_func(void* thread_ts_param)
         strcat(tsstr, "\n");
 
         // Write data to file
-        get_mutex(ts_data->file_mutex);
-        FILE *file = fopen(FILEPATH, "a");
-        if (file == NULL)
+        struct CChannel *channel = ts_data->channel;
+        get_mutex(&channel->file_mutex);
+        // +11 because tsstr was appended with the new line character and outstr
+        ssize_t written_bytes = aesd_backend_append(&channel->backend, tsstr, bytes_num+11);
+        release_mutex(&channel->file_mutex);
+        if (written_bytes < 0)
+        {
+            syslog(LOG_ERR, "Value of errno attempting to write into %s: %d\n", channel->backend.name, errno);
+            break;
+        }
+        syslog(LOG_INFO, "Timestamp thread: wrote %zd bytes into target file\n", written_bytes);
+    }
+    return thread_ts_param;
+}
+
+// Parse the seek command and resolve it on the storage, returns the read offset or -1
+ssize_t run_ioctl_command(const char *p, struct aesd_backend *backend)
+{
+    syslog(LOG_INFO, "Entering ioctl, working with %s\n", p);
+    char *endptr;
+    struct aesd_seekto seekto;
+
+    // Now we are looking for X (command) and Y (offset)
+    errno = 0;  // Clear errno before the call
+    seekto.write_cmd = strtoul(p, &endptr, 10);
+    if (errno == ERANGE)
+    {
+        errno = 0;
+        syslog(LOG_ERR, "Could not convert X value to an unsigned int");
+    }
+
+    // Parse the second number (Y)
+    p = endptr + 1; // Move past the comma
+    seekto.write_cmd_offset = strtoul(p, &endptr, 10);
+    if (errno == ERANGE)
+    {
+        errno = 0;
+        syslog(LOG_ERR, "Could not convert Y value to an unsigned int");
+    }
+
+    syslog(LOG_INFO,"Found X = %u and Y = %u", seekto.write_cmd, seekto.write_cmd_offset);
+
+    // The device backend runs the ioctl, the others resolve the entry themselves
+    return aesd_backend_seek_to(backend, seekto.write_cmd, seekto.write_cmd_offset);
+}
+
+// Hand a complete entry to every enabled consumer, end being its position in the device once written
+void publish_entry(struct CCommitContext *commit, const char *buf, size_t len, uint64_t end)
+{
+    if (commit->wal != NULL)
+    {
+        aesd_wal_append(commit->wal, buf, len);
+    }
+    if (commit->shm != NULL && aesd_shm_publish(commit->shm, buf, len) < 0)
+    {
+        syslog(LOG_ERR, "Entry of %zu bytes does not fit in the shared memory ring\n", len);
+    }
+    if (commit->repl != NULL)
+    {
+        aesd_repl_publish(commit->repl, buf, len);
+    }
+    if (commit->index != NULL)
+    {
+        aesd_index_add(commit->index, buf, len, end - len);
+    }
+}
+
+// Add bytes to the partial entry. Returns false if it could not grow, the bytes are dropped
+static bool pending_append(struct CCommitContext *commit, const char *buf, size_t len)
+{
+    if (commit->pending_len + len > commit->pending_cap)
+    {
+        size_t new_cap = commit->pending_cap ? commit->pending_cap : BUFFER_SIZE;
+        while (new_cap < commit->pending_len + len)
+            new_cap *= 2;
+        char *tmp = realloc(commit->pending, new_cap);
+        if (tmp == NULL)
+        {
+            syslog(LOG_ERR, "Could not grow the pending entry, dropping %zu bytes\n", len);
+            return false;
+        }
+        commit->pending = tmp;
+        commit->pending_cap = new_cap;
+    }
+    memcpy(commit->pending + commit->pending_len, buf, len);
+    commit->pending_len += len;
+    return true;
+}
+
+// Follow the bytes written into the device. Like the driver, bytes are accumulated and each line is
+// committed as one entry, a packet may hold several of them.
+void commit_received(struct CCommitContext *commit, const char *buf, size_t len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+    // Positions for the delta replies, the bytes after the last new line are not committed yet
+    uint64_t start = commit->written;
+    const char *last = memrchr(buf, '\n', len);
+    commit->written += len;
+    if (last != NULL)
+    {
+        commit->committed = start + (last - buf) + 1;
+    }
+    if (commit->wal == NULL && commit->shm == NULL && commit->repl == NULL && commit->index == NULL)
+    {
+        return;
+    }
+
+    const char *line = buf;
+    if (last != NULL && commit->pending_len > 0)
+    {
+        // The first line completes the partial entry
+        const char *eol = memchr(buf, '\n', len);
+        if (pending_append(commit, buf, eol - buf + 1))
+        {
+            publish_entry(commit, commit->pending, commit->pending_len, start + (eol - buf) + 1);
+        }
+        commit->pending_len = 0;
+        line = eol + 1;
+    }
+    // Whole lines in the packet, the common case, no copy needed
+    while (last != NULL && line <= last)
+    {
+        const char *eol = memchr(line, '\n', last - line + 1);
+        publish_entry(commit, line, eol - line + 1, start + (eol - buf) + 1);
+        line = eol + 1;
+    }
+    if (line < buf + len)
+    {
+        pending_append(commit, line, buf + len - line);
+    }
+}
+
+// Send an answer which is not part of the history (command acknowledgement), as a raw frame if framed.
+// It is never compressed, so it does not touch the compression dictionary.
+static int send_control_as(struct CConnection *conn, const char *buf, size_t len, bool framed)
+{
+    if (!framed || conn->frame == NULL)
+    {
+        return send_all(conn->data->fd, buf, len);
+    }
+    ssize_t frame_len = aesd_lz_raw_frame(buf, len, conn->frame, aesd_lz_bound(MAX_BUFFER_SIZE));
+    return frame_len < 0 ? -1 : send_all(conn->data->fd, conn->frame, frame_len);
+}
+
+// Same as send_control_as() with the framing of the connection: framed whenever its history replies
+// are, compressed or pipelined, so the client reads one stream of frames
+int send_control(struct CConnection *conn, const char *buf, size_t len)
+{
+    return send_control_as(conn, buf, len, conn->lz != NULL || conn->pipelined);
+}
+
+// Send a history reply. Compressed replies and pipelined replies are framed, so the client knows
+// their size, plain replies are sent as is. Whole, like the others: send() may stop after a part.
+int send_reply(struct CConnection *conn, const char *buf, size_t len)
+{
+    ssize_t frame_len;
+    if (conn->lz != NULL)
+    {
+        frame_len = aesd_lz_encode_frame(conn->lz, buf, len, conn->frame, aesd_lz_bound(MAX_BUFFER_SIZE));
+        syslog(LOG_INFO, "Compressed %zu bytes into a %zd bytes frame\n", len, frame_len);
+    }
+    else if (conn->pipelined)
+    {
+        frame_len = aesd_lz_raw_frame(buf, len, conn->frame, aesd_lz_bound(MAX_BUFFER_SIZE));
+    }
+    else
+    {
+        return send_all(conn->data->fd, buf, len);
+    }
+    return frame_len < 0 ? -1 : send_all(conn->data->fd, conn->frame, frame_len);
+}
+
+// Memory budget mode: charge an optional per connection allocation. Returns false if over budget
+bool conn_charge(struct CConnection *conn, size_t size)
+{
+    return conn->data->budget == NULL || aesd_budget_try_charge(conn->data->budget, size);
+}
+
+void conn_uncharge(struct CConnection *conn, size_t size)
+{
+    if (conn->data->budget != NULL)
+    {
+        aesd_budget_release(conn->data->budget, size);
+    }
+}
+
+// Memory budget mode: answer a reply the budget cannot hold with AESD_BUDGET_REFUSED. Returns -1 if
+// the connection should be closed
+int send_refusal(struct CConnection *conn)
+{
+    syslog(LOG_ERR, "Memory budget reached, reply refused for %d", conn->data->fd);
+    return send_control(conn, AESD_BUDGET_REFUSED, strlen(AESD_BUDGET_REFUSED)) < 0 ? -1 : 0;
+}
+
+// The frame buffer is needed as long as replies are compressed or pipelined
+void update_frame_buffer(struct CConnection *conn)
+{
+    size_t frame_size = aesd_lz_bound(MAX_BUFFER_SIZE);
+    if ((conn->lz != NULL || conn->pipelined) && conn->frame == NULL)
+    {
+        if (!conn_charge(conn, frame_size))
+        {
+            syslog(LOG_ERR, "Memory budget reached, no frame buffer for %d", conn->data->fd);
+            return;
+        }
+        conn->frame = malloc(frame_size);
+        if (conn->frame == NULL)
+        {
+            conn_uncharge(conn, frame_size);
+        }
+    }
+    else if (conn->lz == NULL && !conn->pipelined && conn->frame != NULL)
+    {
+        free(conn->frame);
+        conn->frame = NULL;
+        conn_uncharge(conn, frame_size);
+    }
+}
+
+void free_compression(struct CConnection *conn)
+{
+    aesd_lz_stream_free(conn->lz);
+    free(conn->lz);
+    conn->lz = NULL;
+    conn_uncharge(conn, aesd_lz_stream_size(MAX_BUFFER_SIZE));
+}
+
+// Enable or disable reply compression for one connection, answer with the resulting state.
+// The dictionary is reset at each activation, so client and server start from the same state.
+void run_compress_command(struct CConnection *conn, const char *p)
+{
+    bool enable = (*p == '1');
+    // The acknowledgement uses the framing in force when the command was received
+    bool framed = conn->lz != NULL || conn->pipelined;
+    char answer[sizeof(AESD_COMPRESS_COM) + 2];
+    if (enable && conn->lz == NULL && conn_charge(conn, aesd_lz_stream_size(MAX_BUFFER_SIZE)))
+    {
+        conn->lz = malloc(sizeof(struct aesd_lz_stream));
+        if (conn->lz == NULL || aesd_lz_stream_init(conn->lz, MAX_BUFFER_SIZE) != 0)
+        {
+            syslog(LOG_ERR, "Could not allocate compression context");
+            free(conn->lz);
+            conn->lz = NULL;
+            conn_uncharge(conn, aesd_lz_stream_size(MAX_BUFFER_SIZE));
+        }
+    }
+    else if (!enable && conn->lz != NULL)
+    {
+        free_compression(conn);
+    }
+    if (conn->lz != NULL)
+    {
+        update_frame_buffer(conn);
+        if (conn->frame == NULL)
+        {
+            free_compression(conn);
+        }
+    }
+
+    int answer_len = snprintf(answer, sizeof(answer), "%s%d\n", AESD_COMPRESS_COM, conn->lz != NULL);
+    send_control_as(conn, answer, answer_len, framed);
+    // A frame buffer no longer needed goes once the acknowledgement used it
+    update_frame_buffer(conn);
+    syslog(LOG_INFO, "Reply compression is now %s", conn->lz != NULL ? "enabled" : "disabled");
+}
+
+// Enable or disable pipelined mode: each received line is one request, answered by exactly one frame
+void run_pipeline_command(struct CConnection *conn, const char *p)
+{
+    char answer[sizeof(AESD_PIPELINE_COM) + 2];
+    bool was_pipelined = conn->pipelined;
+    conn->pipelined = (*p == '1');
+    update_frame_buffer(conn);
+    if (conn->frame == NULL && conn->pipelined)
+    {
+        syslog(LOG_ERR, "Could not allocate frame buffer, pipelined mode refused");
+        conn->pipelined = false;
+    }
+
+    int answer_len = snprintf(answer, sizeof(answer), "%s%d\n", AESD_PIPELINE_COM, conn->pipelined);
+    // Acknowledge with the framing in force when the command was received
+    send_control_as(conn, answer, answer_len, was_pipelined || conn->lz != NULL);
+    // Frames are sent back to back while the client keeps sending, do not let Nagle hold them
+    // until the previous ones are acknowledged
+    int nodelay = conn->pipelined;
+    setsockopt(conn->data->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    syslog(LOG_INFO, "Pipelined mode is now %s", conn->pipelined ? "enabled" : "disabled");
+}
+
+// Select how appends are answered: full history, entry count or nothing
+void run_ingest_command(struct CConnection *conn, const char *p)
+{
+    char answer[sizeof(AESD_INGEST_COM) + 2];
+    int mode = *p - '0';
+    conn->ingest = (mode == AESD_INGEST_COUNT || mode == AESD_INGEST_SILENT) ? mode : AESD_INGEST_ECHO;
+    // Even in silent mode, so the client knows the server understood the command
+    int answer_len = snprintf(answer, sizeof(answer), "%s%d\n", AESD_INGEST_COM, conn->ingest);
+    send_control(conn, answer, answer_len);
+    syslog(LOG_INFO, "Ingest mode is now %d", conn->ingest);
+}
+
+// Enable or disable delta replies. Enabling starts over: the next reply holds the whole history
+void run_delta_command(struct CConnection *conn, const char *p)
+{
+    char answer[sizeof(AESD_DELTA_COM) + 2];
+    // A proxy does not know what its backends committed, it always forwards the full history
+    conn->delta = (*p == '1') && conn->data->proxy == NULL;
+    conn->cursor = 0;
+    int answer_len = snprintf(answer, sizeof(answer), "%s%d\n", AESD_DELTA_COM, conn->delta);
+    send_control(conn, answer, answer_len);
+    syslog(LOG_INFO, "Delta replies are now %s", conn->delta ? "enabled" : "disabled");
+}
+
+// History cache loader: read the full history from the beginning of the storage
+ssize_t read_history(struct aesd_history_cache *cache, char *buf, size_t cap, uint64_t *generation)
+{
+    struct CChannel *channel = cache->loader_ctx;
+    get_mutex(&channel->file_mutex);
+    *generation = aesd_history_generation(cache);
+    ssize_t read_bytes = aesd_backend_read_at(&channel->backend, 0, buf, cap);
+    if (read_bytes < 0)
+    {
+        syslog(LOG_ERR, "Value of errno attempting to read %s: %d\n", channel->backend.name, errno);
+    }
+    release_mutex(&channel->file_mutex);
+    return read_bytes;
+}
+
+// Start the delta positions after the entries the storage of the channel already holds
+void channel_sync_positions(struct CChannel *channel)
+{
+    ssize_t stored = aesd_backend_size(&channel->backend);
+    channel->commit.written = channel->commit.committed = stored > 0 ? stored : 0;
+}
+
+// Create a channel storing its entries in the backend described by spec. Returns NULL on error
+struct CChannel *channel_open(const char *name, const char *spec)
+{
+    struct CChannel *channel = calloc(1, sizeof(struct CChannel));
+    if (channel == NULL)
+    {
+        return NULL;
+    }
+    if (aesd_backend_open(&channel->backend, spec) != 0)
+    {
+        free(channel);
+        return NULL;
+    }
+    snprintf(channel->name, sizeof(channel->name), "%s", name);
+    pthread_mutex_init(&channel->file_mutex, NULL);
+    aesd_history_init(&channel->history, MAX_BUFFER_SIZE, read_history, channel);
+    atomic_init(&channel->writes, 0);
+    atomic_init(&channel->bytes, 0);
+    atomic_init(&channel->replies, 0);
+    channel_sync_positions(channel);
+    syslog(LOG_INFO, "Channel %s stores its entries in %s %s\n", name, channel->backend.name, channel->backend.path);
+    return channel;
+}
+
+// Log the statistics and release the storage. The structure stays allocated, connection threads
+// still running at exit may use its lock
+void channel_close(struct CChannel *channel)
+{
+    syslog(LOG_INFO, "Channel %s: %llu writes, %llu bytes, %llu replies\n", channel->name,
+           (unsigned long long)atomic_load(&channel->writes), (unsigned long long)atomic_load(&channel->bytes),
+           (unsigned long long)atomic_load(&channel->replies));
+    aesd_history_destroy(&channel->history);
+    get_mutex(&channel->file_mutex);
+    aesd_backend_close(&channel->backend);
+    free(channel->commit.pending);
+    channel->commit.pending = NULL;
+    if (channel->commit.index != NULL)
+    {
+        aesd_index_destroy(channel->commit.index);
+        free(channel->commit.index);
+        channel->commit.index = NULL;
+    }
+    release_mutex(&channel->file_mutex);
+}
+
+// Memory budget mode: charge an allocation of the channel. Returns false if over budget
+static bool channel_charge(struct CChannel *channel, size_t size)
+{
+    return channel->budget == NULL || aesd_budget_try_charge(channel->budget, size);
+}
+
+static void channel_uncharge(struct CChannel *channel, size_t size)
+{
+    if (channel->budget != NULL)
+    {
+        aesd_budget_release(channel->budget, size);
+    }
+}
+
+// Free what read_entries() read and give its charge back
+void free_entries(struct CChannel *channel, char *data, uint32_t *lens, size_t charged)
+{
+    free(data);
+    free(lens);
+    channel_uncharge(channel, charged);
+}
+
+// Read the committed entries of the channel: the storage into *data, the length of each entry into
+// *lens, their total into *bytes. Both buffers are charged on the memory budget, *charged bytes to
+// give back with free_entries(). Caller holds file_mutex. Returns the number of entries, -1 with errno set
+ssize_t read_entries(struct CChannel *channel, char **data, uint32_t **lens, size_t *bytes, size_t *charged)
+{
+    uint32_t count = 0;
+    // Read again each time, the device may have been resized since the last call
+    uint32_t depth = channel->backend.bounded ? aesd_backend_depth(&channel->backend) : 0;
+    ssize_t size = aesd_backend_size(&channel->backend);
+    if (size < 0)
+    {
+        return -1;
+    }
+    if (!channel_charge(channel, size + 1))
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    *charged = size + 1;
+    *data = malloc(size + 1);
+    ssize_t read_bytes = *data != NULL ? aesd_backend_read_at(&channel->backend, 0, *data, size) : -1;
+    if (read_bytes < 0)
+    {
+        free(*data);
+        channel_uncharge(channel, *charged);
+        return -1;
+    }
+    if (!channel->backend.bounded)
+    {
+        // A file entry is a line, trailing bytes without their new line are not committed yet
+        for (ssize_t i = 0; i < read_bytes; i++)
+            count += (*data)[i] == '\n';
+    }
+    size_t max = channel->backend.bounded ? depth : count;
+    if (!channel_charge(channel, max * sizeof(uint32_t)))
+    {
+        free(*data);
+        channel_uncharge(channel, *charged);
+        errno = ENOMEM;
+        return -1;
+    }
+    *charged += max * sizeof(uint32_t);
+    *lens = malloc(max * sizeof(uint32_t));
+    if (*lens == NULL && max > 0)
+    {
+        free_entries(channel, *data, NULL, *charged);
+        errno = ENOMEM;
+        return -1;
+    }
+    if (channel->backend.bounded && read_bytes > 0)
+    {
+        // Entries may hold several lines, ask the storage for their lengths, all in one call
+        ssize_t entries = aesd_backend_entry_lens(&channel->backend, *lens, depth, read_bytes);
+        if (entries < 0)
+        {
+            free_entries(channel, *data, *lens, *charged);
+            return -1;
+        }
+        count = entries;
+    }
+    *bytes = 0;
+    const char *p = *data;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!channel->backend.bounded)
+        {
+            (*lens)[i] = (const char *)memchr(p, '\n', *data + read_bytes - p) - p + 1;
+            p += (*lens)[i];
+        }
+        *bytes += (*lens)[i];
+    }
+    return count;
+}
+
+// Index the entries the storage of the channel holds, as many as it keeps now. Caller holds file_mutex,
+// so no entry is written in between. Returns the number of entries, -1 with errno set and index left
+// uninitialized
+static ssize_t load_index(struct CChannel *channel, struct aesd_index *index, size_t *bytes)
+{
+    char *data;
+    uint32_t *lens;
+    size_t charged;
+    ssize_t count = read_entries(channel, &data, &lens, bytes, &charged);
+    if (count < 0)
+    {
+        return -1;
+    }
+    if (aesd_index_init(index, channel->backend.bounded, channel->backend.depth) != 0)
+    {
+        free_entries(channel, data, lens, charged);
+        return -1;
+    }
+    uint64_t offset = 0;
+    for (ssize_t i = 0; i < count; i++)
+    {
+        aesd_index_add(index, data + offset, lens[i], offset);
+        offset += lens[i];
+    }
+    free_entries(channel, data, lens, charged);
+    return count;
+}
+
+// Index the channel for the search command, starting with the entries its storage holds. Returns 0,
+// -1 with errno set
+int channel_enable_index(struct CChannel *channel)
+{
+    struct aesd_index *index = malloc(sizeof(struct aesd_index));
+    if (index == NULL)
+    {
+        return -1;
+    }
+    size_t bytes;
+    get_mutex(&channel->file_mutex);
+    ssize_t count = load_index(channel, index, &bytes);
+    if (count >= 0)
+    {
+        channel->commit.index = index;
+    }
+    release_mutex(&channel->file_mutex);
+    if (count < 0)
+    {
+        free(index);
+        return -1;
+    }
+    syslog(LOG_INFO, "Channel %s indexed, %zd entries, %zu bytes\n", channel->name, count, bytes);
+    return 0;
+}
+
+// Rebuild the index of a bounded channel if its storage was resized since it was built, the ring and
+// the index would no longer number the entries alike
+static void channel_sync_index(struct CChannel *channel)
+{
+    struct aesd_index *index = channel->commit.index;
+    if (!channel->backend.bounded)
+    {
+        return;
+    }
+    get_mutex(&channel->file_mutex);
+    struct aesd_index fresh;
+    size_t bytes;
+    ssize_t count;
+    if (aesd_backend_depth(&channel->backend) != index->capacity && (count = load_index(channel, &fresh, &bytes)) >= 0)
+    {
+        aesd_index_replace(index, &fresh);
+        syslog(LOG_INFO, "Channel %s resized to %u entries, indexed again, %zd entries, %zu bytes\n", channel->name,
+               channel->backend.depth, count, bytes);
+    }
+    release_mutex(&channel->file_mutex);
+}
+
+// Channel names are short words: letters, digits, '-', '_' and '.'. Returns the name length, 0 if invalid
+size_t channel_name_len(const char *name)
+{
+    size_t len = 0;
+    while (isalnum((unsigned char)name[len]) || name[len] == '-' || name[len] == '_' || name[len] == '.')
+    {
+        len++;
+    }
+    return len <= AESD_CHANNEL_NAME_MAX ? len : 0;
+}
+
+// Add a channel, returns it, NULL if the table is full or the storage could not be opened
+struct CChannel *channel_table_add(struct CChannelTable *table, const char *name, const char *spec)
+{
+    if (table->count == AESD_CHANNEL_MAX)
+    {
+        return NULL;
+    }
+    struct CChannel *channel = channel_open(name, spec);
+    if (channel != NULL)
+    {
+        // Its history snapshots and entry reads are charged, not its storage
+        channel->budget = table->budget;
+        channel->history.budget = table->budget;
+        table->channels[table->count++] = channel;
+    }
+    return channel;
+}
+
+// Find the channel called name (name_len bytes), created in memory if unknown and create is set
+struct CChannel *channel_table_get(struct CChannelTable *table, const char *name, size_t name_len, bool create)
+{
+    get_mutex(&table->lock);
+    struct CChannel *channel = NULL;
+    for (size_t i = 0; i < table->count && channel == NULL; i++)
+    {
+        if (strlen(table->channels[i]->name) == name_len && memcmp(table->channels[i]->name, name, name_len) == 0)
+        {
+            channel = table->channels[i];
+        }
+    }
+    if (channel == NULL && create)
+    {
+        char copy[AESD_CHANNEL_NAME_MAX + 1];
+        snprintf(copy, sizeof(copy), "%.*s", (int)name_len, name);
+        channel = channel_table_add(table, copy, "memory");
+        if (channel != NULL && table->indexed && channel_enable_index(channel) != 0)
+        {
+            syslog(LOG_ERR, "Could not index the channel %s: %d", copy, errno);
+        }
+    }
+    release_mutex(&table->lock);
+    return channel;
+}
+
+// Move the connection to another channel, answer with the channel in use afterwards
+void run_channel_command(struct CConnection *conn, const char *p)
+{
+    char answer[sizeof(AESD_CHANNEL_COM) + AESD_CHANNEL_NAME_MAX + 1];
+    size_t name_len = channel_name_len(p);
+    // The name must fill the whole line
+    bool valid = name_len > 0 && (p[name_len] == '\0' || p[name_len] == '\n' || p[name_len] == '\r');
+    struct CChannel *channel = valid ? channel_table_get(conn->data->channels, p, name_len, true) : NULL;
+    if (channel == NULL)
+    {
+        syslog(LOG_ERR, "Channel %.*s refused, staying on %s", (int)name_len, p, conn->data->channel->name);
+    }
+    else if (channel != conn->data->channel)
+    {
+        conn->data->channel = channel;
+        // Positions are per channel, start over
+        conn->cursor = 0;
+    }
+    int answer_len = snprintf(answer, sizeof(answer), "%s%s\n", AESD_CHANNEL_COM, conn->data->channel->name);
+    send_control(conn, answer, answer_len);
+}
+
+// Send a history reply and report the first one since startup
+int send_history(struct CConnection *conn, const char *buf, size_t len)
+{
+    int bytes_sent = send_reply(conn, buf, len);
+    syslog(LOG_INFO, "Sent %d bytes of history as acknowledgement, ||%.*s||\n", bytes_sent, (int)len, buf);
+    if (bytes_sent == -1)
+    {
+        syslog(LOG_ERR, "Value of errno attempting to send data on %d: %d\n", conn->data->fd, errno);
+        return -1;
+    }
+    atomic_fetch_add(&conn->data->channel->replies, 1);
+    if (!atomic_exchange(&first_reply_sent, true))
+    {
+        syslog(LOG_INFO, "First reply sent %.1f ms after startup\n", (monotonic_ns() - startup_ns) / 1e6);
+    }
+    return 0;
+}
+
+// Proxy mode: reply of a forwarded line, passed to the client in order
+void proxy_reply(struct CConnection *conn, int status, const char *reply, size_t len, bool append)
+{
+    conn->proxy_pending--;
+    if (status != 0)
+    {
+        syslog(LOG_ERR, "Backend request failed: %d\n", -status);
+        conn->proxy_failed = true;
+        return;
+    }
+    if (append)
+    {
+        conn->entries++;
+    }
+    if (conn->proxy_failed)
+    {
+        return;
+    }
+    if (conn->proxy_skip > 0)
+    {
+        conn->proxy_skip--;
+        return;
+    }
+    int rc = 0;
+    // Seek commands are always answered with the history, like without the proxy
+    if (!append || conn->ingest == AESD_INGEST_ECHO)
+    {
+        rc = send_history(conn, reply, len);
+    }
+    else if (conn->ingest == AESD_INGEST_COUNT)
+    {
+        // The link counts the entries of all its borrowers, answer with our own count
+        char count[24];
+        int count_len = snprintf(count, sizeof(count), "%llu\n", (unsigned long long)conn->entries);
+        rc = send_control(conn, count, count_len) < 0 ? -1 : 0;
+    }
+    if (rc != 0)
+    {
+        conn->proxy_failed = true;
+    }
+}
+
+void proxy_append_reply(int status, const char *reply, size_t len, void *ctx)
+{
+    proxy_reply(ctx, status, reply, len, true);
+}
+
+void proxy_seek_reply(int status, const char *reply, size_t len, void *ctx)
+{
+    proxy_reply(ctx, status, reply, len, false);
+}
+
+// Proxy mode: forward a complete line to the backend of the channel, borrowing a link for the batch
+// of lines until the next proxy_flush(). Returns -1 if it could not be sent
+int proxy_queue(struct CConnection *conn, const char *line, size_t len)
+{
+    struct CThreadInstance *data = conn->data;
+    struct CChannel *channel = data->channel;
+    bool append = memmem(line, len, AESD_IOCL_COM, strlen(AESD_IOCL_COM)) == NULL;
+    if (conn->link == NULL)
+    {
+        unsigned backend = aesd_proxy_route(data->proxy, channel->name, strlen(channel->name));
+        conn->link = aesd_proxy_acquire(data->proxy, backend, conn->ingest != AESD_INGEST_ECHO);
+        if (conn->link == NULL)
+        {
+            conn->proxy_failed = true;
+            return -1;
+        }
+        if (aesd_proxy_select(conn->link, channel->name) != 0)
+        {
+            conn->proxy_failed = true;
+            return -1;
+        }
+    }
+    // Counted first, a broken connection calls back from the submission
+    conn->proxy_pending++;
+    if (aesd_client_submit(conn->link->client, line, len, append ? proxy_append_reply : proxy_seek_reply, conn) != 0)
+    {
+        conn->proxy_pending--;
+        conn->proxy_failed = true;
+        return -1;
+    }
+    atomic_fetch_add(&data->proxy->backends[conn->link->backend].requests, 1);
+    if (append)
+    {
+        atomic_fetch_add(&channel->writes, 1);
+        atomic_fetch_add(&channel->bytes, len);
+    }
+    return 0;
+}
+
+// Proxy mode: wait for the replies of the forwarded lines, sent to the client as they come, and give
+// the link back. A lost reply sets proxy_failed, the client connection is then closed like the backend's
+void proxy_flush(struct CConnection *conn)
+{
+    if (conn->link == NULL)
+    {
+        return;
+    }
+    while (conn->proxy_pending > 0)
+    {
+        if (aesd_client_poll(conn->link->client, -1) < 0)
+        {
+            break;
+        }
+    }
+    // A broken link fails what is still pending, calling back now
+    aesd_proxy_release(conn->data->proxy, conn->link, conn->proxy_failed || conn->proxy_pending > 0);
+    conn->link = NULL;
+    conn->proxy_pending = 0;
+    conn->proxy_skip = 0;
+}
+
+// Proxy mode: forward the complete lines to the backend of the channel. A pipelined client gets one
+// reply per line once the whole packet was forwarded (see process_pipelined), a plain one the reply
+// to the last line of the packet, like the history after all its writes.
+// Returns -1 if the connection should be closed
+int proxy_packet(struct CConnection *conn, const char *buf, size_t len)
+{
+    if (conn->partial_len + len > conn->partial_cap)
+    {
+        size_t new_cap = conn->partial_cap ? conn->partial_cap : BUFFER_SIZE;
+        while (new_cap < conn->partial_len + len)
+            new_cap *= 2;
+        char *tmp = realloc(conn->partial, new_cap);
+        if (tmp == NULL)
+        {
+            return -1;
+        }
+        conn->partial = tmp;
+        conn->partial_cap = new_cap;
+    }
+    memcpy(conn->partial + conn->partial_len, buf, len);
+    conn->partial_len += len;
+
+    size_t start = 0;
+    size_t queued = 0;
+    const char *eol;
+    while ((eol = memchr(conn->partial + start, '\n', conn->partial_len - start)) != NULL)
+    {
+        size_t line_len = eol - (conn->partial + start) + 1;
+        if (proxy_queue(conn, conn->partial + start, line_len) != 0)
+        {
+            break;
+        }
+        start += line_len;
+        queued++;
+    }
+    memmove(conn->partial, conn->partial + start, conn->partial_len - start);
+    conn->partial_len -= start;
+    if (!conn->pipelined || conn->proxy_failed)
+    {
+        conn->proxy_skip = queued > 0 ? queued - 1 : 0;
+        proxy_flush(conn);
+    }
+    return conn->proxy_failed ? -1 : 0;
+}
+
+// Parse "X,Y:" of a merge command into seekto, returns the names list after it, NULL if invalid
+const char *parse_merge_command(const char *p, struct aesd_seekto *seekto)
+{
+    char *endptr;
+    seekto->write_cmd = strtoul(p, &endptr, 10);
+    if (endptr == p || *endptr != ',')
+    {
+        return NULL;
+    }
+    p = endptr + 1;
+    seekto->write_cmd_offset = strtoul(p, &endptr, 10);
+    if (endptr == p || *endptr != ':')
+    {
+        return NULL;
+    }
+    return endptr + 1;
+}
+
+// Merge reply of one channel, kept until every backend answered
+struct CMergePart
+{
+    char *data;
+    size_t len;
+    bool done;
+};
+
+void merge_part_reply(int status, const char *reply, size_t len, void *ctx)
+{
+    struct CMergePart *part = ctx;
+    part->done = true;
+    if (status == 0 && (part->data = malloc(len)) != NULL)
+    {
+        memcpy(part->data, reply, len);
+        part->len = len;
+    }
+}
+
+// Read the channels named in the list, local ones or through their backends, into buf (MAX_BUFFER_SIZE
+// bytes), in the order of the list. Returns the reply size
+size_t read_merge(struct CConnection *conn, const struct aesd_seekto *seekto, const char *names, char *buf)
+{
+    struct CThreadInstance *data = conn->data;
+    struct CMergePart parts[AESD_MERGE_MAX] = {0};
+    struct aesd_proxy_link *links[AESD_MERGE_MAX] = {0};
+    size_t count = 0;
+    size_t total = 0;
+
+    // Send every request before waiting for the first reply
+    for (const char *p = names; count < AESD_MERGE_MAX; count++)
+    {
+        size_t name_len = channel_name_len(p);
+        char name[AESD_CHANNEL_NAME_MAX + 1];
+        snprintf(name, sizeof(name), "%.*s", (int)name_len, p);
+        if (data->proxy != NULL && name_len > 0)
+        {
+            unsigned backend = aesd_proxy_route(data->proxy, name, name_len);
+            links[count] = aesd_proxy_acquire(data->proxy, backend, false);
+            if (links[count] != NULL &&
+                (aesd_proxy_select(links[count], name) != 0 ||
+                 aesd_client_submit_seek(links[count]->client, seekto->write_cmd, seekto->write_cmd_offset,
+                                         merge_part_reply, &parts[count]) != 0))
+            {
+                parts[count].done = true;
+            }
+        }
+        else if (name_len > 0)
+        {
+            struct CChannel *channel = channel_table_get(data->channels, name, name_len, false);
+            if (channel != NULL)
+            {
+                // Read in place, a local channel is answered right away
+                get_mutex(&channel->file_mutex);
+                ssize_t offset = aesd_backend_seek_to(&channel->backend, seekto->write_cmd, seekto->write_cmd_offset);
+                ssize_t read_bytes = aesd_backend_read_at(&channel->backend, offset < 0 ? 0 : offset, buf + total,
+                                                          MAX_BUFFER_SIZE - total);
+                release_mutex(&channel->file_mutex);
+                total += read_bytes > 0 ? read_bytes : 0;
+            }
+        }
+        p += name_len;
+        if (*p != ',')
+        {
+            count++;
+            break;
+        }
+        p++;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (links[i] == NULL)
+        {
+            continue;
+        }
+        while (!parts[i].done && aesd_client_poll(links[i]->client, -1) >= 0)
+            ;
+        aesd_proxy_release(data->proxy, links[i], !parts[i].done || parts[i].data == NULL);
+        if (parts[i].data != NULL)
+        {
+            size_t len = parts[i].len < MAX_BUFFER_SIZE - total ? parts[i].len : MAX_BUFFER_SIZE - total;
+            memcpy(buf + total, parts[i].data, len);
+            total += len;
+            free(parts[i].data);
+        }
+    }
+    return total;
+}
+
+// Answer the merged history of several channels, cut at MAX_BUFFER_SIZE like any reply
+void run_merge_command(struct CConnection *conn, const char *p)
+{
+    struct aesd_seekto seekto;
+    const char *names = parse_merge_command(p, &seekto);
+    if (!conn_charge(conn, MAX_BUFFER_SIZE))
+    {
+        send_refusal(conn);
+        return;
+    }
+    char *buf = malloc(MAX_BUFFER_SIZE);
+    if (buf == NULL)
+    {
+        conn_uncharge(conn, MAX_BUFFER_SIZE);
+        return;
+    }
+    size_t len = 0;
+    if (names == NULL)
+    {
+        syslog(LOG_ERR, "Invalid merge command %s", p);
+    }
+    else
+    {
+        len = read_merge(conn, &seekto, names, buf);
+    }
+    send_history(conn, buf, len);
+    free(buf);
+    conn_uncharge(conn, MAX_BUFFER_SIZE);
+}
+
+// Save the committed entries of the channel in a snapshot. The storage is read with file_mutex held,
+// the file written without it. Returns the number of entries saved, -1 with errno set
+int save_snapshot(struct CChannel *channel, const char *path, size_t *bytes)
+{
+    char *data;
+    uint32_t *lens;
+    size_t charged;
+    get_mutex(&channel->file_mutex);
+    ssize_t count = read_entries(channel, &data, &lens, bytes, &charged);
+    release_mutex(&channel->file_mutex);
+    if (count < 0)
+    {
+        return -1;
+    }
+    int rc = aesd_snapshot_save(path, data, lens, count);
+    free_entries(channel, data, lens, charged);
+    return rc == 0 ? (int)count : -1;
+}
+
+// Snapshot the default channel into the file configured with -s
+void run_snapshot_command(struct CConnection *conn)
+{
+    char answer[sizeof(AESD_SNAPSHOT_COM) + 32];
+    int answer_len;
+    size_t bytes;
+    int count = -1;
+    if (conn->data->snapshot_path == NULL)
+    {
+        syslog(LOG_ERR, "No snapshot file configured, snapshot refused");
+    }
+    else if ((count = save_snapshot(conn->data->channels->channels[0], conn->data->snapshot_path, &bytes)) < 0)
+    {
+        syslog(LOG_ERR, "Could not save the snapshot %s: %d", conn->data->snapshot_path, errno);
+    }
+    if (count < 0)
+    {
+        answer_len = snprintf(answer, sizeof(answer), "%s-1\n", AESD_SNAPSHOT_COM);
+    }
+    else
+    {
+        syslog(LOG_INFO, "Snapshot of %d entries, %zu bytes saved in %s", count, bytes, conn->data->snapshot_path);
+        answer_len = snprintf(answer, sizeof(answer), "%s%d,%zu\n", AESD_SNAPSHOT_COM, count, bytes);
+    }
+    send_control(conn, answer, answer_len);
+}
+
+// Answer the replication state of this instance, and the lag when it follows a leader
+void run_replication_command(struct CConnection *conn)
+{
+    char answer[1024];
+    int answer_len = 0;
+    if (conn->data->repl_leader != NULL)
+    {
+        answer_len += aesd_repl_leader_status(conn->data->repl_leader, answer, sizeof(answer) - 1);
+        answer[answer_len++] = '\n';
+    }
+    if (conn->data->repl_follower != NULL)
+    {
+        answer_len += aesd_repl_follower_status(conn->data->repl_follower, answer + answer_len, sizeof(answer) - answer_len - 1);
+        answer[answer_len++] = '\n';
+    }
+    if (answer_len == 0)
+    {
+        answer_len = snprintf(answer, sizeof(answer), "role=none\n");
+    }
+    send_control(conn, answer, answer_len);
+}
+
+// Answer the datagram ingest counters
+void run_udp_command(struct CConnection *conn)
+{
+    char answer[256];
+    int answer_len = 0;
+    if (conn->data->udp != NULL)
+    {
+        answer_len = aesd_udp_status(conn->data->udp, answer, sizeof(answer) - 1);
+        answer[answer_len++] = '\n';
+    }
+    else
+    {
+        answer_len = snprintf(answer, sizeof(answer), "port=none\n");
+    }
+    send_control(conn, answer, answer_len);
+}
+
+struct CSearchReply
+{
+    char *buf;
+    size_t len;
+    size_t cap;             // room kept for the trailer
+};
+
+// List a match in the search reply while it fits
+bool add_search_match(uint64_t entry, uint64_t offset, const char *buf, size_t len, void *ctx)
+{
+    struct CSearchReply *reply = ctx;
+    int line_len = snprintf(reply->buf + reply->len, reply->cap - reply->len, "%llu,%llu:%.*s",
+                            (unsigned long long)entry, (unsigned long long)offset, (int)len, buf);
+    if (line_len < 0 || reply->len + line_len >= reply->cap)
+    {
+        // Counted only, the reply is full
+        reply->buf[reply->len] = '\0';
+        reply->cap = reply->len;
+        return true;
+    }
+    reply->len += line_len;
+    if (len == 0 || buf[len - 1] != '\n')
+    {
+        reply->buf[reply->len++] = '\n';
+    }
+    return true;
+}
+
+// Answer the entries of the channel holding the term, found with its index
+void run_search_command(struct CConnection *conn, const char *p)
+{
+    struct aesd_index *index = conn->data->channel->commit.index;
+    size_t term_len = strcspn(p, "\r\n");
+    char trailer[sizeof(AESD_SEARCH_COM) + 24];
+    if (index == NULL)
+    {
+        syslog(LOG_ERR, "Channel %s is not indexed, search refused", conn->data->channel->name);
+        int trailer_len = snprintf(trailer, sizeof(trailer), "%s-1\n", AESD_SEARCH_COM);
+        send_control(conn, trailer, trailer_len);
+        return;
+    }
+    if (!conn_charge(conn, MAX_BUFFER_SIZE))
+    {
+        send_refusal(conn);
+        return;
+    }
+    struct CSearchReply reply = {.buf = malloc(MAX_BUFFER_SIZE), .cap = MAX_BUFFER_SIZE - sizeof(trailer)};
+    if (reply.buf == NULL)
+    {
+        syslog(LOG_ERR, "No memory left for a search reply");
+        conn_uncharge(conn, MAX_BUFFER_SIZE);
+        return;
+    }
+    channel_sync_index(conn->data->channel);
+    uint64_t start_ns = monotonic_ns();
+    size_t matches = aesd_index_search(index, p, term_len, add_search_match, &reply);
+    syslog(LOG_INFO, "Search of %.*s in %s: %zu matches in %llu us", (int)term_len, p, conn->data->channel->name,
+           matches, (unsigned long long)(monotonic_ns() - start_ns) / 1000);
+    reply.len += snprintf(reply.buf + reply.len, sizeof(trailer), "%s%zu\n", AESD_SEARCH_COM, matches);
+    send_control(conn, reply.buf, reply.len);
+    free(reply.buf);
+    conn_uncharge(conn, MAX_BUFFER_SIZE);
+}
+
+// Handle a connection setting command. Returns true if buf was such a command
+bool run_connection_command(struct CConnection *conn, const char *buf)
+{
+    // Proxy mode: the replies to the lines forwarded before go first
+    if (conn->link != NULL && strncmp(buf, AESD_COMMAND_PREFIX, strlen(AESD_COMMAND_PREFIX)) == 0)
+    {
+        proxy_flush(conn);
+    }
+    if (strncmp(buf, AESD_COMPRESS_COM, strlen(AESD_COMPRESS_COM)) == 0)
+    {
+        run_compress_command(conn, buf + strlen(AESD_COMPRESS_COM));
+        return true;
+    }
+    if (strncmp(buf, AESD_PIPELINE_COM, strlen(AESD_PIPELINE_COM)) == 0)
+    {
+        run_pipeline_command(conn, buf + strlen(AESD_PIPELINE_COM));
+        return true;
+    }
+    if (strncmp(buf, AESD_INGEST_COM, strlen(AESD_INGEST_COM)) == 0)
+    {
+        run_ingest_command(conn, buf + strlen(AESD_INGEST_COM));
+        return true;
+    }
+    if (strncmp(buf, AESD_DELTA_COM, strlen(AESD_DELTA_COM)) == 0)
+    {
+        run_delta_command(conn, buf + strlen(AESD_DELTA_COM));
+        return true;
+    }
+    if (strncmp(buf, AESD_CHANNEL_COM, strlen(AESD_CHANNEL_COM)) == 0)
+    {
+        run_channel_command(conn, buf + strlen(AESD_CHANNEL_COM));
+        return true;
+    }
+    if (strncmp(buf, AESD_REPLICATION_COM, strlen(AESD_REPLICATION_COM)) == 0)
+    {
+        run_replication_command(conn);
+        return true;
+    }
+    if (strncmp(buf, AESD_SNAPSHOT_COM, strlen(AESD_SNAPSHOT_COM)) == 0)
+    {
+        run_snapshot_command(conn);
+        return true;
+    }
+    if (strncmp(buf, AESD_UDP_COM, strlen(AESD_UDP_COM)) == 0)
+    {
+        run_udp_command(conn);
+        return true;
+    }
+    if (strncmp(buf, AESD_MERGE_COM, strlen(AESD_MERGE_COM)) == 0)
+    {
+        run_merge_command(conn, buf + strlen(AESD_MERGE_COM));
+        return true;
+    }
+    if (strncmp(buf, AESD_SEARCH_COM, strlen(AESD_SEARCH_COM)) == 0)
+    {
+        run_search_command(conn, buf + strlen(AESD_SEARCH_COM));
+        return true;
+    }
+    return false;
+}
+
+// Delta mode: read the bytes committed since the previous reply into buf (MAX_BUFFER_SIZE bytes),
+// preceded by the gap line if some of them were evicted. Caller holds file_mutex. Returns the reply
+// size, -1 on error
+ssize_t read_delta(struct CConnection *conn, char *buf)
+{
+    struct CChannel *channel = conn->data->channel;
+    uint64_t committed = channel->commit.committed;
+    // Position of the oldest byte still stored, a file keeps everything
+    uint64_t base = 0;
+    if (channel->backend.bounded)
+    {
+        ssize_t size = aesd_backend_size(&channel->backend);
+        if (size < 0)
+        {
+            return -1;
+        }
+        base = committed > (uint64_t)size ? committed - size : 0;
+    }
+
+    uint64_t from = conn->cursor;
+    size_t reply_len = 0;
+    if (from < base)
+    {
+        // 0 is the first reply, the whole history is expected
+        if (from != 0)
+        {
+            reply_len = snprintf(buf, MAX_BUFFER_SIZE, "%s%llu\n", AESD_DELTA_GAP, (unsigned long long)(base - from));
+        }
+        from = base;
+    }
+    // A partial entry is not part of the history yet, even if the storage shows it
+    size_t len = committed > from ? committed - from : 0;
+    if (len > MAX_BUFFER_SIZE - reply_len)
+    {
+        len = MAX_BUFFER_SIZE - reply_len;
+    }
+    ssize_t read_bytes = aesd_backend_read_at(&channel->backend, from - base, buf + reply_len, len);
+    if (read_bytes < 0)
+    {
+        return -1;
+    }
+    conn->cursor = from + read_bytes;
+    return reply_len + read_bytes;
+}
+
+// Write a packet into the storage of the channel and hand its entries to the consumers. Caller holds
+// file_mutex. Returns the bytes written, -1 on error
+ssize_t store_packet(struct CChannel *channel, const char *buf, size_t len)
+{
+    ssize_t written_bytes = aesd_backend_append(&channel->backend, buf, len);
+    if (written_bytes < 0)
+    {
+        syslog(LOG_ERR, "Value of errno attempting to write into %s: %d\n", channel->backend.name, errno);
+        return -1;
+    }
+    syslog(LOG_INFO, "Received %zu bytes, wrote %zd bytes into channel %s\n", len, written_bytes, channel->name);
+    atomic_fetch_add(&channel->writes, 1);
+    atomic_fetch_add(&channel->bytes, written_bytes);
+    // Same bytes, same order as the storage, since we still hold file_mutex
+    commit_received(&channel->commit, buf, len);
+    return written_bytes;
+}
+
+// Write a packet into the device, or run the seek command it holds, then send the history back if requested.
+// Returns -1 if the connection should be closed
+int handle_packet(struct CConnection *conn, const char *buf, size_t len, bool reply)
+{
+    struct CThreadInstance *data = conn->data;
+    struct CChannel *channel = data->channel;
+    if (data->proxy != NULL)
+    {
+        // Stored by the backend of the channel, whole lines only
+        return proxy_packet(conn, buf, len);
+    }
+    const char *prefix = AESD_IOCL_COM;
+    // If received string is an IOCTL, special handling
+    const char *p = memmem(buf, len, prefix, strlen(prefix));
+    // Delta replies are read with file_mutex held, right after the write
+    bool delta = p == NULL && reply && conn->delta && conn->ingest == AESD_INGEST_ECHO;
+    // Its reply buffer is allocated before taking the device. Over the memory budget the reply is
+    // refused rather than waited for, the memory could only come back from this connection
+    char *sendBuffer = NULL;
+    bool refused = false;
+    if ((p != NULL || delta) && reply)
+    {
+        if (!conn_charge(conn, MAX_BUFFER_SIZE))
+        {
+            // A seek does nothing else, a write is still stored
+            if (p != NULL)
+            {
+                return send_refusal(conn);
+            }
+            delta = false;
+            refused = true;
+        }
+        else if ((sendBuffer = malloc(MAX_BUFFER_SIZE)) == NULL)
+        {
+            conn_uncharge(conn, MAX_BUFFER_SIZE);
+            return -1;
+        }
+    }
+
+    get_mutex(&channel->file_mutex);
+
+    // Keep file_mutex between the seek and the read, no write may move the entries in between
+    if (p != NULL) {
+        syslog(LOG_INFO, "The request is a IOCTL command to set the read pointer");
+
+        // Move past the prefix and run the ioctl command, an invalid seek reads from the beginning
+        ssize_t offset = run_ioctl_command(p + strlen(prefix), &channel->backend);
+        if (!reply)
+        {
+            release_mutex(&channel->file_mutex);
+            return 0;
+        }
+        ssize_t read_bytes = aesd_backend_read_at(&channel->backend, offset < 0 ? 0 : offset, sendBuffer, MAX_BUFFER_SIZE);
+        release_mutex(&channel->file_mutex);
+        int rc = read_bytes < 0 ? -1 : send_history(conn, sendBuffer, read_bytes);
+        free(sendBuffer);
+        conn_uncharge(conn, MAX_BUFFER_SIZE);
+        return rc;
+    }
+
+    // A replica only holds what the leader committed, the packet is answered like a read
+    if (channel->replica)
+    {
+        syslog(LOG_ERR, "Channel %s is a replica, %zu bytes not written\n", channel->name, len);
+    }
+    else if (store_packet(channel, buf, len) < 0)
+    {
+        release_mutex(&channel->file_mutex);
+        if (sendBuffer != NULL)
+        {
+            free(sendBuffer);
+            conn_uncharge(conn, MAX_BUFFER_SIZE);
+        }
+        return -1;
+    }
+    // The bytes are in the storage before anyone reads this generation
+    uint64_t generation = channel->replica ? aesd_history_generation(&channel->history)
+                                           : aesd_history_written(&channel->history);
+    if (delta)
+    {
+        // Not shared: every connection has its own position
+        ssize_t reply_len = read_delta(conn, sendBuffer);
+        release_mutex(&channel->file_mutex);
+        int rc = reply_len < 0 ? -1 : send_history(conn, sendBuffer, reply_len);
+        free(sendBuffer);
+        conn_uncharge(conn, MAX_BUFFER_SIZE);
+        return rc;
+    }
+    release_mutex(&channel->file_mutex);
+
+    if (!reply)
+    {
+        // Partial packet, the entry will be completed by the next ones
+        return 0;
+    }
+    if (refused)
+    {
+        // The delta position stays at the previous reply, the next one includes this write
+        return send_refusal(conn);
+    }
+
+    // Ingest mode: the history is neither read nor sent
+    if (conn->ingest != AESD_INGEST_ECHO)
+    {
+        for (const char *eol = buf; (eol = memchr(eol, '\n', buf + len - eol)) != NULL; eol++)
+        {
+            conn->entries++;
+        }
+        if (conn->ingest == AESD_INGEST_SILENT)
+        {
+            return 0;
+        }
+        char count[24];
+        int count_len = snprintf(count, sizeof(count), "%llu\n", (unsigned long long)conn->entries);
+        return send_control(conn, count, count_len) < 0 ? -1 : 0;
+    }
+
+    // Full history including our write, shared with the connections replying at the same time
+    struct aesd_history *history = aesd_history_get(&channel->history, generation);
+    if (history == NULL)
+    {
+        // The write is stored, only its reply does not fit in the memory budget
+        return data->budget != NULL && errno == ENOMEM ? send_refusal(conn) : -1;
+    }
+    int rc = send_history(conn, history->data, history->len);
+    aesd_history_put(history);
+    return rc;
+}
+
+// Handle a packet, or a line in pipelined mode, between the request probes
+int process_packet(struct CConnection *conn, const char *buf, size_t len, bool reply)
+{
+    AESD_PROBE3(request__start, conn->data->handle, len, reply);
+    int rc = handle_packet(conn, buf, len, reply);
+    AESD_PROBE2(request__done, conn->data->handle, rc);
+    return rc;
+}
+
+// Pipelined mode: split the received bytes in lines, each complete line being one request.
+// A line without its new line yet is kept until the next packets complete it.
+int process_pipelined(struct CConnection *conn, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        const char *eol = memchr(buf, '\n', len);
+        size_t chunk = eol ? (size_t)(eol - buf) + 1 : len;
+        if (conn->line_len + chunk > BUFFER_SIZE)
+        {
+            // Too long to be a command, forward what we have as data, like the plain mode does
+            if (conn->line_len > 0 && process_packet(conn, conn->line, conn->line_len, false) != 0)
+                return -1;
+            conn->line_len = 0;
+            if (!eol)
+                return process_packet(conn, buf, len, false);
+            if (process_packet(conn, buf, chunk, true) != 0)
+                return -1;
+        }
+        else
+        {
+            // Memory budget mode: the line buffer is borrowed while a line is being assembled
+            if (conn->line == NULL && (conn->line = aesd_budget_borrow(conn->data->budget)) == NULL)
+                return -1;
+            memcpy(conn->line + conn->line_len, buf, chunk);
+            conn->line_len += chunk;
+            if (eol)
+            {
+                // Commands are null terminated strings for the parsers
+                conn->line[conn->line_len] = '\0';
+                if (!run_connection_command(conn, conn->line) &&
+                    process_packet(conn, conn->line, conn->line_len, true) != 0)
+                    return -1;
+                conn->line_len = 0;
+            }
+        }
+        buf += chunk;
+        len -= chunk;
+    }
+    // Proxy mode: the lines of the packet were forwarded back to back, now wait for their replies
+    proxy_flush(conn);
+    return conn->proxy_failed ? -1 : 0;
+}
+
+// Memory budget mode: an idle connection holds no buffer. Give the receive buffer back, and the line
+// buffer unless a pipelined line is being assembled, wait for the next packet, then borrow a receive
+// buffer again. Returns it, NULL if the connection should be closed
+char *borrow_receive_buffer(struct CConnection *conn, char *buffer)
+{
+    struct aesd_budget *budget = conn->data->budget;
+    if (buffer != NULL)
+    {
+        aesd_budget_return(budget, buffer);
+    }
+    if (conn->line != NULL && conn->line_len == 0)
+    {
+        aesd_budget_return(budget, conn->line);
+        conn->line = NULL;
+    }
+    struct pollfd pfd = {.fd = conn->data->fd, .events = POLLIN};
+    int rc;
+    while ((rc = poll(&pfd, 1, -1)) < 0 && errno == EINTR)
+        ;
+    return rc < 0 ? NULL : aesd_budget_borrow(budget);
+}
+
+/// Thread processes new transmission
+void* threadfunc(void* thread_param)
+{
+    clock_t start = clock();
+
+    // Cast input param back to a useful type
+    struct CThreadInstance* data = (struct CThreadInstance *) thread_param;
+    struct CConnection conn = {.data = data};
+
+    // Receive data from open port, keep one byte for the null terminator used by the parsers.
+    // Borrowed packet by packet in memory budget mode
+    char* buffer = data->budget != NULL ? NULL : malloc(BUFFER_SIZE + 1);
+    // Pipelined mode line, assembled over several packets if needed
+    conn.line = data->budget != NULL ? NULL : malloc(BUFFER_SIZE + 1);
+    if (data->latency != NULL && buffer != NULL && conn.line != NULL)
+    {
+        // Fault the buffers in now rather than on the first request
+        aesd_latency_prefault(buffer, BUFFER_SIZE + 1);
+        aesd_latency_prefault(conn.line, BUFFER_SIZE + 1);
+    }
+
+    // Total number of bytes received by this thread
+    int32_t len = 0;
+
+    // Extracting client IP address from the socket address storage
+    struct sockaddr_in *sin = (struct sockaddr_in *)&(data->client_addr);
+    unsigned char *client_ip = (unsigned char *)&sin->sin_addr.s_addr;
+    unsigned short int client_port = sin->sin_port;
+    if (data->fd != -1)
+    {
+        syslog(LOG_INFO, "Accepted connection from %d.%d.%d.%d:%d\n", client_ip[0], client_ip[1], client_ip[2], client_ip[3], client_port);
+    }
+
+    while (keepRunning && (data->budget != NULL || (buffer != NULL && conn.line != NULL)))
+    {
+        if (data->budget != NULL && (buffer = borrow_receive_buffer(&conn, buffer)) == NULL)
+        {
+            break;
+        }
+        // Low-latency mode spins on the socket instead of sleeping until data arrives
+        int bytes_num = data->latency != NULL ? aesd_latency_recv(data->fd, buffer, BUFFER_SIZE, &keepRunning)
+                                              : recv(data->fd, buffer, BUFFER_SIZE, 0);
+        if (bytes_num == 0)
+        {
+            // 0 byte received, the connection was closed by the client
+            break;
+        }
+        if (bytes_num == -1)
+        {
+            // Errno 107 means that the socket is NOT connected (any more)
+            syslog(LOG_ERR, "Value of errno attempting to receive data from %d.%d.%d.%d: %d\n", client_ip[0], client_ip[1], client_ip[2], client_ip[3], errno);
+            //printf("Could not receive data from client, ending receiving, errno is %d\n", errno);
+            break;
+        }
+        buffer[bytes_num] = '\0';
+        // Store the last received packet in target file
+        len += bytes_num;
+        if (data->capture != NULL)
+        {
+            aesd_capture_data(data->capture, data->conn_id, buffer, bytes_num);
+        }
+
+        if (conn.pipelined)
+        {
+            if (process_pipelined(&conn, buffer, bytes_num) != 0)
+                break;
+            continue;
+        }
+
+        // Connection settings are handled locally, without touching the device
+        if (run_connection_command(&conn, buffer))
+        {
+            continue;
+        }
+
+        // If new line character, this is the last package and send the answer
+        bool reply = memchr(buffer, '\n', bytes_num) != NULL;
+        if (process_packet(&conn, buffer, bytes_num, reply) != 0)
+        {
+            break;
+        }
+    }
+    
+    clock_t end = clock();
+    float seconds = (float)(end - start) / CLOCKS_PER_SEC;
+    syslog(LOG_INFO, "Thread %d finished, received a total of %d data from the client after %f seconds\n", data->fd, len, seconds);
+    if (data->budget != NULL)
+    {
+        if (buffer != NULL)
+            aesd_budget_return(data->budget, buffer);
+        if (conn.line != NULL)
+            aesd_budget_return(data->budget, conn.line);
+    }
+    else
+    {
+        free(buffer);
+        free(conn.line);
+    }
+    proxy_flush(&conn);
+    free(conn.partial);
+    if (conn.lz != NULL)
+    {
+        free_compression(&conn);
+    }
+    if (conn.frame != NULL)
+    {
+        free(conn.frame);
+        conn_uncharge(&conn, aesd_lz_bound(MAX_BUFFER_SIZE));
+    }
+    if (data->capture != NULL)
+    {
+        aesd_capture_closed(data->capture, data->conn_id);
+    }
+    AESD_PROBE2(conn__close, data->handle, len);
+    // The main loop joins this thread and closes the connection as soon as it is posted
+    connection_finished(data);
+    return thread_param;
+}
+
+// Start the connection thread: pinned in low-latency mode, with a small stack in memory budget mode
+int start_thread(struct CThreadInstance *data)
+{
+    pthread_attr_t attr;
+    if (data->latency != NULL)
+    {
+        if (aesd_latency_socket(data->fd) != 0)
+        {
+            syslog(LOG_ERR, "Could not enable busy polling on %d: %d\n", data->fd, errno);
+        }
+        if (aesd_latency_thread_attr(data->latency, &attr) < 0)
+        {
+            return -1;
+        }
+    }
+    else if (data->budget != NULL)
+    {
+        if (pthread_attr_init(&attr) != 0)
+        {
+            return -1;
+        }
+        pthread_attr_setstacksize(&attr, BUDGET_STACK_SIZE);
+    }
+    else
+    {
+        return pthread_create(&data->thread, NULL, threadfunc, data);
+    }
+    int rc = pthread_create(&data->thread, &attr, threadfunc, data);
+    pthread_attr_destroy(&attr);
+    return rc;
+}
+
+struct CReplayContext
+{
+    struct aesd_backend *backend;
+    struct aesd_shm *shm;
+};
+
+// Write a replayed log entry back into the storage
+void replay_entry(const char *buf, size_t len, void *ctx)
+{
+    struct CReplayContext *replay = ctx;
+    // One write per entry, the driver commits an entry on each trailing new line
+    aesd_backend_append(replay->backend, buf, len);
+    // Not logged again, but local readers should see what the device holds
+    if (replay->shm != NULL)
+    {
+        aesd_shm_publish(replay->shm, buf, len);
+    }
+}
+
+// Reload the tail of the write-ahead log, only if the storage lost its content (module reload, reboot,
+// memory backend)
+void restore_from_wal(struct aesd_wal *wal, struct aesd_backend *backend, struct aesd_shm *shm)
+{
+    ssize_t size = aesd_backend_size(backend);
+    if (size < 0)
+    {
+        syslog(LOG_ERR, "Value of errno attempting to open %s: %d\n", backend->name, errno);
+        return;
+    }
+    if (size == 0)
+    {
+        struct CReplayContext replay = {backend, shm};
+        int replayed = aesd_wal_replay(wal, aesd_backend_depth(backend), replay_entry, &replay);
+        syslog(LOG_INFO, "Device was empty, replayed %d entries from the write-ahead log\n", replayed);
+    }
+    else
+    {
+        syslog(LOG_INFO, "Device already holds data, write-ahead log not replayed\n");
+    }
+}
+
+// Follower: write an entry committed by the leader into the replica channel. Published in turn to
+// the local consumers, so a follower can log it, share it and lead followers of its own
+void replicate_entry(const char *buf, size_t len, void *ctx)
+{
+    struct CChannel *channel = ctx;
+    get_mutex(&channel->file_mutex);
+    if (store_packet(channel, buf, len) >= 0)
+    {
+        aesd_history_written(&channel->history);
+    }
+    release_mutex(&channel->file_mutex);
+}
+
+// Datagram ingest: write a batch of entries into the default channel with one grouped write, under one
+// file_mutex hold, then hand them to the consumers like packets of a connection
+void store_datagrams(const struct iovec *iov, unsigned count, void *ctx)
+{
+    struct CChannel *channel = ctx;
+    get_mutex(&channel->file_mutex);
+    if (channel->replica)
+    {
+        release_mutex(&channel->file_mutex);
+        syslog(LOG_ERR, "Channel %s is a replica, %u datagrams not written\n", channel->name, count);
+        return;
+    }
+    ssize_t written_bytes = aesd_backend_appendv(&channel->backend, iov, count);
+    if (written_bytes < 0)
+    {
+        release_mutex(&channel->file_mutex);
+        syslog(LOG_ERR, "Value of errno attempting to write into %s: %d\n", channel->backend.name, errno);
+        return;
+    }
+    atomic_fetch_add(&channel->writes, count);
+    atomic_fetch_add(&channel->bytes, written_bytes);
+    for (unsigned i = 0; i < count; i++)
+    {
+        commit_received(&channel->commit, iov[i].iov_base, iov[i].iov_len);
+    }
+    aesd_history_written(&channel->history);
+    release_mutex(&channel->file_mutex);
+}
+
+struct CStageContext
+{
+    struct aesd_stages stages;
+    struct CChannel *channel;
+};
+
+void put_history(void *history)
+{
+    aesd_history_put(history);
+}
+
+// Staged mode, commit stage: the packets of a batch are written, or their seek command run, in their
+// order under one file_mutex hold. Then the appends are answered with one history including the batch
+void commit_requests(struct aesd_stage_request **requests, unsigned count, void *ctx)
+{
+    struct CStageContext *staged = ctx;
+    struct CChannel *channel = staged->channel;
+    const char *prefix = AESD_IOCL_COM;
+    bool written = false;
+    get_mutex(&channel->file_mutex);
+    for (unsigned i = 0; i < count; i++)
+    {
+        struct aesd_stage_request *request = requests[i];
+        if (request->close)
+        {
+            continue;
+        }
+        if (strncmp(request->buf, AESD_STAGES_COM, strlen(AESD_STAGES_COM)) == 0)
+        {
+            char *answer = malloc(BUFFER_SIZE);
+            if (answer != NULL)
+            {
+                request->out = answer;
+                request->out_len = aesd_stage_status(&staged->stages, answer, BUFFER_SIZE);
+                request->out_free = free;
+                request->out_ref = answer;
+            }
+            continue;
+        }
+        const char *p = memmem(request->buf, request->len, prefix, strlen(prefix));
+        if (p != NULL)
+        {
+            // Read right away, no write of the batch may move the entries in between
+            ssize_t offset = run_ioctl_command(p + strlen(prefix), &channel->backend);
+            char *reply = request->reply ? malloc(MAX_BUFFER_SIZE) : NULL;
+            if (reply == NULL)
+            {
+                continue;
+            }
+            ssize_t read_bytes = aesd_backend_read_at(&channel->backend, offset < 0 ? 0 : offset, reply, MAX_BUFFER_SIZE);
+            if (read_bytes < 0)
+            {
+                syslog(LOG_ERR, "Value of errno attempting to read %s: %d\n", channel->backend.name, errno);
+                free(reply);
+                continue;
+            }
+            request->out = reply;
+            request->out_len = read_bytes;
+            request->out_free = free;
+            request->out_ref = reply;
+            continue;
+        }
+        // The other commands need the connection thread, they are refused rather than stored as data
+        if (strncmp(request->buf, AESD_COMMAND_PREFIX, strlen(AESD_COMMAND_PREFIX)) == 0)
+        {
+            const char *end = memchr(request->buf, ':', request->len);
+            size_t name_len = end != NULL ? (size_t)(end - request->buf) + 1 : strlen(AESD_COMMAND_PREFIX);
+            char *answer = malloc(name_len + sizeof("-1\n"));
+            if (answer != NULL)
+            {
+                request->out_len = snprintf(answer, name_len + sizeof("-1\n"), "%.*s-1\n", (int)name_len, request->buf);
+                request->out = answer;
+                request->out_free = free;
+                request->out_ref = answer;
+            }
+            continue;
+        }
+        // A replica only holds what the leader committed, the packet is answered like a read
+        if (channel->replica)
+        {
+            syslog(LOG_ERR, "Channel %s is a replica, %zu bytes not written\n", channel->name, request->len);
+        }
+        else if (store_packet(channel, request->buf, request->len) >= 0)
+        {
+            written = true;
+        }
+        if (request->reply)
+        {
+            // Answered with the history below
+            request->out_free = put_history;
+        }
+    }
+    uint64_t generation = written ? aesd_history_written(&channel->history) : aesd_history_generation(&channel->history);
+    release_mutex(&channel->file_mutex);
+
+    // The first reply reads the storage, the next ones share the same history
+    for (unsigned i = 0; i < count; i++)
+    {
+        struct aesd_stage_request *request = requests[i];
+        if (request->close || request->out_free != put_history)
         {
-            syslog(LOG_ERR, "Value of errno attempting to open file %s: %d\n", FILEPATH, errno);
-            break;
+            continue;
         }
-        // +11 because tsstr was appended with the new line character and outstr
-        int written_bytes = fwrite(tsstr, sizeof(char), bytes_num+11, file);
-        fclose(file);
-        release_mutex(ts_data->file_mutex);
-        syslog(LOG_INFO, "Timestamp thread: wrote %d bytes into target file\n", written_bytes);
+        struct aesd_history *history = aesd_history_get(&channel->history, generation);
+        if (history == NULL)
+        {
+            request->out_free = NULL;
+            continue;
+        }
+        request->out = history->data;
+        request->out_len = history->len;
+        request->out_ref = history;
     }
-    return thread_ts_param;
 }
 
-// Prepare and execute ioctl syscall
-int run_ioctl_command(const char *p, int fd)
+// Load the entries of a snapshot into the storage, only if it is empty (module reload, reboot, memory
+// backend). Its entries are not logged again, like a log replay
+void load_snapshot(const char *path, struct aesd_backend *backend, struct aesd_shm *shm)
 {
-    syslog(LOG_INFO, "Entering ioctl, working with %s\n", p);
-    char *endptr;
-    struct aesd_seekto seekto;
-
-    // Now we are looking for X (command) and Y (offset)
-    errno = 0;  // Clear errno before the call
-    seekto.write_cmd = strtoul(p, &endptr, 10);
-    if (errno == ERANGE)
+    ssize_t size = aesd_backend_size(backend);
+    if (size != 0)
     {
-        errno = 0;
-        syslog(LOG_ERR, "Could not convert X value to an unsigned int");
+        syslog(LOG_INFO, "Storage %s not empty, snapshot not loaded\n", backend->name);
+        return;
+    }
+    uint64_t start_ns = monotonic_ns();
+    struct CReplayContext replay = {backend, shm};
+    int loaded = aesd_snapshot_load(path, replay_entry, &replay);
+    if (loaded < 0)
+    {
+        syslog(errno == ENOENT ? LOG_INFO : LOG_ERR, "Snapshot %s not loaded: %d\n", path, errno);
+        return;
     }
+    syslog(LOG_INFO, "Loaded %d entries from the snapshot %s in %.2f ms\n", loaded, path, (monotonic_ns() - start_ns) / 1e6);
+}
 
-    // Parse the second number (Y)
-    p = endptr + 1; // Move past the comma
-    seekto.write_cmd_offset = strtoul(p, &endptr, 10);
-    if (errno == ERANGE)
+// Read the storage once, so the first request does not pay for loading the driver and its pages
+void warm_device(struct aesd_backend *backend)
+{
+    char warm[MAX_BUFFER_SIZE];
+    ssize_t read_bytes = aesd_backend_read_at(backend, 0, warm, sizeof(warm));
+    if (read_bytes < 0)
     {
-        errno = 0;
-        syslog(LOG_ERR, "Could not convert Y value to an unsigned int");
+        syslog(LOG_ERR, "Value of errno attempting to read %s: %d\n", backend->name, errno);
+        return;
     }
+    syslog(LOG_INFO, "Storage %s opened, %zd bytes of history\n", backend->name, read_bytes);
+}
 
-    syslog(LOG_INFO,"Found X = %u and Y = %u", seekto.write_cmd, seekto.write_cmd_offset);
+// The listening socket is open, the device and the optional consumers are set up: tell the parent
+// waiting in create_deamon() and the service manager that requests can be sent
+void signal_ready(int ready_fd)
+{
+    double startup_ms = (monotonic_ns() - startup_ns) / 1e6;
+    if (ready_fd >= 0)
+    {
+        char ready = 1;
+        if (write(ready_fd, &ready, 1) != 1)
+        {
+            syslog(LOG_ERR, "Could not signal readiness to the parent process: %d\n", errno);
+        }
+        close(ready_fd);
+    }
+    char state[64];
+    snprintf(state, sizeof(state), "READY=1\nSTATUS=Ready after %.1f ms", startup_ms);
+    if (aesd_notify(state) < 0)
+    {
+        syslog(LOG_ERR, "Could not notify the service manager: %d\n", errno);
+    }
+    syslog(LOG_INFO, "Ready to accept connections %.1f ms after startup\n", startup_ms);
+}
 
-    // Here we bypass the ioctl function, and directly update the f_pos pointer.
-    return ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto);
+void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-d] [-w wal_dir] [-F fsync_interval_ms] [-S segment_bytes] [-m shm_name] [-c capture_file] [-L cpu_list] [-M budget_mb] [-b backend] [-C name=backend]... [-p port] [-R repl_port] [-f leader_host:repl_port] [-P host:port[,host:port]...] [-s snapshot_file] [-u udp_port] [-T cpu_list] [-i]\n", name);
+    fprintf(stderr, "  -d  run as daemon\n");
+    fprintf(stderr, "  -w  persist committed entries in a write-ahead log stored in wal_dir\n");
+    fprintf(stderr, "  -F  group fdatasync interval in ms, 0 syncs every entry (default 0)\n");
+    fprintf(stderr, "  -S  size of a log segment in bytes (default %d)\n", AESD_WAL_SEGMENT_SIZE);
+    fprintf(stderr, "  -m  publish committed entries in the shared memory ring shm_name (e.g. %s)\n", AESD_SHM_NAME);
+    fprintf(stderr, "  -c  record every received packet in capture_file, to be replayed with aesd-replay\n");
+    fprintf(stderr, "  -L  low-latency mode, connection threads busy poll on the cpus of cpu_list (e.g. 2-3)\n");
+    fprintf(stderr, "  -M  memory budget mode, connections share at most budget_mb MB, further clients wait\n");
+    fprintf(stderr, "  -b  storage: device[:path], file:path or memory[:depth] (default device:%s)\n", AESD_BACKEND_DEVICE_PATH);
+    fprintf(stderr, "  -C  add the channel name stored in backend, selected with %sname (repeatable)\n", AESD_CHANNEL_COM);
+    fprintf(stderr, "  -p  port of the clients (default %s)\n", PORT);
+    fprintf(stderr, "  -R  replication leader, followers connect to repl_port\n");
+    fprintf(stderr, "  -f  replication follower of the leader at leader_host:repl_port, the default channel is read-only\n");
+    fprintf(stderr, "  -s  load the default channel from snapshot_file if its storage is empty, save it there on %s and at exit\n", AESD_SNAPSHOT_COM);
+    fprintf(stderr, "  -u  datagram ingest, each UDP datagram received on udp_port is appended to the default channel\n");
+    fprintf(stderr, "  -i  index the channels for %sterm\n", AESD_SEARCH_COM);
+    fprintf(stderr, "  -T  staged mode, the connections share network, commit and send threads pinned on the cpus of cpu_list\n");
+    fprintf(stderr, "  -P  proxy mode, every channel is stored by one of the aesdsocket backends listed, nothing here\n");
 }
 
-/// Thread processes new transmission
-void* threadfunc(void* thread_param)
+int main(int argc, char** argv)
 {
-    int fd;
-    char *p;
-    const char *prefix = "AESDCHAR_IOCSEEKTO:";
-    bool is_ioctl = false;
-    clock_t start = clock();
+    startup_ns = monotonic_ns();
+    bool daemon_mode = false;
+    char wal_dir[PATH_MAX] = {0};
+    unsigned fsync_interval_ms = 0;
+    size_t segment_size = AESD_WAL_SEGMENT_SIZE;
+    const char *shm_name = NULL;
+    const char *capture_path = NULL;
+    struct aesd_latency latency;
+    bool low_latency = false;
+    size_t budget_mb = 0;
+    const char *backend_spec = "device";
+    // Channels besides the default one, "name=backend"
+    const char *channel_specs[AESD_CHANNEL_MAX - 1];
+    size_t channel_spec_count = 0;
+    const char *port = PORT;
+    const char *repl_port = NULL;
+    const char *leader_address = NULL;
+    const char *proxy_list = NULL;
+    char snapshot_path[PATH_MAX] = {0};
+    const char *udp_port = NULL;
+    struct aesd_latency stage_cpus;
+    bool staged_mode = false;
+    bool indexed = false;
+    int opt;
 
-    // Cast input param back to a useful type
-    struct CThreadInstance* data = (struct CThreadInstance *) thread_param;
+    while ((opt = getopt(argc, argv, "dw:F:S:m:c:L:M:b:C:p:R:f:P:s:u:T:i")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            daemon_mode = true;
+            break;
+        case 'w':
+            // The daemon changes its working directory, so keep an absolute path
+            mkdir(optarg, 0755);
+            if (realpath(optarg, wal_dir) == NULL)
+            {
+                perror("realpath");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'F':
+            fsync_interval_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            segment_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            shm_name = optarg;
+            break;
+        case 'c':
+            capture_path = optarg;
+            break;
+        case 'L':
+            if (aesd_latency_parse(&latency, optarg) != 0)
+            {
+                fprintf(stderr, "Invalid cpu list %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            low_latency = true;
+            break;
+        case 'M':
+            budget_mb = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            backend_spec = optarg;
+            break;
+        case 'C':
+            if (channel_spec_count == AESD_CHANNEL_MAX - 1)
+            {
+                fprintf(stderr, "At most %d channels\n", AESD_CHANNEL_MAX);
+                return EXIT_FAILURE;
+            }
+            channel_specs[channel_spec_count++] = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'R':
+            repl_port = optarg;
+            break;
+        case 'f':
+            leader_address = optarg;
+            break;
+        case 'P':
+            proxy_list = optarg;
+            break;
+        case 's':
+            // The daemon changes its working directory, and the file may not exist yet
+            if (optarg[0] != '/')
+            {
+                if (getcwd(snapshot_path, sizeof(snapshot_path)) == NULL ||
+                    strlen(snapshot_path) + strlen(optarg) + 2 > sizeof(snapshot_path))
+                {
+                    fprintf(stderr, "Invalid snapshot file %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                strcat(snapshot_path, "/");
+            }
+            strncat(snapshot_path, optarg, sizeof(snapshot_path) - strlen(snapshot_path) - 1);
+            break;
+        case 'u':
+            udp_port = optarg;
+            break;
+        case 'T':
+            if (aesd_latency_parse(&stage_cpus, optarg) != 0)
+            {
+                fprintf(stderr, "Invalid cpu list %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            staged_mode = true;
+            break;
+        case 'i':
+            indexed = true;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
 
-    // Receive data from open port
-    char* buffer = malloc(BUFFER_SIZE);
+    // A spinning thread keeps its core for itself, it is not worth saving its memory
+    if (low_latency && budget_mb > 0)
+    {
+        fprintf(stderr, "Low-latency and memory budget modes cannot be combined\n");
+        return EXIT_FAILURE;
+    }
 
-    // Total number of bytes received by this thread
-    int32_t len = 0;
+    // The stages replace the connection threads these modes are about
+    if (staged_mode && (low_latency || budget_mb > 0 || proxy_list != NULL || capture_path != NULL))
+    {
+        fprintf(stderr, "Staged mode cannot be combined with -L, -M, -P or -c\n");
+        return EXIT_FAILURE;
+    }
 
-    // Extracting client IP address from the socket address storage
-    struct sockaddr_in *sin = (struct sockaddr_in *)&(data->client_addr);
-    unsigned char *client_ip = (unsigned char *)&sin->sin_addr.s_addr;
-    unsigned short int client_port = sin->sin_port;
-    if (data->fd != -1)
+    // A proxy stores nothing: its channels only hold statistics, the entries are on the backends
+    struct aesd_proxy proxy;
+    if (proxy_list != NULL)
     {
-        syslog(LOG_INFO, "Accepted connection from %d.%d.%d.%d:%d\n", client_ip[0], client_ip[1], client_ip[2], client_ip[3], client_port);
+        if (wal_dir[0] != '\0' || shm_name != NULL || repl_port != NULL || leader_address != NULL ||
+            budget_mb > 0 || channel_spec_count > 0 || snapshot_path[0] != '\0' || udp_port != NULL || indexed)
+        {
+            fprintf(stderr, "Proxy mode cannot be combined with -w, -m, -R, -f, -M, -C, -s, -u or -i\n");
+            return EXIT_FAILURE;
+        }
+        if (aesd_proxy_init(&proxy, proxy_list) != 0)
+        {
+            fprintf(stderr, "Invalid backend list %s, expected host:port[,host:port]...\n", proxy_list);
+            return EXIT_FAILURE;
+        }
+        backend_spec = "memory";
+    }
+
+    // Use the syslog for non interactive application
+    openlog("aesdsocket",0,LOG_USER);
+    syslog(LOG_INFO, "Entering server socket program\n");
+
+    // Capture abort signal
+    signal(SIGINT, intHandler);
+    signal(SIGTERM, intHandler);
+    // A peer closing its connection fails the send() instead of killing the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Opened before the daemon changes its working directory, so a relative path works
+    struct aesd_capture capture;
+    if (capture_path != NULL)
+    {
+        if (aesd_capture_open(&capture, capture_path) != 0)
+        {
+            perror("capture");
+            return EXIT_FAILURE;
+        }
+        syslog(LOG_INFO, "Capturing inbound traffic in %s\n", capture_path);
     }
 
-    while (keepRunning)
+    // Memory budget: a connection is charged its control block and stack, buffers are borrowed,
+    // the channels are charged for their history snapshots and entry reads
+    struct aesd_budget budget;
+    size_t admission_cost = sizeof(struct CThreadInstance) + BUDGET_STACK_SIZE;
+    if (budget_mb > 0)
     {
-        memset(buffer, 0x00, BUFFER_SIZE);
-        int bytes_num = recv(data->fd, buffer, BUFFER_SIZE, 0);
-        if (bytes_num == 0)
+        if (aesd_budget_init(&budget, budget_mb << 20, BUFFER_SIZE + 1) != 0)
         {
-            // 0 byte received, the connection was closed by the client
-            break;
+            syslog(LOG_ERR, "Memory budget of %zu MB too small\n", budget_mb);
+            return EXIT_FAILURE;
         }
-        if (bytes_num == -1)
+        syslog(LOG_INFO, "Memory budget of %zu MB, %zu bytes per idle connection\n", budget_mb, admission_cost);
+    }
+
+    // Storage of each channel, opened before the daemon changes its working directory too
+    struct CChannelTable channels = {0};
+    pthread_mutex_init(&channels.lock, NULL);
+    channels.budget = budget_mb > 0 ? &budget : NULL;
+    struct CChannel *default_channel = channel_table_add(&channels, AESD_CHANNEL_DEFAULT, backend_spec);
+    if (default_channel == NULL)
+    {
+        fprintf(stderr, "Could not open the storage %s: %s\n", backend_spec, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < channel_spec_count; i++)
+    {
+        const char *spec = channel_specs[i];
+        size_t name_len = channel_name_len(spec);
+        if (name_len == 0 || spec[name_len] != '=' || channel_table_get(&channels, spec, name_len, false) != NULL)
         {
-            // Errno 107 means that the socket is NOT connected (any more)
-            syslog(LOG_ERR, "Value of errno attempting to receive data from %d.%d.%d.%d: %d\n", client_ip[0], client_ip[1], client_ip[2], client_ip[3], errno);
-            //printf("Could not receive data from client, ending receiving, errno is %d\n", errno);
-            break;
+            fprintf(stderr, "Invalid or duplicate channel %s, expected name=backend\n", spec);
+            return EXIT_FAILURE;
         }
-        // Store the last received packet in target file
-        len += bytes_num;
-        get_mutex(data->file_mutex);
-        // Open file and generate file descriptor
-        // We open the file only once, and keep the file descriptor for the read action
-        // If the file was written (is_ioctl = false), we reset the offset pointer
-        FILE *file = fopen(FILEPATH, "a+");
-        if (file == NULL)
-        {
-            syslog(LOG_ERR, "Value of errno attempting to open file %s: %d\n", FILEPATH, errno);
-            break;
+        char name[AESD_CHANNEL_NAME_MAX + 1];
+        snprintf(name, sizeof(name), "%.*s", (int)name_len, spec);
+        if (channel_table_add(&channels, name, spec + name_len + 1) == NULL)
+        {
+            fprintf(stderr, "Could not open the storage %s: %s\n", spec + name_len + 1, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Socket activation: the service manager already listens for us, so no connection is refused
+    // while we start. Taken before the fork, LISTEN_PID designates this process
+    int listen_fd = aesd_listen_fd();
+
+    // Run process as daemon if called with option -d
+    int ready_fd = -1;
+    if(daemon_mode)
+    {
+        ready_fd = create_deamon();
+    }
+
+    // Memory locks are not inherited by the daemon, so locked after the fork
+    if (low_latency)
+    {
+        if (aesd_latency_lock_memory() != 0)
+        {
+            syslog(LOG_ERR, "Could not lock the memory, page faults remain possible: %d\n", errno);
         }
-        fd = fileno(file);
+        syslog(LOG_INFO, "Low-latency mode, connections busy poll on %zu cpus\n", latency.cpu_count);
+    }
 
-        // If received string is an IOCTL, special handling. In particular, do not close file
-        // between ioctl request and read action
-        if (strstr(buffer, prefix) != NULL) {
-            syslog(LOG_INFO, "The request is a IOCTL command to set the read pointer");
+    // The log and the shared memory ring follow the default channel
+    struct CCommitContext *commit = &default_channel->commit;
 
-            // Move past the prefix and run the ioctl command
-            p = buffer + strlen(prefix);
-            run_ioctl_command(p, fd);
-            is_ioctl = true;
+    // Shared memory ring, with the same depth as the storage
+    struct aesd_shm shm;
+    if (shm_name != NULL)
+    {
+        if (aesd_shm_create(&shm, shm_name, default_channel->backend.depth, AESD_SHM_DATA_SIZE) != 0)
+        {
+            syslog(LOG_ERR, "Could not create the shared memory ring %s: %d\n", shm_name, errno);
+            return EXIT_FAILURE;
         }
-        else
+        commit->shm = &shm;
+        syslog(LOG_INFO, "Publishing committed entries in shared memory %s\n", shm_name);
+    }
+
+    // Optional persistence, opened after the fork since its flusher thread would not survive it
+    struct aesd_wal wal;
+    if (wal_dir[0] != '\0')
+    {
+        if (aesd_wal_open(&wal, wal_dir, segment_size, fsync_interval_ms) != 0)
         {
-            int written_bytes = fwrite(buffer, sizeof(char), bytes_num, file);
-            syslog(LOG_INFO, "Received %d bytes, wrote %d bytes into target file\n", bytes_num, written_bytes);
+            syslog(LOG_ERR, "Could not open the write-ahead log in %s\n", wal_dir);
+            return EXIT_FAILURE;
         }
+        commit->wal = &wal;
+        restore_from_wal(commit->wal, &default_channel->backend, commit->shm);
+        channel_sync_positions(default_channel);
+    }
 
-        // If new line character, this is the last package and send the answer
-        if(memchr(buffer, '\n', bytes_num) != NULL) {
-            // Reset file position if file was writen
-            if (!is_ioctl)
-            {
-                // Flush the FILE* buffer to ensure all writes are committed
-                // Otherwise, the lseek can occur before the write
-                // Mixing high-level FILE* operations with low-level file descriptor operations (like lseek) 
-                // can lead to lack of synchronisation between the fwrite and the lseek
-                if (fflush(file) != 0) {
-                    syslog(LOG_ERR, "Failed to flush the file buffer: %d\n", errno);
-                    break;
-                }
-                if (lseek(fd, 0, SEEK_SET) == -1)
-                {
-                    syslog(LOG_ERR, "Value of errno attempting to");
-                    break;
-                }
-                // Reset the FILE* stream's internal position indicator
-                rewind(file);
-            }
-            // Prepare sendBuffer, containing the answer to the client
-            char sendBuffer[MAX_BUFFER_SIZE] = {0};
-            int read_bytes = fread(sendBuffer, sizeof(char), MAX_BUFFER_SIZE, file);
-            release_mutex(data->file_mutex);
-            // Send the full received content as acknowledgement
-            int bytes_sent = send(data->fd, sendBuffer, read_bytes, 0);
-            syslog(LOG_INFO, "Read %d bytes in local file, sent %d bytes as acknowledgement, ||%s||\n", read_bytes, bytes_sent, sendBuffer);
-            if (bytes_sent == -1)
+    // Warm restart: the log is more recent, the snapshot is only loaded if the storage is still empty
+    if (snapshot_path[0] != '\0')
+    {
+        load_snapshot(snapshot_path, &default_channel->backend, commit->shm);
+        channel_sync_positions(default_channel);
+    }
+
+    // Search index of every channel, built from what the storage holds once restored
+    if (indexed)
+    {
+        channels.indexed = true;
+        for (size_t i = 0; i < channels.count; i++)
+        {
+            if (channel_enable_index(channels.channels[i]) != 0)
             {
-                syslog(LOG_ERR, "Value of errno attempting to send data to %d.%d.%d.%d: %d\n", client_ip[0], client_ip[1], client_ip[2], client_ip[3], errno);
-                break;
+                syslog(LOG_ERR, "Could not index the channel %s: %d\n", channels.channels[i]->name, errno);
+                return EXIT_FAILURE;
             }
         }
-
     }
-    
-    clock_t end = clock();
-    float seconds = (float)(end - start) / CLOCKS_PER_SEC;
-    syslog(LOG_INFO, "Thread %d finished, received a total of %d data from the client after %f seconds\n", data->fd, len, seconds);
-    free(buffer);
-    // No need of mutex since operation is atomic.
-    data->done = true;
-    return thread_param;
-}
 
-int main(int argc, char** argv)
-{
-    // Use the syslog for non interactive application
-    openlog("aesdsocket",0,LOG_USER);
-    syslog(LOG_INFO, "Entering server socket program\n");
+    // Replication of the default channel, started after the fork for its threads to survive it.
+    // A follower can lead in turn, forwarding what it applies
+    struct aesd_repl_leader repl_leader;
+    if (repl_port != NULL)
+    {
+        if (aesd_repl_leader_start(&repl_leader, repl_port) != 0)
+        {
+            syslog(LOG_ERR, "Could not listen for followers on port %s: %d\n", repl_port, errno);
+            return EXIT_FAILURE;
+        }
+        commit->repl = &repl_leader;
+    }
+    struct aesd_repl_follower repl_follower;
+    if (leader_address != NULL)
+    {
+        default_channel->replica = true;
+        if (aesd_repl_follower_start(&repl_follower, leader_address, replicate_entry, default_channel) != 0)
+        {
+            syslog(LOG_ERR, "Could not follow the leader %s: %d\n", leader_address, errno);
+            return EXIT_FAILURE;
+        }
+        syslog(LOG_INFO, "Following the leader %s\n", leader_address);
+    }
 
-    // Capture abort signal
-    signal(SIGINT, intHandler);
-    signal(SIGTERM, intHandler);
+    // Datagram ingest, its thread started after the fork too
+    struct aesd_udp udp;
+    if (udp_port != NULL && aesd_udp_start(&udp, udp_port, store_datagrams, default_channel) != 0)
+    {
+        syslog(LOG_ERR, "Could not receive datagrams on port %s: %d\n", udp_port, errno);
+        return EXIT_FAILURE;
+    }
 
-    // Run process as daemon if called with option -d
-    if((argc == 2)&&(argv[1][0] == '-')&&(argv[1][1] == 'd'))
+    // Staged mode, its threads started after the fork too
+    struct CStageContext staged = {.channel = default_channel};
+    if (staged_mode)
     {
-        create_deamon();
+        if (aesd_stage_start(&staged.stages, &stage_cpus, commit_requests, &staged) != 0)
+        {
+            syslog(LOG_ERR, "Could not start the stages: %d\n", errno);
+            return EXIT_FAILURE;
+        }
+        syslog(LOG_INFO, "Staged mode on %zu cpus\n", stage_cpus.cpu_count);
     }
 
     // Listen and accept connections
     struct addrinfo *my_addr = NULL;
-    socket_fd = createSocketConnection(&my_addr);
-    listen(socket_fd, BACKLOG);
+    if (listen_fd >= 0)
+    {
+        socket_fd = listen_fd;
+        syslog(LOG_INFO, "Using the listening socket passed by the service manager\n");
+    }
+    else
+    {
+        socket_fd = createSocketConnection(&my_addr, port);
+        listen(socket_fd, BACKLOG);
+    }
     syslog(LOG_INFO, "Listening to connections on %d\n", socket_fd);
     struct sockaddr_storage client_addr;
     socklen_t addr_size = sizeof(struct sockaddr_storage); // Address size, depends of address type (IPv4 or IPv6)
-    // Create thread queue, using singly Linked List
-    SLIST_HEAD(slisthead, slist_data_s) head;
-    SLIST_INIT(&head);
-    int sizeQ = 0;
+    // Connection threads, reaped as soon as they finish
+    struct CConnectionTable table;
+    if (connection_table_init(&table) != 0)
+    {
+        syslog(LOG_ERR, "Could not create the connection table: %d\n", errno);
+        return EXIT_FAILURE;
+    }
+    wake_fd = table.event_fd;
 
-    // Create mutex for file synchronisation between all the threads (they will all access the same resource)
-    pthread_mutex_t file_mutex;
-    pthread_mutex_init(&file_mutex, NULL);
+    for (size_t i = 0; i < channels.count; i++)
+    {
+        warm_device(&channels.channels[i]->backend);
+    }
+    signal_ready(ready_fd);
 
     // We remove TS printing in assignment 8
     // Create new thread for writing timestamps
     //pthread_t ts_thread;
     //struct CThreadInstance* ts_thread_data =  malloc(sizeof(struct CThreadInstance));
     //ts_thread_data->thread = &ts_thread;
-    //ts_thread_data->file_mutex = &file_mutex;
+    //ts_thread_data->channel = default_channel;
     //int rc = pthread_create(&ts_thread, NULL, timestamp_func, ts_thread_data);
     // Need to free the dynamic allocated struct if pthread creation fails
     //if(rc != 0)
@@ -264,75 +2291,204 @@ int main(int argc, char** argv)
     //    syslog(LOG_INFO, "timestamp thread started, now %d ongoing\n", ++sizeQ);
     //}
 
+    // Wait for a new connection or for finished threads, whichever comes first
+    struct pollfd pfd[2] = {{.fd = socket_fd, .events = POLLIN}, {.fd = table.event_fd, .events = POLLIN}};
+    // Memory budget reached: new clients wait in the listen backlog until a connection ends,
+    // or the next retry since buffers are also released without any event
+    bool paused = false;
     while(keepRunning)
     {
+        pfd[0].fd = paused ? -1 : socket_fd;
+        int ready = poll(pfd, 2, paused ? BUDGET_RETRY_MS : -1);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Value of errno waiting for connections: %d\n", errno);
+            break;
+        }
+        if (ready == 0)
+        {
+            paused = false;
+            continue;
+        }
+
+        // Join finished threads and close their connection, so the client sees the end of the
+        // reply right away
+        if (pfd[1].revents & POLLIN)
+        {
+            connection_table_reap(&table);
+            paused = false;
+        }
+        if (!(pfd[0].revents & POLLIN))
+        {
+            continue;
+        }
+        if (budget_mb > 0 && !aesd_budget_admit(&budget, admission_cost))
+        {
+            syslog(LOG_INFO, "Memory budget reached with %u connections, not accepting\n", atomic_load(&table.active));
+            paused = true;
+            continue;
+        }
+
         // Accept returns "fd" which is the socket file descriptor for the accepted connection,
         // and socket_fd remains the socket file descriptor, still listening for other connections
         // fd is the accepted socket, and will be used for sending/receiving data
-        // Accept is a blocking function, but closing the socket exits the function
         int fd = accept(socket_fd, (struct sockaddr *)&(client_addr), &(addr_size));
-        // If accept() unklocked by an abort signal, no accepted connection thread should be started
-        if(fd >= 0)
+        if (fd < 0 && budget_mb > 0)
         {
-            // Create new thread
-            pthread_t thread;
-
-            // Prepare thread context
-            struct slist_data_s *slist_data_ptr = malloc(sizeof(struct slist_data_s));
-            slist_data_ptr->thread_data.fd = fd;
-            slist_data_ptr->thread_data.done = false;
-            slist_data_ptr->thread_data.client_addr = client_addr;
-            slist_data_ptr->thread_data.thread = &thread;
-            slist_data_ptr->thread_data.file_mutex = &file_mutex;
-
-            if(head.slh_first == NULL)
+            aesd_budget_release(&budget, admission_cost);
+        }
+        // Staged mode: the network stage receives from it along with the others
+        if (fd >= 0 && staged_mode)
+        {
+            if (aesd_stage_add(&staged.stages, fd) != 0)
             {
-                SLIST_INSERT_HEAD(&head, slist_data_ptr, pointers);
+                syslog(LOG_ERR, "Could not hand connection %d to the stages: %d\n", fd, errno);
+                close(fd);
+                continue;
             }
-            else
+            atomic_fetch_add(&table.accepted, 1);
+            continue;
+        }
+        // If accept() unklocked by an abort signal, no accepted connection thread should be started
+        if(fd >= 0)
+        {
+            // Prepare thread context, in a recycled slot when possible
+            struct CThreadInstance* data = connection_table_acquire(&table);
+            if (data == NULL)
             {
-                // Insert new element after the head. No need to have any specific order
-                SLIST_INSERT_AFTER(head.slh_first,slist_data_ptr, pointers);
+                syslog(LOG_ERR, "No memory left for connection %d\n", fd);
+                close(fd);
+                if (budget_mb > 0)
+                {
+                    aesd_budget_release(&budget, admission_cost);
+                }
+                continue;
             }
+            data->fd = fd;
+            data->client_addr = client_addr;
+            data->channel = default_channel;
+            data->channels = &channels;
+            data->capture = capture_path != NULL ? &capture : NULL;
+            data->conn_id = capture_path != NULL ? aesd_capture_connection(&capture) : 0;
+            data->latency = low_latency ? &latency : NULL;
+            data->budget = budget_mb > 0 ? &budget : NULL;
+            data->charged = admission_cost;
+            data->repl_leader = commit->repl;
+            data->repl_follower = leader_address != NULL ? &repl_follower : NULL;
+            data->proxy = proxy_list != NULL ? &proxy : NULL;
+            data->snapshot_path = snapshot_path[0] != '\0' ? snapshot_path : NULL;
+            data->udp = udp_port != NULL ? &udp : NULL;
 
-            // Start thread with its internal data
-            struct CThreadInstance* data =  &(slist_data_ptr->thread_data);
-            int rc = pthread_create(&thread, NULL, threadfunc, data);
-            syslog(LOG_INFO, "New thread started, now %d ongoing\n", ++sizeQ);
-            // Need to free the dynamic allocated struct if pthread creation fails
+            // Before the thread starts, so tracers never see its close first
+            AESD_PROBE2(conn__accept, data->handle, fd);
+            // Start thread with its internal data. The thread id is kept in the slot, the main
+            // loop joins it once the thread posted its completion
+            atomic_fetch_add(&table.active, 1);
+            int rc = start_thread(data);
+            // Give the slot back if pthread creation fails
             if(rc != 0)
             {
-                free(slist_data_ptr);
+                atomic_fetch_sub(&table.active, 1);
+                close(fd);
+                connection_table_release(&table, data);
+                if (data->budget != NULL)
+                {
+                    aesd_budget_release(data->budget, data->charged);
+                }
                 // Transmission is lost, directly waiting for next connection
                 continue;
             }
+            atomic_fetch_add(&table.accepted, 1);
+            syslog(LOG_INFO, "New thread started with handle %u, now %u ongoing\n", data->handle, atomic_load(&table.active));
         }
+    }
 
-        // Remove finished thread if any and release related allocated memory
-        // Give time to the thread to finish first
-        usleep(WAIT_DELAY);
-        struct slist_data_s *elementP, *elementPTemp;
-        SLIST_FOREACH_SAFE(elementP, &head, pointers, elementPTemp)
-            if(elementP->thread_data.done)
-            {
-                // Close thread, no return value
-                syslog(LOG_INFO, "Thread %d closed\n", elementP->thread_data.fd);
-                pthread_join(*(elementP->thread_data.thread),NULL);
-                close(elementP->thread_data.fd);
-                SLIST_REMOVE(&head, elementP, slist_data_s, pointers);
-                free(elementP);
-                sizeQ--;
-            }
+    if (!keepRunning)
+    {
+        syslog(LOG_INFO, "Received interrupt signal, ending connection");
     }
 
     // Terminate the timestamp thread
     //pthread_join(ts_thread,NULL);
     //free(ts_thread_data);
-    sizeQ--;
-    syslog(LOG_INFO, "Exiting the socket server program, %d thread still active\n", sizeQ);
-    usleep(WAIT_DELAY);
+    // Close the connections still open and join their threads: from here on, nothing else uses the
+    // log, the shared memory, the capture, the channels or the budget
+    unsigned running = connection_table_shutdown(&table, SHUTDOWN_TIMEOUT_MS);
+    syslog(LOG_INFO, "Exiting the socket server program, %u thread still active, %llu connections accepted, %llu threads joined\n",
+           running, (unsigned long long)atomic_load(&table.accepted),
+           (unsigned long long)atomic_load(&table.reaped));
+    if (running > 0)
+    {
+        // Blocked elsewhere than on their socket (e.g. a proxied backend), the state they use is
+        // left to the process exit rather than freed under them
+        syslog(LOG_ERR, "%u connection threads did not stop, exiting without cleanup\n", running);
+        closelog();
+        return EXIT_FAILURE;
+    }
+    // Nothing is replicated or received into the channel, or published to the followers past this point
+    if (staged_mode)
+    {
+        aesd_stage_stop(&staged.stages);
+    }
+    if (udp_port != NULL)
+    {
+        aesd_udp_stop(&udp);
+    }
+    if (leader_address != NULL)
+    {
+        aesd_repl_follower_stop(&repl_follower);
+    }
+    if (commit->repl != NULL)
+    {
+        aesd_repl_leader_stop(commit->repl);
+    }
+    // Written before the storage is closed, the memory backend loses its entries then
+    if (snapshot_path[0] != '\0')
+    {
+        size_t bytes;
+        int count = save_snapshot(default_channel, snapshot_path, &bytes);
+        if (count < 0)
+        {
+            syslog(LOG_ERR, "Could not save the snapshot %s: %d\n", snapshot_path, errno);
+        }
+        else
+        {
+            syslog(LOG_INFO, "Snapshot of %d entries, %zu bytes saved in %s\n", count, bytes, snapshot_path);
+        }
+    }
+    if (commit->wal != NULL)
+    {
+        aesd_wal_close(commit->wal);
+    }
+    if (commit->shm != NULL)
+    {
+        aesd_shm_close(commit->shm);
+    }
+    if (capture_path != NULL)
+    {
+        aesd_capture_close(&capture);
+    }
+    if (proxy_list != NULL)
+    {
+        aesd_proxy_destroy(&proxy);
+    }
+    connection_table_destroy(&table);
+    // The memory backend history is lost here, unless it was logged (-w)
+    for (size_t i = 0; i < channels.count; i++)
+    {
+        channel_close(channels.channels[i]);
+    }
+    if (budget_mb > 0)
+    {
+        aesd_budget_destroy(&budget);
+    }
     // Free my_addr once we are finished
-    freeaddrinfo(my_addr);
+    if (my_addr != NULL)
+    {
+        freeaddrinfo(my_addr);
+    }
     closelog();
 
     return 0;
@@ -4,13 +4,87 @@
 
 #include <fcntl.h>
 #include <netdb.h>
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
-#include "queue_bsd.h"
+#include "aesd-backend.h"
+#include "aesd-budget.h"
+#include "aesd-capture.h"
+#include "aesd-history.h"
+#include "aesd-index.h"
+#include "aesd-latency.h"
+#include "aesd-lz.h"
+#include "aesd-notify.h"
+#include "aesd-probe.h"
+#include "aesd-proxy.h"
+#include "aesd-repl.h"
+#include "aesd-shm.h"
+#include "aesd-snapshot.h"
+#include "aesd-stage.h"
+#include "aesd-udp.h"
+#include "aesd-wal.h"
 
 #define PORT "9000"
 
+// Per connection commands, handled by the server and never written into the device
+// Reply compression, AESDSOCKET_COMPRESS:1 enables it and AESDSOCKET_COMPRESS:0 disables it
+#define AESD_COMPRESS_COM "AESDSOCKET_COMPRESS:"
+// Pipelined mode, AESDSOCKET_PIPELINE:1 enables it. Each line is then one request answered by
+// exactly one frame (see aesd-lz.h), so a client can send many lines before reading the replies
+#define AESD_PIPELINE_COM "AESDSOCKET_PIPELINE:"
+// Ingest mode, for producers which do not need the history back. AESDSOCKET_INGEST:1 answers an append
+// with the number of entries this connection wrote so far, AESDSOCKET_INGEST:2 does not answer at all,
+// AESDSOCKET_INGEST:0 restores the history echo. Seek commands are always answered with the history
+#define AESD_INGEST_COM "AESDSOCKET_INGEST:"
+#define AESD_INGEST_ECHO 0
+#define AESD_INGEST_COUNT 1
+#define AESD_INGEST_SILENT 2
+// Delta replies, AESDSOCKET_DELTA:1 enables them. The connection keeps the position of the last byte
+// it received: the first reply holds the whole history, the next ones only the bytes committed since.
+// If evicted entries made the delta impossible, the reply starts with the line
+// AESDSOCKET_DELTA:GAP:<bytes lost>, followed by the whole history
+#define AESD_DELTA_COM "AESDSOCKET_DELTA:"
+#define AESD_DELTA_GAP AESD_DELTA_COM "GAP:"
+// Channel selection, AESDSOCKET_CHANNEL:name moves the connection to the history called name, created
+// in memory if unknown. Answered with the name of the channel in use afterwards
+#define AESD_CHANNEL_COM "AESDSOCKET_CHANNEL:"
+#define AESD_CHANNEL_DEFAULT "default"
+#define AESD_CHANNEL_NAME_MAX 32
+// Channels configured with -C and created on demand, together
+#define AESD_CHANNEL_MAX 64
+// Replication state, AESDSOCKET_REPLICATION: answers one line per role of this instance (see
+// aesd_repl_leader_status() and aesd_repl_follower_status()), or "role=none"
+#define AESD_REPLICATION_COM "AESDSOCKET_REPLICATION:"
+// Read across channels, AESDSOCKET_MERGE:X,Y:name[,name]... answers the concatenation of what each
+// channel answers to the seek command X,Y, in the order of the names. Unknown channels answer nothing.
+// In proxy mode the channels are read from their backends in parallel
+#define AESD_MERGE_COM "AESDSOCKET_MERGE:"
+#define AESD_MERGE_MAX 16
+// Snapshot of the default channel, AESDSOCKET_SNAPSHOT: saves its entries in the file given with -s,
+// answered with AESDSOCKET_SNAPSHOT:<entries>,<bytes>, or AESDSOCKET_SNAPSHOT:-1 if it failed
+#define AESD_SNAPSHOT_COM "AESDSOCKET_SNAPSHOT:"
+// Datagram ingest counters, AESDSOCKET_UDP: answers one line (see aesd_udp_status()), or "port=none"
+// if -u was not given
+#define AESD_UDP_COM "AESDSOCKET_UDP:"
+// Staged mode counters, AESDSOCKET_STAGES: answers one line per stage (see aesd_stage_status()). In
+// staged mode it is the only command besides the seek, the others need a connection thread
+#define AESD_STAGES_COM "AESDSOCKET_STAGES:"
+// Search of the history of the channel, AESDSOCKET_SEARCH:term answers a line X,offset:entry per entry
+// holding term, oldest first, X being its number for the seek command (its line for a file storage)
+// and offset its position in the history read. Then comes AESDSOCKET_SEARCH:<matches>, or
+// AESDSOCKET_SEARCH:-1 if the server was not started with -i. Matches beyond MAX_BUFFER_SIZE are
+// counted, not listed.
+// Only the entries the ring holds, or the last AESD_INDEX_FILE_ENTRIES lines of a file, are searched
+#define AESD_SEARCH_COM "AESDSOCKET_SEARCH:"
+// Memory budget mode (-M): a reply needing its own MAX_BUFFER_SIZE buffer (seek, delta, merge, search)
+// or a history snapshot is answered with this line when the budget cannot hold it. Nothing waits for
+// memory; the write of the packet, if any, is stored all the same
+#define AESD_BUDGET_REFUSED "AESDSOCKET_BUDGET:-1\n"
+// Every command above starts with it
+#define AESD_COMMAND_PREFIX "AESDSOCKET_"
+
 // (IPv4 only--see struct sockaddr_in6 for IPv6)
 // struct sockaddr_in {
 //     short int          sin_family;  // Address family, AF_INET
@@ -21,35 +95,148 @@
 
 // Socket file descriptor for listening connection, has to be closed upon interrupt signal
 static volatile int socket_fd = -1;
+// Wakes the main loop up, so an abort signal is seen even if delivered to a connection thread
+static volatile int wake_fd = -1;
+
+/// Consumers of the committed entries, an entry being a line, split and assembled the same way as
+/// the aesdchar driver does. One per channel, only used with its file_mutex held.
+struct CCommitContext
+{
+    char *pending;          // partial entry, bytes after the last new line
+    size_t pending_len;
+    size_t pending_cap;
+    struct aesd_wal *wal;   // Persistence, NULL if disabled
+    struct aesd_shm *shm;   // Shared memory ring for local readers, NULL if disabled
+    struct aesd_repl_leader *repl; // Followers of this instance, NULL if not a leader
+    struct aesd_index *index; // Search index, NULL if disabled
+    uint64_t written;       // bytes written since the storage was created, position of the next byte
+    uint64_t committed;     // end of the last complete entry, same scale
+};
+
+/// A named history: its own storage, lock and statistics, so writers of different channels never
+/// wait for each other
+struct CChannel
+{
+    char name[AESD_CHANNEL_NAME_MAX + 1];
+    pthread_mutex_t file_mutex;         // Serializes the storage accesses
+    struct aesd_backend backend;        // Storage of the entries, used with file_mutex held
+    struct CCommitContext commit;       // Consumers of the committed entries
+    bool replica;                       // Written by the leader only, client writes are refused
+    struct aesd_history_cache history;  // Full history reads, shared between the connections
+    struct aesd_budget *budget;         // Memory budget mode (-M): charged for its reads, NULL otherwise
+    atomic_ullong writes;               // packets written
+    atomic_ullong bytes;                // bytes written
+    atomic_ullong replies;              // history replies sent
+};
+
+/// Channels by name, the default one first. Channels are only added, never removed while running
+struct CChannelTable
+{
+    pthread_mutex_t lock;               // lookups and creations
+    struct CChannel *channels[AESD_CHANNEL_MAX];
+    size_t count;
+    bool indexed;                       // channels created from now on are indexed (-i)
+    struct aesd_budget *budget;         // charged for the reads of the channels (-M), NULL otherwise
+};
+
+struct CConnectionTable;
 
 /// Create struct for thread information
 struct CThreadInstance
 {
     int fd ; // accepted socket connection identifyer, unique for each thread
     struct sockaddr_storage client_addr; // Describes the socket address.
-    bool done; // True if the thread can be terminated
-    pthread_t* thread;
-    pthread_mutex_t *file_mutex; // Shared resource synchronization
+    pthread_t thread;
+    uint32_t handle; // Index in the connection table
+    struct CConnectionTable *table; // Where the thread posts its completion
+    struct CThreadInstance *next_done; // Completion queue link, set when the thread finished
+    struct CChannel *channel; // History the connection reads and writes, the default one at first
+    struct CChannelTable *channels; // Where AESDSOCKET_CHANNEL looks channels up
+    struct aesd_capture *capture; // Inbound traffic capture, NULL if disabled
+    uint32_t conn_id; // Connection id in the capture
+    struct aesd_latency *latency; // Low-latency mode, NULL if disabled
+    struct aesd_budget *budget; // Memory budget mode, NULL if disabled
+    size_t charged; // Admission charge on the budget, released once the thread is joined
+    struct aesd_repl_leader *repl_leader; // Replication, NULL if not a leader
+    struct aesd_repl_follower *repl_follower; // Replication, NULL if not a follower
+    struct aesd_proxy *proxy; // Proxy mode, NULL if the channels are stored here
+    const char *snapshot_path; // Where AESDSOCKET_SNAPSHOT saves the default channel, NULL if disabled
+    struct aesd_udp *udp; // Datagram ingest, NULL if disabled
+};
+
+/// Per connection settings and buffers, owned by the connection thread
+struct CConnection
+{
+    struct CThreadInstance *data;
+    struct aesd_lz_stream *lz;  // Reply compression, NULL if disabled
+    char *frame;                // Frame buffer, allocated while replies are compressed or pipelined
+    bool pipelined;             // One framed reply per received line
+    char *line;                 // Pipelined mode, line being assembled
+    size_t line_len;
+    int ingest;                 // AESD_INGEST_*, how appends are answered
+    uint64_t entries;           // Entries completed by this connection, for AESD_INGEST_COUNT
+    bool delta;                 // Replies only hold the bytes committed since the previous one
+    uint64_t cursor;            // Delta mode, end of the last reply (CCommitContext scale), 0 before the first
+    // Proxy mode
+    struct aesd_proxy_link *link; // Upstream link of the lines forwarded and not answered yet, NULL if none
+    size_t proxy_pending;       // Replies expected on link
+    size_t proxy_skip;          // Replies not sent to the client, plain mode only answers the last line
+    bool proxy_failed;          // A reply was lost, or could not be sent to the client
+    char *partial;              // Line being assembled, forwarded once complete
+    size_t partial_len;
+    size_t partial_cap;
 };
 
-struct slist_data_s
+/// Connections indexed by handle. A finished thread pushes itself on a lock-free completion queue
+/// and signals the eventfd, the main loop then joins it and recycles its slot right away.
+/// Slots and handles are only allocated and recycled by the main loop.
+struct CConnectionTable
 {
-    struct CThreadInstance thread_data;
-    SLIST_ENTRY(slist_data_s) pointers;
+    struct CThreadInstance **slots;     // allocated on first use, reused once reaped
+    uint32_t *free_handles;             // stack of the handles available for a new connection
+    size_t free_count;
+    size_t capacity;
+    _Atomic(struct CThreadInstance *) done; // finished threads, not joined yet
+    int event_fd;                       // readable while done is not empty
+    atomic_uint active;                 // threads running
+    atomic_ullong accepted;             // connections accepted since startup
+    atomic_ullong reaped;               // threads joined since startup
 };
 
+/// Startup time, and whether the first reply was already sent, for the cold start report
+static uint64_t startup_ns;
+static atomic_bool first_reply_sent;
+
 /// In case of abort request, terminate threads
+/// Only async-signal-safe calls here: the main loop logs the interruption, a syslog() from the handler
+/// would deadlock if the signal interrupted another syslog() of the same thread
 static volatile int keepRunning = 1;
 void intHandler(int dummy) {
-    syslog(LOG_INFO, "Received interrupt signal, ending connection");
     keepRunning = 0;
     close(socket_fd);
+    if (wake_fd >= 0)
+    {
+        uint64_t one = 1;
+        ssize_t rc = write(wake_fd, &one, sizeof(one));
+        (void)rc;
+    }
+}
+
+/// Helper function reading the monotonic clock, in ns
+uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
 /// Helper function get mutex
 void get_mutex(pthread_mutex_t* mutex)
 {
+    // Waiting time and hold time, traced without syslog or clock reads
+    AESD_PROBE1(lock__wait, mutex);
     int rc = pthread_mutex_lock(mutex);
+    AESD_PROBE1(lock__acquired, mutex);
     if(rc != 0)
     {
         syslog(LOG_INFO, "[CHILD TREAD] could not get mutex");
@@ -59,6 +246,7 @@ void get_mutex(pthread_mutex_t* mutex)
 /// Helper function release mutex
 void release_mutex(pthread_mutex_t* mutex)
 {
+    AESD_PROBE1(lock__release, mutex);
     int rc = pthread_mutex_unlock(mutex);
     if(rc != 0)
     {
@@ -66,10 +254,163 @@ void release_mutex(pthread_mutex_t* mutex)
     }
 }
 
+/// Helper function creating the connection table, returns 0 or -1 if the eventfd could not be created
+int connection_table_init(struct CConnectionTable *table)
+{
+    memset(table, 0, sizeof(*table));
+    atomic_init(&table->done, NULL);
+    atomic_init(&table->active, 0);
+    atomic_init(&table->accepted, 0);
+    atomic_init(&table->reaped, 0);
+    table->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return table->event_fd < 0 ? -1 : 0;
+}
+
+/// Helper function taking a free slot for a new connection, NULL if out of memory.
+/// Only the handle and table fields are set
+struct CThreadInstance *connection_table_acquire(struct CConnectionTable *table)
+{
+    if (table->free_count == 0)
+    {
+        size_t capacity = table->capacity ? table->capacity * 2 : 16;
+        struct CThreadInstance **slots = realloc(table->slots, capacity * sizeof(*slots));
+        if (slots == NULL)
+            return NULL;
+        table->slots = slots;
+        uint32_t *free_handles = realloc(table->free_handles, capacity * sizeof(*free_handles));
+        if (free_handles == NULL)
+            return NULL;
+        table->free_handles = free_handles;
+        // Lowest handles on top of the stack
+        for (size_t i = capacity; i > table->capacity; i--)
+        {
+            table->slots[i - 1] = NULL;
+            table->free_handles[table->free_count++] = i - 1;
+        }
+        table->capacity = capacity;
+    }
+    uint32_t handle = table->free_handles[table->free_count - 1];
+    if (table->slots[handle] == NULL)
+    {
+        table->slots[handle] = malloc(sizeof(struct CThreadInstance));
+        if (table->slots[handle] == NULL)
+            return NULL;
+    }
+    table->free_count--;
+    struct CThreadInstance *data = table->slots[handle];
+    data->fd = -1;
+    data->handle = handle;
+    data->table = table;
+    return data;
+}
+
+/// Helper function giving a slot back, its thread was joined or never started. Its connection is
+/// closed by then, a free slot has no fd
+void connection_table_release(struct CConnectionTable *table, struct CThreadInstance *data)
+{
+    data->fd = -1;
+    table->free_handles[table->free_count++] = data->handle;
+}
+
+/// Helper function called by a connection thread when it is about to return
+void connection_finished(struct CThreadInstance *data)
+{
+    struct CConnectionTable *table = data->table;
+    atomic_fetch_sub(&table->active, 1);
+    struct CThreadInstance *head = atomic_load(&table->done);
+    do
+    {
+        data->next_done = head;
+    } while (!atomic_compare_exchange_weak(&table->done, &head, data));
+    eventfd_write(table->event_fd, 1);
+}
+
+/// Helper function joining the finished threads, closing their connection and recycling their slot.
+/// Returns the number of threads joined
+unsigned connection_table_reap(struct CConnectionTable *table)
+{
+    eventfd_t count;
+    eventfd_read(table->event_fd, &count);
+    // The whole queue is taken at once, threads finishing meanwhile signal the eventfd again
+    struct CThreadInstance *data = atomic_exchange(&table->done, NULL);
+    unsigned reaped = 0;
+    while (data != NULL)
+    {
+        struct CThreadInstance *next = data->next_done;
+        pthread_join(data->thread, NULL);
+        close(data->fd);
+        if (data->budget != NULL)
+            aesd_budget_release(data->budget, data->charged);
+        syslog(LOG_INFO, "Thread %d closed, handle %u recycled\n", data->fd, data->handle);
+        connection_table_release(table, data);
+        reaped++;
+        data = next;
+    }
+    atomic_fetch_add(&table->reaped, reaped);
+    return reaped;
+}
+
+/// Helper function ending the connections still open at exit, before the state they use is destroyed:
+/// their socket is shut down, so a thread blocked in recv() or send() returns, then the threads are
+/// joined. Returns the number of threads still running after timeout_ms
+unsigned connection_table_shutdown(struct CConnectionTable *table, int timeout_ms)
+{
+    // Only the main loop fills and frees the slots, a slot in use has the fd of its connection
+    for (size_t i = 0; i < table->capacity; i++)
+    {
+        if (table->slots[i] != NULL && table->slots[i]->fd >= 0)
+            shutdown(table->slots[i]->fd, SHUT_RDWR);
+    }
+    uint64_t deadline = monotonic_ns() + (uint64_t)timeout_ms * 1000000ull;
+    connection_table_reap(table);
+    while (atomic_load(&table->active) > 0 && monotonic_ns() < deadline)
+    {
+        struct pollfd pfd = {.fd = table->event_fd, .events = POLLIN};
+        poll(&pfd, 1, 100);
+        connection_table_reap(table);
+    }
+    return atomic_load(&table->active);
+}
+
+/// Helper function releasing the free slots. Slots of the threads still running stay allocated
+void connection_table_destroy(struct CConnectionTable *table)
+{
+    for (size_t i = 0; i < table->free_count; i++)
+        free(table->slots[table->free_handles[i]]);
+    free(table->slots);
+    free(table->free_handles);
+}
+
+/// Helper function sending a complete buffer, send() can return after a partial transfer
+/// Returns the number of bytes sent, or -1 on error
+ssize_t send_all(int fd, const char* buf, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t rc = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (rc == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        sent += rc;
+    }
+    return sent;
+}
+
 /// Function which transfer process to a deamon
 /// A deamon is running outside any console, in the system background
-void create_deamon()
+/// Returns the pipe to write to once the daemon is ready, the parent only exits then
+int create_deamon()
 {        
+    // The parent waits on this pipe, so whoever started us (start-stop-daemon, scripts) knows
+    // the server is ready to reply when we return
+    int ready_pipe[2];
+    if (pipe(ready_pipe) != 0)
+        exit(EXIT_FAILURE);
+
     // creating child process which is not attached to a TTY
     int pid = fork();
     // An error occurred
@@ -77,7 +418,16 @@ void create_deamon()
         exit(EXIT_FAILURE);
     // Success: Let the parent terminate so grand parent can proceed
     if (pid > 0)
-        exit(EXIT_SUCCESS);
+    {
+        close(ready_pipe[1]);
+        char ready;
+        ssize_t rc;
+        while ((rc = read(ready_pipe[0], &ready, 1)) < 0 && errno == EINTR)
+            ;
+        // The pipe is closed without a byte if the daemon failed during startup
+        exit(rc == 1 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(ready_pipe[0]);
 
     // Create a new session so daemon is not linked to any tty
     if (setsid() < 0)
@@ -107,13 +457,17 @@ void create_deamon()
         // If operation failed, stop execution and return error
         perror("dub");
     }
+    return ready_pipe[1];
 }
 
-/// Function initializing the socket, prepares the future connections
-int createSocketConnection(struct addrinfo** my_addr)
+/// Function initializing the socket on port, prepares the future connections
+int createSocketConnection(struct addrinfo** my_addr, const char *port)
 {
     // Create socket and bind it to given port
     int socket_fd = socket(PF_INET, SOCK_STREAM, 0);
+    // A restarted server binds again while the connections of the previous one are in TIME_WAIT
+    int reuse = 1;
+    setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     // first, load up address structs with getaddrinfo():
     struct addrinfo hints;
     memset((void*)&hints, 0, sizeof (struct addrinfo));
@@ -122,7 +476,7 @@ int createSocketConnection(struct addrinfo** my_addr)
     hints.ai_flags = AI_PASSIVE; // fill in my IP for me
     // Beware that my_addr is a double pointer, because getaddrinfo changes the
     // addrinfo pointer address.
-    int status = getaddrinfo(NULL, PORT, &hints, my_addr);
+    int status = getaddrinfo(NULL, port, &hints, my_addr);
     if (status != 0 || my_addr == NULL)
     {
         return -1;
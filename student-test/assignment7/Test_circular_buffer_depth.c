@@ -0,0 +1,212 @@
+#include "unity.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+// Entry sizes summing up past 32 KB, offsets are size_t and must not wrap at 16 bits
+#define LARGE_ENTRY_SIZE 20000
+
+static char entry_names[64][8];
+static unsigned int released;
+
+/**
+* Add entry "<number>\n" to @param buffer, numbers starting at 0
+*/
+static void add_numbered_entry(struct aesd_circular_buffer *buffer, unsigned int number)
+{
+    struct aesd_buffer_entry entry = {0};
+    snprintf(entry_names[number % 64], sizeof(entry_names[0]), "%u\n", number);
+    entry.buffptr = entry_names[number % 64];
+    entry.size = strlen(entry_names[number % 64]);
+    aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+/**
+* Check @param buffer holds the @param count entries numbered from @param first, oldest first
+*/
+static void check_numbered_entries(struct aesd_circular_buffer *buffer, unsigned int first, unsigned int count)
+{
+    size_t offset = 0;
+    TEST_ASSERT_EQUAL_UINT32(count, aesd_circular_buffer_count(buffer));
+    for(unsigned int i = 0; i < count; i++)
+    {
+        char expected[8];
+        size_t entry_offset = 99;
+        struct aesd_buffer_entry *entry;
+        snprintf(expected, sizeof(expected), "%u\n", first + i);
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offset, &entry_offset);
+        TEST_ASSERT_NOT_NULL(entry);
+        TEST_ASSERT_EQUAL_INT(0, entry_offset);
+        TEST_ASSERT_EQUAL_STRING_LEN_MESSAGE(expected, entry->buffptr, strlen(expected),
+                "The entries must be the newest ones, oldest first");
+        offset += entry->size;
+    }
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offset, NULL),
+            "No entry must be found past the last byte");
+}
+
+static void count_release(struct aesd_buffer_entry *entry)
+{
+    (void)entry;
+    released++;
+}
+
+/**
+* A depth which is not a power of two keeps more slots than entries: the buffer must still hold
+* exactly depth entries once it wrapped around the slots, several times
+*/
+void test_circular_buffer_wrap_non_power_of_two_depth()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_resize(&buffer, 5, NULL));
+    TEST_ASSERT_EQUAL_UINT32(8, buffer.capacity);
+
+    for(unsigned int i = 0; i < 4; i++)
+    {
+        add_numbered_entry(&buffer, i);
+    }
+    TEST_ASSERT_FALSE_MESSAGE(buffer.full, "4 entries of 5 must not fill the buffer");
+    add_numbered_entry(&buffer, 4);
+    TEST_ASSERT_TRUE_MESSAGE(buffer.full, "5 entries of 5 must fill the buffer");
+    check_numbered_entries(&buffer, 0, 5);
+
+    for(unsigned int i = 5; i < 23; i++)
+    {
+        add_numbered_entry(&buffer, i);
+    }
+    check_numbered_entries(&buffer, 18, 5);
+    aesd_circular_buffer_destroy(&buffer);
+}
+
+/**
+* Offsets past 32 KB resolve to the right entry and offset, before and after the buffer wrapped
+*/
+void test_circular_buffer_offsets_past_32k()
+{
+    struct aesd_circular_buffer buffer;
+    char *data = malloc(6 * LARGE_ENTRY_SIZE);
+    size_t entry_offset = 0;
+    struct aesd_buffer_entry *entry;
+    TEST_ASSERT_NOT_NULL(data);
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_resize(&buffer, 3, NULL));
+
+    for(unsigned int i = 0; i < 6; i++)
+    {
+        struct aesd_buffer_entry add = {0};
+        memset(data + i * LARGE_ENTRY_SIZE, 'a' + i, LARGE_ENTRY_SIZE);
+        add.buffptr = data + i * LARGE_ENTRY_SIZE;
+        add.size = LARGE_ENTRY_SIZE;
+        aesd_circular_buffer_add_entry(&buffer, &add);
+        if(i == 2)
+        {
+            entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 2 * LARGE_ENTRY_SIZE + 12345, &entry_offset);
+            TEST_ASSERT_NOT_NULL(entry);
+            TEST_ASSERT_EQUAL_PTR(data + 2 * LARGE_ENTRY_SIZE, entry->buffptr);
+            TEST_ASSERT_EQUAL_INT(12345, entry_offset);
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(3 * LARGE_ENTRY_SIZE, aesd_circular_buffer_size(&buffer));
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 32768, &entry_offset);
+    TEST_ASSERT_NOT_NULL(entry);
+    TEST_ASSERT_EQUAL_PTR(data + 4 * LARGE_ENTRY_SIZE, entry->buffptr);
+    TEST_ASSERT_EQUAL_INT(32768 - LARGE_ENTRY_SIZE, entry_offset);
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 3 * LARGE_ENTRY_SIZE - 1, &entry_offset);
+    TEST_ASSERT_NOT_NULL(entry);
+    TEST_ASSERT_EQUAL_PTR(data + 5 * LARGE_ENTRY_SIZE, entry->buffptr);
+    TEST_ASSERT_EQUAL_INT(LARGE_ENTRY_SIZE - 1, entry_offset);
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 3 * LARGE_ENTRY_SIZE, &entry_offset));
+
+    aesd_circular_buffer_destroy(&buffer);
+    free(data);
+}
+
+/**
+* Shrinking keeps the newest entries and releases the others, growing keeps them all; the buffer
+* then wraps at its new depth. Covers the inline slots and allocated ones
+*/
+void test_circular_buffer_resize_keeps_newest()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    for(unsigned int i = 0; i < 13; i++)
+    {
+        add_numbered_entry(&buffer, i);
+    }
+    check_numbered_entries(&buffer, 3, 10);
+
+    released = 0;
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_resize(&buffer, 3, count_release));
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(7, released, "The 7 oldest entries must be released");
+    TEST_ASSERT_TRUE(buffer.full);
+    check_numbered_entries(&buffer, 10, 3);
+
+    released = 0;
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_resize(&buffer, 40, count_release));
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, released, "Growing must not release any entry");
+    TEST_ASSERT_EQUAL_UINT32(64, buffer.capacity);
+    TEST_ASSERT_FALSE(buffer.full);
+    check_numbered_entries(&buffer, 10, 3);
+    for(unsigned int i = 13; i < 60; i++)
+    {
+        add_numbered_entry(&buffer, i);
+    }
+    check_numbered_entries(&buffer, 20, 40);
+
+    released = 0;
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_resize(&buffer, 6, count_release));
+    TEST_ASSERT_EQUAL_UINT32(34, released);
+    check_numbered_entries(&buffer, 54, 6);
+
+    TEST_ASSERT_EQUAL_INT(-EINVAL, aesd_circular_buffer_resize(&buffer, 0, count_release));
+    TEST_ASSERT_EQUAL_INT(-EINVAL, aesd_circular_buffer_resize(&buffer, AESDCHAR_MAX_DEPTH + 1, count_release));
+    check_numbered_entries(&buffer, 54, 6);
+    aesd_circular_buffer_destroy(&buffer);
+}
+
+/**
+* The binary search finds, for every byte, the entry a linear scan of the entries finds, with
+* entries of different sizes, empty ones included, once the buffer wrapped
+*/
+void test_circular_buffer_index_for_fpos()
+{
+    static const char data[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    static const size_t sizes[] = {3, 1, 0, 7, 2, 0, 0, 5, 1, 4, 6, 2};
+    struct aesd_circular_buffer buffer;
+    size_t total = 0;
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_resize(&buffer, 9, NULL));
+    for(unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        struct aesd_buffer_entry add = {0};
+        add.buffptr = data;
+        add.size = sizes[i];
+        aesd_circular_buffer_add_entry(&buffer, &add);
+    }
+    TEST_ASSERT_EQUAL_UINT32(9, aesd_circular_buffer_count(&buffer));
+    for(unsigned int i = 3; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        total += sizes[i];
+    }
+    TEST_ASSERT_EQUAL_INT(total, aesd_circular_buffer_size(&buffer));
+
+    for(size_t offset = 0; offset < total; offset++)
+    {
+        uint32_t expected = 0;
+        size_t start = 0;
+        // Linear scan: the entry whose bytes hold offset
+        while(start + buffer.entry[AESD_CIRCULAR_BUFFER_SLOT(&buffer, buffer.out_offs + expected)].size <= offset)
+        {
+            start += buffer.entry[AESD_CIRCULAR_BUFFER_SLOT(&buffer, buffer.out_offs + expected)].size;
+            expected++;
+        }
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(expected, aesd_circular_buffer_index_for_fpos(&buffer, offset),
+                "The binary search must find the entry holding the offset");
+        TEST_ASSERT_EQUAL_INT(start, aesd_circular_buffer_entry_start(&buffer, expected));
+    }
+    TEST_ASSERT_EQUAL_UINT32(9, aesd_circular_buffer_index_for_fpos(&buffer, total));
+    aesd_circular_buffer_destroy(&buffer);
+}
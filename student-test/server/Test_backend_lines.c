@@ -0,0 +1,91 @@
+#include "unity.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../../server/aesd-backend.h"
+
+/**
+* Each line of a write is an entry, the bytes after the last new line wait for the next writes, as
+* the driver splits a write into its entry buffer
+*/
+void test_backend_memory_one_entry_per_line()
+{
+    struct aesd_backend backend;
+    char history[64];
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, aesd_backend_open(&backend, "memory:4"), "Could not open the memory backend");
+
+    TEST_ASSERT_EQUAL_INT(8, aesd_backend_append(&backend, "a\nbb\nccc", 8));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(5, aesd_backend_size(&backend), "The bytes after the last new line are not committed");
+    TEST_ASSERT_EQUAL_INT(0, aesd_backend_seek_to(&backend, 0, 0));
+    TEST_ASSERT_EQUAL_INT(3, aesd_backend_seek_to(&backend, 1, 1));
+    errno = 0;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, aesd_backend_seek_to(&backend, 2, 0), "A pending line must not be an entry");
+    TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+
+    TEST_ASSERT_EQUAL_INT(2, aesd_backend_append(&backend, "c\n", 2));
+    TEST_ASSERT_EQUAL_INT(10, aesd_backend_read_at(&backend, 0, history, sizeof(history)));
+    TEST_ASSERT_EQUAL_STRING_LEN_MESSAGE("a\nbb\ncccc\n", history, 10, "The pending bytes must be committed first");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(6, aesd_backend_seek_to(&backend, 2, 1), "A line written in two writes is one entry");
+    errno = 0;
+    TEST_ASSERT_EQUAL_INT(-1, aesd_backend_seek_to(&backend, 2, 6));
+    TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+
+    aesd_backend_close(&backend);
+}
+
+/**
+* Lines of one write evict the oldest entries one by one: the last depth lines are kept, even when
+* a write holds more lines than the depth
+*/
+void test_backend_memory_lines_evict_oldest()
+{
+    struct aesd_backend backend;
+    char history[64];
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, aesd_backend_open(&backend, "memory:3"), "Could not open the memory backend");
+
+    TEST_ASSERT_EQUAL_INT(4, aesd_backend_append(&backend, "1\n2\n", 4));
+    TEST_ASSERT_EQUAL_INT(10, aesd_backend_append(&backend, "3\n4\n5\n6\n7\n", 10));
+    TEST_ASSERT_EQUAL_INT(6, aesd_backend_size(&backend));
+    TEST_ASSERT_EQUAL_INT(6, aesd_backend_read_at(&backend, 0, history, sizeof(history)));
+    TEST_ASSERT_EQUAL_STRING_LEN_MESSAGE("5\n6\n7\n", history, 6, "The last 3 lines must be kept");
+    TEST_ASSERT_EQUAL_INT(4, aesd_backend_seek_to(&backend, 2, 0));
+    errno = 0;
+    TEST_ASSERT_EQUAL_INT(-1, aesd_backend_seek_to(&backend, 3, 0));
+    TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+
+    aesd_backend_close(&backend);
+}
+
+/**
+* The entry lengths come in one call, oldest first and capped at max: the memory ring gives its
+* entries, a file its complete lines
+*/
+void test_backend_entry_lens()
+{
+    struct aesd_backend backend;
+    uint32_t lens[8];
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, aesd_backend_open(&backend, "memory:3"), "Could not open the memory backend");
+    TEST_ASSERT_EQUAL_INT(11, aesd_backend_append(&backend, "a\nbb\nccc\ndd", 11));
+    TEST_ASSERT_EQUAL_INT(3, aesd_backend_entry_lens(&backend, lens, 8, 9));
+    TEST_ASSERT_EQUAL_UINT32(2, lens[0]);
+    TEST_ASSERT_EQUAL_UINT32(3, lens[1]);
+    TEST_ASSERT_EQUAL_UINT32(4, lens[2]);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(2, aesd_backend_entry_lens(&backend, lens, 2, 9), "At most max entries");
+    aesd_backend_close(&backend);
+
+    char path[] = "/tmp/aesd-backend-lens-XXXXXX";
+    char spec[sizeof(path) + 5];
+    int fd = mkstemp(path);
+    TEST_ASSERT_TRUE_MESSAGE(fd >= 0, "Could not create the backend file");
+    close(fd);
+    snprintf(spec, sizeof(spec), "file:%s", path);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, aesd_backend_open(&backend, spec), "Could not open the file backend");
+    TEST_ASSERT_EQUAL_INT(11, aesd_backend_append(&backend, "a\nbb\nccc\ndd", 11));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, aesd_backend_entry_lens(&backend, lens, 8, 11), "The pending line is not an entry");
+    TEST_ASSERT_EQUAL_UINT32(2, lens[0]);
+    TEST_ASSERT_EQUAL_UINT32(4, lens[2]);
+    aesd_backend_close(&backend);
+    unlink(path);
+}
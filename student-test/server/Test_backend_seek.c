@@ -0,0 +1,108 @@
+#include "unity.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../../server/aesd-backend.h"
+
+#define BACKEND_PATH_TEMPLATE "/tmp/aesd-backend-seek-XXXXXX"
+
+/**
+* Open a file backend in a new file, its name written into @param path, holding "ab\n" then
+* @param count lines of @param line_len bytes (new line included)
+*/
+static void open_file_backend(struct aesd_backend *backend, char *path, size_t count, size_t line_len)
+{
+    char spec[sizeof(BACKEND_PATH_TEMPLATE) + 5];
+    char line[256];
+    int fd;
+    strcpy(path, BACKEND_PATH_TEMPLATE);
+    fd = mkstemp(path);
+    TEST_ASSERT_TRUE_MESSAGE(fd >= 0, "Could not create the backend file");
+    close(fd);
+    snprintf(spec, sizeof(spec), "file:%s", path);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, aesd_backend_open(backend, spec), "Could not open the file backend");
+    TEST_ASSERT_EQUAL_INT(3, aesd_backend_append(backend, "ab\n", 3));
+    memset(line, 'x', line_len - 1);
+    line[line_len - 1] = '\n';
+    for(size_t i = 0; i < count; i++)
+    {
+        TEST_ASSERT_EQUAL_INT(line_len, aesd_backend_append(backend, line, line_len));
+    }
+}
+
+/**
+* An offset past the end of an entry is refused, even when later entries would hold that offset
+* (it used to resolve into the following entries once the scan went past its first chunk)
+*/
+void test_backend_file_seek_past_entry_end()
+{
+    struct aesd_backend backend;
+    char path[sizeof(BACKEND_PATH_TEMPLATE)];
+    open_file_backend(&backend, path, 40, 200);
+
+    errno = 0;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, aesd_backend_seek_to(&backend, 0, 100),
+            "Offset 100 of a 3 bytes entry must not be found");
+    TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+    errno = 0;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, aesd_backend_seek_to(&backend, 0, 4),
+            "Offset 4 of a 3 bytes entry must not be found");
+    TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+    errno = 0;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, aesd_backend_seek_to(&backend, 20, 201),
+            "Offset 201 of a 200 bytes entry must not be found");
+    TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+    errno = 0;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, aesd_backend_seek_to(&backend, 41, 0),
+            "Entry 41 of 41 must not be found");
+    TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+
+    aesd_backend_close(&backend);
+    unlink(path);
+}
+
+/**
+* Offsets inside an entry resolve to its start plus the offset, in the first chunk scanned and
+* in the following ones
+*/
+void test_backend_file_seek_inside_entry()
+{
+    struct aesd_backend backend;
+    char path[sizeof(BACKEND_PATH_TEMPLATE)];
+    open_file_backend(&backend, path, 40, 200);
+
+    TEST_ASSERT_EQUAL_INT(0, aesd_backend_seek_to(&backend, 0, 0));
+    TEST_ASSERT_EQUAL_INT(2, aesd_backend_seek_to(&backend, 0, 2));
+    TEST_ASSERT_EQUAL_INT(3, aesd_backend_seek_to(&backend, 1, 0));
+    TEST_ASSERT_EQUAL_INT(3 + 20 * 200 + 150, aesd_backend_seek_to(&backend, 21, 150));
+    TEST_ASSERT_EQUAL_INT(3 + 40 * 200 - 1, aesd_backend_seek_to(&backend, 40, 199));
+
+    aesd_backend_close(&backend);
+    unlink(path);
+}
+
+/**
+* The end of an entry is a valid offset, as the driver accepts it: the seek lands on the start of the
+* next entry, or on the end of the storage for the last one. File and memory storages agree
+*/
+void test_backend_seek_to_entry_end()
+{
+    struct aesd_backend backend;
+    char path[sizeof(BACKEND_PATH_TEMPLATE)];
+    open_file_backend(&backend, path, 40, 200);
+    TEST_ASSERT_EQUAL_INT(3, aesd_backend_seek_to(&backend, 0, 3));
+    TEST_ASSERT_EQUAL_INT(3 + 20 * 200, aesd_backend_seek_to(&backend, 20, 200));
+    TEST_ASSERT_EQUAL_INT(3 + 40 * 200, aesd_backend_seek_to(&backend, 40, 200));
+    aesd_backend_close(&backend);
+    unlink(path);
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, aesd_backend_open(&backend, "memory"), "Could not open the memory backend");
+    TEST_ASSERT_EQUAL_INT(6, aesd_backend_append(&backend, "ab\ncd\n", 6));
+    TEST_ASSERT_EQUAL_INT(3, aesd_backend_seek_to(&backend, 0, 3));
+    TEST_ASSERT_EQUAL_INT(6, aesd_backend_seek_to(&backend, 1, 3));
+    errno = 0;
+    TEST_ASSERT_EQUAL_INT(-1, aesd_backend_seek_to(&backend, 1, 4));
+    TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+    aesd_backend_close(&backend);
+}
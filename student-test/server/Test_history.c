@@ -0,0 +1,103 @@
+#include "unity.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "../../server/aesd-history.h"
+
+#define HISTORY_READERS 8
+
+struct counting_loader
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    unsigned int started;   // readers which called aesd_history_get
+    unsigned int reads;
+};
+
+struct history_reader
+{
+    struct aesd_history_cache *cache;
+    struct aesd_history *history;
+};
+
+/**
+* Loader counting its calls. It waits for every reader to ask for the history, so they all ask
+* while the read is in flight
+*/
+static ssize_t counting_load(struct aesd_history_cache *cache, char *buf, size_t cap, uint64_t *generation)
+{
+    struct counting_loader *loader = cache->loader_ctx;
+    pthread_mutex_lock(&loader->lock);
+    while(loader->started < HISTORY_READERS)
+    {
+        pthread_cond_wait(&loader->changed, &loader->lock);
+    }
+    loader->reads++;
+    *generation = aesd_history_generation(cache);
+    int len = snprintf(buf, cap, "read %u\n", loader->reads);
+    pthread_mutex_unlock(&loader->lock);
+    return len;
+}
+
+static void *read_history(void *arg)
+{
+    struct history_reader *reader = arg;
+    struct counting_loader *loader = reader->cache->loader_ctx;
+    pthread_mutex_lock(&loader->lock);
+    loader->started++;
+    pthread_cond_broadcast(&loader->changed);
+    pthread_mutex_unlock(&loader->lock);
+    reader->history = aesd_history_get(reader->cache, 0);
+    return NULL;
+}
+
+/**
+* Readers asking for the same generation at once share one read of the device and one buffer; a
+* write then makes the next reader read the device again
+*/
+void test_history_single_read_per_generation()
+{
+    struct aesd_history_cache cache;
+    struct counting_loader loader = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0};
+    struct history_reader readers[HISTORY_READERS];
+    pthread_t threads[HISTORY_READERS];
+    struct aesd_history *history;
+    aesd_history_init(&cache, 64, counting_load, &loader);
+
+    for(unsigned int i = 0; i < HISTORY_READERS; i++)
+    {
+        readers[i].cache = &cache;
+        readers[i].history = NULL;
+        TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[i], NULL, read_history, &readers[i]));
+    }
+    for(unsigned int i = 0; i < HISTORY_READERS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, loader.reads, "Concurrent readers must share a single read");
+    for(unsigned int i = 0; i < HISTORY_READERS; i++)
+    {
+        TEST_ASSERT_NOT_NULL(readers[i].history);
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(readers[0].history, readers[i].history, "Every reader must get the same buffer");
+    }
+    TEST_ASSERT_EQUAL_STRING_LEN("read 1\n", readers[0].history->data, readers[0].history->len);
+
+    history = aesd_history_get(&cache, 0);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(readers[0].history, history, "The cached history must be served without a read");
+    aesd_history_put(history);
+    TEST_ASSERT_EQUAL_UINT32(1, loader.reads);
+
+    TEST_ASSERT_EQUAL_INT(1, aesd_history_written(&cache));
+    history = aesd_history_get(&cache, 1);
+    TEST_ASSERT_NOT_NULL(history);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(2, loader.reads, "A write must invalidate the cached history");
+    TEST_ASSERT_EQUAL_INT(1, history->generation);
+    TEST_ASSERT_EQUAL_STRING_LEN("read 2\n", history->data, history->len);
+    aesd_history_put(history);
+
+    for(unsigned int i = 0; i < HISTORY_READERS; i++)
+    {
+        aesd_history_put(readers[i].history);
+    }
+    aesd_history_destroy(&cache);
+}
@@ -0,0 +1,114 @@
+#include "unity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../server/aesd-lz.h"
+
+// Biggest reply of the server, MAX_BUFFER_SIZE in aesdsocket.c
+#define REPLY_SIZE 50000
+
+static char encoded[REPLY_SIZE + REPLY_SIZE / 255 + 64];
+static char decoded[REPLY_SIZE];
+
+/**
+* Fill @param buf with @param len pseudo random bytes, which do not compress
+*/
+static void fill_random(char *buf, size_t len, uint32_t seed)
+{
+    for(size_t i = 0; i < len; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = (char)(seed >> 16);
+    }
+}
+
+/**
+* Encode @param len bytes of @param src with @param enc, decode the frame with @param dec and check
+* the bytes come back. The frame method and size are left in @param method and @param frame_len
+*/
+static void round_trip(struct aesd_lz_stream *enc, struct aesd_lz_stream *dec, const char *src, size_t len,
+        int *method, size_t *frame_len)
+{
+    ssize_t written = aesd_lz_encode_frame(enc, src, len, encoded, sizeof(encoded));
+    TEST_ASSERT_TRUE_MESSAGE(written >= AESD_LZ_FRAME_HEADER, "Could not encode the frame");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(len, aesd_lz_decode_frame(dec, encoded, written, decoded, sizeof(decoded)),
+            "Could not decode the frame");
+    TEST_ASSERT_TRUE_MESSAGE(memcmp(src, decoded, len) == 0, "The decoded frame differs from the reply");
+    *method = encoded[2];
+    *frame_len = written;
+}
+
+/**
+* Consecutive replies come back on one stream: an empty one, an incompressible one kept stored, a
+* full MAX_BUFFER_SIZE one, then one found in the dictionary the previous reply left
+*/
+void test_lz_consecutive_replies()
+{
+    struct aesd_lz_stream enc, dec;
+    size_t frame_len = 0;
+    int method = -1;
+    // One more byte for the terminating zero snprintf puts after the last line
+    char *text = malloc(REPLY_SIZE + 1);
+    char *noise = malloc(4096);
+    TEST_ASSERT_NOT_NULL(text);
+    TEST_ASSERT_NOT_NULL(noise);
+    TEST_ASSERT_EQUAL_INT(0, aesd_lz_stream_init(&enc, REPLY_SIZE));
+    TEST_ASSERT_EQUAL_INT(0, aesd_lz_stream_init(&dec, REPLY_SIZE));
+
+    round_trip(&enc, &dec, "", 0, &method, &frame_len);
+    TEST_ASSERT_EQUAL_INT(AESD_LZ_METHOD_STORED, method);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_LZ_FRAME_HEADER, frame_len, "An empty reply is a bare header");
+
+    fill_random(noise, 4096, 7);
+    round_trip(&enc, &dec, noise, 4096, &method, &frame_len);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_LZ_METHOD_STORED, method, "An incompressible reply must be stored");
+    TEST_ASSERT_EQUAL_INT(AESD_LZ_FRAME_HEADER + 4096, frame_len);
+
+    for(size_t i = 0; i < REPLY_SIZE; i += 10)
+    {
+        snprintf(text + i, 11, "line %04zu\n", (i / 10) % 10000);
+    }
+    round_trip(&enc, &dec, text, REPLY_SIZE, &method, &frame_len);
+    TEST_ASSERT_EQUAL_INT(AESD_LZ_METHOD_LZ, method);
+    TEST_ASSERT_TRUE_MESSAGE(frame_len < REPLY_SIZE / 2, "A full reply of lines must compress");
+
+    fill_random(noise, 4096, 11);
+    round_trip(&enc, &dec, noise, 4096, &method, &frame_len);
+    TEST_ASSERT_EQUAL_INT(AESD_LZ_METHOD_STORED, method);
+    round_trip(&enc, &dec, noise, 4096, &method, &frame_len);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_LZ_METHOD_LZ, method,
+            "A reply repeating the previous one must be found in the dictionary");
+    TEST_ASSERT_TRUE_MESSAGE(frame_len < 256, "A dictionary hit must not send the reply again");
+
+    aesd_lz_stream_free(&enc);
+    aesd_lz_stream_free(&dec);
+    free(noise);
+    free(text);
+}
+
+/**
+* A raw frame between two compressed ones leaves both dictionaries alone, and decodes without a stream
+*/
+void test_lz_raw_frame_outside_stream()
+{
+    struct aesd_lz_stream enc, dec;
+    size_t frame_len = 0;
+    int method = -1;
+    char reply[1024];
+    ssize_t written;
+    TEST_ASSERT_EQUAL_INT(0, aesd_lz_stream_init(&enc, REPLY_SIZE));
+    TEST_ASSERT_EQUAL_INT(0, aesd_lz_stream_init(&dec, REPLY_SIZE));
+
+    fill_random(reply, sizeof(reply), 3);
+    round_trip(&enc, &dec, reply, sizeof(reply), &method, &frame_len);
+    TEST_ASSERT_EQUAL_INT(AESD_LZ_METHOD_STORED, method);
+    written = aesd_lz_raw_frame("AESDSOCKET_INGEST:1\n", 20, encoded, sizeof(encoded));
+    TEST_ASSERT_EQUAL_INT(AESD_LZ_FRAME_HEADER + 20, written);
+    TEST_ASSERT_EQUAL_INT(20, aesd_lz_decode_frame(NULL, encoded, written, decoded, sizeof(decoded)));
+    TEST_ASSERT_EQUAL_STRING_LEN("AESDSOCKET_INGEST:1\n", decoded, 20);
+    round_trip(&enc, &dec, reply, sizeof(reply), &method, &frame_len);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(AESD_LZ_METHOD_LZ, method, "The raw frame must not replace the dictionary");
+
+    aesd_lz_stream_free(&enc);
+    aesd_lz_stream_free(&dec);
+}